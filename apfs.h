@@ -7,8 +7,11 @@
 #define _APFS_H
 
 #include <linux/buffer_head.h>
+#include <linux/completion.h>
 #include <linux/fs.h>
+#include <linux/kobject.h>
 #include <linux/list.h>
+#include <linux/rbtree.h>
 #include <linux/types.h>
 #include <linux/version.h>
 #include "apfs_raw.h"
@@ -28,6 +31,16 @@ static inline bool sb_rdonly(const struct super_block *sb) { return sb->s_flags
 #define lockdep_assert_held_write(l)	((void)(l))
 #endif
 
+/* Direct reads, fiemap and lseek all go through iomap on recent kernels */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+#define APFS_IOMAP
+#endif
+
+/* Blocks bigger than a page need large folios in the buffer cache */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 15, 0)
+#define APFS_LARGE_BLOCKS
+#endif
+
 /* Compatibility wrapper around submit_bh() */
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 0, 0)
 #define apfs_submit_bh(op, op_flags, bh) submit_bh(op, op_flags, bh)
@@ -42,12 +55,79 @@ struct apfs_ioctl_snap_name {
 	char name[APFS_SNAP_MAX_NAMELEN + 1];
 };
 
+/*
+ * Parameter for the bulk directory listing ioctl
+ */
+struct apfs_ioctl_readdirplus {
+	__u64 pos;		/* Position to continue from, updated on return */
+	__u64 buf;		/* User address for the entries */
+	__u32 buf_size;		/* Size of the buffer */
+	__u32 count;		/* Number of entries returned */
+	__u32 flags;		/* APFS_READDIRPLUS_* flags, set on return */
+	__u32 pad;
+};
+
+#define APFS_READDIRPLUS_EOF	0x1	/* No more entries in the directory */
+
+/*
+ * Directory entry returned by the bulk listing ioctl, followed by the name
+ */
+struct apfs_ioctl_dirent_plus {
+	__u64 ino;
+	__u64 size;		/* Logical size of the file */
+	__u64 blocks;		/* Allocated size in 512-byte units */
+	__s64 atime_sec;
+	__s64 mtime_sec;
+	__s64 ctime_sec;
+	__s64 btime_sec;
+	__u32 atime_nsec;
+	__u32 mtime_nsec;
+	__u32 ctime_nsec;
+	__u32 btime_nsec;
+	__u32 mode;
+	__u32 nlink;
+	__u32 uid;
+	__u32 gid;
+	__u32 bsd_flags;
+	__u16 rec_len;		/* Length of the entry, name and padding included */
+	__u16 name_len;		/* Length of the name, without the terminating null */
+	__u8 type;		/* DT_* type of the file */
+	__u8 flags;		/* APFS_DIRENT_PLUS_* flags */
+	__u8 pad[6];
+	char name[];
+};
+
+#define APFS_DIRENT_PLUS_ATTRS	0x1	/* The inode fields are valid */
+
+/*
+ * Parameter for the snapshot diff ioctl
+ */
+struct apfs_ioctl_snap_diff {
+	char name[APFS_SNAP_MAX_NAMELEN + 1];	/* Base snapshot */
+	__u64 pos;		/* First object id to report, updated on return */
+	__u64 buf;		/* User address for the ranges */
+	__u32 count;		/* Size of the buffer in ranges, updated on return */
+	__u32 flags;		/* APFS_SNAP_DIFF_* flags, set on return */
+};
+
+#define APFS_SNAP_DIFF_EOF	0x1	/* No more ranges after these */
+
+/*
+ * Inclusive range of object ids whose catalog records may have changed
+ */
+struct apfs_ioctl_snap_diff_range {
+	__u64 start;
+	__u64 end;
+};
+
 #define APFS_IOC_SET_DFLT_PFK	_IOW('@', 0x80, struct apfs_wrapped_crypto_state)
 #define APFS_IOC_SET_DIR_CLASS	_IOW('@', 0x81, u32)
 #define APFS_IOC_SET_PFK	_IOW('@', 0x82, struct apfs_wrapped_crypto_state)
 #define APFS_IOC_GET_CLASS	_IOR('@', 0x83, u32)
 #define APFS_IOC_GET_PFK	_IOR('@', 0x84, struct apfs_wrapped_crypto_state)
 #define APFS_IOC_TAKE_SNAPSHOT	_IOW('@', 0x85, struct apfs_ioctl_snap_name)
+#define APFS_IOC_READDIRPLUS	_IOWR('@', 0x86, struct apfs_ioctl_readdirplus)
+#define APFS_IOC_SNAP_DIFF	_IOWR('@', 0x87, struct apfs_ioctl_snap_diff)
 
 /*
  * In-memory representation of an APFS object
@@ -59,8 +139,8 @@ struct apfs_object {
 
 	/*
 	 * Buffer head containing the one block of the object, may be NULL if
-	 * the object is only in memory. TODO: support objects with more than
-	 * one block.
+	 * the object is only in memory. Only ephemeral objects can span more
+	 * than one block, and those are always in memory.
 	 */
 	struct buffer_head *o_bh;
 	char *data; /* The raw object */
@@ -87,6 +167,20 @@ struct apfs_node {
 	int val_free_list_len;	/* Length of the fragmented free value space */
 
 	struct apfs_object object; /* Object holding the node */
+	atomic_t refcnt;	/* Shared with the node cache, if cached */
+};
+
+#define APFS_NODE_CACHE_BITS	9
+#define APFS_NODE_CACHE_SLOTS	(1 << APFS_NODE_CACHE_BITS)
+#define APFS_NODE_CACHE_LOCKS	16
+
+/*
+ * Cache of parsed index nodes, keyed by block number. Each cached node holds
+ * a reference of its own, so that queries can share it.
+ */
+struct apfs_node_cache {
+	struct apfs_node *slots[APFS_NODE_CACHE_SLOTS];
+	spinlock_t locks[APFS_NODE_CACHE_LOCKS];
 };
 
 /**
@@ -140,6 +234,21 @@ struct apfs_spaceman {
 	u64 sm_free_cache_base;
 	u64 sm_free_cache_blkcnt;
 
+	/*
+	 * Largest free block count among the chunks of each cib, built lazily
+	 * as the cibs are read. A chunk can't have a longer free run than its
+	 * free count, so this lets the allocator skip cibs without reading them.
+	 */
+	u32 *sm_cib_max_free;
+	u32 sm_cib_summary_len;		/* Length of @sm_cib_max_free */
+
+	/*
+	 * Size of the main free queue once the current transaction was done
+	 * flushing it. The queue may hold a backlog from older transactions,
+	 * so only the growth past this point counts against the commit limits.
+	 */
+	u64 sm_main_fq_start;
+
 	/* Shift to match an ip block with its bitmap in the array */
 	int sm_ip_bmaps_shift;
 	/* Mask to find an ip block's offset inside its ip bitmap */
@@ -150,10 +259,20 @@ struct apfs_spaceman {
 	struct buffer_head *sm_ip_bmaps[];
 };
 
+/* Value in the spaceman cib summary for cibs that haven't been read yet */
+#define APFS_CIB_FREE_UNKNOWN		U32_MAX
+
 #define TRANSACTION_MAIN_QUEUE_MAX	4096
+/* Most main free queue records to flush at the start of each transaction */
+#define TRANSACTION_FQ_FLUSH_MAX	512
+/* Main free queue size that forces a full flush, regardless of the budget */
+#define TRANSACTION_FQ_BACKLOG_MAX	(4 * TRANSACTION_MAIN_QUEUE_MAX)
 #define TRANSACTION_BUFFERS_MAX		65536
 #define TRANSACTION_STARTS_MAX		65536
 
+/* Default number of seconds before a transaction gets committed */
+#define APFS_DEFAULT_COMMIT_INTERVAL	5
+
 /* Possible states for the container transaction structure */
 #define APFS_NX_TRANS_FORCE_COMMIT	1	/* Commit guaranteed */
 #define APFS_NX_TRANS_DEFER_COMMIT	2	/* Commit banned right now */
@@ -170,6 +289,7 @@ struct apfs_nx_transaction {
 	struct list_head t_buffers;	/* List of buffers in the transaction */
 	size_t t_buffers_count;		/* Count of items on the list */
 	int t_starts_count;		/* Count of starts for transaction */
+	u64 t_delalloc_count;		/* Data blocks waiting for allocation */
 };
 
 /*
@@ -188,6 +308,9 @@ struct apfs_vol_transaction {
 BUFFER_FNS(TRANS, trans);
 BUFFER_FNS(CSUM, csum);
 
+/* Fake block number for buffers waiting on delayed allocation */
+#define APFS_DELALLOC_BNO	(~(sector_t)0)
+
 /*
  * Additional information for a buffer in a transaction.
  */
@@ -220,11 +343,49 @@ struct apfs_ephemeral_object_info {
  */
 #define APFS_EPHEMERAL_LIST_SIZE	32768
 #define APFS_EPHEMERAL_LIST_LIMIT	(APFS_EPHEMERAL_LIST_SIZE / sizeof(struct apfs_ephemeral_object_info))
+/* Biggest ephemeral object we accept; the spaceman grows with the container */
+#define APFS_EPHEMERAL_OBJ_MAX_SIZE	(1 << 20)
 
 /* Mount option flags for a container */
 #define APFS_CHECK_NODES	1
 #define APFS_READWRITE		2
 
+/* Commit duration buckets: under 1ms, 4ms, 16ms, 64ms, 256ms, 1s and longer */
+#define APFS_COMMIT_HIST_BUCKETS	7
+
+/* Compression algorithms for the decompression statistics */
+enum {
+	APFS_STAT_ZLIB,
+	APFS_STAT_LZVN,
+	APFS_STAT_LZFSE,
+	APFS_STAT_LZBITMAP,
+	APFS_STAT_PLAIN,
+	APFS_STAT_ALGO_COUNT,
+};
+
+/*
+ * Container statistics, kept per cpu and exported in /sys/fs/apfs/<dev>/
+ */
+struct apfs_nx_stats {
+	u64 commits;
+	u64 commit_buffers;	/* Total buffers written by the commits */
+	u64 early_buffers;	/* Data buffers written before their commit */
+	u64 commit_hist[APFS_COMMIT_HIST_BUCKETS];
+	u64 omap_hits;
+	u64 omap_misses;
+	u64 allocations;
+	u64 alloc_cibs_scanned;	/* Total cibs read by the allocations */
+	u64 cows;
+	u64 decompressed[APFS_STAT_ALGO_COUNT];	/* Bytes, by algorithm */
+	u64 orphans_cleaned;	/* Orphan files deleted in full */
+	u64 orphan_blocks;	/* Blocks released from orphan files */
+	u64 xattr_hits;		/* Xattr lookups answered by the inode cache */
+	u64 xattr_misses;	/* Xattr lookups that needed a catalog query */
+};
+
+#define apfs_nx_stat_add(nxi, field, n)	this_cpu_add((nxi)->nx_stats->field, n)
+#define apfs_nx_stat_inc(nxi, field)	this_cpu_inc((nxi)->nx_stats->field)
+
 /*
  * Container superblock data in memory
  */
@@ -248,18 +409,32 @@ struct apfs_nxsb_info {
 	unsigned int nx_flags;	/* Mount options shared by all volumes */
 	unsigned int nx_refcnt; /* Number of mounted volumes in container */
 
-	/* TODO: handle block sizes above the maximum of PAGE_SIZE? */
+	/* Block sizes above PAGE_SIZE are only mounted read-only for now */
 	unsigned long nx_blocksize;
 	unsigned char nx_blocksize_bits;
 
 	struct apfs_spaceman *nx_spaceman;
 	struct apfs_nx_transaction nx_transaction;
 
-	/* For now, a single semaphore for every operation */
+	/* Total allocation count of all volumes, for statfs; see apfs_alloc_count_add() */
+	u64 nx_used_blocks;
+	bool nx_used_blocks_valid;
+	struct apfs_node_cache nx_node_cache;
+
+	/*
+	 * Taken for writing by every transaction, this protects the spaceman,
+	 * the ephemeral objects and the rest of the container state. Readers
+	 * of a volume only need the volume semaphore, see apfs_vol_sem(). The
+	 * lock order is nx_big_sem, then the volume semaphores, then nxs_mutex.
+	 */
 	struct rw_semaphore nx_big_sem;
 
 	/* List of currently mounted containers */
 	struct list_head nx_list;
+
+	struct apfs_nx_stats __percpu *nx_stats;
+	struct kobject nx_kobj;		/* Directory in /sys/fs/apfs/ */
+	struct completion nx_kobj_unregister;
 };
 
 extern struct mutex nxs_mutex;
@@ -282,16 +457,36 @@ struct apfs_omap_rec {
 	u64 bno;
 };
 
-#define APFS_OMAP_CACHE_SLOTS		128
-#define APFS_OMAP_CACHE_SLOT_MASK	(APFS_OMAP_CACHE_SLOTS - 1)
+#define APFS_OMAP_CACHE_WAYS		4
+#define APFS_OMAP_CACHE_DEFAULT_SIZE	512		/* In records */
+#define APFS_OMAP_CACHE_MAX_SIZE	(1 << 20)	/* In records */
+
+/*
+ * Set of records in the omap cache, replaced in round-robin order
+ */
+struct apfs_omap_cache_set {
+	struct apfs_omap_rec recs[APFS_OMAP_CACHE_WAYS];
+	unsigned int victim;	/* Next way to evict */
+};
+
+/*
+ * Omap cache statistics, kept per cpu
+ */
+struct apfs_omap_cache_stats {
+	u64 hits;
+	u64 misses;
+	u64 evictions;
+};
 
 /**
  * Cache of omap records
  */
 struct apfs_omap_cache {
-	struct apfs_omap_rec recs[APFS_OMAP_CACHE_SLOTS];
+	struct apfs_omap_cache_set *sets;
+	unsigned int set_mask;
 	bool disabled;
-	spinlock_t lock;
+	seqlock_t lock;		/* Readers don't take the spinlock */
+	struct apfs_omap_cache_stats __percpu *stats;
 };
 
 /*
@@ -306,6 +501,9 @@ struct apfs_omap {
 
 	/* Number of snapshots sharing this omap */
 	unsigned int omap_refcnt;
+
+	/* Protects all trees of the volume, for every mounted snapshot */
+	struct rw_semaphore omap_sem;
 };
 
 /*
@@ -322,6 +520,7 @@ struct apfs_sb_info {
 	u64 s_snap_xid; /* Transaction id for mounted snapshot */
 
 	struct apfs_node *s_cat_root;	/* Root of the catalog tree */
+	struct apfs_node *s_fext_root;	/* Root of the fext tree, if sealed */
 	struct apfs_omap *s_omap;	/* The object map */
 
 	struct apfs_object s_vobject;	/* Volume superblock object */
@@ -330,6 +529,10 @@ struct apfs_sb_info {
 	unsigned int s_vol_nr;		/* Index of the volume in the sb list */
 	kuid_t s_uid;			/* uid to override on-disk uid */
 	kgid_t s_gid;			/* gid to override on-disk gid */
+	unsigned int s_omap_cache_size;	/* Records in the omap cache */
+	unsigned int s_commit_interval;	/* Seconds between commits, or 0 */
+	u32 s_compress_algo;		/* Algorithm for new files, or 0 */
+	bool s_bench;			/* Time the b-trees and allocator on mount */
 
 	struct apfs_crypto_state_val *s_dflt_pfk; /* default per-file key */
 
@@ -338,6 +541,13 @@ struct apfs_sb_info {
 
 	struct inode *s_private_dir;	/* Inode for the private directory */
 	struct work_struct s_orphan_cleanup_work;
+	spinlock_t s_orphan_lock;	/* Protects @s_orphan_queue */
+	struct list_head s_orphan_queue; /* Orphans left to clean, by eviction */
+	struct delayed_work s_commit_work;
+	struct work_struct s_compress_work;
+	spinlock_t s_compress_lock;	/* Protects @s_compress_queue */
+	struct list_head s_compress_queue; /* Closed files waiting to compress */
+	struct work_struct s_bench_work;
 };
 
 static inline struct apfs_sb_info *APFS_SB(struct super_block *sb)
@@ -372,6 +582,18 @@ static inline struct apfs_nxsb_info *APFS_NXI(struct super_block *sb)
 	return APFS_SB(sb)->s_nxi;
 }
 
+/**
+ * apfs_vol_sem - Get the semaphore that protects a volume's trees
+ * @sb: superblock structure
+ *
+ * The semaphore is shared by all mounted snapshots of the volume, because they
+ * also share the omap, so it lives there.
+ */
+static inline struct rw_semaphore *apfs_vol_sem(struct super_block *sb)
+{
+	return &APFS_SB(sb)->s_omap->omap_sem;
+}
+
 /**
  * APFS_SM - Get the shared spaceman struct for a volume's superblock
  * @sb: superblock structure
@@ -381,6 +603,23 @@ static inline struct apfs_spaceman *APFS_SM(struct super_block *sb)
 	return APFS_NXI(sb)->nx_spaceman;
 }
 
+/**
+ * apfs_alloc_count_add - Update the allocation count of the mounted volume
+ * @sb:		superblock structure
+ * @delta:	number of blocks allocated, negative if they were freed
+ *
+ * The change is also applied to the container's used block count, if it has
+ * already been computed, so that statfs doesn't need to read every volume.
+ */
+static inline void apfs_alloc_count_add(struct super_block *sb, s64 delta)
+{
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+
+	le64_add_cpu(&APFS_SB(sb)->s_vsb_raw->apfs_fs_alloc_count, delta);
+	if (nxi->nx_used_blocks_valid)
+		nxi->nx_used_blocks += delta;
+}
+
 static inline bool apfs_is_case_insensitive(struct super_block *sb)
 {
 	return (APFS_SB(sb)->s_vsb_raw->apfs_incompatible_features &
@@ -554,7 +793,7 @@ static inline void apfs_init_sibling_map_key(u64 id, struct apfs_key *key)
 }
 
 extern void apfs_init_drec_key(struct super_block *sb, u64 ino, const char *name,
-			       unsigned int name_len, struct apfs_key *key);
+			       unsigned int name_len, u32 hash, struct apfs_key *key);
 
 /**
  * apfs_init_xattr_key - Initialize an in-memory key for a xattr query
@@ -644,6 +883,7 @@ static inline u64 apfs_cat_cnid(struct apfs_key_header *key)
 #define APFS_QUERY_ANY_NUMBER	004000	/* Multiple search for any number */
 #define APFS_QUERY_MULTIPLE	(APFS_QUERY_ANY_NAME | APFS_QUERY_ANY_NUMBER)
 #define APFS_QUERY_PREV		010000	/* Find previous record */
+#define APFS_QUERY_SEQ		020000	/* Inserting a batch of records in order */
 
 /*
  * Structure used to retrieve data from an APFS B-Tree. For now only used
@@ -666,6 +906,17 @@ struct apfs_query {
 	int depth;			/* Put a limit on recursion */
 };
 
+/*
+ * A record for a batch insertion in a b-tree
+ */
+struct apfs_btree_rec {
+	struct apfs_key key;	/* In-memory key, to refresh the query */
+	void *raw_key;		/* On-disk record key */
+	int key_len;		/* Length of @raw_key */
+	void *raw_val;		/* On-disk record value */
+	int val_len;		/* Length of @raw_val */
+};
+
 /**
  * apfs_query_storage - Get the storage type for a query's btree
  * @query: the query structure
@@ -725,6 +976,43 @@ struct apfs_dstream_info {
 	bool			ds_ext_dirty;	/* Is ds_cached_ext dirty? */
 	spinlock_t		ds_ext_lock;	/* Protects ds_cached_ext */
 	bool			ds_shared;	/* Has multiple references? */
+
+	/*
+	 * Blocks allocated in the current transaction but not yet in use, to
+	 * be handed out to the following blocks of the dstream
+	 */
+	u64			ds_prealloc_bno;	/* First reserved block */
+	u64			ds_prealloc_len;	/* Reserved block count */
+	u64			ds_prealloc_dsblock;	/* Logical block for it */
+
+	/*
+	 * Blocks appended in the current transaction that only exist in the
+	 * page cache for now; they get allocated together at commit time
+	 */
+	u64			ds_delalloc_start;	/* First delayed block */
+	u64			ds_delalloc_len;	/* Delayed block count */
+
+	/*
+	 * Clean extents recently read from disk, protected by ds_ext_lock; the
+	 * extent records must not change without dropping them from here
+	 */
+	struct rb_root		ds_ext_map;	/* Extents by logical address */
+	struct list_head	ds_ext_map_lru;	/* Same extents, by last use */
+	unsigned int		ds_ext_map_count; /* Number of cached extents */
+};
+
+/* Maximum number of extents in the extent map of a single dstream */
+#define APFS_EXTENT_MAP_MAX	64
+/* Maximum number of extents to prefetch from a leaf after a map miss */
+#define APFS_EXTENT_PREFETCH_MAX	(APFS_EXTENT_MAP_MAX / 2)
+
+/*
+ * Entry in the extent map of a dstream
+ */
+struct apfs_extent_map_entry {
+	struct rb_node		node;	/* Node in the tree of extents */
+	struct list_head	lru;	/* Node in the list by last use */
+	struct apfs_file_extent	ext;	/* The cached extent */
 };
 
 /**
@@ -755,12 +1043,24 @@ struct apfs_inode_info {
 	u64			i_int_flags;	 /* Internal flags */
 	u32			i_bsd_flags;	 /* BSD flags */
 	struct list_head	i_list;		 /* List of inodes in transaction */
+	u64			i_sync_xid;	 /* Last transaction to change it */
+	u64			i_datasync_xid;	 /* Same, only for data changes */
 
 	bool			 i_has_dstream;	 /* Is there a dstream record? */
 	struct apfs_dstream_info i_dstream;	 /* Dstream data, if any */
 
 	bool			i_cleaned;	 /* Orphan data already deleted */
 
+	/* Block table for compressed files, protected by the vfs i_lock */
+	struct apfs_compress_table *i_compress_table;
+
+	/* Xattrs read so far, protected by the volume lock */
+	struct apfs_xattr_cache *i_xattr_cache;
+
+	atomic_t		i_open_count;	 /* Open files for the inode */
+	bool			i_compress_on_close; /* Compress after last close */
+	struct list_head	i_compress_list; /* Entry in @s_compress_queue */
+
 	struct inode vfs_inode;
 };
 
@@ -862,30 +1162,44 @@ do {									\
 
 /* btree.c */
 extern struct apfs_node *apfs_query_root(const struct apfs_query *query);
+extern int apfs_child_from_query(struct apfs_query *query, u64 *child);
 extern struct apfs_query *apfs_alloc_query(struct apfs_node *node,
 					   struct apfs_query *parent);
 extern void apfs_free_query(struct apfs_query *query);
 extern int apfs_btree_query(struct super_block *sb, struct apfs_query **query);
 extern int apfs_omap_lookup_block(struct super_block *sb, struct apfs_omap *omap, u64 id, u64 *block, bool write);
 extern int apfs_omap_lookup_newest_block(struct super_block *sb, struct apfs_omap *omap, u64 id, u64 *block, bool write);
+extern int apfs_omap_lookup_version(struct super_block *sb, struct apfs_omap *omap, u64 id, u64 xid, u64 *block, u64 *found_xid);
 extern int apfs_create_omap_rec(struct super_block *sb, u64 oid, u64 bno);
 extern int apfs_delete_omap_rec(struct super_block *sb, u64 oid);
 extern int apfs_query_join_transaction(struct apfs_query *query);
 extern int __apfs_btree_insert(struct apfs_query *query, void *key, int key_len, void *val, int val_len);
 extern int apfs_btree_insert(struct apfs_query *query, void *key, int key_len,
 			     void *val, int val_len);
+extern int apfs_btree_insert_batch(struct apfs_query *query, const struct apfs_btree_rec *recs, int count);
 extern int apfs_btree_remove(struct apfs_query *query);
 extern void apfs_btree_change_node_count(struct apfs_query *query, int change);
 extern int apfs_btree_replace(struct apfs_query *query, void *key, int key_len,
 			      void *val, int val_len);
 extern void apfs_query_direct_forward(struct apfs_query *query);
+extern int apfs_omap_cache_init(struct apfs_omap_cache *cache, unsigned int size);
+extern void apfs_omap_cache_free(struct apfs_omap_cache *cache);
+extern void apfs_omap_cache_get_stats(struct apfs_omap_cache *cache, struct apfs_omap_cache_stats *stats);
+extern void apfs_btree_bench(struct super_block *sb);
 
 /* compress.c */
 extern int apfs_compress_get_size(struct inode *inode, loff_t *size);
+extern void apfs_compress_forget_table(struct inode *inode);
+extern void apfs_compress_free_workspaces(void);
+extern void apfs_compress_queue_inode(struct inode *inode);
+extern void apfs_compress_work(struct work_struct *work);
+extern int apfs_decode_selftest(void);
+extern void apfs_decode_bench(void);
 
 /* dir.c */
-extern int apfs_inode_by_name(struct inode *dir, const struct qstr *child,
+extern int apfs_inode_by_name(struct inode *dir, const struct dentry *dentry,
 			      u64 *ino);
+extern int apfs_ioc_readdirplus(struct file *file, void __user *user_arg);
 extern int apfs_mkany(struct inode *dir, struct dentry *dentry,
 		      umode_t mode, dev_t rdev, const char *symname);
 
@@ -937,11 +1251,18 @@ extern int __apfs_get_block(struct apfs_dstream_info *dstream, sector_t iblock,
 extern int apfs_get_block(struct inode *inode, sector_t iblock,
 			  struct buffer_head *bh_result, int create);
 extern int apfs_flush_extent_cache(struct apfs_dstream_info *dstream);
+extern void apfs_extent_map_clear(struct apfs_dstream_info *dstream);
 extern int apfs_dstream_get_new_bno(struct apfs_dstream_info *dstream, u64 dsblock, u64 *bno);
+extern int apfs_dstream_free_prealloc(struct apfs_dstream_info *dstream);
+extern int apfs_dstream_flush_delalloc(struct apfs_dstream_info *dstream, struct page *locked_page);
+extern int apfs_get_delalloc_block(struct inode *inode, sector_t iblock,
+				   struct buffer_head *bh_result, int create);
 extern int apfs_get_new_block(struct inode *inode, sector_t iblock,
 			      struct buffer_head *bh_result, int create);
 extern int APFS_GET_NEW_BLOCK_MAXOPS(void);
 extern int apfs_truncate(struct apfs_dstream_info *dstream, loff_t new_size);
+extern int apfs_dstream_count_extents(struct apfs_dstream_info *dstream, int max);
+extern int APFS_DROP_EXTENTS_MAXOPS(int count);
 extern int apfs_inode_delete_front(struct inode *inode);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
 extern loff_t apfs_remap_file_range(struct file *src_file, loff_t off, struct file *dst_file, loff_t destoff, loff_t len, unsigned int remap_flags);
@@ -949,8 +1270,12 @@ extern loff_t apfs_remap_file_range(struct file *src_file, loff_t off, struct fi
 extern int apfs_clone_file_range(struct file *src_file, loff_t off, struct file *dst_file, loff_t destoff, u64 len);
 #endif
 extern int apfs_clone_extents(struct apfs_dstream_info *dstream, u64 new_id);
+extern long apfs_fallocate(struct file *file, int mode, loff_t offset, loff_t len);
 extern int apfs_nonsparse_dstream_read(struct apfs_dstream_info *dstream, void *buf, size_t count, u64 offset);
 extern void apfs_nonsparse_dstream_preread(struct apfs_dstream_info *dstream);
+#ifdef APFS_IOMAP
+extern const struct iomap_ops apfs_iomap_ops;
+#endif
 
 /* file.c */
 extern int apfs_file_mmap(struct file *file, struct vm_area_struct *vma);
@@ -961,16 +1286,20 @@ extern struct inode *apfs_iget(struct super_block *sb, u64 cnid);
 extern int apfs_update_inode(struct inode *inode, char *new_name);
 extern int APFS_UPDATE_INODE_MAXOPS(void);
 extern void apfs_orphan_cleanup_work(struct work_struct *work);
+extern void apfs_orphan_queue_drop(struct super_block *sb);
 extern void apfs_evict_inode(struct inode *inode);
 extern struct inode *apfs_new_inode(struct inode *dir, umode_t mode,
 				    dev_t rdev);
 extern int apfs_create_inode_rec(struct super_block *sb, struct inode *inode,
 				 struct dentry *dentry);
 extern int apfs_inode_create_exclusive_dstream(struct inode *inode);
+extern int apfs_inode_create_dstream_rec(struct inode *inode);
+extern int apfs_setsize(struct inode *inode, loff_t new_size);
 extern int APFS_CREATE_INODE_REC_MAXOPS(void);
 extern int __apfs_write_begin(struct file *file, struct address_space *mapping, loff_t pos, unsigned int len, unsigned int flags, struct page **pagep, void **fsdata);
 extern int __apfs_write_end(struct file *file, struct address_space *mapping, loff_t pos, unsigned int len, unsigned int copied, struct page *page, void *fsdata);
 extern int apfs_dstream_adj_refcnt(struct apfs_dstream_info *dstream, u32 delta);
+extern int apfs_inode_drop_dstream(struct inode *inode);
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5, 12, 0)
 extern int apfs_setattr(struct dentry *dentry, struct iattr *iattr);
@@ -1019,6 +1348,8 @@ extern int apfs_fileattr_set(struct user_namespace *mnt_userns, struct dentry *d
 
 /* key.c */
 extern int apfs_filename_cmp(struct super_block *sb, const char *name1, unsigned int len1, const char *name2, unsigned int len2);
+extern u32 apfs_drec_name_hash(struct super_block *sb, const char *name, unsigned int name_len);
+extern void apfs_filename_bench(void);
 extern int apfs_keycmp(struct apfs_key *k1, struct apfs_key *k2);
 extern int apfs_read_cat_key(void *raw, int size, struct apfs_key *key, bool hashed);
 extern int apfs_read_fext_key(void *raw, int size, struct apfs_key *key);
@@ -1038,6 +1369,8 @@ extern void apfs_update_node(struct apfs_node *node);
 extern int apfs_delete_node(struct apfs_node *node, int type);
 extern int apfs_node_query(struct super_block *sb, struct apfs_query *query);
 extern void apfs_node_query_first(struct apfs_query *query);
+extern int apfs_query_continue_multiple(struct apfs_query *query, const struct apfs_key *key, int flags);
+extern int apfs_query_next_in_node(struct apfs_query *query, struct apfs_key *key);
 extern int apfs_omap_map_from_query(struct apfs_query *query, struct apfs_omap_map *map);
 extern int apfs_node_split(struct apfs_query *query);
 extern int apfs_node_locate_key(struct apfs_node *node, int index, int *off);
@@ -1048,8 +1381,18 @@ extern int apfs_node_replace(struct apfs_query *query, void *key, int key_len, v
 extern int apfs_node_insert(struct apfs_query *query, void *key, int key_len, void *val, int val_len);
 extern int apfs_create_single_rec_node(struct apfs_query *query, void *key, int key_len, void *val, int val_len);
 extern int apfs_make_empty_btree_root(struct super_block *sb, u32 subtype, u64 *oid);
+extern void apfs_node_cache_init(struct apfs_node_cache *cache);
+extern void apfs_node_cache_forget(struct super_block *sb, u64 bno);
+extern void apfs_node_cache_drop_all(struct super_block *sb);
+extern void apfs_node_readahead_leaves(struct apfs_query *query);
+
+/* Number of runs, and iterations per run, when the module is loaded with bench=1 */
+#define APFS_BENCH_RUNS		5
+#define APFS_BENCH_ITERS	10000
 
 /* object.c */
+extern int apfs_fletcher64_selftest(void);
+extern void apfs_fletcher64_bench(void);
 extern int apfs_obj_verify_csum(struct super_block *sb, struct buffer_head *bh);
 extern void apfs_obj_set_csum(struct super_block *sb, struct apfs_obj_phys *obj);
 extern int apfs_multiblock_verify_csum(char *object, u32 size);
@@ -1063,6 +1406,7 @@ extern u64 apfs_data_index_to_bno(struct super_block *sb, u32 index);
 
 /* snapshot.c */
 extern int apfs_ioc_take_snapshot(struct file *file, void __user *user_arg);
+extern int apfs_ioc_snap_diff(struct file *file, void __user *user_arg);
 extern int apfs_switch_to_snapshot(struct super_block *sb);
 
 /* spaceman.c */
@@ -1070,6 +1414,10 @@ extern int apfs_read_spaceman(struct super_block *sb);
 extern int apfs_free_queue_insert_nocache(struct super_block *sb, u64 bno, u64 count);
 extern int apfs_free_queue_insert(struct super_block *sb, u64 bno, u64 count);
 extern int apfs_spaceman_allocate_block(struct super_block *sb, u64 *bno, bool backwards);
+extern int apfs_spaceman_allocate_extent(struct super_block *sb, u64 *bno, u64 *count, bool backwards);
+extern int apfs_spaceman_free_unused_extent(struct super_block *sb, u64 bno, u64 count);
+extern u64 apfs_main_fq_trans_count(struct super_block *sb);
+extern void apfs_spaceman_bench(struct super_block *sb);
 
 /* super.c */
 extern int apfs_map_volume_super_bno(struct super_block *sb, u64 bno, bool check);
@@ -1081,9 +1429,13 @@ extern int apfs_sync_fs(struct super_block *sb, int wait);
 
 /* transaction.c */
 extern int apfs_cpoint_data_free(struct super_block *sb, u64 bno);
+extern void apfs_readahead_ephemeral_objects(struct super_block *sb);
 extern int apfs_transaction_start(struct super_block *sb, struct apfs_max_ops maxops);
 extern int apfs_transaction_commit(struct super_block *sb);
+extern void apfs_transaction_commit_work(struct work_struct *work);
 extern void apfs_inode_join_transaction(struct super_block *sb, struct inode *inode);
+extern void apfs_inode_data_join_transaction(struct super_block *sb, struct inode *inode);
+extern bool apfs_inode_needs_sync(struct inode *inode, int datasync);
 extern int apfs_transaction_join(struct super_block *sb,
 				 struct buffer_head *bh);
 void apfs_transaction_abort(struct super_block *sb);
@@ -1102,6 +1454,7 @@ extern ssize_t apfs_listxattr(struct dentry *dentry, char *buffer, size_t size);
 extern int apfs_xattr_get_compressed_data(struct inode *inode, const char *name, struct apfs_compressed_data *cdata);
 extern void apfs_release_compressed_data(struct apfs_compressed_data *cdata);
 extern int apfs_compressed_data_read(struct apfs_compressed_data *cdata, void *buf, size_t count, u64 offset);
+extern void apfs_xattr_cache_drop(struct inode *inode);
 
 /* xfield.c */
 extern int apfs_find_xfield(u8 *xfields, int len, u8 xtype, char **xval);
@@ -1109,6 +1462,7 @@ extern int apfs_init_xfields(u8 *buffer, int buflen);
 extern int apfs_insert_xfield(u8 *buffer, int buflen,
 			      const struct apfs_x_field *xkey,
 			      const void *xval);
+extern int apfs_remove_xfield(u8 *buffer, int buflen, u8 xtype);
 
 /*
  * Inode and file operations
@@ -1125,14 +1479,24 @@ extern const struct file_operations apfs_dir_operations;
 extern const struct file_operations apfs_file_operations;
 extern const struct inode_operations apfs_file_inode_operations;
 
+/* inode.c */
+extern const struct address_space_operations apfs_aops;
+
 /* namei.c */
 extern const struct inode_operations apfs_dir_inode_operations;
 extern const struct inode_operations apfs_special_inode_operations;
 extern const struct dentry_operations apfs_dentry_operations;
+extern u32 apfs_dentry_drec_hash(const struct dentry *dentry);
 
 /* symlink.c */
 extern const struct inode_operations apfs_symlink_inode_operations;
 
+/* sysfs.c */
+extern int apfs_sysfs_init(void);
+extern void apfs_sysfs_exit(void);
+extern int apfs_sysfs_register_nx(struct apfs_nxsb_info *nxi);
+extern void apfs_sysfs_unregister_nx(struct apfs_nxsb_info *nxi);
+
 /* xattr.c */
 extern const struct xattr_handler *apfs_xattr_handlers[];
 
@@ -1169,6 +1533,12 @@ apfs_sb_bread(struct super_block *sb, sector_t block)
 	return __bread_gfp(APFS_NXI(sb)->nx_bdev, block, sb->s_blocksize, __GFP_MOVABLE);
 }
 
+/* Start reading a block that will be needed soon, without waiting for it */
+static inline void apfs_sb_breadahead(struct super_block *sb, sector_t block)
+{
+	__breadahead(APFS_NXI(sb)->nx_bdev, block, sb->s_blocksize);
+}
+
 /* Use instead of apfs_sb_bread() for blocks that will just be overwritten */
 static inline struct buffer_head *
 apfs_getblk(struct super_block *sb, sector_t block)
@@ -1445,6 +1445,8 @@ struct apfs_compress_hdr {
 	__le64 size;
 } __packed;
 
+#define APFS_COMPRESS_SIGNATURE		0x636d7066 /* "fpmc" */
+
 #define APFS_COMPRESS_ZLIB_ATTR		3
 #define APFS_COMPRESS_ZLIB_RSRC		4
 #define APFS_COMPRESS_LZVN_ATTR		7
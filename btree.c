@@ -4,8 +4,13 @@
  */
 
 #include <linux/buffer_head.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include "apfs.h"
+#include "trace.h"
 
 struct apfs_node *apfs_query_root(const struct apfs_query *query)
 {
@@ -35,7 +40,7 @@ static u64 apfs_catalog_base_oid(struct apfs_query *query)
  * basic sanity check as a protection against crafted filesystems.  Returns 0
  * on success or -EFSCORRUPTED otherwise.
  */
-static int apfs_child_from_query(struct apfs_query *query, u64 *child)
+int apfs_child_from_query(struct apfs_query *query, u64 *child)
 {
 	struct super_block *sb = query->node->object.sb;
 	char *raw = query->node->object.data;
@@ -59,20 +64,110 @@ static int apfs_child_from_query(struct apfs_query *query, u64 *child)
 	return 0;
 }
 
+/**
+ * apfs_omap_cache_init - Set up an empty omap cache
+ * @cache:	the cache to initialize
+ * @size:	requested number of records, 0 to disable the cache
+ *
+ * The number of sets is rounded down to a power of two. Returns 0 on success,
+ * or -ENOMEM in case of failure.
+ */
+int apfs_omap_cache_init(struct apfs_omap_cache *cache, unsigned int size)
+{
+	unsigned int set_count;
+
+	seqlock_init(&cache->lock);
+	cache->sets = NULL;
+	cache->set_mask = 0;
+	cache->disabled = true;
+
+	cache->stats = alloc_percpu(struct apfs_omap_cache_stats);
+	if (!cache->stats)
+		return -ENOMEM;
+
+	if (size > APFS_OMAP_CACHE_MAX_SIZE)
+		size = APFS_OMAP_CACHE_MAX_SIZE;
+	set_count = size / APFS_OMAP_CACHE_WAYS;
+	if (set_count == 0)
+		return 0;
+	set_count = rounddown_pow_of_two(set_count);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 18, 0)
+	cache->sets = vzalloc(set_count * sizeof(*cache->sets));
+#else
+	cache->sets = kvcalloc(set_count, sizeof(*cache->sets), GFP_KERNEL);
+#endif
+	if (!cache->sets) {
+		free_percpu(cache->stats);
+		cache->stats = NULL;
+		return -ENOMEM;
+	}
+	cache->set_mask = set_count - 1;
+	cache->disabled = false;
+	return 0;
+}
+
+/**
+ * apfs_omap_cache_free - Free all memory used by an omap cache
+ * @cache: the cache to free
+ */
+void apfs_omap_cache_free(struct apfs_omap_cache *cache)
+{
+	kvfree(cache->sets);
+	cache->sets = NULL;
+	free_percpu(cache->stats);
+	cache->stats = NULL;
+	cache->disabled = true;
+}
+
+/**
+ * apfs_omap_cache_get_stats - Add up the statistics for an omap cache
+ * @cache:	the cache
+ * @stats:	on return, the totals for all cpus
+ */
+void apfs_omap_cache_get_stats(struct apfs_omap_cache *cache, struct apfs_omap_cache_stats *stats)
+{
+	int cpu;
+
+	memset(stats, 0, sizeof(*stats));
+	if (!cache->stats)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct apfs_omap_cache_stats *curr = per_cpu_ptr(cache->stats, cpu);
+
+		stats->hits += curr->hits;
+		stats->misses += curr->misses;
+		stats->evictions += curr->evictions;
+	}
+}
+
+/**
+ * apfs_omap_cache_set - Get the set of records where an oid may be cached
+ * @cache:	the cache
+ * @oid:	object id
+ */
+static inline struct apfs_omap_cache_set *apfs_omap_cache_set(struct apfs_omap_cache *cache, u64 oid)
+{
+	return &cache->sets[oid & cache->set_mask];
+}
+
 /**
  * apfs_omap_cache_lookup - Look for an oid in an omap's cache
  * @omap:	the object map
  * @oid:	object id to look up
  * @bno:	on return, the block number for the oid
  *
- * Returns 0 on success, or -1 if this mapping is not cached.
+ * Returns 0 on success, or -1 if this mapping is not cached. Readers never
+ * take the lock, they just retry if a writer got in the way.
  */
 static int apfs_omap_cache_lookup(struct apfs_omap *omap, u64 oid, u64 *bno)
 {
 	struct apfs_omap_cache *cache = &omap->omap_cache;
-	struct apfs_omap_rec *record = NULL;
-	int slot;
-	int ret = -1;
+	struct apfs_omap_cache_set *set = NULL;
+	unsigned int seq;
+	int way;
+	int ret;
 
 	if (cache->disabled)
 		return -1;
@@ -81,16 +176,25 @@ static int apfs_omap_cache_lookup(struct apfs_omap *omap, u64 oid, u64 *bno)
 	if (!oid)
 		return -1;
 
-	slot = oid & APFS_OMAP_CACHE_SLOT_MASK;
-	record = &cache->recs[slot];
-
-	spin_lock(&cache->lock);
-	if (record->oid == oid) {
-		*bno = record->bno;
-		ret = 0;
-	}
-	spin_unlock(&cache->lock);
+	set = apfs_omap_cache_set(cache, oid);
+	do {
+		seq = read_seqbegin(&cache->lock);
+		ret = -1;
+		for (way = 0; way < APFS_OMAP_CACHE_WAYS; ++way) {
+			struct apfs_omap_rec *record = &set->recs[way];
+
+			if (READ_ONCE(record->oid) == oid) {
+				*bno = READ_ONCE(record->bno);
+				ret = 0;
+				break;
+			}
+		}
+	} while (read_seqretry(&cache->lock, seq));
 
+	if (ret)
+		this_cpu_inc(cache->stats->misses);
+	else
+		this_cpu_inc(cache->stats->hits);
 	return ret;
 }
 
@@ -99,23 +203,41 @@ static int apfs_omap_cache_lookup(struct apfs_omap *omap, u64 oid, u64 *bno)
  * @omap:	the object map
  * @oid:	object id of the record
  * @bno:	block number for the oid
+ *
+ * Updates the record if the oid is already cached; otherwise it takes a free
+ * way in the set, or evicts the oldest one.
  */
 static void apfs_omap_cache_save(struct apfs_omap *omap, u64 oid, u64 bno)
 {
 	struct apfs_omap_cache *cache = &omap->omap_cache;
+	struct apfs_omap_cache_set *set = NULL;
 	struct apfs_omap_rec *record = NULL;
-	int slot;
+	int way;
 
-	if (cache->disabled)
+	if (cache->disabled || !oid)
 		return;
 
-	slot = oid & APFS_OMAP_CACHE_SLOT_MASK;
-	record = &cache->recs[slot];
+	set = apfs_omap_cache_set(cache, oid);
 
-	spin_lock(&cache->lock);
-	record->oid = oid;
-	record->bno = bno;
-	spin_unlock(&cache->lock);
+	write_seqlock(&cache->lock);
+	for (way = 0; way < APFS_OMAP_CACHE_WAYS; ++way) {
+		if (set->recs[way].oid == oid) {
+			record = &set->recs[way];
+			break;
+		}
+	}
+	for (way = 0; !record && way < APFS_OMAP_CACHE_WAYS; ++way) {
+		if (set->recs[way].oid == 0)
+			record = &set->recs[way];
+	}
+	if (!record) {
+		record = &set->recs[set->victim];
+		set->victim = (set->victim + 1) % APFS_OMAP_CACHE_WAYS;
+		this_cpu_inc(cache->stats->evictions);
+	}
+	WRITE_ONCE(record->oid, oid);
+	WRITE_ONCE(record->bno, bno);
+	write_sequnlock(&cache->lock);
 }
 
 /**
@@ -126,21 +248,25 @@ static void apfs_omap_cache_save(struct apfs_omap *omap, u64 oid, u64 bno)
 static void apfs_omap_cache_delete(struct apfs_omap *omap, u64 oid)
 {
 	struct apfs_omap_cache *cache = &omap->omap_cache;
-	struct apfs_omap_rec *record = NULL;
-	int slot;
+	struct apfs_omap_cache_set *set = NULL;
+	int way;
 
-	if (cache->disabled)
+	if (cache->disabled || !oid)
 		return;
 
-	slot = oid & APFS_OMAP_CACHE_SLOT_MASK;
-	record = &cache->recs[slot];
+	set = apfs_omap_cache_set(cache, oid);
 
-	spin_lock(&cache->lock);
-	if (record->oid == oid) {
-		record->oid = 0;
-		record->bno = 0;
+	write_seqlock(&cache->lock);
+	for (way = 0; way < APFS_OMAP_CACHE_WAYS; ++way) {
+		struct apfs_omap_rec *record = &set->recs[way];
+
+		if (record->oid == oid) {
+			WRITE_ONCE(record->oid, 0);
+			WRITE_ONCE(record->bno, 0);
+			break;
+		}
 	}
-	spin_unlock(&cache->lock);
+	write_sequnlock(&cache->lock);
 }
 
 /**
@@ -189,8 +315,11 @@ static int apfs_omap_lookup_block_with_xid(struct super_block *sb, struct apfs_o
 	int ret = 0;
 
 	if (!write) {
-		if (!apfs_omap_cache_lookup(omap, id, block))
+		if (!apfs_omap_cache_lookup(omap, id, block)) {
+			apfs_nx_stat_inc(nxi, omap_hits);
 			return 0;
+		}
+		apfs_nx_stat_inc(nxi, omap_misses);
 	}
 
 	query = apfs_alloc_query(omap->omap_root, NULL /* parent */);
@@ -283,6 +412,53 @@ int apfs_omap_lookup_newest_block(struct super_block *sb, struct apfs_omap *omap
 	return apfs_omap_lookup_block_with_xid(sb, omap, id, -1, block, write);
 }
 
+/**
+ * apfs_omap_lookup_version - Find a version of a virtual object by its xid
+ * @sb:		filesystem superblock
+ * @omap:	object map to be searched
+ * @id:		id of the object
+ * @xid:	transaction id
+ * @block:	on return, the block number for the version found
+ * @found_xid:	on return, the transaction id for the version found
+ *
+ * Searches @omap for the most recent version of the object with a transaction
+ * id below @xid, and reports when it was written. The omap cache only knows
+ * about the current version, so it's not used here. Returns 0 on success or a
+ * negative error code in case of failure.
+ */
+int apfs_omap_lookup_version(struct super_block *sb, struct apfs_omap *omap, u64 id, u64 xid, u64 *block, u64 *found_xid)
+{
+	struct apfs_query *query;
+	struct apfs_omap_map map = {0};
+	int ret;
+
+	query = apfs_alloc_query(omap->omap_root, NULL /* parent */);
+	if (!query)
+		return -ENOMEM;
+	apfs_init_omap_key(id, xid, &query->key);
+	query->flags |= APFS_QUERY_OMAP;
+
+	ret = apfs_btree_query(sb, &query);
+	if (ret) {
+		if (ret != -ENODATA)
+			apfs_err(sb, "query failed for oid 0x%llx, xid 0x%llx", id, xid);
+		goto fail;
+	}
+
+	ret = apfs_omap_map_from_query(query, &map);
+	if (ret) {
+		apfs_alert(sb, "bad object map leaf block: 0x%llx",
+			   query->node->object.block_nr);
+		goto fail;
+	}
+	*block = map.bno;
+	*found_xid = map.xid;
+
+fail:
+	apfs_free_query(query);
+	return ret;
+}
+
 /**
  * apfs_create_omap_rec - Create a record in the volume's omap tree
  * @sb:		filesystem superblock
@@ -554,8 +730,10 @@ next_node:
 	} else if (err) {
 		goto fail;
 	}
-	if (apfs_node_is_leaf((*query)->node)) /* All done */
+	if (apfs_node_is_leaf((*query)->node)) { /* All done */
+		trace_apfs_btree_query(sb, *query, 0);
 		return 0;
+	}
 
 	err = apfs_child_from_query(*query, &child_id);
 	if (err) {
@@ -565,6 +743,7 @@ next_node:
 	}
 
 	/* Now go a level deeper and search the child */
+	apfs_node_readahead_leaves(*query);
 	node = apfs_read_node(sb, child_id, storage, false /* write */);
 	if (IS_ERR(node)) {
 		apfs_err(sb, "failed to read node 0x%llx", child_id);
@@ -593,6 +772,7 @@ next_node:
 fail:
 	/* Don't leave stale record info here or some callers will use it */
 	(*query)->key_len = (*query)->len = 0;
+	trace_apfs_btree_query(sb, *query, err);
 	return err;
 }
 
@@ -632,6 +812,8 @@ int apfs_query_join_transaction(struct apfs_query *query)
 		apfs_err(sb, "Cow failed for node 0x%llx", oid);
 		return PTR_ERR(node);
 	}
+	/* The old block will get freed, so don't keep it cached */
+	apfs_node_cache_forget(sb, query->node->object.block_nr);
 	apfs_node_free(query->node);
 	query->node = node;
 
@@ -890,6 +1072,63 @@ int apfs_btree_insert(struct apfs_query *query, void *key, int key_len, void *va
 	return 0;
 }
 
+/**
+ * apfs_btree_insert_batch - Insert a sorted batch of records into a b-tree leaf
+ * @query:	query run to search for the first record
+ * @recs:	the records to insert, in key order
+ * @count:	number of records in @recs
+ *
+ * The tree must have no records between the keys of the batch, so that each
+ * record simply goes right after the previous one and the query never needs to
+ * be rerun from the root. Nodes that fill up along the way get split right
+ * after the insertion point, so the batch leaves them dense instead of half
+ * full. Returns 0 on success, or a negative error code in case of failure.
+ */
+int apfs_btree_insert_batch(struct apfs_query *query, const struct apfs_btree_rec *recs, int count)
+{
+	struct super_block *sb = NULL;
+	struct apfs_node *root = NULL;
+	struct apfs_query *level = NULL;
+	int err = 0;
+	int i;
+
+	root = apfs_query_root(query);
+	ASSERT(apfs_node_is_root(root));
+	ASSERT(apfs_node_is_leaf(query->node));
+	sb = root->object.sb;
+
+	/* Queries for new levels inherit the flags, so set it everywhere */
+	for (level = query; level; level = level->parent)
+		level->flags |= APFS_QUERY_SEQ;
+
+	for (i = 0; i < count; ++i) {
+		const struct apfs_btree_rec *rec = &recs[i];
+
+		/* A refresh must find the previous record of the batch */
+		query->key = rec->key;
+		while (true) {
+			err = __apfs_btree_insert(query, rec->raw_key, rec->key_len, rec->raw_val, rec->val_len);
+			if (err != -EAGAIN)
+				break;
+			err = apfs_query_refresh(query, root, true /* nodata */);
+			if (err) {
+				apfs_err(sb, "query refresh failed");
+				goto out;
+			}
+		}
+		if (err)
+			goto out;
+
+		apfs_assert_query_is_valid(query);
+		apfs_btree_change_rec_count(query, 1 /* change */, rec->key_len, rec->val_len);
+	}
+
+out:
+	for (level = query; level; level = level->parent)
+		level->flags &= ~APFS_QUERY_SEQ;
+	return err;
+}
+
 /**
  * __apfs_btree_remove - Remove a record from a b-tree (at any level)
  * @query:	exact query that found the record
@@ -1172,3 +1411,262 @@ void apfs_query_direct_forward(struct apfs_query *query)
 		query = query->parent;
 	}
 }
+
+/* Records inserted, and then removed, by each run of the b-tree benchmark */
+#define APFS_BENCH_RECS		256
+/* Inline value for the benchmark records, big enough to force a few splits */
+#define APFS_BENCH_VAL_LEN	128
+/* Template for the names of the benchmark records, which all have its length */
+#define APFS_BENCH_NAME		"bench.00000000"
+
+/**
+ * apfs_btree_bench_info - Get the b-tree info from the footer of a root node
+ * @root: the root node
+ */
+static struct apfs_btree_info *apfs_btree_bench_info(struct apfs_node *root)
+{
+	struct super_block *sb = root->object.sb;
+
+	return (void *)root->object.data + sb->s_blocksize - sizeof(struct apfs_btree_info);
+}
+
+/**
+ * apfs_btree_bench_lookups - Time a run of inode lookups in the catalog
+ * @sb:		superblock structure
+ * @scatter:	scatter the inode numbers instead of taking them in order
+ * @found:	on return, the number of lookups that found a record
+ *
+ * The inode numbers go from the root directory to the next free id, so some of
+ * them will miss, but all the lookups still descend to a leaf. Returns the time
+ * taken in nanoseconds, or 0 in case of failure.
+ */
+static u64 apfs_btree_bench_lookups(struct super_block *sb, bool scatter, int *found)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_query *query = NULL;
+	u32 seed = 0x43415421, span;
+	u64 start, first = APFS_ROOT_DIR_INO_NUM;
+	int err = 0;
+	int i;
+
+	span = min_t(u64, le64_to_cpu(sbi->s_vsb_raw->apfs_next_obj_id) - first, U32_MAX);
+	if (!span)
+		return 0;
+	*found = 0;
+
+	start = ktime_get_ns();
+	for (i = 0; i < APFS_BENCH_ITERS; i++) {
+		u64 ino;
+
+		seed = seed * 1103515245 + 12345;
+		ino = first + (scatter ? (seed >> 8) % span : i % span);
+
+		query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
+		if (!query)
+			return 0;
+		apfs_init_inode_key(ino, &query->key);
+		query->flags |= APFS_QUERY_CAT | APFS_QUERY_EXACT;
+		err = apfs_btree_query(sb, &query);
+		apfs_free_query(query);
+		if (!err)
+			++*found;
+		else if (err != -ENODATA)
+			return 0;
+	}
+	return ktime_get_ns() - start;
+}
+
+/**
+ * apfs_btree_bench_rec - Set the key and name of a benchmark record
+ * @cnid:	catalog id that owns the records
+ * @seq:	sequence number of the record
+ * @scatter:	scatter the names instead of putting them in order
+ * @key:	raw key to set, with room for the name
+ * @name:	buffer for the name, of the size of APFS_BENCH_NAME
+ *
+ * Returns the length of the key.
+ */
+static int apfs_btree_bench_rec(u64 cnid, u32 seq, bool scatter, struct apfs_xattr_key *key, char *name)
+{
+	/* Multiplying by an odd constant gives the same names in another order */
+	snprintf(name, sizeof(APFS_BENCH_NAME), "bench.%08x", scatter ? seq * 0x9e3779b1 : seq);
+	apfs_key_set_hdr(APFS_TYPE_XATTR, cnid, key);
+	key->name_len = cpu_to_le16(sizeof(APFS_BENCH_NAME));
+	memcpy(key->name, name, sizeof(APFS_BENCH_NAME));
+	return sizeof(*key) + sizeof(APFS_BENCH_NAME);
+}
+
+/**
+ * apfs_btree_bench_insert - Time the insertion of a run of xattr records
+ * @sb:		superblock structure
+ * @scatter:	insert the records in scattered order
+ * @ns:		on return, the time taken by the queries and insertions
+ * @splits:	on return, the number of nodes added to the catalog
+ *
+ * The records belong to the next free catalog id, and they are all removed in
+ * the same transaction, so the only change that reaches the disk is the shape
+ * of the catalog. Returns 0 on success or a negative error code in case of
+ * failure.
+ */
+static int apfs_btree_bench_insert(struct super_block *sb, bool scatter, u64 *ns, u64 *splits)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_max_ops maxops;
+	struct apfs_query *query = NULL;
+	struct apfs_xattr_key *key = NULL;
+	struct apfs_xattr_val *val = NULL;
+	char name[sizeof(APFS_BENCH_NAME)];
+	int key_len, val_len;
+	u64 cnid, nodes, start;
+	int err, i;
+
+	key = kmalloc(sizeof(*key) + sizeof(name), GFP_KERNEL);
+	val_len = sizeof(*val) + APFS_BENCH_VAL_LEN;
+	val = kzalloc(val_len, GFP_KERNEL);
+	if (!key || !val) {
+		err = -ENOMEM;
+		goto out;
+	}
+	val->flags = cpu_to_le16(APFS_XATTR_DATA_EMBEDDED);
+	val->xdata_len = cpu_to_le16(APFS_BENCH_VAL_LEN);
+	memset(val->xdata, 0xa5, APFS_BENCH_VAL_LEN);
+
+	maxops.cat = 2 * APFS_BENCH_RECS;
+	maxops.blks = 0;
+	err = apfs_transaction_start(sb, maxops);
+	if (err)
+		goto out;
+	cnid = le64_to_cpu(sbi->s_vsb_raw->apfs_next_obj_id);
+	nodes = le64_to_cpu(apfs_btree_bench_info(sbi->s_cat_root)->bt_node_count);
+
+	start = ktime_get_ns();
+	for (i = 0; i < APFS_BENCH_RECS; i++) {
+		key_len = apfs_btree_bench_rec(cnid, i, scatter, key, name);
+		query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
+		if (!query) {
+			err = -ENOMEM;
+			goto fail;
+		}
+		apfs_init_xattr_key(cnid, name, &query->key);
+		query->flags = APFS_QUERY_CAT | APFS_QUERY_EXACT;
+		err = apfs_btree_query(sb, &query);
+		if (err != -ENODATA) {
+			apfs_err(sb, "query failed for id 0x%llx (%s)", cnid, name);
+			if (!err)
+				err = -EEXIST;
+			goto fail;
+		}
+		err = apfs_btree_insert(query, key, key_len, val, val_len);
+		if (err) {
+			apfs_err(sb, "insertion failed for id 0x%llx (%s)", cnid, name);
+			goto fail;
+		}
+		apfs_free_query(query);
+		query = NULL;
+	}
+	*ns = ktime_get_ns() - start;
+	*splits = le64_to_cpu(apfs_btree_bench_info(sbi->s_cat_root)->bt_node_count) - nodes;
+
+	for (i = 0; i < APFS_BENCH_RECS; i++) {
+		apfs_btree_bench_rec(cnid, i, scatter, key, name);
+		query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
+		if (!query) {
+			err = -ENOMEM;
+			goto fail;
+		}
+		apfs_init_xattr_key(cnid, name, &query->key);
+		query->flags = APFS_QUERY_CAT | APFS_QUERY_EXACT;
+		err = apfs_btree_query(sb, &query);
+		if (err) {
+			apfs_err(sb, "query failed for id 0x%llx (%s)", cnid, name);
+			goto fail;
+		}
+		err = apfs_btree_remove(query);
+		if (err) {
+			apfs_err(sb, "removal failed for id 0x%llx (%s)", cnid, name);
+			goto fail;
+		}
+		apfs_free_query(query);
+		query = NULL;
+	}
+
+	err = apfs_transaction_commit(sb);
+	if (err)
+		goto fail;
+	goto out;
+
+fail:
+	apfs_free_query(query);
+	apfs_transaction_abort(sb);
+out:
+	kfree(val);
+	kfree(key);
+	return err;
+}
+
+/**
+ * apfs_btree_bench - Time the catalog queries, insertions and node splits
+ * @sb: superblock structure for a mounted volume
+ *
+ * Runs inode lookups in order and scattered, and for read-write mounts also
+ * inserts and removes a run of records in order and scattered. Reports the best
+ * of a few runs, along with the height of the catalog, so that the numbers can
+ * be compared between builds on the same image.
+ */
+void apfs_btree_bench(struct super_block *sb)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_btree_node_phys *root_raw;
+	u64 best_seq = U64_MAX, best_rand = U64_MAX;
+	u64 best_ins_seq = U64_MAX, best_ins_rand = U64_MAX;
+	u64 splits_seq = 0, splits_rand = 0;
+	int found_seq = 0, found_rand = 0;
+	int height, run;
+	int err;
+
+	for (run = 0; run < APFS_BENCH_RUNS; run++) {
+		u64 ns;
+
+		down_read(apfs_vol_sem(sb));
+		ns = apfs_btree_bench_lookups(sb, false /* scatter */, &found_seq);
+		if (ns)
+			best_seq = min(best_seq, ns);
+		ns = apfs_btree_bench_lookups(sb, true /* scatter */, &found_rand);
+		if (ns)
+			best_rand = min(best_rand, ns);
+		up_read(apfs_vol_sem(sb));
+	}
+	down_read(apfs_vol_sem(sb));
+	root_raw = (void *)sbi->s_cat_root->object.data;
+	height = le16_to_cpu(root_raw->btn_level) + 1;
+	up_read(apfs_vol_sem(sb));
+	if (best_seq == U64_MAX || best_rand == U64_MAX) {
+		apfs_warn(sb, "bench: catalog lookups failed");
+		return;
+	}
+	apfs_info(sb, "bench: catalog lookup, height %d: sequential %llu ns (%d found), random %llu ns (%d found)",
+		  height, div_u64(best_seq, APFS_BENCH_ITERS), found_seq,
+		  div_u64(best_rand, APFS_BENCH_ITERS), found_rand);
+
+	if (sb_rdonly(sb))
+		return;
+	for (run = 0; run < APFS_BENCH_RUNS; run++) {
+		u64 ns;
+
+		err = apfs_btree_bench_insert(sb, false /* scatter */, &ns, &splits_seq);
+		if (err)
+			goto fail;
+		best_ins_seq = min(best_ins_seq, ns);
+		err = apfs_btree_bench_insert(sb, true /* scatter */, &ns, &splits_rand);
+		if (err)
+			goto fail;
+		best_ins_rand = min(best_ins_rand, ns);
+	}
+	apfs_info(sb, "bench: catalog insertion of %d records: sequential %llu ns (%llu new nodes), random %llu ns (%llu new nodes)",
+		  APFS_BENCH_RECS, div_u64(best_ins_seq, APFS_BENCH_RECS), splits_seq,
+		  div_u64(best_ins_rand, APFS_BENCH_RECS), splits_rand);
+	return;
+
+fail:
+	apfs_warn(sb, "bench: catalog insertions failed (err:%d)", err);
+}
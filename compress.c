@@ -5,17 +5,19 @@
 
 #include <linux/slab.h>
 #include <linux/zlib.h>
-#include <linux/mutex.h>
+#include <linux/pagemap.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 
 #include "apfs.h"
+#include "trace.h"
 #include "libzbitmap.h"
 #include "lzfse/lzfse.h"
 #include "lzfse/lzvn_decode_base.h"
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 12, 0)
 
-#include <linux/vmalloc.h>
-
 static inline void *kvmalloc(size_t size, gfp_t flags)
 {
 	gfp_t kmalloc_flags = flags;
@@ -36,14 +38,181 @@ static inline void *kvmalloc(size_t size, gfp_t flags)
 
 #endif /* LINUX_VERSION_CODE < KERNEL_VERSION(4, 12, 0) */
 
+/*
+ * Scratch memory for decompressing a single block. A few of these are kept
+ * around for the whole module, so that reads don't need to allocate anything
+ * for every block.
+ */
+struct apfs_compress_ws {
+	struct list_head list;
+	u8 *cbuf;			/* Compressed data for the block */
+	u8 *dbuf;			/* Decompressed data, if it has no other place */
+	void *lzfse_scratch;		/* Decoder state for lzfse */
+	struct z_stream_s zstream;	/* Stream and workspace for zlib */
+};
+
+/* The compressed data for a block may be bigger than the block itself */
+#define APFS_COMPRESS_WS_CBUF_SIZE	(2 * APFS_COMPRESS_BLOCK)
+
+/*
+ * Pool of idle workspaces. The total never goes above the number of cpus;
+ * if they are all taken, callers wait for one to be returned.
+ */
+static struct {
+	spinlock_t lock;
+	struct list_head idle;
+	int total;
+	wait_queue_head_t wait;
+} apfs_compress_ws_pool = {
+	.lock	= __SPIN_LOCK_UNLOCKED(apfs_compress_ws_pool.lock),
+	.idle	= LIST_HEAD_INIT(apfs_compress_ws_pool.idle),
+	.wait	= __WAIT_QUEUE_HEAD_INITIALIZER(apfs_compress_ws_pool.wait),
+};
+
+static void apfs_compress_ws_free(struct apfs_compress_ws *ws)
+{
+	kvfree(ws->cbuf);
+	kvfree(ws->dbuf);
+	kvfree(ws->lzfse_scratch);
+	kvfree(ws->zstream.workspace);
+	kfree(ws);
+}
+
+static struct apfs_compress_ws *apfs_compress_ws_alloc(void)
+{
+	struct apfs_compress_ws *ws = NULL;
+
+	ws = kzalloc(sizeof(*ws), GFP_KERNEL);
+	if (!ws)
+		return NULL;
+	ws->cbuf = kvmalloc(APFS_COMPRESS_WS_CBUF_SIZE, GFP_KERNEL);
+	ws->dbuf = kvmalloc(APFS_COMPRESS_BLOCK, GFP_KERNEL);
+	/* Same size that lzfse_decode_buffer() would allocate by itself */
+	ws->lzfse_scratch = kvmalloc(lzfse_decode_scratch_size() + 1, GFP_KERNEL);
+	ws->zstream.workspace = kvmalloc(zlib_inflate_workspacesize(), GFP_KERNEL);
+	if (!ws->cbuf || !ws->dbuf || !ws->lzfse_scratch || !ws->zstream.workspace) {
+		apfs_compress_ws_free(ws);
+		return NULL;
+	}
+	return ws;
+}
+
+/**
+ * apfs_compress_ws_get - Take a workspace from the pool
+ *
+ * Returns the workspace, or NULL if none could be allocated. This may sleep,
+ * so callers must not hold any locks that the other users of the pool need.
+ */
+static struct apfs_compress_ws *apfs_compress_ws_get(void)
+{
+	struct apfs_compress_ws *ws = NULL;
+
+	spin_lock(&apfs_compress_ws_pool.lock);
+	while (true) {
+		ws = list_first_entry_or_null(&apfs_compress_ws_pool.idle, struct apfs_compress_ws, list);
+		if (ws) {
+			list_del(&ws->list);
+			break;
+		}
+		if (apfs_compress_ws_pool.total < num_online_cpus()) {
+			apfs_compress_ws_pool.total++;
+			spin_unlock(&apfs_compress_ws_pool.lock);
+			ws = apfs_compress_ws_alloc();
+			if (ws)
+				return ws;
+			spin_lock(&apfs_compress_ws_pool.lock);
+			apfs_compress_ws_pool.total--;
+			/* Don't wait if nobody is going to return a workspace */
+			if (!apfs_compress_ws_pool.total)
+				break;
+		}
+		spin_unlock(&apfs_compress_ws_pool.lock);
+		wait_event(apfs_compress_ws_pool.wait, !list_empty_careful(&apfs_compress_ws_pool.idle));
+		spin_lock(&apfs_compress_ws_pool.lock);
+	}
+	spin_unlock(&apfs_compress_ws_pool.lock);
+	return ws;
+}
+
+/**
+ * apfs_compress_ws_put - Return a workspace to the pool
+ * @ws: the workspace
+ */
+static void apfs_compress_ws_put(struct apfs_compress_ws *ws)
+{
+	spin_lock(&apfs_compress_ws_pool.lock);
+	list_add(&ws->list, &apfs_compress_ws_pool.idle);
+	spin_unlock(&apfs_compress_ws_pool.lock);
+	wake_up(&apfs_compress_ws_pool.wait);
+}
+
+/**
+ * apfs_compress_free_workspaces - Free the pool of workspaces
+ *
+ * Only called on module exit, when no workspace can be in use.
+ */
+void apfs_compress_free_workspaces(void)
+{
+	struct apfs_compress_ws *ws, *tmp;
+
+	list_for_each_entry_safe(ws, tmp, &apfs_compress_ws_pool.idle, list) {
+		list_del(&ws->list);
+		apfs_compress_ws_free(ws);
+	}
+	apfs_compress_ws_pool.total = 0;
+}
+
+/**
+ * apfs_zlib_inflate - Inflate a raw deflate stream
+ * @ws:		workspace to use
+ * @dst:	buffer for the decompressed data
+ * @dsize:	size of @dst
+ * @src:	compressed data
+ * @ssize:	size of @src
+ *
+ * Same as zlib_inflate_blob(), but without allocating the stream. Returns the
+ * size of the decompressed data on success, or -EINVAL in case of failure.
+ */
+static int apfs_zlib_inflate(struct apfs_compress_ws *ws, u8 *dst, size_t dsize, const u8 *src, size_t ssize)
+{
+	struct z_stream_s *strm = &ws->zstream;
+	int ret;
+
+	strm->next_in = src;
+	strm->avail_in = ssize;
+	strm->next_out = dst;
+	strm->avail_out = dsize;
+
+	if (zlib_inflateInit2(strm, -MAX_WBITS) != Z_OK)
+		return -EINVAL;
+	ret = zlib_inflate(strm, Z_FINISH);
+	/* After Z_FINISH, only Z_STREAM_END means that everything was unpacked */
+	if (ret == Z_STREAM_END)
+		ret = dsize - strm->avail_out;
+	else
+		ret = -EINVAL;
+	zlib_inflateEnd(strm);
+	return ret;
+}
+
+/*
+ * Location of each compressed block in the resource fork, parsed once and
+ * shared by all open files for the inode
+ */
+struct apfs_compress_table {
+	atomic_t refcnt;
+	u32 num;			/* Number of blocks */
+	struct apfs_compress_table_entry {
+		u64 offs;		/* Offset in the resource fork */
+		u32 size;		/* Size of the compressed data */
+	} entries[];
+};
+
 struct apfs_compress_file_data {
 	struct apfs_compress_hdr hdr;
-	u8 *buf;
-	ssize_t bufblk;
-	size_t bufsize;
-	struct mutex mtx;
 	struct super_block *sb;
 	struct apfs_compressed_data cdata;
+	struct apfs_compress_table *table; /* Block table, NULL if inline */
 };
 
 static inline int apfs_compress_is_rsrc(u32 algo)
@@ -72,10 +241,173 @@ static inline bool apfs_compress_is_supported(u32 algo)
 	}
 }
 
+static void apfs_compress_put_table(struct apfs_compress_table *table)
+{
+	if (table && atomic_dec_and_test(&table->refcnt))
+		kvfree(table);
+}
+
+/**
+ * apfs_compress_forget_table - Drop the cached block table for an inode
+ * @inode: the vfs inode
+ *
+ * Must be called when the compressed data of @inode changes. Files that are
+ * already open keep using their old table.
+ */
+void apfs_compress_forget_table(struct inode *inode)
+{
+	struct apfs_inode_info *ai = APFS_I(inode);
+	struct apfs_compress_table *table = NULL;
+
+	spin_lock(&inode->i_lock);
+	table = ai->i_compress_table;
+	ai->i_compress_table = NULL;
+	spin_unlock(&inode->i_lock);
+
+	apfs_compress_put_table(table);
+}
+
+/**
+ * apfs_compress_read_table - Parse the block table for a resource fork
+ * @fd: compressed file data, with the header and resource fork already set
+ *
+ * Returns the new table on success, or an error pointer in case of failure.
+ */
+static struct apfs_compress_table *apfs_compress_read_table(struct apfs_compress_file_data *fd)
+{
+	struct super_block *sb = fd->sb;
+	struct apfs_compressed_data *comp_data = &fd->cdata;
+	struct apfs_compress_table *table = NULL;
+	void *raw = NULL;
+	u32 algo = le32_to_cpu(fd->hdr.algo);
+	u64 max_num;
+	u32 num, i;
+	int res;
+
+	/* The table can be bigger than this, but those blocks can't be read */
+	max_num = DIV_ROUND_UP(le64_to_cpu(fd->hdr.size), APFS_COMPRESS_BLOCK);
+	if (max_num > comp_data->size / sizeof(__le32)) {
+		apfs_err(sb, "resource fork is too small for file size");
+		return ERR_PTR(-EFSCORRUPTED);
+	}
+	if (max_num >= U32_MAX / sizeof(table->entries[0])) {
+		apfs_err(sb, "too many compressed blocks (0x%llx)", max_num);
+		return ERR_PTR(-EFBIG);
+	}
+
+	if (algo != APFS_COMPRESS_LZBITMAP_RSRC && algo != APFS_COMPRESS_LZVN_RSRC && algo != APFS_COMPRESS_LZFSE_RSRC) {
+		struct apfs_compress_rsrc_hdr hdr = {0};
+		struct apfs_compress_rsrc_data cd = {0};
+		struct apfs_compress_rsrc_block *blks = NULL;
+		u32 doffs;
+
+		res = apfs_compressed_data_read(comp_data, &hdr, sizeof(hdr), 0 /* offset */);
+		if (res) {
+			apfs_err(sb, "failed to read resource header");
+			return ERR_PTR(res);
+		}
+
+		doffs = be32_to_cpu(hdr.data_offs);
+		res = apfs_compressed_data_read(comp_data, &cd, sizeof(cd), doffs);
+		if (res) {
+			apfs_err(sb, "failed to read resource data header");
+			return ERR_PTR(res);
+		}
+		num = min_t(u64, le32_to_cpu(cd.num), max_num);
+
+		table = kvmalloc(sizeof(*table) + num * sizeof(table->entries[0]), GFP_KERNEL);
+		raw = blks = kvmalloc(num * sizeof(*blks), GFP_KERNEL);
+		if (!table || !raw) {
+			res = -ENOMEM;
+			goto fail;
+		}
+		res = apfs_compressed_data_read(comp_data, blks, num * sizeof(*blks), (u64)doffs + sizeof(cd));
+		if (res) {
+			apfs_err(sb, "failed to read resource block metadata");
+			goto fail;
+		}
+		for (i = 0; i < num; i++) {
+			table->entries[i].offs = (u64)doffs + le32_to_cpu(blks[i].offs) + 4;
+			table->entries[i].size = le32_to_cpu(blks[i].size);
+		}
+	} else {
+		__le32 *blks = NULL;
+
+		/* The offsets are followed by the end of the last block */
+		num = max_num;
+		if ((u64)(num + 1) * sizeof(*blks) > comp_data->size) {
+			apfs_err(sb, "resource fork is too small for block table");
+			return ERR_PTR(-EFSCORRUPTED);
+		}
+		table = kvmalloc(sizeof(*table) + num * sizeof(table->entries[0]), GFP_KERNEL);
+		raw = blks = kvmalloc((num + 1) * sizeof(*blks), GFP_KERNEL);
+		if (!table || !raw) {
+			res = -ENOMEM;
+			goto fail;
+		}
+		res = apfs_compressed_data_read(comp_data, blks, (num + 1) * sizeof(*blks), 0 /* offset */);
+		if (res) {
+			apfs_err(sb, "failed to read resource block metadata");
+			goto fail;
+		}
+		for (i = 0; i < num; i++) {
+			table->entries[i].offs = le32_to_cpu(blks[i]);
+			table->entries[i].size = le32_to_cpu(blks[i + 1]) - le32_to_cpu(blks[i]);
+		}
+	}
+
+	kvfree(raw);
+	atomic_set(&table->refcnt, 1);
+	table->num = num;
+	return table;
+
+fail:
+	kvfree(raw);
+	kvfree(table);
+	return ERR_PTR(res);
+}
+
+/**
+ * apfs_compress_get_table - Get the block table for a compressed file
+ * @inode:	the vfs inode
+ * @fd:		compressed file data, with the header and resource fork already set
+ *
+ * Reuses the table from an earlier open if possible. Returns 0 on success, or
+ * a negative error code in case of failure.
+ */
+static int apfs_compress_get_table(struct inode *inode, struct apfs_compress_file_data *fd)
+{
+	struct apfs_inode_info *ai = APFS_I(inode);
+	struct apfs_compress_table *table = NULL;
+
+	spin_lock(&inode->i_lock);
+	table = ai->i_compress_table;
+	if (table)
+		atomic_inc(&table->refcnt);
+	spin_unlock(&inode->i_lock);
+	if (table)
+		goto out;
+
+	table = apfs_compress_read_table(fd);
+	if (IS_ERR(table))
+		return PTR_ERR(table);
+
+	/* Someone else may have read it in the meantime, that's fine */
+	spin_lock(&inode->i_lock);
+	if (!ai->i_compress_table) {
+		ai->i_compress_table = table;
+		atomic_inc(&table->refcnt);
+	}
+	spin_unlock(&inode->i_lock);
+
+out:
+	fd->table = table;
+	return 0;
+}
+
 static int apfs_compress_file_open(struct inode *inode, struct file *filp)
 {
 	struct super_block *sb = inode->i_sb;
-	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
 	struct apfs_compress_file_data *fd;
 	ssize_t res;
 	bool is_rsrc;
@@ -99,10 +431,9 @@ static int apfs_compress_file_open(struct inode *inode, struct file *filp)
 	fd = kzalloc(sizeof(*fd), GFP_KERNEL);
 	if (!fd)
 		return -ENOMEM;
-	mutex_init(&fd->mtx);
 	fd->sb = sb;
 
-	down_read(&nxi->nx_big_sem);
+	down_read(apfs_vol_sem(sb));
 
 	res = ____apfs_xattr_get(inode, APFS_XATTR_NAME_COMPRESSED, &fd->hdr, sizeof(fd->hdr), 0);
 	if (res != sizeof(fd->hdr)) {
@@ -115,13 +446,6 @@ static int apfs_compress_file_open(struct inode *inode, struct file *filp)
 		goto fail;
 	}
 
-	fd->buf = kvmalloc(APFS_COMPRESS_BLOCK, GFP_KERNEL);
-	if (!fd->buf) {
-		res = -ENOMEM;
-		goto fail;
-	}
-	fd->bufblk = -1;
-
 	is_rsrc = apfs_compress_is_rsrc(le32_to_cpu(fd->hdr.algo));
 	res = apfs_xattr_get_compressed_data(inode, is_rsrc ? APFS_XATTR_NAME_RSRC_FORK : APFS_XATTR_NAME_COMPRESSED, &fd->cdata);
 	if (res) {
@@ -129,219 +453,337 @@ static int apfs_compress_file_open(struct inode *inode, struct file *filp)
 		goto fail;
 	}
 
-	up_read(&nxi->nx_big_sem);
+	if (is_rsrc) {
+		res = apfs_compress_get_table(inode, fd);
+		if (res) {
+			apfs_err(sb, "failed to read block table");
+			goto fail;
+		}
+	}
+
+	up_read(apfs_vol_sem(sb));
 
 	filp->private_data = fd;
 	return 0;
 
 fail:
 	apfs_release_compressed_data(&fd->cdata);
-	if (fd->buf)
-		kvfree(fd->buf);
-	up_read(&nxi->nx_big_sem);
+	apfs_compress_put_table(fd->table);
+	up_read(apfs_vol_sem(sb));
 	kfree(fd);
 	if (res > 0)
 		res = -EINVAL;
 	return res;
 }
 
-static int apfs_compress_file_read_block(struct apfs_compress_file_data *fd, loff_t block)
+/**
+ * apfs_compress_file_locate_block - Find a compressed block in the file data
+ * @fd:		compressed file data
+ * @block:	index of the block
+ * @coffs:	on return, offset of the compressed block in the file data
+ * @csize:	on return, size of the compressed block
+ * @bsize:	on return, expected size of the block after decompression
+ *
+ * Returns 0 on success, -ENODATA if @block is past the end of the file, or
+ * another negative error code in case of failure.
+ */
+static int apfs_compress_file_locate_block(struct apfs_compress_file_data *fd, loff_t block, u64 *coffs, size_t *csize, size_t *bsize)
 {
 	struct super_block *sb = fd->sb;
-	struct apfs_compressed_data *comp_data = &fd->cdata;
-	u8 *cdata = NULL;
-	u8 *tmp = fd->buf;
-	u32 doffs = 0, coffs;
-	size_t csize, bsize;
-	int res = 0;
-
-	if (apfs_compress_is_rsrc(le32_to_cpu(fd->hdr.algo)) &&
-	   le32_to_cpu(fd->hdr.algo) != APFS_COMPRESS_LZBITMAP_RSRC &&
-	   le32_to_cpu(fd->hdr.algo) != APFS_COMPRESS_LZVN_RSRC &&
-	   le32_to_cpu(fd->hdr.algo) != APFS_COMPRESS_LZFSE_RSRC) {
-		struct apfs_compress_rsrc_hdr hdr = {0};
-		struct apfs_compress_rsrc_data cd = {0};
-		struct apfs_compress_rsrc_block blk = {0};
-		u32 blk_off;
-
-		res = apfs_compressed_data_read(comp_data, &hdr, sizeof(hdr), 0 /* offset */);
-		if (res) {
-			apfs_err(sb, "failed to read resource header");
-			return res;
-		}
+	struct apfs_compress_table *table = fd->table;
 
-		doffs = be32_to_cpu(hdr.data_offs);
-		res = apfs_compressed_data_read(comp_data, &cd, sizeof(cd), doffs);
-		if (res) {
-			apfs_err(sb, "failed to read resource data header");
-			return res;
-		}
-		if (block >= le32_to_cpu(cd.num))
-			return 0;
-
-		blk_off = doffs + sizeof(cd) + sizeof(blk) * block;
-		res = apfs_compressed_data_read(comp_data, &blk, sizeof(blk), blk_off);
-		if (res) {
-			apfs_err(sb, "failed to read resource block metadata");
-			return res;
-		}
-
-		bsize = le64_to_cpu(fd->hdr.size) - block * APFS_COMPRESS_BLOCK;
-		if (bsize > APFS_COMPRESS_BLOCK)
-			bsize = APFS_COMPRESS_BLOCK;
-
-		csize = le32_to_cpu(blk.size);
-		coffs = le32_to_cpu(blk.offs) + 4;
-	} else if (apfs_compress_is_rsrc(le32_to_cpu(fd->hdr.algo))) {
-		__le32 blks[2];
-		u32 blk_off;
-
-		blk_off = doffs + sizeof(__le32) * block;
-		res = apfs_compressed_data_read(comp_data, blks, sizeof(blks), blk_off);
-		if (res) {
-			apfs_err(sb, "failed to read resource block metadata");
-			return res;
-		}
+	if (table) {
+		if (block >= table->num)
+			return -ENODATA;
 
-		bsize = le64_to_cpu(fd->hdr.size) - block * APFS_COMPRESS_BLOCK;
-		if (bsize > APFS_COMPRESS_BLOCK)
-			bsize = APFS_COMPRESS_BLOCK;
+		*bsize = le64_to_cpu(fd->hdr.size) - block * APFS_COMPRESS_BLOCK;
+		if (*bsize > APFS_COMPRESS_BLOCK)
+			*bsize = APFS_COMPRESS_BLOCK;
 
-		coffs = le32_to_cpu(blks[0]);
-		csize = le32_to_cpu(blks[1]) - coffs;
+		*coffs = table->entries[block].offs;
+		*csize = table->entries[block].size;
 	} else {
 		/*
 		 * I think attr compression is only for single-block files, in
 		 * fact none of these files ever seem to decompress to more than
 		 * 2048 bytes.
 		 */
-		bsize = le64_to_cpu(fd->hdr.size);
-		if (block != 0 || bsize > APFS_COMPRESS_BLOCK) {
+		*bsize = le64_to_cpu(fd->hdr.size);
+		if (block != 0 || *bsize > APFS_COMPRESS_BLOCK) {
 			apfs_err(sb, "file too big for inline compression");
 			return -EFSCORRUPTED;
 		}
 
 		/* The first few bytes are the decmpfs header */
-		coffs = sizeof(struct apfs_compress_hdr);
-		csize = comp_data->size - sizeof(struct apfs_compress_hdr);
+		*coffs = sizeof(struct apfs_compress_hdr);
+		*csize = fd->cdata.size - sizeof(struct apfs_compress_hdr);
 	}
 
-	cdata = kvmalloc(csize, GFP_KERNEL);
-	if (!cdata)
-		return -ENOMEM;
-	res = apfs_compressed_data_read(comp_data, cdata, csize, doffs + coffs);
-	if (res) {
-		apfs_err(sb, "failed to read compressed block");
-		goto fail;
+	if (*csize < 1 || *csize > 2 * APFS_COMPRESS_BLOCK) {
+		apfs_err(sb, "bad compressed block size (0x%zx)", *csize);
+		return -EFSCORRUPTED;
 	}
+	return 0;
+}
 
-	switch (le32_to_cpu(fd->hdr.algo)) {
+/**
+ * apfs_compress_decode - Decompress a single block
+ * @sb:		filesystem superblock
+ * @ws:		workspace for the decoders
+ * @algo:	compression algorithm
+ * @dst:	buffer for the decompressed data
+ * @bsize:	expected size of the decompressed data, which fits in @dst
+ * @cdata:	compressed data
+ * @csize:	size of @cdata, must not be zero
+ *
+ * This doesn't touch any shared state, so callers may decompress several
+ * blocks in parallel. Returns the size of the decompressed data on success, or
+ * a negative error code in case of failure.
+ */
+static ssize_t __apfs_compress_decode(struct super_block *sb, struct apfs_compress_ws *ws, u32 algo, u8 *dst, size_t bsize, u8 *cdata, size_t csize)
+{
+	int res;
+
+	/* Blocks that didn't compress well are stored raw after one byte */
+	switch (algo) {
 	case APFS_COMPRESS_ZLIB_RSRC:
 	case APFS_COMPRESS_ZLIB_ATTR:
 		if (cdata[0] == 0x78 && csize >= 2) {
-			res = zlib_inflate_blob(tmp, bsize, cdata + 2, csize - 2);
+			res = apfs_zlib_inflate(ws, dst, bsize, cdata + 2, csize - 2);
 			if (res <= 0) {
 				apfs_err(sb, "zlib decompression failed");
-				goto fail;
+				return res ? res : -EINVAL;
 			}
-			bsize = res;
-			res = 0;
-		} else if ((cdata[0] & 0x0F) == 0x0F) {
-			memcpy(tmp, &cdata[1], csize - 1);
-			bsize = csize - 1;
-		} else {
+			return res;
+		} else if ((cdata[0] & 0x0F) != 0x0F) {
 			apfs_err(sb, "zlib decompression failed");
-			res = -EINVAL;
-			goto fail;
+			return -EINVAL;
 		}
 		break;
 	case APFS_COMPRESS_LZVN_RSRC:
 	case APFS_COMPRESS_LZVN_ATTR:
-		if (cdata[0] == 0x06) {
-			memcpy(tmp, &cdata[1], csize - 1);
-			bsize = csize - 1;
-		} else {
+		if (cdata[0] != 0x06) {
 			lzvn_decoder_state dstate = {0};
 
 			dstate.src = cdata;
 			dstate.src_end = dstate.src + csize;
-			dstate.dst = dstate.dst_begin = tmp;
+			dstate.dst = dstate.dst_begin = dst;
 			dstate.dst_end = dstate.dst + bsize;
 			lzvn_decode(&dstate);
-			bsize = dstate.dst - tmp;
+			return dstate.dst - dst;
 		}
 		break;
 	case APFS_COMPRESS_LZBITMAP_RSRC:
 	case APFS_COMPRESS_LZBITMAP_ATTR:
 		if (cdata[0] == 0x5a) {
-			res = zbm_decompress(tmp, bsize, cdata, csize, &bsize);
+			res = zbm_decompress(dst, bsize, cdata, csize, &bsize);
 			if (res < 0) {
 				apfs_err(sb, "lzbitmap decompression failed");
-				goto fail;
+				return res;
 			}
-			res = 0;
-		} else if ((cdata[0] & 0x0F) == 0x0F) {
-			memcpy(tmp, &cdata[1], csize - 1);
-			bsize = csize - 1;
-		} else {
+			return bsize;
+		} else if ((cdata[0] & 0x0F) != 0x0F) {
 			apfs_err(sb, "lzbitmap decompression failed");
-			res = -EINVAL;
-			goto fail;
+			return -EINVAL;
 		}
 		break;
 	case APFS_COMPRESS_LZFSE_RSRC:
 	case APFS_COMPRESS_LZFSE_ATTR:
 		if (cdata[0] == 0x62 && csize >= 2) {
-			res = lzfse_decode_buffer(tmp, bsize, cdata, csize, NULL);
+			res = lzfse_decode_buffer(dst, bsize, cdata, csize, ws->lzfse_scratch);
 			if (res == 0) {
 				apfs_err(sb, "lzfse decompression failed");
 				/* Could be ENOMEM too... */
-				res = -EINVAL;
-				goto fail;
+				return -EINVAL;
 			}
-			bsize = res;
-			res = 0;
-		} else {
-			/* cdata[0] == 0xff, apparently */
-			memcpy(tmp, &cdata[1], csize - 1);
-			bsize = csize - 1;
+			return res;
 		}
+		/* cdata[0] == 0xff, apparently */
 		break;
 	case APFS_COMPRESS_PLAIN_RSRC:
 	case APFS_COMPRESS_PLAIN_ATTR:
-		memcpy(tmp, &cdata[1], csize - 1);
-		bsize = csize - 1;
 		break;
 	default:
-		res = -EINVAL;
-		goto fail;
+		return -EINVAL;
 	}
-	fd->bufblk = block;
-	fd->bufsize = bsize;
-fail:
-	kvfree(cdata);
+
+	if (csize - 1 > bsize) {
+		apfs_err(sb, "uncompressed block is too big (0x%zx)", csize - 1);
+		return -EFSCORRUPTED;
+	}
+	memcpy(dst, &cdata[1], csize - 1);
+	return csize - 1;
+}
+
+/**
+ * apfs_compress_stat_index - Get the statistics index for an algorithm
+ * @algo:	compression algorithm, already known to be supported
+ */
+static inline int apfs_compress_stat_index(u32 algo)
+{
+	switch (algo) {
+	case APFS_COMPRESS_ZLIB_RSRC:
+	case APFS_COMPRESS_ZLIB_ATTR:
+		return APFS_STAT_ZLIB;
+	case APFS_COMPRESS_LZVN_RSRC:
+	case APFS_COMPRESS_LZVN_ATTR:
+		return APFS_STAT_LZVN;
+	case APFS_COMPRESS_LZFSE_RSRC:
+	case APFS_COMPRESS_LZFSE_ATTR:
+		return APFS_STAT_LZFSE;
+	case APFS_COMPRESS_LZBITMAP_RSRC:
+	case APFS_COMPRESS_LZBITMAP_ATTR:
+		return APFS_STAT_LZBITMAP;
+	default:
+		return APFS_STAT_PLAIN;
+	}
+}
+
+/**
+ * apfs_compress_decode - Decompress a single block and account for it
+ * @sb:		filesystem superblock
+ * @ws:		workspace for the decoders
+ * @algo:	compression algorithm
+ * @dst:	buffer for the decompressed data
+ * @bsize:	expected size of the decompressed data, which fits in @dst
+ * @cdata:	compressed data
+ * @csize:	size of @cdata, must not be zero
+ *
+ * Same as __apfs_compress_decode(), but it also updates the statistics.
+ */
+static ssize_t apfs_compress_decode(struct super_block *sb, struct apfs_compress_ws *ws, u32 algo, u8 *dst, size_t bsize, u8 *cdata, size_t csize)
+{
+	ssize_t res;
+
+	res = __apfs_compress_decode(sb, ws, algo, dst, bsize, cdata, csize);
+	trace_apfs_decompress(sb, algo, csize, res);
+	if (res > 0)
+		apfs_nx_stat_add(APFS_NXI(sb), decompressed[apfs_compress_stat_index(algo)], res);
 	return res;
 }
 
+/**
+ * apfs_compress_file_read_block - Read and decompress a single block
+ * @fd:		compressed file data
+ * @ws:		workspace for the decoders, the block is left in its dbuf
+ * @block:	index of the block
+ *
+ * Nothing in @fd gets modified, so readers of the same file don't need to
+ * wait for each other, and the volume lock is only held while the compressed
+ * data is read. Returns the size of the decompressed block on success, or a
+ * negative error code in case of failure.
+ */
+static ssize_t apfs_compress_file_read_block(struct apfs_compress_file_data *fd, struct apfs_compress_ws *ws, loff_t block)
+{
+	struct super_block *sb = fd->sb;
+	u64 coffs;
+	size_t csize, bsize;
+	int err;
+
+	err = apfs_compress_file_locate_block(fd, block, &coffs, &csize, &bsize);
+	if (err == -ENODATA)
+		return 0;
+	if (err)
+		return err;
+
+	down_read(apfs_vol_sem(sb));
+	err = apfs_compressed_data_read(&fd->cdata, ws->cbuf, csize, coffs);
+	up_read(apfs_vol_sem(sb));
+	if (err) {
+		apfs_err(sb, "failed to read compressed block");
+		return err;
+	}
+
+	return apfs_compress_decode(sb, ws, le32_to_cpu(fd->hdr.algo), ws->dbuf, bsize, ws->cbuf, csize);
+}
+
 static int apfs_compress_file_release(struct inode *inode, struct file *filp)
 {
 	struct apfs_compress_file_data *fd = filp->private_data;
 
 	apfs_release_compressed_data(&fd->cdata);
-	if (fd->buf)
-		kvfree(fd->buf);
+	apfs_compress_put_table(fd->table);
 	kfree(fd);
 	return 0;
 }
 
-static ssize_t apfs_compress_file_read_from_block(struct apfs_compress_file_data *fd, char *buf, size_t size, loff_t off)
+/**
+ * apfs_compress_grab_page_nowait - Get a locked page cache page, if it's free
+ * @mapping:	address space for the file
+ * @index:	index of the page
+ *
+ * Returns NULL if the page is locked by someone else or can't be allocated.
+ */
+static struct page *apfs_compress_grab_page_nowait(struct address_space *mapping, pgoff_t index)
 {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	struct folio *folio = NULL;
+
+	folio = __filemap_get_folio(mapping, index, FGP_LOCK | FGP_CREAT | FGP_NOWAIT, mapping_gfp_mask(mapping));
+	return IS_ERR(folio) ? NULL : &folio->page;
+#else
+	return grab_cache_page_nowait(mapping, index);
+#endif
+}
+
+/**
+ * apfs_compress_fill_siblings - Add the rest of a decompressed block to the cache
+ * @mapping:	address space for the file
+ * @block:	index of the block
+ * @dbuf:	decompressed data for the block
+ * @dsize:	size of @dbuf
+ * @skip:	index of the page that the caller is filling itself
+ *
+ * The whole block had to be decompressed for a single page, so keep the other
+ * pages around for later readers. Pages that are busy or already uptodate are
+ * left alone.
+ */
+static void apfs_compress_fill_siblings(struct address_space *mapping, loff_t block, const u8 *dbuf, size_t dsize, pgoff_t skip)
+{
+	pgoff_t first, nr, i;
+
+	if (PAGE_SIZE >= APFS_COMPRESS_BLOCK)
+		return;
+	first = block * (APFS_COMPRESS_BLOCK >> PAGE_SHIFT);
+	nr = DIV_ROUND_UP(dsize, PAGE_SIZE);
+
+	for (i = 0; i < nr; i++) {
+		size_t len = min_t(size_t, dsize - i * PAGE_SIZE, PAGE_SIZE);
+		struct page *page = NULL;
+		void *addr = NULL;
+
+		if (first + i == skip)
+			continue;
+		page = apfs_compress_grab_page_nowait(mapping, first + i);
+		if (!page)
+			continue;
+		if (!PageUptodate(page)) {
+			addr = kmap(page);
+			memcpy(addr, dbuf + i * PAGE_SIZE, len);
+			memset(addr + len, 0, PAGE_SIZE - len);
+			kunmap(page);
+			flush_dcache_page(page);
+			SetPageUptodate(page);
+		}
+		unlock_page(page);
+		put_page(page);
+	}
+}
+
+static ssize_t apfs_compress_file_read_page(struct file *filp, struct page *page, char *buf, loff_t off)
+{
+	struct apfs_compress_file_data *fd = filp->private_data;
 	struct super_block *sb = fd->sb;
-	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
-	struct apfs_compressed_data cdata = fd->cdata;
-	loff_t block;
-	size_t bsize;
-	ssize_t res;
+	struct apfs_compress_ws *ws = NULL;
+	u64 fsize = le64_to_cpu(fd->hdr.size);
+	size_t size = PAGE_SIZE;
+	loff_t step;
+	ssize_t res = 0;
+
+	if (off >= fsize)
+		return 0;
+	if (size > fsize - off)
+		size = fsize - off;
 
 	/*
 	 * Request reads of all blocks before actually working with any of them.
@@ -350,62 +792,42 @@ static ssize_t apfs_compress_file_read_from_block(struct apfs_compress_file_data
 	 * work with readahead as usual, but I'm not confident I can get that
 	 * right (TODO).
 	 */
-	if (cdata.has_dstream && off == 0) {
-		down_read(&nxi->nx_big_sem);
-		apfs_nonsparse_dstream_preread(cdata.dstream);
-		up_read(&nxi->nx_big_sem);
+	if (fd->cdata.has_dstream && off == 0) {
+		down_read(apfs_vol_sem(sb));
+		apfs_nonsparse_dstream_preread(fd->cdata.dstream);
+		up_read(apfs_vol_sem(sb));
 	}
 
-	if (off >= le64_to_cpu(fd->hdr.size))
-		return 0;
-	if (size > le64_to_cpu(fd->hdr.size) - off)
-		size = le64_to_cpu(fd->hdr.size) - off;
-
-	block = off / APFS_COMPRESS_BLOCK;
-	off -= block * APFS_COMPRESS_BLOCK;
-	if (block != fd->bufblk) {
-		down_read(&nxi->nx_big_sem);
-		res = apfs_compress_file_read_block(fd, block);
-		up_read(&nxi->nx_big_sem);
-		if (res) {
-			apfs_err(sb, "failed to read block into buffer");
-			return res;
-		}
-	}
-	bsize = fd->bufsize;
-
-	if (bsize < off)
-		return 0;
-	bsize -= off;
-	if (size > bsize)
-		size = bsize;
-	memcpy(buf, fd->buf + off, size);
-	return size;
-}
-
-static ssize_t apfs_compress_file_read_page(struct file *filp, char *buf, loff_t off)
-{
-	struct apfs_compress_file_data *fd = filp->private_data;
-	loff_t step;
-	ssize_t block, res;
-	size_t size = PAGE_SIZE;
+	ws = apfs_compress_ws_get();
+	if (!ws)
+		return -ENOMEM;
 
 	step = 0;
 	while (step < size) {
-		block = APFS_COMPRESS_BLOCK - ((off + step) & (APFS_COMPRESS_BLOCK - 1));
-		if (block > size - step)
-			block = size - step;
-		mutex_lock(&fd->mtx);
-		res = apfs_compress_file_read_from_block(fd, buf + step, block, off + step);
-		mutex_unlock(&fd->mtx);
-		if (res < block) {
-			if (res < 0 && !step)
-				return res;
-			step += res > 0 ? res : 0;
+		loff_t block = (off + step) / APFS_COMPRESS_BLOCK;
+		size_t boff = off + step - block * APFS_COMPRESS_BLOCK;
+		size_t want = min_t(size_t, size - step, APFS_COMPRESS_BLOCK - boff);
+		size_t len;
+
+		res = apfs_compress_file_read_block(fd, ws, block);
+		if (res < 0) {
+			apfs_err(sb, "failed to read block into buffer");
 			break;
 		}
-		step += block;
+		apfs_compress_fill_siblings(page->mapping, block, ws->dbuf, res, page->index);
+
+		if (res <= boff)
+			break;
+		len = min_t(size_t, want, res - boff);
+		memcpy(buf + step, ws->dbuf + boff, len);
+		step += len;
+		if (len < want)
+			break;
 	}
+
+	apfs_compress_ws_put(ws);
+	if (res < 0 && !step)
+		return res;
 	return step;
 }
 
@@ -424,7 +846,7 @@ static int apfs_compress_readpage(struct file *filp, struct page *page)
 	/* Mostly copied from ext4_read_inline_page() */
 	off = page->index << PAGE_SHIFT;
 	addr = kmap(page);
-	ret = apfs_compress_file_read_page(filp, addr, off);
+	ret = apfs_compress_file_read_page(filp, page, addr, off);
 	flush_dcache_page(page);
 	kunmap(page);
 	if (ret >= 0) {
@@ -437,12 +859,267 @@ static int apfs_compress_readpage(struct file *filp, struct page *page)
 	return ret;
 }
 
+/* Readahead works one compressed block at a time, so pages can't be bigger */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0) && PAGE_SIZE <= APFS_COMPRESS_BLOCK
+#define APFS_COMPRESS_READAHEAD
+
+/* Number of pages in a compressed block */
+#define APFS_COMPRESS_BLOCK_PAGES	(APFS_COMPRESS_BLOCK >> PAGE_SHIFT)
+
+/*
+ * Compressed block from a readahead window, which gets decompressed straight
+ * into the page cache, maybe in parallel with others
+ */
+struct apfs_compress_ra_block {
+	struct work_struct work;
+	struct apfs_compress_file_data *fd;
+	u8 *cdata;		/* Compressed data for the block */
+	size_t csize;		/* Size of the compressed data */
+	size_t bsize;		/* Expected size of the decompressed data */
+	u64 coffs;		/* Offset of the compressed data in the file */
+	int nr_pages;		/* Number of pages present in @pages */
+	struct page *pages[APFS_COMPRESS_BLOCK_PAGES];
+};
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+
+static inline struct page *apfs_readahead_page(struct readahead_control *rac)
+{
+	struct folio *folio = readahead_folio(rac);
+
+	return folio ? &folio->page : NULL;
+}
+
+/* The page cache keeps its own reference to the folio */
+static inline void apfs_readahead_put_page(struct page *page) {}
+
+#else /* LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0) */
+
+static inline struct page *apfs_readahead_page(struct readahead_control *rac)
+{
+	return readahead_page(rac);
+}
+
+static inline void apfs_readahead_put_page(struct page *page)
+{
+	put_page(page);
+}
+
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0) */
+
+/**
+ * apfs_compress_ra_decode - Decompress a readahead block into its pages
+ * @blk: the block to decompress
+ *
+ * The pages get unlocked and released on return, uptodate only on success.
+ * If the whole block is in the page cache, it gets mapped and decompressed in
+ * place; otherwise it needs a temporary buffer.
+ */
+static void apfs_compress_ra_decode(struct apfs_compress_ra_block *blk)
+{
+	struct apfs_compress_file_data *fd = blk->fd;
+	struct super_block *sb = fd->sb;
+	struct apfs_compress_ws *ws = NULL;
+	u8 *dst = NULL;
+	bool mapped = false;
+	ssize_t res;
+	int i;
+
+	ws = apfs_compress_ws_get();
+	if (!ws) {
+		res = -ENOMEM;
+		goto out;
+	}
+
+	if (blk->nr_pages == APFS_COMPRESS_BLOCK_PAGES) {
+		dst = vmap(blk->pages, APFS_COMPRESS_BLOCK_PAGES, VM_MAP, PAGE_KERNEL);
+		mapped = !!dst;
+	}
+	if (!dst)
+		dst = ws->dbuf;
+
+	res = apfs_compress_decode(sb, ws, le32_to_cpu(fd->hdr.algo), dst, blk->bsize, blk->cdata, blk->csize);
+	if (res < 0) {
+		apfs_err(sb, "failed to decompress block at 0x%llx", blk->coffs);
+		goto out;
+	}
+	memset(dst + res, 0, APFS_COMPRESS_BLOCK - res);
+
+	if (mapped)
+		goto out;
+	for (i = 0; i < APFS_COMPRESS_BLOCK_PAGES; i++) {
+		struct page *page = blk->pages[i];
+		void *addr = NULL;
+
+		if (!page)
+			continue;
+		addr = kmap(page);
+		memcpy(addr, dst + i * PAGE_SIZE, PAGE_SIZE);
+		kunmap(page);
+	}
+
+out:
+	if (mapped)
+		vunmap(dst);
+	if (ws)
+		apfs_compress_ws_put(ws);
+
+	for (i = 0; i < APFS_COMPRESS_BLOCK_PAGES; i++) {
+		struct page *page = blk->pages[i];
+
+		if (!page)
+			continue;
+		if (res >= 0) {
+			flush_dcache_page(page);
+			SetPageUptodate(page);
+		}
+		unlock_page(page);
+		apfs_readahead_put_page(page);
+	}
+}
+
+static void apfs_compress_ra_work(struct work_struct *work)
+{
+	struct apfs_compress_ra_block *blk = container_of(work, struct apfs_compress_ra_block, work);
+
+	apfs_compress_ra_decode(blk);
+}
+
+/**
+ * apfs_compress_ra_fetch - Read the compressed data for a readahead window
+ * @fd:		compressed file data
+ * @blocks:	array of blocks in the window
+ * @first:	index in the file of the first block
+ * @nr:		number of blocks in @blocks
+ * @cbuf:	on return, buffer with the data for all blocks; free with kvfree()
+ *
+ * The compressed data for all the blocks is read with a single request. Returns
+ * the number of blocks that can be decompressed, or a negative error code in
+ * case of failure.
+ */
+static int apfs_compress_ra_fetch(struct apfs_compress_file_data *fd, struct apfs_compress_ra_block *blocks, loff_t first, int nr, u8 **cbuf)
+{
+	struct super_block *sb = fd->sb;
+	u64 start = U64_MAX, end = 0;
+	int i, err = 0;
+
+	down_read(apfs_vol_sem(sb));
+
+	for (i = 0; i < nr; i++) {
+		struct apfs_compress_ra_block *blk = &blocks[i];
+
+		err = apfs_compress_file_locate_block(fd, first + i, &blk->coffs, &blk->csize, &blk->bsize);
+		if (err == -ENODATA)
+			break;
+		if (err)
+			goto out;
+		start = min(start, blk->coffs);
+		end = max(end, blk->coffs + blk->csize);
+	}
+	nr = i;
+	if (nr == 0) {
+		err = 0;
+		goto out;
+	}
+
+	/* Blocks are usually contiguous; don't read huge gaps if they aren't */
+	if (end - start > (u64)nr * 2 * APFS_COMPRESS_BLOCK) {
+		err = -EFSCORRUPTED;
+		goto out;
+	}
+	*cbuf = kvmalloc(end - start, GFP_KERNEL);
+	if (!*cbuf) {
+		err = -ENOMEM;
+		goto out;
+	}
+	err = apfs_compressed_data_read(&fd->cdata, *cbuf, end - start, start);
+	if (err) {
+		apfs_err(sb, "failed to read compressed blocks");
+		kvfree(*cbuf);
+		*cbuf = NULL;
+		goto out;
+	}
+
+	for (i = 0; i < nr; i++)
+		blocks[i].cdata = *cbuf + (blocks[i].coffs - start);
+
+out:
+	up_read(apfs_vol_sem(sb));
+	return err ? err : nr;
+}
+
+/**
+ * apfs_compress_readahead - Read and decompress a window of compressed blocks
+ * @rac: readahead request
+ *
+ * The blocks are decompressed in parallel on the unbound workqueue. Any page
+ * that doesn't get read here is left for ->read_folio().
+ */
+static void apfs_compress_readahead(struct readahead_control *rac)
+{
+	struct apfs_compress_file_data *fd = NULL;
+	struct apfs_compress_ra_block *blocks = NULL;
+	u8 *cbuf = NULL;
+	loff_t first, last;
+	int nr, i;
+
+	if (!rac->file || !readahead_count(rac))
+		return;
+	fd = rac->file->private_data;
+
+	first = readahead_index(rac) / APFS_COMPRESS_BLOCK_PAGES;
+	last = (readahead_index(rac) + readahead_count(rac) - 1) / APFS_COMPRESS_BLOCK_PAGES;
+	nr = last - first + 1;
+
+	blocks = kvcalloc(nr, sizeof(*blocks), GFP_KERNEL);
+	if (!blocks)
+		return;
+	nr = apfs_compress_ra_fetch(fd, blocks, first, nr, &cbuf);
+	if (nr <= 0)
+		goto out;
+
+	while (readahead_count(rac)) {
+		struct apfs_compress_ra_block *blk = NULL;
+		struct page *page = NULL;
+		pgoff_t index = readahead_index(rac);
+
+		if (index / APFS_COMPRESS_BLOCK_PAGES - first >= nr)
+			break;
+		page = apfs_readahead_page(rac);
+		if (!page)
+			break;
+		blk = &blocks[index / APFS_COMPRESS_BLOCK_PAGES - first];
+		blk->pages[index % APFS_COMPRESS_BLOCK_PAGES] = page;
+		blk->nr_pages++;
+	}
+
+	/* Decompress the last block here while the workers take the others */
+	for (i = 0; i < nr - 1; i++) {
+		blocks[i].fd = fd;
+		INIT_WORK(&blocks[i].work, apfs_compress_ra_work);
+		queue_work(system_unbound_wq, &blocks[i].work);
+	}
+	blocks[nr - 1].fd = fd;
+	apfs_compress_ra_decode(&blocks[nr - 1]);
+	for (i = 0; i < nr - 1; i++)
+		flush_work(&blocks[i].work);
+
+out:
+	kvfree(cbuf);
+	kvfree(blocks);
+}
+
+#endif /* APFS_COMPRESS_READAHEAD */
+
 const struct address_space_operations apfs_compress_aops = {
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
 	.read_folio	= apfs_compress_read_folio,
 #else
 	.readpage	= apfs_compress_readpage,
 #endif
+#ifdef APFS_COMPRESS_READAHEAD
+	.readahead	= apfs_compress_readahead,
+#endif
 };
 
 /* TODO: these operations are all happening without proper locks */
@@ -472,3 +1149,614 @@ int apfs_compress_get_size(struct inode *inode, loff_t *size)
 	*size = le64_to_cpu(hdr.size);
 	return 0;
 }
+
+/*
+ * Compressed files are built in memory before they are written, so the size of
+ * the files that get compressed on close has to be limited.
+ */
+#define APFS_COMPRESS_WRITE_MAX_SIZE	(64 * 1024 * 1024)
+
+/**
+ * apfs_compress_encode_block - Compress a single block of a file
+ * @algo:	compression algorithm for the resource fork
+ * @scratch:	scratch memory for the encoders
+ * @dst:	buffer for the compressed data
+ * @dsize:	size of @dst
+ * @src:	data to compress
+ * @ssize:	size of @src, no bigger than APFS_COMPRESS_BLOCK
+ *
+ * Returns the size of the compressed data, or 0 if it doesn't fit in @dst.
+ * Blocks that don't compress well are stored raw after a marker byte, just
+ * like the decoders expect.
+ */
+static size_t apfs_compress_encode_block(u32 algo, void *scratch, u8 *dst, size_t dsize, const u8 *src, size_t ssize)
+{
+	size_t csize = 0;
+
+	if (algo == APFS_COMPRESS_LZVN_RSRC) {
+		if (ssize >= LZVN_ENCODE_MIN_SRC_SIZE)
+			csize = lzvn_encode_buffer(dst, dsize, src, ssize, scratch);
+	} else {
+		csize = lzfse_encode_buffer(dst, dsize, src, ssize, scratch);
+	}
+	if (csize && csize <= ssize)
+		return csize;
+
+	if (ssize + 1 > dsize)
+		return 0;
+	dst[0] = algo == APFS_COMPRESS_LZVN_RSRC ? 0x06 : 0xff;
+	memcpy(dst + 1, src, ssize);
+	return ssize + 1;
+}
+
+/**
+ * apfs_compress_read_plain - Read the uncompressed data of a regular file
+ * @inode:	the vfs inode
+ * @buf:	buffer for the data
+ * @pos:	offset to read from
+ * @len:	number of bytes to read, all of them inside the file
+ *
+ * Goes through the page cache, so it must not be called inside a transaction.
+ * Returns 0 on success or a negative error code in case of failure.
+ */
+static int apfs_compress_read_plain(struct inode *inode, u8 *buf, loff_t pos, size_t len)
+{
+	struct address_space *mapping = inode->i_mapping;
+
+	while (len) {
+		size_t off = offset_in_page(pos);
+		size_t count = min_t(size_t, len, PAGE_SIZE - off);
+		struct page *page = NULL;
+		void *addr = NULL;
+
+		page = read_mapping_page(mapping, pos >> PAGE_SHIFT, NULL);
+		if (IS_ERR(page))
+			return PTR_ERR(page);
+		addr = kmap(page);
+		memcpy(buf, addr + off, count);
+		kunmap(page);
+		put_page(page);
+
+		buf += count;
+		pos += count;
+		len -= count;
+	}
+	return 0;
+}
+
+/**
+ * apfs_compress_has_xattrs - Check if an inode already has compression xattrs
+ * @inode: the vfs inode, locked
+ *
+ * Errors are reported as true, so that the file is left alone.
+ */
+static bool apfs_compress_has_xattrs(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	int rsrc_ret, cmp_ret;
+
+	down_read(apfs_vol_sem(sb));
+	rsrc_ret = __apfs_xattr_get(inode, APFS_XATTR_NAME_RSRC_FORK, NULL, 0);
+	cmp_ret = __apfs_xattr_get(inode, APFS_XATTR_NAME_COMPRESSED, NULL, 0);
+	up_read(apfs_vol_sem(sb));
+	return rsrc_ret != -ENODATA || cmp_ret != -ENODATA;
+}
+
+/**
+ * apfs_compress_inode_eligible - Check if a file can be compressed on close
+ * @inode: the vfs inode, locked
+ */
+static bool apfs_compress_inode_eligible(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct apfs_inode_info *ai = APFS_I(inode);
+	loff_t size = i_size_read(inode);
+
+	if (sb->s_flags & SB_RDONLY || !APFS_SB(sb)->s_compress_algo)
+		return false;
+	if (!S_ISREG(inode->i_mode) || !inode->i_nlink)
+		return false;
+	/* Compressed files can't be written, so they can't be appended to */
+	if (ai->i_bsd_flags & (APFS_INOBSD_COMPRESSED | APFS_INOBSD_APPEND | APFS_INOBSD_IMMUTABLE))
+		return false;
+	if (!ai->i_has_dstream || ai->i_dstream.ds_shared)
+		return false;
+	if (size == 0 || size > APFS_COMPRESS_WRITE_MAX_SIZE)
+		return false;
+	if (mapping_mapped(inode->i_mapping) || apfs_vol_is_encrypted(sb))
+		return false;
+	/* Don't overwrite a resource fork that the user set for some reason */
+	return !apfs_compress_has_xattrs(inode);
+}
+
+/* Files with more extents are left alone, to keep the transaction bounded */
+#define APFS_COMPRESS_MAX_EXTENTS	64
+
+/**
+ * apfs_compress_inode - Replace the data of a regular file with a compressed copy
+ * @inode: the vfs inode
+ *
+ * Called by the worker for files that had the compression flag set by the user,
+ * once their last open file is closed. Files that don't compress well enough to
+ * save some blocks are left alone, and so are the ones that can't be handled
+ * in a single small transaction. Returns 0 on success or a negative error code
+ * in case of failure, and the file remains uncompressed in that case.
+ */
+static int apfs_compress_inode(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct apfs_inode_info *ai = APFS_I(inode);
+	struct apfs_compress_hdr *hdr = NULL;
+	struct apfs_max_ops maxops;
+	u32 algo = APFS_SB(sb)->s_compress_algo;
+	u8 *rsrc = NULL, *blk = NULL;
+	void *scratch = NULL;
+	__le32 *offs = NULL;
+	size_t len, cap, hdr_len;
+	loff_t size;
+	u32 num, i;
+	bool inline_data;
+	int nr_ext;
+	int err = 0;
+
+	inode_lock(inode);
+	/* The file got opened again, so its last close will queue it again */
+	if (atomic_read(&ai->i_open_count) || !ai->i_compress_on_close)
+		goto out;
+	ai->i_compress_on_close = false;
+	if (!apfs_compress_inode_eligible(inode))
+		goto out;
+
+	/* Get the data into the extents, and read it back after that */
+	err = filemap_write_and_wait(inode->i_mapping);
+	if (err)
+		goto out;
+
+	down_read(apfs_vol_sem(sb));
+	nr_ext = apfs_dstream_count_extents(&ai->i_dstream, APFS_COMPRESS_MAX_EXTENTS);
+	up_read(apfs_vol_sem(sb));
+	if (nr_ext < 0) {
+		err = nr_ext;
+		goto out;
+	}
+	if (nr_ext > APFS_COMPRESS_MAX_EXTENTS)
+		goto out;
+
+	size = i_size_read(inode);
+	num = DIV_ROUND_UP(size, APFS_COMPRESS_BLOCK);
+	len = (num + 1) * sizeof(*offs);
+	/* Keep some room for the header, in case the data ends up inline */
+	cap = sizeof(*hdr) + len + size;
+
+	hdr = kvmalloc(cap, GFP_KERNEL);
+	blk = kvmalloc(APFS_COMPRESS_BLOCK, GFP_KERNEL);
+	scratch = kvmalloc(lzfse_encode_scratch_size() + 1, GFP_KERNEL);
+	if (!hdr || !blk || !scratch) {
+		err = -ENOMEM;
+		goto out;
+	}
+	rsrc = (u8 *)(hdr + 1);
+	offs = (__le32 *)rsrc;
+
+	for (i = 0; i < num; i++) {
+		loff_t pos = (loff_t)i * APFS_COMPRESS_BLOCK;
+		size_t bsize = min_t(loff_t, size - pos, APFS_COMPRESS_BLOCK);
+		size_t csize;
+
+		err = apfs_compress_read_plain(inode, blk, pos, bsize);
+		if (err) {
+			apfs_err(sb, "failed to read block 0x%x of ino 0x%llx", i, apfs_ino(inode));
+			goto out;
+		}
+		offs[i] = cpu_to_le32(len);
+		csize = apfs_compress_encode_block(algo, scratch, rsrc + len, cap - sizeof(*hdr) - len, blk, bsize);
+		if (!csize) /* Bigger than the file itself */
+			goto out;
+		len += csize;
+		cond_resched();
+	}
+	offs[num] = cpu_to_le32(len);
+
+	hdr->signature = cpu_to_le32(APFS_COMPRESS_SIGNATURE);
+	hdr->size = cpu_to_le64(size);
+
+	/* Small files go in the decmpfs xattr, right after the header */
+	hdr_len = sizeof(*hdr) + len - (num + 1) * sizeof(*offs);
+	inline_data = num == 1 && hdr_len <= APFS_XATTR_MAX_EMBEDDED_SIZE;
+	if (inline_data) {
+		memmove(rsrc, rsrc + (num + 1) * sizeof(*offs), len - (num + 1) * sizeof(*offs));
+		hdr->algo = cpu_to_le32(algo - 1); /* The attr version */
+	} else {
+		/* Not worth it unless it saves some blocks */
+		if (round_up(len, sb->s_blocksize) >= round_up(size, sb->s_blocksize))
+			goto out;
+		hdr->algo = cpu_to_le32(algo);
+		hdr_len = sizeof(*hdr);
+	}
+
+	/*
+	 * The xattrs were checked to be missing, and the extents counted, so
+	 * running out of room is caught here, before any change is made.
+	 */
+	maxops.cat = 2 * APFS_XATTR_SET_MAXOPS() + APFS_UPDATE_INODE_MAXOPS() + APFS_DROP_EXTENTS_MAXOPS(nr_ext) + 1;
+	maxops.blks = (inline_data ? 0 : DIV_ROUND_UP(len, sb->s_blocksize)) + nr_ext;
+	err = apfs_transaction_start(sb, maxops);
+	if (err)
+		goto out;
+	apfs_inode_data_join_transaction(sb, inode);
+
+	if (!inline_data) {
+		err = apfs_xattr_set(inode, APFS_XATTR_NAME_RSRC_FORK, rsrc, len, XATTR_CREATE);
+		if (err)
+			goto fail;
+	}
+	err = apfs_xattr_set(inode, APFS_XATTR_NAME_COMPRESSED, hdr, hdr_len, XATTR_CREATE);
+	if (err)
+		goto fail;
+
+	err = apfs_inode_drop_dstream(inode);
+	if (err)
+		goto fail;
+	ai->i_bsd_flags |= APFS_INOBSD_COMPRESSED;
+	inode->i_blocks = (size + 511) >> 9;
+
+	/*
+	 * Page cache misses must not go through the old operations once the
+	 * dstream is gone, or they would read holes. Switch the mapping before
+	 * dropping the cached pages, so that no stale page can be added back.
+	 */
+	inode->i_mapping->a_ops = &apfs_compress_aops;
+	inode->i_fop = &apfs_compress_file_operations;
+	truncate_inode_pages(inode->i_mapping, 0);
+
+	err = apfs_transaction_commit(sb);
+	if (err)
+		goto fail_ops;
+	goto out;
+
+fail_ops:
+	inode->i_mapping->a_ops = &apfs_aops;
+	inode->i_fop = &apfs_file_operations;
+	truncate_inode_pages(inode->i_mapping, 0);
+	ai->i_bsd_flags &= ~APFS_INOBSD_COMPRESSED;
+fail:
+	apfs_transaction_abort(sb);
+out:
+	inode_unlock(inode);
+	kvfree(scratch);
+	kvfree(blk);
+	kvfree(hdr);
+	return err;
+}
+
+/**
+ * apfs_compress_queue_inode - Schedule compression for a file that got closed
+ * @inode: the vfs inode, with the compression flag set
+ *
+ * The queue holds a reference to the inode until the worker is done with it.
+ */
+void apfs_compress_queue_inode(struct inode *inode)
+{
+	struct apfs_sb_info *sbi = APFS_SB(inode->i_sb);
+	struct apfs_inode_info *ai = APFS_I(inode);
+
+	spin_lock(&sbi->s_compress_lock);
+	if (list_empty(&ai->i_compress_list)) {
+		ihold(inode);
+		list_add_tail(&ai->i_compress_list, &sbi->s_compress_queue);
+	}
+	spin_unlock(&sbi->s_compress_lock);
+	schedule_work(&sbi->s_compress_work);
+}
+
+void apfs_compress_work(struct work_struct *work)
+{
+	struct apfs_sb_info *sbi = NULL;
+	struct apfs_inode_info *ai = NULL;
+	struct inode *inode = NULL;
+	int err;
+
+	sbi = container_of(work, struct apfs_sb_info, s_compress_work);
+	for (;;) {
+		spin_lock(&sbi->s_compress_lock);
+		ai = list_first_entry_or_null(&sbi->s_compress_queue, struct apfs_inode_info, i_compress_list);
+		if (ai)
+			list_del_init(&ai->i_compress_list);
+		spin_unlock(&sbi->s_compress_lock);
+		if (!ai)
+			return;
+
+		/* Compression is only an optimization, so the errors are just logged */
+		inode = &ai->vfs_inode;
+		err = apfs_compress_inode(inode);
+		if (err)
+			apfs_err(inode->i_sb, "failed to compress ino 0x%llx (err:%d)", apfs_ino(inode), err);
+		iput(inode);
+		cond_resched();
+	}
+}
+
+/**
+ * apfs_lzfse_copy_selftest - Check the wide match copies against the byte loop
+ *
+ * Returns 0 if the outputs match for all the short distances and lengths that
+ * take the wide paths, or -EINVAL otherwise.
+ */
+static int __init apfs_lzfse_copy_selftest(void)
+{
+	u8 fast[160], slow[160];
+	size_t d, m, i;
+
+	for (d = 1; d < 48; d++) {
+		/* The distances in between use the original eight-byte copy */
+		if (d >= 8 && d < 16)
+			continue;
+		/* Shorter matches at short distances never take a wide path */
+		for (m = d < 8 ? 9 : 1; m <= 64; m++) {
+			for (i = 0; i < sizeof(fast); i++)
+				fast[i] = slow[i] = i * 7 + 1;
+
+			/* Both may write past the match, so only compare up to it */
+			if (d < 8)
+				copy_short_distance(fast + 64, d, m);
+			else
+				copy_wide(fast + 64, fast + 64 - d, m);
+			for (i = 0; i < m; i++)
+				slow[64 + i] = slow[64 + i - d];
+			if (memcmp(fast, slow, 64 + m)) {
+				pr_err("APFS: lzfse copy self-test failed for distance %zu, length %zu\n", d, m);
+				return -EINVAL;
+			}
+		}
+	}
+	return 0;
+}
+
+/**
+ * apfs_decode_selftest - Check the fast copy paths of the decoders
+ *
+ * The wide copies are only valid under conditions that the decoders check by
+ * themselves, so compare them with the plain byte loops under those same
+ * conditions. Returns 0 on success, or -EINVAL if any of them is broken.
+ */
+int __init apfs_decode_selftest(void)
+{
+	int err;
+
+	err = apfs_lzfse_copy_selftest();
+	if (err)
+		return err;
+	err = zbm_selftest();
+	if (err)
+		pr_err("APFS: lzbitmap copy self-test failed\n");
+	return err;
+}
+
+/* Decoding a full block takes much longer than the other benchmarked paths */
+#define APFS_DECODE_BENCH_ITERS	(APFS_BENCH_ITERS / 100)
+
+enum {
+	APFS_DECODE_BENCH_LZFSE,
+	APFS_DECODE_BENCH_LZVN,
+	APFS_DECODE_BENCH_LZBITMAP,
+	APFS_DECODE_BENCH_COUNT,
+};
+
+/**
+ * apfs_decode_bench_text - Fill a buffer with compressible pseudorandom text
+ * @buf:	buffer to fill
+ * @len:	length of @buf
+ */
+static void __init apfs_decode_bench_text(u8 *buf, size_t len)
+{
+	static const char * const words[] __initconst = {
+		"apfs ", "node ", "extent ", "inode ", "snapshot ", "btree ",
+		"volume ", "container ", "checkpoint ", "xattr ", "dstream ",
+		"omap ", "\n", "0x1f2e3d4c ", "spaceman ", "keybag ",
+	};
+	u32 seed = 0x41504653;
+	size_t pos = 0;
+
+	while (pos < len) {
+		const char *word;
+		size_t wlen;
+
+		seed = seed * 1103515245 + 12345;
+		word = words[(seed >> 16) % ARRAY_SIZE(words)];
+		wlen = min(strlen(word), len - pos);
+		memcpy(buf + pos, word, wlen);
+		pos += wlen;
+	}
+}
+
+/**
+ * apfs_decode_bench_zbm - Build an LZBITMAP stream for the decode benchmark
+ * @dst:	buffer for the stream, with room for twice @len
+ * @len:	decompressed length, a multiple of 8
+ *
+ * There is no encoder in the tree, so this builds compressed chunks by hand from
+ * a fixed table of bitmaps, picking one per group of eight bytes. Returns the
+ * length of the stream.
+ */
+static size_t __init apfs_decode_bench_zbm(u8 *dst, size_t len)
+{
+	static const u8 maps[12] __initconst = {
+		0xff, 0x00, 0x0f, 0xf0, 0x01, 0x80, 0x55, 0xaa, 0x03, 0xc0, 0x3c, 0x18,
+	};
+	u32 seed = 0x5a424d09, lit_seed = 0x4c495431;
+	u8 *p = dst;
+	size_t off;
+
+	memcpy(p, "ZBM\x09", 4);
+	p += 4;
+
+	for (off = 0; off < len; off += 0x8000) {
+		u32 chunk = min_t(size_t, len - off, 0x8000);
+		u32 groups = chunk / 8;
+		u32 chunk_seed = seed;
+		u8 *hdr = p, *meta = p + 15, *table;
+		u32 meta_off, total, g, bit;
+		int i;
+
+		/* The literals come first, so walk the bitmap choices twice */
+		for (g = 0; g < groups; g++) {
+			seed = seed * 1103515245 + 12345;
+			/* The first group has no history to match against */
+			i = g ? (seed >> 16) % ARRAY_SIZE(maps) : 0;
+			for (bit = 0; bit < hweight8(maps[i]); bit++) {
+				lit_seed = lit_seed * 1103515245 + 12345;
+				*meta++ = 'a' + (lit_seed >> 16) % 26;
+			}
+		}
+
+		/* The periods never change, so the first two areas are empty */
+		meta_off = meta - hdr;
+		seed = chunk_seed;
+		for (g = 0; g < groups; g++) {
+			seed = seed * 1103515245 + 12345;
+			i = g ? (seed >> 16) % ARRAY_SIZE(maps) : 0;
+			/* Bitmap numbers below 3 are not indexes into the table */
+			if (g % 2 == 0)
+				*meta = i + 3;
+			else
+				*meta++ |= (i + 3) << 4;
+		}
+		if (groups % 2)
+			meta++;
+
+		table = meta;
+		memset(table, 0, 17);
+		for (i = 0, bit = 0; i < ARRAY_SIZE(maps); i++, bit += 10) {
+			int j;
+
+			for (j = 0; j < 8; j++) {
+				if (maps[i] & 1 << j)
+					table[(bit + j) / 8] |= 1 << (bit + j) % 8;
+			}
+		}
+		total = table + 17 - hdr;
+
+		hdr[0] = total;
+		hdr[1] = total >> 8;
+		hdr[2] = total >> 16;
+		hdr[3] = chunk;
+		hdr[4] = chunk >> 8;
+		hdr[5] = chunk >> 16;
+		for (i = 0; i < 3; i++) {
+			hdr[6 + 3 * i] = meta_off;
+			hdr[7 + 3 * i] = meta_off >> 8;
+			hdr[8 + 3 * i] = meta_off >> 16;
+		}
+		p += total;
+	}
+
+	/* An empty chunk ends the stream */
+	memset(p, 0, 6);
+	p[0] = 6;
+	p += 6;
+	return p - dst;
+}
+
+/**
+ * apfs_decode_bench_one - Decode a block once, for the benchmark
+ * @which:	decoder to use
+ * @dst:	buffer for the decoded block
+ * @src:	compressed block
+ * @slen:	length of @src
+ * @scratch:	scratch memory for the lzfse decoder
+ *
+ * Returns the decoded length, or 0 in case of failure.
+ */
+static size_t __init apfs_decode_bench_one(int which, u8 *dst, const u8 *src, size_t slen, void *scratch)
+{
+	lzvn_decoder_state dstate = {0};
+	size_t out = 0;
+
+	switch (which) {
+	case APFS_DECODE_BENCH_LZFSE:
+		return lzfse_decode_buffer(dst, APFS_COMPRESS_BLOCK, src, slen, scratch);
+	case APFS_DECODE_BENCH_LZVN:
+		dstate.src = src;
+		dstate.src_end = src + slen;
+		dstate.dst = dstate.dst_begin = dst;
+		dstate.dst_end = dst + APFS_COMPRESS_BLOCK;
+		lzvn_decode(&dstate);
+		return dstate.dst - dst;
+	default:
+		if (zbm_decompress(dst, APFS_COMPRESS_BLOCK, src, slen, &out))
+			return 0;
+		return out;
+	}
+}
+
+/**
+ * apfs_decode_bench - Time the decoders for the compressed files
+ *
+ * The lzfse and lzvn input is some pseudorandom text, compressed with the
+ * in-tree encoders; the lzbitmap input gets put together by hand. Reports the
+ * best of a few runs for a full block with each decoder.
+ */
+void __init apfs_decode_bench(void)
+{
+	static const char * const names[] __initconst = {"lzfse", "lzvn", "lzbitmap"};
+	u8 *plain = NULL, *dst = NULL, *src[APFS_DECODE_BENCH_COUNT] = {NULL};
+	size_t slen[APFS_DECODE_BENCH_COUNT] = {0};
+	u64 best[APFS_DECODE_BENCH_COUNT];
+	void *scratch = NULL;
+	size_t sink = 0;
+	int which, run, i;
+
+	plain = kvmalloc(APFS_COMPRESS_BLOCK, GFP_KERNEL);
+	dst = kvmalloc(APFS_COMPRESS_BLOCK, GFP_KERNEL);
+	scratch = kvmalloc(max(lzfse_encode_scratch_size(), lzfse_decode_scratch_size()) + 1, GFP_KERNEL);
+	if (!plain || !dst || !scratch)
+		goto out;
+	for (which = 0; which < APFS_DECODE_BENCH_COUNT; which++) {
+		src[which] = kvmalloc(2 * APFS_COMPRESS_BLOCK, GFP_KERNEL);
+		if (!src[which])
+			goto out;
+	}
+
+	apfs_decode_bench_text(plain, APFS_COMPRESS_BLOCK);
+	slen[APFS_DECODE_BENCH_LZFSE] = lzfse_encode_buffer(src[APFS_DECODE_BENCH_LZFSE], 2 * APFS_COMPRESS_BLOCK, plain, APFS_COMPRESS_BLOCK, scratch);
+	slen[APFS_DECODE_BENCH_LZVN] = lzvn_encode_buffer(src[APFS_DECODE_BENCH_LZVN], 2 * APFS_COMPRESS_BLOCK, plain, APFS_COMPRESS_BLOCK, scratch);
+	slen[APFS_DECODE_BENCH_LZBITMAP] = apfs_decode_bench_zbm(src[APFS_DECODE_BENCH_LZBITMAP], APFS_COMPRESS_BLOCK);
+
+	for (which = 0; which < APFS_DECODE_BENCH_COUNT; which++) {
+		best[which] = U64_MAX;
+		if (!slen[which] || apfs_decode_bench_one(which, dst, src[which], slen[which], scratch) != APFS_COMPRESS_BLOCK) {
+			pr_err("APFS: bench: %s input failed to decode\n", names[which]);
+			goto out;
+		}
+		if (which != APFS_DECODE_BENCH_LZBITMAP && memcmp(dst, plain, APFS_COMPRESS_BLOCK)) {
+			pr_err("APFS: bench: %s input decoded wrong\n", names[which]);
+			goto out;
+		}
+	}
+
+	for (run = 0; run < APFS_BENCH_RUNS; run++) {
+		for (which = 0; which < APFS_DECODE_BENCH_COUNT; which++) {
+			u64 start;
+
+			start = ktime_get_ns();
+			for (i = 0; i < APFS_DECODE_BENCH_ITERS; i++)
+				sink += apfs_decode_bench_one(which, dst, src[which], slen[which], scratch);
+			best[which] = min(best[which], ktime_get_ns() - start);
+			cond_resched();
+		}
+	}
+
+	pr_info("APFS: bench: decode of %d bytes: lzfse %llu ns from %zu, lzvn %llu ns from %zu, lzbitmap %llu ns from %zu (%zu)\n",
+		APFS_COMPRESS_BLOCK,
+		div_u64(best[APFS_DECODE_BENCH_LZFSE], APFS_DECODE_BENCH_ITERS), slen[APFS_DECODE_BENCH_LZFSE],
+		div_u64(best[APFS_DECODE_BENCH_LZVN], APFS_DECODE_BENCH_ITERS), slen[APFS_DECODE_BENCH_LZVN],
+		div_u64(best[APFS_DECODE_BENCH_LZBITMAP], APFS_DECODE_BENCH_ITERS), slen[APFS_DECODE_BENCH_LZBITMAP],
+		sink);
+
+out:
+	for (which = 0; which < APFS_DECODE_BENCH_COUNT; which++)
+		kvfree(src[which]);
+	kvfree(scratch);
+	kvfree(dst);
+	kvfree(plain);
+}
@@ -3,6 +3,7 @@
  * Copyright (C) 2018 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
  */
 
+#include <linux/mount.h>
 #include <linux/slab.h>
 #include <linux/buffer_head.h>
 #include "apfs.h"
@@ -87,6 +88,7 @@ static int apfs_drec_from_query(struct apfs_query *query, struct apfs_drec *drec
  * apfs_dentry_lookup - Lookup a dentry record in the catalog b-tree
  * @dir:	parent directory
  * @child:	filename
+ * @hash:	precomputed hash for @child (0 if unknown)
  * @drec:	on return, the directory record found
  *
  * Runs a catalog query for @name in the @dir directory.  On success, sets
@@ -94,7 +96,7 @@ static int apfs_drec_from_query(struct apfs_query *query, struct apfs_drec *drec
  * an appropriate error pointer.
  */
 static struct apfs_query *apfs_dentry_lookup(struct inode *dir,
-					     const struct qstr *child,
+					     const struct qstr *child, u32 hash,
 					     struct apfs_drec *drec)
 {
 	struct super_block *sb = dir->i_sb;
@@ -107,7 +109,7 @@ static struct apfs_query *apfs_dentry_lookup(struct inode *dir,
 	query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
 	if (!query)
 		return ERR_PTR(-ENOMEM);
-	apfs_init_drec_key(sb, cnid, child->name, child->len, &query->key);
+	apfs_init_drec_key(sb, cnid, child->name, child->len, hash, &query->key);
 
 	/*
 	 * Distinct filenames in the same directory may (rarely) share the same
@@ -149,22 +151,21 @@ fail:
 /**
  * apfs_inode_by_name - Find the cnid for a given filename
  * @dir:	parent directory
- * @child:	filename
+ * @dentry:	dentry for the filename
  * @ino:	on return, the inode number found
  *
  * Returns 0 and the inode number (which is the cnid of the file
  * record); otherwise, return the appropriate error code.
  */
-int apfs_inode_by_name(struct inode *dir, const struct qstr *child, u64 *ino)
+int apfs_inode_by_name(struct inode *dir, const struct dentry *dentry, u64 *ino)
 {
 	struct super_block *sb = dir->i_sb;
-	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
 	struct apfs_query *query;
 	struct apfs_drec drec;
 	int err = 0;
 
-	down_read(&nxi->nx_big_sem);
-	query = apfs_dentry_lookup(dir, child, &drec);
+	down_read(apfs_vol_sem(sb));
+	query = apfs_dentry_lookup(dir, &dentry->d_name, apfs_dentry_drec_hash(dentry), &drec);
 	if (IS_ERR(query)) {
 		err = PTR_ERR(query);
 		goto out;
@@ -172,23 +173,116 @@ int apfs_inode_by_name(struct inode *dir, const struct qstr *child, u64 *ino)
 	*ino = drec.ino;
 	apfs_free_query(query);
 out:
-	up_read(&nxi->nx_big_sem);
+	up_read(apfs_vol_sem(sb));
 	return err;
 }
 
+/*
+ * Position of a directory listing, saved so that the next readdir() call can
+ * continue right away instead of searching all the records again
+ */
+struct apfs_readdir_cursor {
+	loff_t	pos;		/* Value of ctx->pos after the last emitted entry */
+	u64	number;		/* Hash of the last emitted record, if any */
+	char	name[APFS_NAME_LEN + 1]; /* Name of the last emitted record */
+};
+
+/**
+ * apfs_readdir_save - Remember the position of the last record emitted
+ * @file:	the directory file
+ * @query:	query that found the record
+ * @drec:	the directory record
+ * @pos:	new position for the listing
+ *
+ * Failure to allocate the cursor is ignored, it only makes things slower.
+ */
+static void apfs_readdir_save(struct file *file, struct apfs_query *query, struct apfs_drec *drec, loff_t pos)
+{
+	struct super_block *sb = file_inode(file)->i_sb;
+	struct apfs_readdir_cursor *cursor = file->private_data;
+
+	if (drec->name_len > APFS_NAME_LEN)
+		return;
+
+	if (!cursor) {
+		cursor = kmalloc(sizeof(*cursor), GFP_KERNEL);
+		if (!cursor)
+			return;
+		file->private_data = cursor;
+	}
+
+	cursor->number = 0;
+	if (apfs_is_normalization_insensitive(sb)) {
+		struct apfs_drec_hashed_key *de_hkey = NULL;
+
+		/* The key length was already checked by apfs_drec_from_query() */
+		de_hkey = (void *)query->node->object.data + query->key_off;
+		cursor->number = le32_to_cpu(de_hkey->name_len_and_hash) & APFS_DREC_HASH_MASK;
+	}
+	memcpy(cursor->name, drec->name, drec->name_len);
+	cursor->name[drec->name_len] = 0;
+	cursor->pos = pos;
+}
+
+/**
+ * apfs_readdir_seek - Set up a readdir query to continue from the saved cursor
+ * @file:	the directory file
+ * @query:	query to set up
+ * @skip:	on return, should the current record be skipped?
+ *
+ * Finds the last emitted record, or the one that would come before it if it
+ * got deleted, with a single descent. Returns 0 on success, -ENODATA if no
+ * records remain, or another negative error code in case of failure.
+ */
+static int apfs_readdir_seek(struct file *file, struct apfs_query **query, bool *skip)
+{
+	struct inode *inode = file_inode(file);
+	struct super_block *sb = inode->i_sb;
+	struct apfs_readdir_cursor *cursor = file->private_data;
+	struct apfs_key key;
+	struct apfs_drec drec;
+	bool hashed = apfs_is_normalization_insensitive(sb);
+	int err;
+
+	(*query)->key.id = apfs_ino(inode);
+	(*query)->key.type = APFS_TYPE_DIR_REC;
+	(*query)->key.number = cursor->number;
+	(*query)->key.name = cursor->name;
+	(*query)->flags = APFS_QUERY_CAT;
+
+	err = apfs_btree_query(sb, query);
+	if (err)
+		return err;
+
+	/* From now on, get all the records that come before this one */
+	apfs_init_drec_key(sb, apfs_ino(inode), NULL /* name */, 0 /* name_len */, 0 /* hash */, &key);
+	err = apfs_query_continue_multiple(*query, &key, APFS_QUERY_MULTIPLE);
+	if (err)
+		return err;
+
+	err = apfs_drec_from_query(*query, &drec, hashed);
+	if (err) {
+		apfs_alert(sb, "bad dentry record in directory 0x%llx", apfs_ino(inode));
+		return err;
+	}
+	*skip = strcmp((char *)drec.name, cursor->name) == 0;
+	return 0;
+}
+
 static int apfs_readdir(struct file *file, struct dir_context *ctx)
 {
 	struct inode *inode = file_inode(file);
 	struct super_block *sb = inode->i_sb;
 	struct apfs_sb_info *sbi = APFS_SB(sb);
-	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_readdir_cursor *cursor = file->private_data;
 	struct apfs_query *query;
 	u64 cnid = apfs_ino(inode);
 	loff_t pos;
 	bool hashed = apfs_is_normalization_insensitive(sb);
+	bool have_rec = false;
 	int err = 0;
 
-	down_read(&nxi->nx_big_sem);
+	down_read(apfs_vol_sem(sb));
 
 	/* Inode numbers might overflow here; follow btrfs in ignoring that */
 	if (!dir_emit_dots(file, ctx))
@@ -200,27 +294,44 @@ static int apfs_readdir(struct file *file, struct dir_context *ctx)
 		goto out;
 	}
 
-	/* We want all the children for the cnid, regardless of the name */
-	apfs_init_drec_key(sb, cnid, NULL /* name */, 0 /* name_len */, &query->key);
-	query->flags = APFS_QUERY_CAT | APFS_QUERY_MULTIPLE | APFS_QUERY_EXACT;
+	if (cursor && cursor->pos == ctx->pos) {
+		/* Continue right where the last call stopped */
+		bool skip = false;
+
+		err = apfs_readdir_seek(file, &query, &skip);
+		if (err == -ENODATA) {
+			err = 0;
+			goto free_query;
+		}
+		if (err)
+			goto free_query;
+		have_rec = !skip;
+		pos = 0;
+	} else {
+		/* We want all the children for the cnid, regardless of the name */
+		apfs_init_drec_key(sb, cnid, NULL /* name */, 0 /* name_len */, 0 /* hash */, &query->key);
+		query->flags = APFS_QUERY_CAT | APFS_QUERY_MULTIPLE | APFS_QUERY_EXACT;
+		pos = ctx->pos - 2;
+	}
 
-	pos = ctx->pos - 2;
 	while (1) {
 		struct apfs_drec drec;
 		/*
 		 * We query for the matching records, one by one. After we
-		 * pass ctx->pos we begin to emit them.
-		 *
-		 * TODO: Faster approach for large directories?
+		 * pass ctx->pos we begin to emit them. This only happens after
+		 * a seek, otherwise the cursor lets us start at the right one.
 		 */
 
-		err = apfs_btree_query(sb, &query);
-		if (err == -ENODATA) { /* Got all the records */
-			err = 0;
-			break;
+		if (!have_rec) {
+			err = apfs_btree_query(sb, &query);
+			if (err == -ENODATA) { /* Got all the records */
+				err = 0;
+				break;
+			}
+			if (err)
+				break;
 		}
-		if (err)
-			break;
+		have_rec = false;
 
 		err = apfs_drec_from_query(query, &drec, hashed);
 		if (err) {
@@ -235,20 +346,242 @@ static int apfs_readdir(struct file *file, struct dir_context *ctx)
 				      drec.ino, drec.type))
 				break;
 			++ctx->pos;
+			apfs_readdir_save(file, query, &drec, ctx->pos);
 		}
 		pos--;
 	}
+
+free_query:
 	apfs_free_query(query);
+out:
+	up_read(apfs_vol_sem(sb));
+	return err;
+}
+
+/* Most bytes of entries to return from a single bulk listing call */
+#define APFS_READDIRPLUS_BUF_MAX	(256 * 1024)
+
+/*
+ * Listing context for the bulk directory ioctl, which collects the entries
+ * in a kernel buffer before their inodes are read
+ */
+struct apfs_readdirplus_ctx {
+	struct dir_context ctx;
+	char	*buf;		/* Buffer for the entries */
+	u32	size;		/* Size of the buffer */
+	u32	used;		/* Bytes of the buffer already in use */
+	u32	count;		/* Number of entries in the buffer */
+	bool	full;		/* Did the listing stop for lack of room? */
+};
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 1, 0)
+#define APFS_FILLDIR_CONTINUE	0
+#define APFS_FILLDIR_STOP	-EINVAL
+static int apfs_readdirplus_actor(struct dir_context *ctx, const char *name, int name_len,
+				  loff_t offset, u64 ino, unsigned int d_type)
+#else
+#define APFS_FILLDIR_CONTINUE	true
+#define APFS_FILLDIR_STOP	false
+static bool apfs_readdirplus_actor(struct dir_context *ctx, const char *name, int name_len,
+				   loff_t offset, u64 ino, unsigned int d_type)
+#endif
+{
+	struct apfs_readdirplus_ctx *rctx = container_of(ctx, struct apfs_readdirplus_ctx, ctx);
+	struct apfs_ioctl_dirent_plus *de = NULL;
+	u32 rec_len;
+
+	/* The dots don't have records, and the caller knows about them */
+	if (ctx->pos < 2)
+		return APFS_FILLDIR_CONTINUE;
+
+	rec_len = round_up(sizeof(*de) + name_len + 1, 8);
+	if (rec_len > rctx->size - rctx->used) {
+		rctx->full = true;
+		return APFS_FILLDIR_STOP;
+	}
+
+	de = (void *)rctx->buf + rctx->used;
+	memset(de, 0, sizeof(*de));
+	de->ino = ino;
+	de->type = d_type;
+	de->rec_len = rec_len;
+	de->name_len = name_len;
+	memcpy(de->name, name, name_len);
+	de->name[name_len] = 0;
+
+	rctx->used += rec_len;
+	rctx->count++;
+	return APFS_FILLDIR_CONTINUE;
+}
+
+/**
+ * apfs_readdirplus_owner - Report the owner of an inode like stat() would
+ * @file:	the directory file, for the mount idmapping
+ * @inode:	the inode
+ * @de:		the entry to fill
+ */
+static void apfs_readdirplus_owner(struct file *file, struct inode *inode, struct apfs_ioctl_dirent_plus *de)
+{
+	kuid_t uid;
+	kgid_t gid;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 12, 0)
+	uid = inode->i_uid;
+	gid = inode->i_gid;
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(6, 0, 0)
+	uid = i_uid_into_mnt(file_mnt_user_ns(file), inode);
+	gid = i_gid_into_mnt(file_mnt_user_ns(file), inode);
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0)
+	uid = vfsuid_into_kuid(i_uid_into_vfsuid(file_mnt_user_ns(file), inode));
+	gid = vfsgid_into_kgid(i_gid_into_vfsgid(file_mnt_user_ns(file), inode));
+#else
+	uid = vfsuid_into_kuid(i_uid_into_vfsuid(file_mnt_idmap(file), inode));
+	gid = vfsgid_into_kgid(i_gid_into_vfsgid(file_mnt_idmap(file), inode));
+#endif
+	de->uid = from_kuid_munged(current_user_ns(), uid);
+	de->gid = from_kgid_munged(current_user_ns(), gid);
+}
+
+/**
+ * apfs_readdirplus_fill - Fill the inode fields of a bulk listing entry
+ * @file: the directory file
+ * @de:   the entry
+ *
+ * The inode stays in the cache afterwards, so a later stat() won't need to
+ * query the catalog. Entries whose inode can't be read are left without the
+ * APFS_DIRENT_PLUS_ATTRS flag; they may have been deleted in the meantime.
+ */
+static void apfs_readdirplus_fill(struct file *file, struct apfs_ioctl_dirent_plus *de)
+{
+	struct super_block *sb = file_inode(file)->i_sb;
+	struct inode *inode = NULL;
+	struct timespec64 ts;
+
+	inode = apfs_iget(sb, de->ino);
+	if (IS_ERR(inode))
+		return;
+
+	de->size = i_size_read(inode);
+	de->blocks = inode->i_blocks;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 6, 0)
+	ts = inode->i_ctime;
+#else
+	ts = inode_get_ctime(inode);
+#endif
+	de->ctime_sec = ts.tv_sec;
+	de->ctime_nsec = ts.tv_nsec;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 7, 0)
+	ts = inode->i_atime;
+#else
+	ts = inode_get_atime(inode);
+#endif
+	de->atime_sec = ts.tv_sec;
+	de->atime_nsec = ts.tv_nsec;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 7, 0)
+	ts = inode->i_mtime;
+#else
+	ts = inode_get_mtime(inode);
+#endif
+	de->mtime_sec = ts.tv_sec;
+	de->mtime_nsec = ts.tv_nsec;
+	de->btime_sec = APFS_I(inode)->i_crtime.tv_sec;
+	de->btime_nsec = APFS_I(inode)->i_crtime.tv_nsec;
+	de->mode = inode->i_mode;
+	de->nlink = inode->i_nlink;
+	apfs_readdirplus_owner(file, inode, de);
+	de->bsd_flags = APFS_I(inode)->i_bsd_flags;
+	de->flags |= APFS_DIRENT_PLUS_ATTRS;
+
+	iput(inode);
+}
+
+/**
+ * apfs_ioc_readdirplus - Ioctl handler to list a directory with inode fields
+ * @file:	the directory file
+ * @user_arg:	parameters for the listing
+ *
+ * Works like getdents() followed by a stat() for each entry, but with a single
+ * pass over the directory records and without a path lookup for each child.
+ * The position is the same one used by readdir(), except that the dots are
+ * never returned. Returns 0 on success, or a negative error code in case of
+ * failure.
+ */
+int apfs_ioc_readdirplus(struct file *file, void __user *user_arg)
+{
+	struct inode *dir = file_inode(file);
+	struct apfs_ioctl_readdirplus arg;
+	struct apfs_readdirplus_ctx rctx = {
+		.ctx.actor = apfs_readdirplus_actor,
+	};
+	u32 off;
+	int err;
+
+	/* Listing only needs read access, but stat() of the children needs search */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 12, 0)
+	err = inode_permission(dir, MAY_EXEC);
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0)
+	err = inode_permission(file_mnt_user_ns(file), dir, MAY_EXEC);
+#else
+	err = inode_permission(file_mnt_idmap(file), dir, MAY_EXEC);
+#endif
+	if (err)
+		return err;
+
+	if (copy_from_user(&arg, user_arg, sizeof(arg)))
+		return -EFAULT;
+	if (arg.buf_size < round_up(sizeof(struct apfs_ioctl_dirent_plus) + APFS_NAME_LEN + 1, 8))
+		return -EINVAL;
+	if (arg.pos > LLONG_MAX)
+		return -EINVAL;
+
+	rctx.size = min_t(u32, arg.buf_size, APFS_READDIRPLUS_BUF_MAX);
+	rctx.buf = kvmalloc(rctx.size, GFP_KERNEL);
+	if (!rctx.buf)
+		return -ENOMEM;
+	rctx.ctx.pos = arg.pos;
+
+	/* Exclusive, because the readdir cursor is kept in the file */
+	err = down_write_killable(&dir->i_rwsem);
+	if (err)
+		goto out;
+	if (IS_DEADDIR(dir))
+		err = -ENOENT;
+	else
+		err = apfs_readdir(file, &rctx.ctx);
+	inode_unlock(dir);
+	if (err)
+		goto out;
+
+	/* No locks held here, apfs_iget() takes the volume lock on its own */
+	for (off = 0; off < rctx.used; off += ((struct apfs_ioctl_dirent_plus *)(rctx.buf + off))->rec_len)
+		apfs_readdirplus_fill(file, (void *)rctx.buf + off);
 
+	if (copy_to_user(u64_to_user_ptr(arg.buf), rctx.buf, rctx.used)) {
+		err = -EFAULT;
+		goto out;
+	}
+	arg.pos = rctx.ctx.pos;
+	arg.count = rctx.count;
+	arg.flags = rctx.full ? 0 : APFS_READDIRPLUS_EOF;
+	if (copy_to_user(user_arg, &arg, sizeof(arg)))
+		err = -EFAULT;
 out:
-	up_read(&nxi->nx_big_sem);
+	kvfree(rctx.buf);
 	return err;
 }
 
+static int apfs_dir_release(struct inode *inode, struct file *file)
+{
+	kfree(file->private_data);
+	file->private_data = NULL;
+	return 0;
+}
+
 const struct file_operations apfs_dir_operations = {
 	.llseek		= generic_file_llseek,
 	.read		= generic_read_dir,
 	.iterate_shared	= apfs_readdir,
+	.release	= apfs_dir_release,
 	.fsync		= apfs_fsync,
 	.unlocked_ioctl	= apfs_dir_ioctl,
 };
@@ -358,12 +691,13 @@ static int apfs_build_dentry_val(struct inode *inode, u64 sibling_id,
  * apfs_create_dentry_rec - Create a dentry record in the catalog b-tree
  * @inode:	vfs inode for the dentry
  * @qname:	filename
+ * @hash:	precomputed hash for @qname (0 if unknown)
  * @parent_id:	inode number for the parent of the dentry
  * @sibling_id:	sibling id for this hardlink (0 for none)
  *
  * Returns 0 on success or a negative error code in case of failure.
  */
-static int apfs_create_dentry_rec(struct inode *inode, struct qstr *qname,
+static int apfs_create_dentry_rec(struct inode *inode, struct qstr *qname, u32 hash,
 				  u64 parent_id, u64 sibling_id)
 {
 	struct super_block *sb = inode->i_sb;
@@ -378,7 +712,7 @@ static int apfs_create_dentry_rec(struct inode *inode, struct qstr *qname,
 	query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
 	if (!query)
 		return -ENOMEM;
-	apfs_init_drec_key(sb, parent_id, qname->name, qname->len, &query->key);
+	apfs_init_drec_key(sb, parent_id, qname->name, qname->len, hash, &query->key);
 	query->flags |= APFS_QUERY_CAT;
 
 	ret = apfs_btree_query(sb, &query);
@@ -595,7 +929,7 @@ static int apfs_create_dentry(struct dentry *dentry, struct inode *inode)
 		}
 	}
 
-	err = apfs_create_dentry_rec(inode, &dentry->d_name, apfs_ino(parent), sibling_id);
+	err = apfs_create_dentry_rec(inode, &dentry->d_name, apfs_dentry_drec_hash(dentry), apfs_ino(parent), sibling_id);
 	if (err) {
 		apfs_err(sb, "failed to create drec for ino 0x%llx", apfs_ino(inode));
 		return err;
@@ -791,7 +1125,7 @@ static int apfs_prepare_dentry_for_link(struct dentry *dentry)
 	u64 sibling_id;
 	int ret;
 
-	query = apfs_dentry_lookup(parent, &dentry->d_name, &drec);
+	query = apfs_dentry_lookup(parent, &dentry->d_name, apfs_dentry_drec_hash(dentry), &drec);
 	if (IS_ERR(query)) {
 		apfs_err(sb, "lookup failed in dir 0x%llx", apfs_ino(parent));
 		return PTR_ERR(query);
@@ -815,7 +1149,7 @@ static int apfs_prepare_dentry_for_link(struct dentry *dentry)
 		apfs_err(sb, "failed to create sibling recs in dir 0x%llx", apfs_ino(parent));
 		return ret;
 	}
-	return apfs_create_dentry_rec(d_inode(dentry), &dentry->d_name,
+	return apfs_create_dentry_rec(d_inode(dentry), &dentry->d_name, apfs_dentry_drec_hash(dentry),
 				      apfs_ino(parent), sibling_id);
 }
 #define APFS_PREPARE_DENTRY_FOR_LINK_MAXOPS	(1 + APFS_CREATE_SIBLING_RECS_MAXOPS + \
@@ -1013,7 +1347,7 @@ static int apfs_delete_dentry(struct dentry *dentry)
 	struct apfs_drec drec;
 	int err;
 
-	query = apfs_dentry_lookup(parent, &dentry->d_name, &drec);
+	query = apfs_dentry_lookup(parent, &dentry->d_name, apfs_dentry_drec_hash(dentry), &drec);
 	if (IS_ERR(query))
 		return PTR_ERR(query);
 	err = apfs_btree_remove(query);
@@ -1196,7 +1530,7 @@ static int apfs_create_orphan_link(struct inode *inode)
 	err = apfs_orphan_name(apfs_ino(inode), &qname);
 	if (err)
 		return err;
-	err = apfs_create_dentry_rec(inode, &qname, apfs_ino(priv_dir), 0 /* sibling_id */);
+	err = apfs_create_dentry_rec(inode, &qname, 0 /* hash */, apfs_ino(priv_dir), 0 /* sibling_id */);
 	if (err) {
 		apfs_err(sb, "failed to create drec for ino 0x%llx", apfs_ino(inode));
 		goto fail;
@@ -1240,7 +1574,7 @@ int apfs_delete_orphan_link(struct inode *inode)
 	if (err)
 		return err;
 
-	query = apfs_dentry_lookup(priv_dir, &qname, &drec);
+	query = apfs_dentry_lookup(priv_dir, &qname, 0 /* hash */, &drec);
 	if (IS_ERR(query)) {
 		apfs_err(sb, "dentry lookup failed");
 		err = PTR_ERR(query);
@@ -1503,7 +1837,7 @@ u64 apfs_any_orphan_ino(struct super_block *sb, u64 *ino_p)
 	query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
 	if (!query)
 		return -ENOMEM;
-	apfs_init_drec_key(sb, APFS_PRIV_DIR_INO_NUM, NULL /* name */, 0 /* name_len */, &query->key);
+	apfs_init_drec_key(sb, APFS_PRIV_DIR_INO_NUM, NULL /* name */, 0 /* name_len */, 0 /* hash */, &query->key);
 	query->flags = APFS_QUERY_CAT | APFS_QUERY_MULTIPLE | APFS_QUERY_EXACT;
 
 	while (!found) {
@@ -6,7 +6,12 @@
 #include <linux/buffer_head.h>
 #include <linux/slab.h>
 #include <linux/blk_types.h>
+#include <linux/blkdev.h>
+#include <linux/falloc.h>
 #include "apfs.h"
+#ifdef APFS_IOMAP
+#include <linux/iomap.h>
+#endif
 
 #define MAX(X, Y)	((X) <= (Y) ? (Y) : (X))
 
@@ -90,6 +95,175 @@ int apfs_extent_from_query(struct apfs_query *query,
 	return 0;
 }
 
+/**
+ * apfs_extent_map_lookup - Find the cached clean extent that covers an address
+ * @dstream:	data stream info
+ * @iaddr:	logical address to look up
+ * @extent:	on return, the extent found
+ *
+ * The caller must hold the extent lock. Returns true on a hit.
+ */
+static bool apfs_extent_map_lookup(struct apfs_dstream_info *dstream, u64 iaddr, struct apfs_file_extent *extent)
+{
+	struct rb_node *node = dstream->ds_ext_map.rb_node;
+
+	while (node) {
+		struct apfs_extent_map_entry *entry = NULL;
+
+		entry = rb_entry(node, struct apfs_extent_map_entry, node);
+		if (iaddr < entry->ext.logical_addr) {
+			node = node->rb_left;
+		} else if (iaddr >= entry->ext.logical_addr + entry->ext.len) {
+			node = node->rb_right;
+		} else {
+			*extent = entry->ext;
+			list_move(&entry->lru, &dstream->ds_ext_map_lru);
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * apfs_extent_map_erase - Remove and free an entry from the extent map
+ * @dstream:	data stream info
+ * @entry:	the entry to remove
+ *
+ * The caller must hold the extent lock.
+ */
+static void apfs_extent_map_erase(struct apfs_dstream_info *dstream, struct apfs_extent_map_entry *entry)
+{
+	rb_erase(&entry->node, &dstream->ds_ext_map);
+	list_del(&entry->lru);
+	--dstream->ds_ext_map_count;
+	kfree(entry);
+}
+
+/**
+ * apfs_extent_map_add - Add an extent just read from disk to the extent map
+ * @dstream:	data stream info
+ * @extent:	the extent to add
+ *
+ * The map is only a cache, so failures here are silently ignored.
+ */
+static void apfs_extent_map_add(struct apfs_dstream_info *dstream, const struct apfs_file_extent *extent)
+{
+	struct apfs_extent_map_entry *new = NULL;
+	struct rb_node **link = NULL, *parent = NULL;
+
+	/* Xattr dstreams are short-lived, and mostly read in one go */
+	if (!dstream->ds_inode)
+		return;
+
+	new = kmalloc(sizeof(*new), GFP_NOFS);
+	if (!new)
+		return;
+	new->ext = *extent;
+
+	spin_lock(&dstream->ds_ext_lock);
+	link = &dstream->ds_ext_map.rb_node;
+	while (*link) {
+		struct apfs_extent_map_entry *entry = NULL;
+
+		entry = rb_entry(*link, struct apfs_extent_map_entry, node);
+		parent = *link;
+		if (extent->logical_addr + extent->len <= entry->ext.logical_addr) {
+			link = &parent->rb_left;
+		} else if (extent->logical_addr >= entry->ext.logical_addr + entry->ext.len) {
+			link = &parent->rb_right;
+		} else {
+			/* Some other reader got here first */
+			spin_unlock(&dstream->ds_ext_lock);
+			kfree(new);
+			return;
+		}
+	}
+	rb_link_node(&new->node, parent, link);
+	rb_insert_color(&new->node, &dstream->ds_ext_map);
+	list_add(&new->lru, &dstream->ds_ext_map_lru);
+
+	if (++dstream->ds_ext_map_count > APFS_EXTENT_MAP_MAX) {
+		struct apfs_extent_map_entry *victim = NULL;
+
+		victim = list_last_entry(&dstream->ds_ext_map_lru, struct apfs_extent_map_entry, lru);
+		apfs_extent_map_erase(dstream, victim);
+	}
+	spin_unlock(&dstream->ds_ext_lock);
+}
+
+/**
+ * apfs_extent_map_drop - Forget the cached extents that overlap a range
+ * @dstream:	data stream info
+ * @start:	first logical address in the range
+ * @end:	first logical address after the range
+ *
+ * Must be called whenever the extent records in the range change.
+ */
+static void apfs_extent_map_drop(struct apfs_dstream_info *dstream, u64 start, u64 end)
+{
+	struct rb_node *node = NULL;
+
+	spin_lock(&dstream->ds_ext_lock);
+	node = rb_first(&dstream->ds_ext_map);
+	while (node) {
+		struct apfs_extent_map_entry *entry = NULL;
+
+		entry = rb_entry(node, struct apfs_extent_map_entry, node);
+		node = rb_next(node);
+		if (entry->ext.logical_addr >= end)
+			break;
+		if (entry->ext.logical_addr + entry->ext.len > start)
+			apfs_extent_map_erase(dstream, entry);
+	}
+	spin_unlock(&dstream->ds_ext_lock);
+}
+
+/**
+ * apfs_extent_map_clear - Forget all the cached extents for a dstream
+ * @dstream: data stream info
+ */
+void apfs_extent_map_clear(struct apfs_dstream_info *dstream)
+{
+	apfs_extent_map_drop(dstream, 0, U64_MAX);
+}
+
+/**
+ * apfs_extent_prefetch - Add the extents that follow a query's to the map
+ * @dstream:	data stream info
+ * @query:	query that just found the extent record for @extent
+ * @extent:	the extent found by @query
+ *
+ * The following extent records of the dstream are usually in the same leaf,
+ * which is already in memory, so this saves new descents for sequential reads.
+ */
+static void apfs_extent_prefetch(struct apfs_dstream_info *dstream, struct apfs_query *query, const struct apfs_file_extent *extent)
+{
+	struct super_block *sb = dstream->ds_sb;
+	u8 type = apfs_is_sealed(sb) ? 0 : APFS_TYPE_FILE_EXTENT;
+	u64 next_addr = extent->logical_addr + extent->len;
+	struct apfs_file_extent next;
+	struct apfs_key key;
+	int i;
+
+	if (!dstream->ds_inode)
+		return;
+
+	for (i = 0; i < APFS_EXTENT_PREFETCH_MAX; ++i) {
+		if (next_addr >= dstream->ds_size)
+			return;
+		if (apfs_query_next_in_node(query, &key))
+			return;
+		if (key.id != dstream->ds_id || key.type != type)
+			return;
+		if (apfs_extent_from_query(query, &next))
+			return;
+		if (next.logical_addr != next_addr)
+			return;
+		apfs_extent_map_add(dstream, &next);
+		next_addr += next.len;
+	}
+}
+
 /**
  * apfs_extent_read - Read the extent record that covers a block
  * @dstream:	data stream info
@@ -104,7 +278,6 @@ static int apfs_extent_read(struct apfs_dstream_info *dstream, sector_t dsblock,
 {
 	struct super_block *sb = dstream->ds_sb;
 	struct apfs_sb_info *sbi = APFS_SB(sb);
-	struct apfs_superblock *vsb_raw = sbi->s_vsb_raw;
 	struct apfs_key key;
 	struct apfs_query *query;
 	struct apfs_file_extent *cache = &dstream->ds_cached_ext;
@@ -119,6 +292,11 @@ static int apfs_extent_read(struct apfs_dstream_info *dstream, sector_t dsblock,
 		spin_unlock(&dstream->ds_ext_lock);
 		return 0;
 	}
+	/* The cached extent may be dirty, so it must be checked first */
+	if (apfs_extent_map_lookup(dstream, iaddr, extent)) {
+		spin_unlock(&dstream->ds_ext_lock);
+		return 0;
+	}
 	spin_unlock(&dstream->ds_ext_lock);
 
 	/* We will search for the extent that covers iblock */
@@ -127,11 +305,7 @@ static int apfs_extent_read(struct apfs_dstream_info *dstream, sector_t dsblock,
 		root = sbi->s_cat_root;
 	} else {
 		apfs_init_fext_key(dstream->ds_id, iaddr, &key);
-		root = apfs_read_node(sb, le64_to_cpu(vsb_raw->apfs_fext_tree_oid), APFS_OBJ_PHYSICAL, false /* write */);
-		if (IS_ERR(root)) {
-			apfs_err(sb, "failed to read fext root 0x%llx", le64_to_cpu(vsb_raw->apfs_fext_tree_oid));
-			return PTR_ERR(root);
-		}
+		root = sbi->s_fext_root;
 	}
 
 	query = apfs_alloc_query(root, NULL /* parent */);
@@ -170,11 +344,11 @@ static int apfs_extent_read(struct apfs_dstream_info *dstream, sector_t dsblock,
 		*cache = *extent;
 		spin_unlock(&dstream->ds_ext_lock);
 	}
+	apfs_extent_map_add(dstream, extent);
+	apfs_extent_prefetch(dstream, query, extent);
 
 done:
 	apfs_free_query(query);
-	if (apfs_is_sealed(sb))
-		apfs_node_free(root);
 	return ret;
 }
 
@@ -254,13 +428,12 @@ int __apfs_get_block(struct apfs_dstream_info *dstream, sector_t dsblock,
 int apfs_get_block(struct inode *inode, sector_t iblock,
 		   struct buffer_head *bh_result, int create)
 {
-	struct apfs_nxsb_info *nxi = APFS_NXI(inode->i_sb);
 	struct apfs_inode_info *ai = APFS_I(inode);
 	int ret;
 
-	down_read(&nxi->nx_big_sem);
+	down_read(apfs_vol_sem(inode->i_sb));
 	ret = __apfs_get_block(&ai->i_dstream, iblock, bh_result, create);
-	up_read(&nxi->nx_big_sem);
+	up_read(apfs_vol_sem(inode->i_sb));
 	return ret;
 }
 
@@ -938,7 +1111,7 @@ static int apfs_free_phys_ext(struct super_block *sb, struct apfs_phys_extent *p
 	struct apfs_superblock *vsb_raw = APFS_SB(sb)->s_vsb_raw;
 
 	apfs_assert_in_transaction(sb, &vsb_raw->apfs_o);
-	le64_add_cpu(&vsb_raw->apfs_fs_alloc_count, -pext->blkcount);
+	apfs_alloc_count_add(sb, -pext->blkcount);
 	le64_add_cpu(&vsb_raw->apfs_total_blocks_freed, pext->blkcount);
 
 	return apfs_free_queue_insert(sb, pext->bno, pext->blkcount);
@@ -1097,7 +1270,7 @@ static inline bool apfs_dstream_cache_is_tail(struct apfs_dstream_info *dstream)
 {
 	struct apfs_file_extent *cache = &dstream->ds_cached_ext;
 
-	/* nx_big_sem provides the locking for the cache here */
+	/* The volume semaphore provides the locking for the cache here */
 	return cache->len && (dstream->ds_size <= cache->logical_addr + cache->len);
 }
 
@@ -1117,6 +1290,7 @@ int apfs_flush_extent_cache(struct apfs_dstream_info *dstream)
 		return 0;
 	ASSERT(ext->len > 0);
 
+	apfs_extent_map_drop(dstream, ext->logical_addr, ext->logical_addr + ext->len);
 	err = apfs_update_extent(dstream, ext);
 	if (err) {
 		apfs_err(sb, "extent update failed");
@@ -1165,6 +1339,7 @@ static int apfs_create_hole(struct apfs_dstream_info *dstream, u64 start, u64 en
 	/* File extent records use addresses, not block numbers */
 	start <<= sb->s_blocksize_bits;
 	end <<= sb->s_blocksize_bits;
+	apfs_extent_map_drop(dstream, start, end);
 
 	apfs_key_set_hdr(APFS_TYPE_FILE_EXTENT, extent_id, &raw_key);
 	raw_key.logical_addr = cpu_to_le64(start);
@@ -1346,58 +1521,103 @@ static int apfs_dstream_cache_in_snap(struct apfs_dstream_info *dstream, bool *i
 	return apfs_range_in_snap(sb, cache->phys_block_num, cache->len >> sb->s_blocksize_bits, in_snap);
 }
 
+/* Maximum number of blocks to reserve for a dstream in a single allocation */
+#define APFS_MAX_PREALLOC_BLKS	1024
+
 /**
- * apfs_dstream_get_new_block - Like the get_block_t function, but for dstreams
+ * apfs_dstream_free_prealloc - Give back the unused reserved blocks of a dstream
+ * @dstream: data stream info
+ *
+ * Must be called before the transaction commits. Returns 0 on success, or a
+ * negative error code in case of failure.
+ */
+int apfs_dstream_free_prealloc(struct apfs_dstream_info *dstream)
+{
+	struct super_block *sb = dstream->ds_sb;
+	int err;
+
+	if (!dstream->ds_prealloc_len)
+		return 0;
+
+	err = apfs_spaceman_free_unused_extent(sb, dstream->ds_prealloc_bno, dstream->ds_prealloc_len);
+	if (err)
+		apfs_err(sb, "failed to free reserved blocks for dstream 0x%llx", dstream->ds_id);
+	dstream->ds_prealloc_len = 0;
+	return err;
+}
+
+/**
+ * apfs_dstream_alloc_block - Allocate the physical block for a dstream block
  * @dstream:	data stream info
- * @dsblock:	logical dstream block to map
- * @bh_result:	buffer head to map (NULL if none)
- * @bno:	if not NULL, the new block number is returned here
+ * @dsblock:	logical dstream block that needs a new physical block
+ * @bno:	on return, the allocated block number
  *
- * Returns 0 on success, or a negative error code in case of failure.
+ * Writes to the end of a file reserve a run of contiguous blocks ahead of
+ * time, which grows with the file, so that the following blocks come from the
+ * same extent. Unused blocks get freed by apfs_dstream_free_prealloc() before
+ * the transaction commits. Returns 0 on success, or a negative error code in
+ * case of failure.
  */
-static int apfs_dstream_get_new_block(struct apfs_dstream_info *dstream, u64 dsblock, struct buffer_head *bh_result, u64 *bno)
+static int apfs_dstream_alloc_block(struct apfs_dstream_info *dstream, u64 dsblock, u64 *bno)
+{
+	struct super_block *sb = dstream->ds_sb;
+	u64 count = 1;
+	int err;
+
+	if (dstream->ds_prealloc_len && dstream->ds_prealloc_dsblock == dsblock) {
+		*bno = dstream->ds_prealloc_bno++;
+		dstream->ds_prealloc_dsblock++;
+		dstream->ds_prealloc_len--;
+		return 0;
+	}
+
+	err = apfs_dstream_free_prealloc(dstream);
+	if (err)
+		return err;
+
+	/* Xattr dstreams are written all at once, and never extended */
+	if (dstream->ds_inode && dsblock + 1 >= apfs_size_to_blocks(sb, dstream->ds_size))
+		count = clamp_t(u64, dsblock, 1, APFS_MAX_PREALLOC_BLKS);
+
+	err = apfs_spaceman_allocate_extent(sb, bno, &count, false /* backwards */);
+	if (err)
+		return err;
+
+	if (count > 1) {
+		/* Make sure the reserved blocks get freed on commit */
+		apfs_inode_join_transaction(sb, dstream->ds_inode);
+		dstream->ds_prealloc_bno = *bno + 1;
+		dstream->ds_prealloc_len = count - 1;
+		dstream->ds_prealloc_dsblock = dsblock + 1;
+	}
+	return 0;
+}
+
+/**
+ * apfs_dstream_add_new_blocks - Record a run of new blocks in a dstream
+ * @dstream:	data stream info
+ * @dsblock:	first logical dstream block of the run
+ * @phys_bno:	first physical block of the run
+ * @count:	number of blocks in the run
+ *
+ * Updates the block counters and the extent cache for a run of blocks that
+ * was just allocated for @dstream. Returns 0 on success, or a negative error
+ * code in case of failure.
+ */
+static int apfs_dstream_add_new_blocks(struct apfs_dstream_info *dstream, u64 dsblock, u64 phys_bno, u64 count)
 {
 	struct super_block *sb = dstream->ds_sb;
 	struct apfs_superblock *vsb_raw = APFS_SB(sb)->s_vsb_raw;
 	struct apfs_file_extent *cache = NULL;
-	u64 phys_bno, logical_addr, cache_blks, dstream_blks;
+	u64 logical_addr, cache_blks, dstream_blks;
 	bool in_snap = true;
 	int err;
 
-	/* TODO: preallocate tail blocks */
 	logical_addr = dsblock << sb->s_blocksize_bits;
 
-	err = apfs_spaceman_allocate_block(sb, &phys_bno, false /* backwards */);
-	if (err) {
-		apfs_err(sb, "block allocation failed");
-		return err;
-	}
 	apfs_assert_in_transaction(sb, &vsb_raw->apfs_o);
-	le64_add_cpu(&vsb_raw->apfs_fs_alloc_count, 1);
-	le64_add_cpu(&vsb_raw->apfs_total_blocks_alloced, 1);
-	if (bno)
-		*bno = phys_bno;
-
-	if (bh_result) {
-		apfs_map_bh(bh_result, sb, phys_bno);
-		err = apfs_transaction_join(sb, bh_result);
-		if (err)
-			return err;
-
-		if (!buffer_uptodate(bh_result)) {
-			/*
-			 * Truly new buffers need to be marked as such, to get
-			 * zeroed; this also takes care of holes in sparse files
-			 */
-			set_buffer_new(bh_result);
-		} else if (dstream->ds_size > logical_addr) {
-			/*
-			 * The last block may have stale data left from a
-			 * truncation
-			 */
-			apfs_zero_bh_tail(sb, bh_result, dstream->ds_size - logical_addr);
-		}
-	}
+	apfs_alloc_count_add(sb, count);
+	le64_add_cpu(&vsb_raw->apfs_total_blocks_alloced, count);
 
 	dstream_blks = apfs_size_to_blocks(sb, dstream->ds_size);
 	if (dstream_blks < dsblock) {
@@ -1423,7 +1643,7 @@ static int apfs_dstream_get_new_block(struct apfs_dstream_info *dstream, u64 dsb
 	if (!in_snap && apfs_dstream_cache_is_tail(dstream) &&
 	    logical_addr == cache->logical_addr + cache->len &&
 	    phys_bno == cache->phys_block_num + cache_blks) {
-		cache->len += sb->s_blocksize;
+		cache->len += count << sb->s_blocksize_bits;
 		dstream->ds_ext_dirty = true;
 		return 0;
 	}
@@ -1449,10 +1669,66 @@ static int apfs_dstream_get_new_block(struct apfs_dstream_info *dstream, u64 dsb
 
 	cache->logical_addr = logical_addr;
 	cache->phys_block_num = phys_bno;
-	cache->len = sb->s_blocksize;
+	cache->len = count << sb->s_blocksize_bits;
 	dstream->ds_ext_dirty = true;
 	return 0;
 }
+
+/**
+ * apfs_dstream_get_new_block - Like the get_block_t function, but for dstreams
+ * @dstream:	data stream info
+ * @dsblock:	logical dstream block to map
+ * @bh_result:	buffer head to map (NULL if none)
+ * @bno:	if not NULL, the new block number is returned here
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_dstream_get_new_block(struct apfs_dstream_info *dstream, u64 dsblock, struct buffer_head *bh_result, u64 *bno)
+{
+	struct super_block *sb = dstream->ds_sb;
+	u64 phys_bno, logical_addr;
+	int err;
+
+	logical_addr = dsblock << sb->s_blocksize_bits;
+
+	/* Delayed blocks must get their extents before anything else changes */
+	if (dstream->ds_delalloc_len) {
+		err = apfs_dstream_flush_delalloc(dstream, bh_result ? bh_result->b_page : NULL);
+		if (err)
+			return err;
+	}
+
+	err = apfs_dstream_alloc_block(dstream, dsblock, &phys_bno);
+	if (err) {
+		apfs_err(sb, "block allocation failed");
+		return err;
+	}
+	if (bno)
+		*bno = phys_bno;
+
+	if (bh_result) {
+		apfs_map_bh(bh_result, sb, phys_bno);
+		err = apfs_transaction_join(sb, bh_result);
+		if (err)
+			return err;
+
+		if (!buffer_uptodate(bh_result)) {
+			/*
+			 * Truly new buffers need to be marked as such, to get
+			 * zeroed; this also takes care of holes in sparse files
+			 */
+			set_buffer_new(bh_result);
+		} else if (dstream->ds_size > logical_addr) {
+			/*
+			 * The last block may have stale data left from a
+			 * truncation
+			 */
+			apfs_zero_bh_tail(sb, bh_result, dstream->ds_size - logical_addr);
+		}
+	}
+
+	return apfs_dstream_add_new_blocks(dstream, dsblock, phys_bno, 1);
+}
 int APFS_GET_NEW_BLOCK_MAXOPS(void)
 {
 	return APFS_FLUSH_EXTENT_CACHE;
@@ -1480,63 +1756,271 @@ int apfs_get_new_block(struct inode *inode, sector_t iblock,
 	return apfs_dstream_get_new_block(&ai->i_dstream, iblock, bh_result, NULL /* bno */);
 }
 
+/* Free blocks to leave out of delayed allocation, for metadata updates */
+#define APFS_DELALLOC_MARGIN	1024
+
 /**
- * apfs_shrink_dstream_last_extent - Shrink last extent of dstream being resized
+ * apfs_dstream_can_delay - Check if a new dstream block can be allocated later
  * @dstream:	data stream info
- * @new_size:	new size for the whole data stream
- *
- * Deletes, shrinks or zeroes the last extent, as needed for the truncation of
- * the data stream.
+ * @dsblock:	logical dstream block to map
  *
- * Only works with the last extent, so it needs to be called repeatedly to
- * complete the truncation. Returns -EAGAIN in that case, or 0 when the process
- * is complete. Returns other negative error codes in case of failure.
+ * Only blocks appended to the end of an unshared file get delayed, and only
+ * while the container has plenty of free space to hand out at commit time.
  */
-static int apfs_shrink_dstream_last_extent(struct apfs_dstream_info *dstream, loff_t new_size)
+static bool apfs_dstream_can_delay(struct apfs_dstream_info *dstream, u64 dsblock)
 {
 	struct super_block *sb = dstream->ds_sb;
-	struct apfs_sb_info *sbi = APFS_SB(sb);
-	struct apfs_query *query;
-	struct apfs_file_extent tail;
-	u64 extent_id = dstream->ds_id;
-	int ret = 0;
+	struct apfs_spaceman *sm = APFS_SM(sb);
+	struct apfs_nx_transaction *nx_trans = &APFS_NXI(sb)->nx_transaction;
 
-	query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
-	if (!query)
-		return -ENOMEM;
-	apfs_init_file_extent_key(extent_id, -1, &query->key);
-	query->flags = APFS_QUERY_CAT;
+	if (!dstream->ds_inode || dstream->ds_shared)
+		return false;
 
-	ret = apfs_btree_query(sb, &query);
-	if (ret && ret != -ENODATA) {
-		apfs_err(sb, "query failed for last extent of id 0x%llx", extent_id);
-		goto out;
+	if (dstream->ds_delalloc_len) {
+		if (dsblock != dstream->ds_delalloc_start + dstream->ds_delalloc_len)
+			return false;
+	} else if (dsblock != apfs_size_to_blocks(sb, dstream->ds_size)) {
+		return false;
 	}
 
-	if (!apfs_query_found_extent(query)) {
-		/* No more extents, we deleted the whole file already? */
-		if (new_size) {
-			apfs_err(sb, "missing extent for dstream 0x%llx", extent_id);
-			ret = -EFSCORRUPTED;
-		} else {
-			ret = 0;
-		}
-		goto out;
-	}
+	return sm->sm_free_count > nx_trans->t_delalloc_count + APFS_DELALLOC_MARGIN;
+}
 
-	ret = apfs_extent_from_query(query, &tail);
-	if (ret) {
-		apfs_err(sb, "bad tail extent record on dstream 0x%llx", extent_id);
-		goto out;
-	}
+/**
+ * apfs_get_delalloc_block - The get_block_t function for buffered writes
+ * @inode:	inode being written to
+ * @iblock:	logical block to map
+ * @bh_result:	buffer head to map
+ * @create:	must be set
+ *
+ * Blocks appended to the file are only reserved here, without any changes to
+ * the allocation bitmaps or the extent records; the buffer is marked as
+ * delayed and apfs_dstream_flush_delalloc() maps it later, along with all its
+ * neighbours. Other blocks go through copy-on-write right away.
+ */
+int apfs_get_delalloc_block(struct inode *inode, sector_t iblock,
+			    struct buffer_head *bh_result, int create)
+{
+	struct super_block *sb = inode->i_sb;
+	struct apfs_dstream_info *dstream = &APFS_I(inode)->i_dstream;
+	struct apfs_nx_transaction *nx_trans = &APFS_NXI(sb)->nx_transaction;
 
-	if (tail.logical_addr + tail.len < new_size) {
-		apfs_err(sb, "missing extent for dstream 0x%llx", extent_id);
-		ret = -EFSCORRUPTED; /* Tail extent missing */
-	} else if (tail.logical_addr + tail.len == new_size) {
-		ret = 0; /* Nothing more to be done */
-	} else if (tail.logical_addr >= new_size) {
-		/* This whole extent needs to go */
+	ASSERT(create);
+	if (!apfs_dstream_can_delay(dstream, iblock))
+		return apfs_dstream_get_new_block(dstream, iblock, bh_result, NULL /* bno */);
+
+	if (!dstream->ds_delalloc_len)
+		dstream->ds_delalloc_start = iblock;
+	dstream->ds_delalloc_len++;
+	nx_trans->t_delalloc_count++;
+
+	apfs_map_bh(bh_result, sb, APFS_DELALLOC_BNO);
+	set_buffer_new(bh_result);
+	set_buffer_delay(bh_result);
+	return 0;
+}
+
+/**
+ * apfs_delalloc_zero_block - Zero a newly allocated block with no page cache
+ * @sb:		superblock structure
+ * @bno:	block number
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_delalloc_zero_block(struct super_block *sb, u64 bno)
+{
+	struct buffer_head *bh = NULL;
+	int err;
+
+	bh = apfs_getblk(sb, bno);
+	if (!bh)
+		return -EIO;
+	memset(bh->b_data, 0, sb->s_blocksize);
+	set_buffer_uptodate(bh);
+	err = apfs_transaction_join(sb, bh);
+	brelse(bh);
+	return err;
+}
+
+/**
+ * apfs_delalloc_map_buffers - Map delayed buffers to their new blocks
+ * @dstream:	data stream info
+ * @dsblock:	first logical block of the run
+ * @bno:	first physical block allocated for the run
+ * @count:	number of blocks in the run
+ * @locked_page: page already locked by the caller, if any
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_delalloc_map_buffers(struct apfs_dstream_info *dstream, u64 dsblock, u64 bno, u64 count, struct page *locked_page)
+{
+	struct super_block *sb = dstream->ds_sb;
+	struct address_space *mapping = dstream->ds_inode->i_mapping;
+	int bits_per_page = PAGE_SHIFT - sb->s_blocksize_bits;
+	u64 i;
+	int err = 0;
+
+	for (i = 0; i < count; ++i) {
+		struct page *page = NULL;
+		struct buffer_head *bh = NULL;
+		pgoff_t index = (dsblock + i) >> bits_per_page;
+		int j;
+
+		if (locked_page && locked_page->index == index)
+			page = locked_page;
+		else
+			page = find_lock_page(mapping, index);
+
+		if (page && page_has_buffers(page)) {
+			bh = page_buffers(page);
+			for (j = 0; j < ((dsblock + i) & ((1 << bits_per_page) - 1)); ++j)
+				bh = bh->b_this_page;
+		}
+
+		if (bh && buffer_delay(bh)) {
+			apfs_map_bh(bh, sb, bno + i);
+			clear_buffer_delay(bh);
+			err = apfs_transaction_join(sb, bh);
+		} else {
+			/* Shouldn't happen, but don't leave stale data around */
+			err = apfs_delalloc_zero_block(sb, bno + i);
+		}
+
+		if (page && page != locked_page) {
+			unlock_page(page);
+			put_page(page);
+		}
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+/**
+ * apfs_dstream_flush_delalloc - Allocate all delayed blocks for a dstream
+ * @dstream:	data stream info
+ * @locked_page: page already locked by the caller, if any
+ *
+ * Allocates the pending delayed blocks in runs as contiguous as possible,
+ * creates the extent records for them and attaches their buffers to the
+ * transaction, so that they get written on commit. Returns 0 on success, or a
+ * negative error code in case of failure.
+ */
+int apfs_dstream_flush_delalloc(struct apfs_dstream_info *dstream, struct page *locked_page)
+{
+	struct super_block *sb = dstream->ds_sb;
+	struct apfs_nx_transaction *nx_trans = &APFS_NXI(sb)->nx_transaction;
+	u64 dsblock, end, bno, count;
+	int err;
+
+	if (!dstream->ds_delalloc_len)
+		return 0;
+
+	dsblock = dstream->ds_delalloc_start;
+	end = dsblock + dstream->ds_delalloc_len;
+	/* The extent updates below must not try to flush again */
+	nx_trans->t_delalloc_count -= dstream->ds_delalloc_len;
+	dstream->ds_delalloc_len = 0;
+
+	while (dsblock < end) {
+		count = end - dsblock;
+		err = apfs_spaceman_allocate_extent(sb, &bno, &count, false /* backwards */);
+		if (err) {
+			apfs_err(sb, "delayed allocation failed for dstream 0x%llx", dstream->ds_id);
+			return err;
+		}
+		err = apfs_delalloc_map_buffers(dstream, dsblock, bno, count, locked_page);
+		if (err)
+			return err;
+		err = apfs_dstream_add_new_blocks(dstream, dsblock, bno, count);
+		if (err)
+			return err;
+		dsblock += count;
+	}
+	return 0;
+}
+
+/**
+ * apfs_dstream_trim_delalloc - Forget the delayed blocks past a new size
+ * @dstream:	data stream info
+ * @new_size:	new size for the data stream
+ */
+static void apfs_dstream_trim_delalloc(struct apfs_dstream_info *dstream, loff_t new_size)
+{
+	struct super_block *sb = dstream->ds_sb;
+	struct apfs_nx_transaction *nx_trans = &APFS_NXI(sb)->nx_transaction;
+	u64 new_blks, end, keep;
+
+	if (!dstream->ds_delalloc_len)
+		return;
+
+	new_blks = apfs_size_to_blocks(sb, new_size);
+	end = dstream->ds_delalloc_start + dstream->ds_delalloc_len;
+	if (new_blks >= end)
+		return;
+
+	keep = new_blks > dstream->ds_delalloc_start ? new_blks - dstream->ds_delalloc_start : 0;
+	nx_trans->t_delalloc_count -= dstream->ds_delalloc_len - keep;
+	dstream->ds_delalloc_len = keep;
+}
+
+/**
+ * apfs_shrink_dstream_last_extent - Shrink last extent of dstream being resized
+ * @dstream:	data stream info
+ * @new_size:	new size for the whole data stream
+ *
+ * Deletes, shrinks or zeroes the last extent, as needed for the truncation of
+ * the data stream.
+ *
+ * Only works with the last extent, so it needs to be called repeatedly to
+ * complete the truncation. Returns -EAGAIN in that case, or 0 when the process
+ * is complete. Returns other negative error codes in case of failure.
+ */
+static int apfs_shrink_dstream_last_extent(struct apfs_dstream_info *dstream, loff_t new_size)
+{
+	struct super_block *sb = dstream->ds_sb;
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_query *query;
+	struct apfs_file_extent tail;
+	u64 extent_id = dstream->ds_id;
+	int ret = 0;
+
+	query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
+	if (!query)
+		return -ENOMEM;
+	apfs_init_file_extent_key(extent_id, -1, &query->key);
+	query->flags = APFS_QUERY_CAT;
+
+	ret = apfs_btree_query(sb, &query);
+	if (ret && ret != -ENODATA) {
+		apfs_err(sb, "query failed for last extent of id 0x%llx", extent_id);
+		goto out;
+	}
+
+	if (!apfs_query_found_extent(query)) {
+		/* No more extents, we deleted the whole file already? */
+		if (new_size) {
+			apfs_err(sb, "missing extent for dstream 0x%llx", extent_id);
+			ret = -EFSCORRUPTED;
+		} else {
+			ret = 0;
+		}
+		goto out;
+	}
+
+	ret = apfs_extent_from_query(query, &tail);
+	if (ret) {
+		apfs_err(sb, "bad tail extent record on dstream 0x%llx", extent_id);
+		goto out;
+	}
+
+	if (tail.logical_addr + tail.len < new_size) {
+		apfs_err(sb, "missing extent for dstream 0x%llx", extent_id);
+		ret = -EFSCORRUPTED; /* Tail extent missing */
+	} else if (tail.logical_addr + tail.len == new_size) {
+		ret = 0; /* Nothing more to be done */
+	} else if (tail.logical_addr >= new_size) {
+		/* This whole extent needs to go */
 		ret = apfs_btree_remove(query);
 		if (ret) {
 			apfs_err(sb, "removal failed for id 0x%llx, addr 0x%llx", dstream->ds_id, tail.logical_addr);
@@ -1584,6 +2068,7 @@ static int apfs_shrink_dstream(struct apfs_dstream_info *dstream, loff_t new_siz
 {
 	int ret;
 
+	apfs_extent_map_drop(dstream, new_size, U64_MAX);
 	do {
 		ret = apfs_shrink_dstream_last_extent(dstream, new_size);
 	} while (ret == -EAGAIN);
@@ -1605,6 +2090,12 @@ int apfs_truncate(struct apfs_dstream_info *dstream, loff_t new_size)
 	struct apfs_file_extent *cache = &dstream->ds_cached_ext;
 	int err;
 
+	/* Delayed blocks past the new end never need to be allocated */
+	apfs_dstream_trim_delalloc(dstream, new_size);
+	err = apfs_dstream_flush_delalloc(dstream, NULL /* locked_page */);
+	if (err)
+		return err;
+
 	/* TODO: don't write the cached extent if it will be deleted */
 	err = apfs_flush_extent_cache(dstream);
 	if (err) {
@@ -1630,6 +2121,37 @@ int apfs_truncate(struct apfs_dstream_info *dstream, loff_t new_size)
 	return apfs_create_hole(dstream, old_blks, new_blks);
 }
 
+/**
+ * apfs_dstream_count_extents - Count the extent records of a data stream
+ * @dstream:	data stream info
+ * @max:	stop counting after this many
+ *
+ * Returns the number of extents, which is more than @max if the count got cut
+ * short, or a negative error code in case of failure.
+ */
+int apfs_dstream_count_extents(struct apfs_dstream_info *dstream, int max)
+{
+	struct super_block *sb = dstream->ds_sb;
+	struct apfs_file_extent extent;
+	u64 next = 0;
+	int count, err;
+
+	for (count = 0; count <= max && next < dstream->ds_size; ++count) {
+		err = apfs_extent_read(dstream, next >> sb->s_blocksize_bits, &extent);
+		if (err) {
+			apfs_err(sb, "failed to read extent for offset 0x%llx of dstream 0x%llx", next, dstream->ds_id);
+			return err;
+		}
+		next = extent.logical_addr + extent.len;
+	}
+	return count;
+}
+int APFS_DROP_EXTENTS_MAXOPS(int count)
+{
+	/* The cache flush, and then the removal of each record */
+	return (1 + count) * APFS_UPDATE_EXTENTS_MAXOPS;
+}
+
 /**
  * apfs_dstream_delete_front - Deletes as many leading extents as possible
  * @sb:		filesystem superblock
@@ -1642,16 +2164,12 @@ int apfs_truncate(struct apfs_dstream_info *dstream, loff_t new_size)
 static int apfs_dstream_delete_front(struct super_block *sb, u64 ds_id)
 {
 	struct apfs_sb_info *sbi = APFS_SB(sb);
-	struct apfs_spaceman *sm = APFS_SM(sb);
-	struct apfs_spaceman_phys *sm_raw = sm->sm_raw;
-	struct apfs_spaceman_free_queue *fq = NULL;
 	struct apfs_query *query = NULL;
 	struct apfs_file_extent head;
 	bool first_match = true;
 	int ret;
 
-	fq = &sm_raw->sm_fq[APFS_SFQ_MAIN];
-	if (le64_to_cpu(fq->sfq_count) > TRANSACTION_MAIN_QUEUE_MAX)
+	if (apfs_main_fq_trans_count(sb) > TRANSACTION_MAIN_QUEUE_MAX)
 		return -EAGAIN;
 
 	query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
@@ -1703,6 +2221,7 @@ next_extent:
 			apfs_err(sb, "failed to put range 0x%llx-0x%llx", head.phys_block_num, head.len);
 			goto out;
 		}
+		apfs_nx_stat_add(APFS_NXI(sb), orphan_blocks, head.len >> sb->s_blocksize_bits);
 		ret = apfs_crypto_adj_refcnt(sb, head.crypto_id, -1);
 		if (ret) {
 			apfs_err(sb, "failed to take crypto id 0x%llx", head.crypto_id);
@@ -1710,7 +2229,7 @@ next_extent:
 		}
 	}
 
-	if (le64_to_cpu(fq->sfq_count) <= TRANSACTION_MAIN_QUEUE_MAX)
+	if (apfs_main_fq_trans_count(sb) <= TRANSACTION_MAIN_QUEUE_MAX)
 		goto next_extent;
 	ret = -EAGAIN;
 out:
@@ -1742,6 +2261,7 @@ int apfs_inode_delete_front(struct inode *inode)
 		apfs_err(sb, "extent cache flush failed for dstream 0x%llx", dstream->ds_id);
 		return ret;
 	}
+	apfs_extent_map_clear(dstream);
 
 	ret = apfs_dstream_delete_front(sb, dstream->ds_id);
 	if (ret == -ENODATA)
@@ -1749,194 +2269,109 @@ int apfs_inode_delete_front(struct inode *inode)
 	return ret;
 }
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
-loff_t apfs_remap_file_range(struct file *src_file, loff_t off, struct file *dst_file, loff_t destoff, loff_t len, unsigned int remap_flags)
-#else
-int apfs_clone_file_range(struct file *src_file, loff_t off, struct file *dst_file, loff_t destoff, u64 len)
-#endif
+/**
+ * apfs_extent_create_records - Create logical extent records for a new dstream
+ * @sb:		filesystem superblock
+ * @dstream_id:	the dstream id, with no extent records yet
+ * @extents:	extent info for the records, in order
+ * @count:	number of extents
+ *
+ * The records get inserted as a single batch, since no others can fall in
+ * between. Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_extent_create_records(struct super_block *sb, u64 dstream_id, struct apfs_file_extent *extents, int count)
 {
-	struct inode *src_inode = file_inode(src_file);
-	struct inode *dst_inode = file_inode(dst_file);
-	struct apfs_inode_info *src_ai = APFS_I(src_inode);
-	struct apfs_inode_info *dst_ai = APFS_I(dst_inode);
-	struct apfs_dstream_info *src_ds = &src_ai->i_dstream;
-	struct apfs_dstream_info *dst_ds = &dst_ai->i_dstream;
-	struct super_block *sb = src_inode->i_sb;
 	struct apfs_sb_info *sbi = APFS_SB(sb);
-	/* TODO: remember to update the maxops in the future */
-	struct apfs_max_ops maxops = {0};
-	const u64 xfield_flags = APFS_INODE_MAINTAIN_DIR_STATS | APFS_INODE_IS_SPARSE | APFS_INODE_HAS_PURGEABLE_FLAGS;
-	int err;
+	struct apfs_query *query = NULL;
+	struct apfs_btree_rec *recs = NULL;
+	struct apfs_file_extent_val *raw_vals = NULL;
+	struct apfs_file_extent_key *raw_keys = NULL;
+	int ret = 0;
+	int i;
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
-	if (remap_flags & ~(REMAP_FILE_ADVISORY))
-		return -EINVAL;
-#endif
-	if (src_inode == dst_inode)
-		return -EINVAL;
+	if (!count)
+		return 0;
 
-	/* We only want to clone whole files, like in the official driver */
-	if (off != 0 || destoff != 0 || len != 0)
-		return -EINVAL;
+	recs = kcalloc(count, sizeof(*recs), GFP_KERNEL);
+	raw_keys = kcalloc(count, sizeof(*raw_keys), GFP_KERNEL);
+	raw_vals = kcalloc(count, sizeof(*raw_vals), GFP_KERNEL);
+	if (!recs || !raw_keys || !raw_vals) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < count; ++i) {
+		struct apfs_file_extent *extent = &extents[i];
 
-	/*
-	 * Clones here work in two steps: first the user creates an empty target
-	 * file, and then the user calls the ioctl, which replaces the file with
-	 * a clone. This is not atomic, of course.
-	 */
-	if (dst_ai->i_has_dstream || dst_ai->i_bsd_flags & APFS_INOBSD_COMPRESSED) {
-		apfs_warn(sb, "clones can only replace freshly created files");
-		return -EOPNOTSUPP;
+		apfs_key_set_hdr(APFS_TYPE_FILE_EXTENT, dstream_id, &raw_keys[i]);
+		raw_keys[i].logical_addr = cpu_to_le64(extent->logical_addr);
+		raw_vals[i].len_and_flags = cpu_to_le64(extent->len);
+		raw_vals[i].phys_block_num = cpu_to_le64(extent->phys_block_num);
+		raw_vals[i].crypto_id = cpu_to_le64(apfs_vol_is_encrypted(sb) ? dstream_id : 0); /* TODO */
+
+		apfs_init_file_extent_key(dstream_id, extent->logical_addr, &recs[i].key);
+		recs[i].raw_key = &raw_keys[i];
+		recs[i].key_len = sizeof(raw_keys[i]);
+		recs[i].raw_val = &raw_vals[i];
+		recs[i].val_len = sizeof(raw_vals[i]);
 	}
-	if (dst_ai->i_int_flags & xfield_flags) {
-		apfs_warn(sb, "clone can't replace a file that has xfields");
-		return -EOPNOTSUPP;
+
+	query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
+	if (!query) {
+		ret = -ENOMEM;
+		goto out;
 	}
+	query->key = recs[0].key;
+	query->flags = APFS_QUERY_CAT | APFS_QUERY_EXACT;
 
-	if (!src_ai->i_has_dstream) {
-		apfs_warn(sb, "can't clone a file with no dstream");
-		return -EOPNOTSUPP;
+	ret = apfs_btree_query(sb, &query);
+	if (ret && ret != -ENODATA) {
+		apfs_err(sb, "query failed for id 0x%llx, addr 0x%llx", dstream_id, extents[0].logical_addr);
+		goto out;
 	}
 
-	err = apfs_transaction_start(sb, maxops);
-	if (err)
-		return err;
-	apfs_inode_join_transaction(sb, src_inode);
-	apfs_inode_join_transaction(sb, dst_inode);
+	ret = apfs_btree_insert_batch(query, recs, count);
+	if (ret)
+		apfs_err(sb, "insertion failed for id 0x%llx, addr 0x%llx", dstream_id, extents[0].logical_addr);
+out:
+	apfs_free_query(query);
+	kfree(raw_vals);
+	kfree(raw_keys);
+	kfree(recs);
+	return ret;
+}
 
-	err = apfs_flush_extent_cache(src_ds);
-	if (err) {
-		apfs_err(sb, "extent cache flush failed for dstream 0x%llx", src_ds->ds_id);
-		goto fail;
-	}
-	err = apfs_dstream_adj_refcnt(src_ds, +1);
-	if (err) {
-		apfs_err(sb, "failed to take dstream id 0x%llx", src_ds->ds_id);
-		goto fail;
+/**
+ * apfs_put_single_extent - Put a reference to a single extent
+ * @sb:		filesystem superblock
+ * @paddr_end:	first block after the extent to put
+ * @paddr_min:	don't put references before this block
+ *
+ * Puts a reference to the physical extent range that ends in paddr. Sets
+ * @paddr_end to the beginning of the extent, so that the caller can continue
+ * with the previous one. Returns 0 on success, or a negative error code in
+ * case of failure.
+ *
+ * TODO: unify this with apfs_take_single_extent(), they are almost the same.
+ */
+static int apfs_put_single_extent(struct super_block *sb, u64 *paddr_end, u64 paddr_min)
+{
+	struct apfs_superblock *vsb_raw = APFS_SB(sb)->s_vsb_raw;
+	struct apfs_node *extref_root = NULL;
+	struct apfs_key key;
+	struct apfs_query *query = NULL;
+	struct apfs_phys_extent prev_ext;
+	u64 prev_start, prev_end;
+	bool cropped_head = false, cropped_tail = false;
+	struct apfs_file_extent tmp = {0}; /* TODO: clean up all the fake extent interfaces? */
+	int ret;
+
+	extref_root = apfs_read_node(sb, le64_to_cpu(vsb_raw->apfs_extentref_tree_oid), APFS_OBJ_PHYSICAL, true /* write */);
+	if (IS_ERR(extref_root)) {
+		apfs_err(sb, "failed to read extref root 0x%llx", le64_to_cpu(vsb_raw->apfs_extentref_tree_oid));
+		return PTR_ERR(extref_root);
 	}
-	src_ds->ds_shared = true;
-
-#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 6, 0)
-	dst_inode->i_mtime = dst_inode->i_ctime = current_time(dst_inode);
-#elif LINUX_VERSION_CODE < KERNEL_VERSION(6, 7, 0)
-	dst_inode->i_mtime = inode_set_ctime_current(dst_inode);
-#else
-	inode_set_mtime_to_ts(dst_inode, inode_set_ctime_current(dst_inode));
-#endif
-	dst_inode->i_size = src_inode->i_size;
-	dst_ai->i_key_class = src_ai->i_key_class;
-	dst_ai->i_int_flags = src_ai->i_int_flags;
-	dst_ai->i_bsd_flags = src_ai->i_bsd_flags;
-	dst_ai->i_has_dstream = true;
-
-	dst_ds->ds_sb = src_ds->ds_sb;
-	dst_ds->ds_inode = dst_inode;
-	dst_ds->ds_id = src_ds->ds_id;
-	dst_ds->ds_size = src_ds->ds_size;
-	dst_ds->ds_sparse_bytes = src_ds->ds_sparse_bytes;
-	dst_ds->ds_cached_ext = src_ds->ds_cached_ext;
-	dst_ds->ds_ext_dirty = false;
-	dst_ds->ds_shared = true;
-
-	dst_ai->i_int_flags |= APFS_INODE_WAS_EVER_CLONED | APFS_INODE_WAS_CLONED;
-	src_ai->i_int_flags |= APFS_INODE_WAS_EVER_CLONED;
-
-	/*
-	 * The sparse flag is the important one here: if we need it, it will get
-	 * set later by apfs_update_inode(), after the xfield gets created.
-	 */
-	dst_ai->i_int_flags &= ~xfield_flags;
-
-	/*
-	 * Commit the transaction to make sure all buffers in the source inode
-	 * go through copy-on-write. This is a bit excessive, but I don't expect
-	 * clones to be created often enough for it to matter.
-	 */
-	sbi->s_nxi->nx_transaction.t_state |= APFS_NX_TRANS_FORCE_COMMIT;
-	err = apfs_transaction_commit(sb);
-	if (err)
-		goto fail;
-	return dst_ds->ds_size;
-
-fail:
-	apfs_transaction_abort(sb);
-	return err;
-}
-
-/**
- * apfs_extent_create_record - Create a logical extent record for a dstream id
- * @sb:		filesystem superblock
- * @dstream_id:	the dstream id
- * @extent:	extent info for the record
- *
- * Returns 0 on success, or a negative error code in case of failure.
- */
-static int apfs_extent_create_record(struct super_block *sb, u64 dstream_id, struct apfs_file_extent *extent)
-{
-	struct apfs_sb_info *sbi = APFS_SB(sb);
-	struct apfs_query *query = NULL;
-	struct apfs_file_extent_val raw_val;
-	struct apfs_file_extent_key raw_key;
-	int ret = 0;
-
-	query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
-	if (!query)
-		return -ENOMEM;
-	apfs_init_file_extent_key(dstream_id, extent->logical_addr, &query->key);
-	query->flags = APFS_QUERY_CAT | APFS_QUERY_EXACT;
-
-	ret = apfs_btree_query(sb, &query);
-	if (ret && ret != -ENODATA) {
-		apfs_err(sb, "query failed for id 0x%llx, addr 0x%llx", dstream_id, extent->logical_addr);
-		goto out;
-	}
-
-	apfs_key_set_hdr(APFS_TYPE_FILE_EXTENT, dstream_id, &raw_key);
-	raw_key.logical_addr = cpu_to_le64(extent->logical_addr);
-	raw_val.len_and_flags = cpu_to_le64(extent->len);
-	raw_val.phys_block_num = cpu_to_le64(extent->phys_block_num);
-	raw_val.crypto_id = cpu_to_le64(apfs_vol_is_encrypted(sb) ? dstream_id : 0); /* TODO */
-
-	ret = apfs_btree_insert(query, &raw_key, sizeof(raw_key), &raw_val, sizeof(raw_val));
-	if (ret)
-		apfs_err(sb, "insertion failed for id 0x%llx, addr 0x%llx", dstream_id, extent->logical_addr);
-out:
-	apfs_free_query(query);
-	return ret;
-}
-
-/**
- * apfs_put_single_extent - Put a reference to a single extent
- * @sb:		filesystem superblock
- * @paddr_end:	first block after the extent to put
- * @paddr_min:	don't put references before this block
- *
- * Puts a reference to the physical extent range that ends in paddr. Sets
- * @paddr_end to the beginning of the extent, so that the caller can continue
- * with the previous one. Returns 0 on success, or a negative error code in
- * case of failure.
- *
- * TODO: unify this with apfs_take_single_extent(), they are almost the same.
- */
-static int apfs_put_single_extent(struct super_block *sb, u64 *paddr_end, u64 paddr_min)
-{
-	struct apfs_superblock *vsb_raw = APFS_SB(sb)->s_vsb_raw;
-	struct apfs_node *extref_root = NULL;
-	struct apfs_key key;
-	struct apfs_query *query = NULL;
-	struct apfs_phys_extent prev_ext;
-	u64 prev_start, prev_end;
-	bool cropped_head = false, cropped_tail = false;
-	struct apfs_file_extent tmp = {0}; /* TODO: clean up all the fake extent interfaces? */
-	int ret;
-
-	extref_root = apfs_read_node(sb, le64_to_cpu(vsb_raw->apfs_extentref_tree_oid), APFS_OBJ_PHYSICAL, true /* write */);
-	if (IS_ERR(extref_root)) {
-		apfs_err(sb, "failed to read extref root 0x%llx", le64_to_cpu(vsb_raw->apfs_extentref_tree_oid));
-		return PTR_ERR(extref_root);
-	}
-	apfs_assert_in_transaction(sb, &vsb_raw->apfs_o);
-	vsb_raw->apfs_extentref_tree_oid = cpu_to_le64(extref_root->object.oid);
+	apfs_assert_in_transaction(sb, &vsb_raw->apfs_o);
+	vsb_raw->apfs_extentref_tree_oid = cpu_to_le64(extref_root->object.oid);
 
 	apfs_init_extent_key(*paddr_end - 1, &key);
 
@@ -2187,146 +2622,1255 @@ static int apfs_range_take_reference(struct super_block *sb, u64 paddr, u64 leng
 	return 0;
 }
 
+/* Number of extents to clone with a single batch insertion */
+#define APFS_CLONE_BATCH	64
+
 /**
- * apfs_clone_single_extent - Make a copy of an extent in a dstream to a new one
+ * apfs_clone_extents - Make a copy of all extents in a dstream to a new one
  * @dstream:	old dstream
- * @new_id:	id of the new dstream
- * @log_addr:	logical address for the extent
+ * @new_id:	id for the new dstream
  *
- * Duplicates the logical extent, and updates the references to the physical
- * extents as required. Sets @addr to the end of the extent, so that the caller
- * can continue in the same place. Returns 0 on success, or a negative error
- * code in case of failure.
+ * Duplicates the logical extents in batches, and updates the references to the
+ * physical extents as required. Returns 0 on success, or a negative error code
+ * in case of failure.
  */
-static int apfs_clone_single_extent(struct apfs_dstream_info *dstream, u64 new_id, u64 *log_addr)
+int apfs_clone_extents(struct apfs_dstream_info *dstream, u64 new_id)
 {
 	struct super_block *sb = dstream->ds_sb;
-	struct apfs_file_extent extent;
-	int err;
+	struct apfs_file_extent *extents = NULL;
+	u64 next = 0;
+	int count, i;
+	int err = 0;
 
-	err = apfs_extent_read(dstream, *log_addr >> sb->s_blocksize_bits, &extent);
-	if (err) {
-		apfs_err(sb, "failed to read an extent to clone for dstream 0x%llx", dstream->ds_id);
-		return err;
-	}
-	err = apfs_extent_create_record(sb, new_id, &extent);
-	if (err) {
-		apfs_err(sb, "failed to create extent record for clone of dstream 0x%llx", dstream->ds_id);
-		return err;
-	}
+	extents = kcalloc(APFS_CLONE_BATCH, sizeof(*extents), GFP_KERNEL);
+	if (!extents)
+		return -ENOMEM;
 
-	if (!apfs_ext_is_hole(&extent)) {
-		err = apfs_range_take_reference(sb, extent.phys_block_num, extent.len);
+	while (next < dstream->ds_size) {
+		for (count = 0; count < APFS_CLONE_BATCH && next < dstream->ds_size; ++count) {
+			err = apfs_extent_read(dstream, next >> sb->s_blocksize_bits, &extents[count]);
+			if (err) {
+				apfs_err(sb, "failed to read an extent to clone for dstream 0x%llx", dstream->ds_id);
+				goto out;
+			}
+			next += extents[count].len;
+		}
+
+		err = apfs_extent_create_records(sb, new_id, extents, count);
 		if (err) {
-			apfs_err(sb, "failed to take a reference to physical range 0x%llx-0x%llx", extent.phys_block_num, extent.len);
-			return err;
+			apfs_err(sb, "failed to create extent records for clone of dstream 0x%llx", dstream->ds_id);
+			goto out;
+		}
+
+		for (i = 0; i < count; ++i) {
+			struct apfs_file_extent *extent = &extents[i];
+
+			if (apfs_ext_is_hole(extent))
+				continue;
+			err = apfs_range_take_reference(sb, extent->phys_block_num, extent->len);
+			if (err) {
+				apfs_err(sb, "failed to take a reference to physical range 0x%llx-0x%llx", extent->phys_block_num, extent->len);
+				goto out;
+			}
 		}
 	}
 
-	*log_addr += extent.len;
-	return 0;
+out:
+	kfree(extents);
+	return err;
 }
 
+/* Inode flags for xfields that a clone can't replace */
+#define APFS_CLONE_XFIELD_FLAGS	(APFS_INODE_MAINTAIN_DIR_STATS | APFS_INODE_IS_SPARSE | APFS_INODE_HAS_PURGEABLE_FLAGS)
+
 /**
- * apfs_clone_extents - Make a copy of all extents in a dstream to a new one
- * @dstream:	old dstream
- * @new_id:	id for the new dstream
+ * apfs_clone_can_share_dstream - Can a clone just share the whole dstream?
+ * @src_inode:	source inode
+ * @dst_inode:	destination inode
  *
- * Returns 0 on success, or a negative error code in case of failure.
+ * This is how the official driver makes its clones: the user creates an empty
+ * target file, and then calls the ioctl, which replaces the file with a clone.
  */
-int apfs_clone_extents(struct apfs_dstream_info *dstream, u64 new_id)
+static bool apfs_clone_can_share_dstream(struct inode *src_inode, struct inode *dst_inode)
 {
-	u64 next = 0;
-	int err;
+	struct apfs_inode_info *src_ai = APFS_I(src_inode);
+	struct apfs_inode_info *dst_ai = APFS_I(dst_inode);
 
-	while (next < dstream->ds_size) {
-		err = apfs_clone_single_extent(dstream, new_id, &next);
-		if (err)
-			return err;
-	}
-	return 0;
+	if (!src_ai->i_has_dstream)
+		return false;
+	if (dst_ai->i_has_dstream || dst_ai->i_bsd_flags & APFS_INOBSD_COMPRESSED)
+		return false;
+	return !(dst_ai->i_int_flags & APFS_CLONE_XFIELD_FLAGS);
 }
 
 /**
- * apfs_nonsparse_dstream_read - Read from a dstream without holes
- * @dstream:	dstream to read
- * @buf:	destination buffer
- * @count:	exact number of bytes to read
- * @offset:	dstream offset to read from
+ * apfs_clone_whole_file - Turn an empty file into a clone of another
+ * @src_inode:	source inode
+ * @dst_inode:	destination inode, which must pass apfs_clone_can_share_dstream()
  *
- * Returns 0 on success or a negative error code in case of failure.
+ * Both inodes end up sharing the same dstream. This is not atomic, of course.
+ * Returns the length of the clone on success, or a negative error code in case
+ * of failure.
  */
-int apfs_nonsparse_dstream_read(struct apfs_dstream_info *dstream, void *buf, size_t count, u64 offset)
+static loff_t apfs_clone_whole_file(struct inode *src_inode, struct inode *dst_inode)
 {
-	struct super_block *sb = dstream->ds_sb;
-	u64 logical_start_block, logical_end_block, log_bno, blkcnt, idx;
-	struct buffer_head **bhs = NULL;
-	int ret = 0;
+	struct apfs_inode_info *src_ai = APFS_I(src_inode);
+	struct apfs_inode_info *dst_ai = APFS_I(dst_inode);
+	struct apfs_dstream_info *src_ds = &src_ai->i_dstream;
+	struct apfs_dstream_info *dst_ds = &dst_ai->i_dstream;
+	struct super_block *sb = src_inode->i_sb;
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	/* TODO: remember to update the maxops in the future */
+	struct apfs_max_ops maxops = {0};
+	int err;
 
-	/* Save myself from thinking about overflow here */
-	if (count >= APFS_MAX_FILE_SIZE || offset >= APFS_MAX_FILE_SIZE) {
-		apfs_err(sb, "dstream read overflow (0x%llx-0x%llx)", offset, (unsigned long long)count);
-		return -EFBIG;
-	}
+	err = apfs_transaction_start(sb, maxops);
+	if (err)
+		return err;
+	apfs_inode_join_transaction(sb, src_inode);
+	apfs_inode_join_transaction(sb, dst_inode);
 
-	if (offset + count > dstream->ds_size) {
-		apfs_err(sb, "reading past the end (0x%llx-0x%llx)", offset, (unsigned long long)count);
-		/* No caller is expected to legitimately read out-of-bounds */
-		return -EFSCORRUPTED;
+	/* Shared extents can't be delayed, the blocks must exist for the clone */
+	err = apfs_dstream_flush_delalloc(src_ds, NULL /* locked_page */);
+	if (err)
+		goto fail;
+	err = apfs_flush_extent_cache(src_ds);
+	if (err) {
+		apfs_err(sb, "extent cache flush failed for dstream 0x%llx", src_ds->ds_id);
+		goto fail;
 	}
+	err = apfs_dstream_adj_refcnt(src_ds, +1);
+	if (err) {
+		apfs_err(sb, "failed to take dstream id 0x%llx", src_ds->ds_id);
+		goto fail;
+	}
+	src_ds->ds_shared = true;
 
-	logical_start_block = offset >> sb->s_blocksize_bits;
-	logical_end_block = (offset + count + sb->s_blocksize - 1) >> sb->s_blocksize_bits;
-	blkcnt = logical_end_block - logical_start_block;
-	bhs = kcalloc(blkcnt, sizeof(*bhs), GFP_KERNEL);
-	if (!bhs)
-		return -ENOMEM;
-
-	for (log_bno = logical_start_block; log_bno < logical_end_block; log_bno++) {
-		struct buffer_head *bh = NULL;
-		u64 bno = 0;
-
-		idx = log_bno - logical_start_block;
-
-		ret = apfs_logic_to_phys_bno(dstream, log_bno, &bno);
-		if (ret)
-			goto out;
-		if (bno == 0) {
-			apfs_err(sb, "nonsparse dstream has a hole");
-			ret = -EFSCORRUPTED;
-			goto out;
-		}
-
-#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 7, 0)
-		bhs[idx] = __getblk_gfp(APFS_NXI(sb)->nx_bdev, bno, sb->s_blocksize, __GFP_MOVABLE);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 6, 0)
+	dst_inode->i_mtime = dst_inode->i_ctime = current_time(dst_inode);
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(6, 7, 0)
+	dst_inode->i_mtime = inode_set_ctime_current(dst_inode);
 #else
-		bhs[idx] = bdev_getblk(APFS_NXI(sb)->nx_bdev, bno, sb->s_blocksize, __GFP_MOVABLE);
+	inode_set_mtime_to_ts(dst_inode, inode_set_ctime_current(dst_inode));
 #endif
-		if (!bhs[idx]) {
-			apfs_err(sb, "failed to map block 0x%llx", bno);
-			ret = -EIO;
-			goto out;
-		}
+	dst_inode->i_size = src_inode->i_size;
+	dst_ai->i_key_class = src_ai->i_key_class;
+	dst_ai->i_int_flags = src_ai->i_int_flags;
+	dst_ai->i_bsd_flags = src_ai->i_bsd_flags;
+	dst_ai->i_has_dstream = true;
 
-		bh = bhs[idx];
-		if (!buffer_uptodate(bh)) {
-			get_bh(bh);
-			lock_buffer(bh);
-			bh->b_end_io = end_buffer_read_sync;
-			apfs_submit_bh(REQ_OP_READ, 0, bh);
-		}
-	}
+	dst_ds->ds_sb = src_ds->ds_sb;
+	dst_ds->ds_inode = dst_inode;
+	dst_ds->ds_id = src_ds->ds_id;
+	dst_ds->ds_size = src_ds->ds_size;
+	dst_ds->ds_sparse_bytes = src_ds->ds_sparse_bytes;
+	dst_ds->ds_cached_ext = src_ds->ds_cached_ext;
+	dst_ds->ds_ext_dirty = false;
+	dst_ds->ds_shared = true;
+	dst_ds->ds_prealloc_len = 0;
+	dst_ds->ds_delalloc_len = 0;
+	apfs_extent_map_clear(dst_ds);
 
-	for (log_bno = logical_start_block; log_bno < logical_end_block; log_bno++) {
-		int off_in_block, left_in_block;
+	dst_ai->i_int_flags |= APFS_INODE_WAS_EVER_CLONED | APFS_INODE_WAS_CLONED;
+	src_ai->i_int_flags |= APFS_INODE_WAS_EVER_CLONED;
 
-		idx = log_bno - logical_start_block;
-		wait_on_buffer(bhs[idx]);
-		if (!buffer_uptodate(bhs[idx])) {
-			apfs_err(sb, "failed to read a block");
-			ret = -EIO;
-			goto out;
-		}
+	/*
+	 * The sparse flag is the important one here: if we need it, it will get
+	 * set later by apfs_update_inode(), after the xfield gets created.
+	 */
+	dst_ai->i_int_flags &= ~APFS_CLONE_XFIELD_FLAGS;
+
+	/*
+	 * Commit the transaction to make sure all buffers in the source inode
+	 * go through copy-on-write. This is a bit excessive, but I don't expect
+	 * clones to be created often enough for it to matter.
+	 */
+	sbi->s_nxi->nx_transaction.t_state |= APFS_NX_TRANS_FORCE_COMMIT;
+	err = apfs_transaction_commit(sb);
+	if (err)
+		goto fail;
+	return dst_ds->ds_size;
+
+fail:
+	apfs_transaction_abort(sb);
+	return err;
+}
+
+
+/**
+ * apfs_split_extent_at - Make sure no extent record crosses a logical address
+ * @dstream:	data stream info
+ * @addr:	logical address, block-aligned
+ *
+ * Returns 0 on success or a negative error code in case of failure.
+ */
+static int apfs_split_extent_at(struct apfs_dstream_info *dstream, u64 addr)
+{
+	struct super_block *sb = dstream->ds_sb;
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_query *query = NULL;
+	struct apfs_file_extent extent;
+	int ret;
+
+	query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
+	if (!query)
+		return -ENOMEM;
+	apfs_init_file_extent_key(dstream->ds_id, addr, &query->key);
+	query->flags = APFS_QUERY_CAT;
+
+	ret = apfs_btree_query(sb, &query);
+	if (ret && ret != -ENODATA) {
+		apfs_err(sb, "query failed for id 0x%llx, addr 0x%llx", dstream->ds_id, addr);
+		goto out;
+	}
+	if (ret == -ENODATA || !apfs_query_found_extent(query)) {
+		ret = 0;
+		goto out;
+	}
+
+	ret = apfs_extent_from_query(query, &extent);
+	if (ret) {
+		apfs_err(sb, "bad extent record for dstream 0x%llx", dstream->ds_id);
+		goto out;
+	}
+	if (extent.logical_addr < addr && addr < extent.logical_addr + extent.len) {
+		ret = apfs_split_extent(query, addr);
+		if (ret)
+			apfs_err(sb, "failed to split extent in dstream 0x%llx", dstream->ds_id);
+	}
+
+out:
+	apfs_free_query(query);
+	return ret;
+}
+
+/**
+ * apfs_remove_extent_range - Delete all extent records inside a logical range
+ * @dstream:	data stream info
+ * @start:	first logical address in the range
+ * @end:	logical address right after the range
+ *
+ * No extent may cross the bounds of the range; apfs_split_extent_at() takes
+ * care of that. The records are removed from the end, and the references to
+ * their physical blocks are put. Returns 0 on success or a negative error code
+ * in case of failure.
+ */
+static int apfs_remove_extent_range(struct apfs_dstream_info *dstream, u64 start, u64 end)
+{
+	struct super_block *sb = dstream->ds_sb;
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_query *query = NULL;
+	struct apfs_file_extent *cache = NULL;
+	struct apfs_file_extent extent;
+	int ret = 0;
+
+	apfs_extent_map_drop(dstream, start, end);
+
+	/*
+	 * Readers may have cached one of these extents since the last commit,
+	 * and its blocks are about to be freed.
+	 */
+	spin_lock(&dstream->ds_ext_lock);
+	cache = &dstream->ds_cached_ext;
+	if (cache->len && cache->logical_addr < end && cache->logical_addr + cache->len > start) {
+		ASSERT(!dstream->ds_ext_dirty);
+		cache->len = 0;
+	}
+	spin_unlock(&dstream->ds_ext_lock);
+
+	while (start < end) {
+		query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
+		if (!query)
+			return -ENOMEM;
+		apfs_init_file_extent_key(dstream->ds_id, end - 1, &query->key);
+		query->flags = APFS_QUERY_CAT;
+
+		ret = apfs_btree_query(sb, &query);
+		if (ret && ret != -ENODATA) {
+			apfs_err(sb, "query failed for id 0x%llx, addr 0x%llx", dstream->ds_id, end - 1);
+			break;
+		}
+		if (ret == -ENODATA || !apfs_query_found_extent(query)) {
+			ret = 0;
+			break;
+		}
+
+		ret = apfs_extent_from_query(query, &extent);
+		if (ret) {
+			apfs_err(sb, "bad extent record for dstream 0x%llx", dstream->ds_id);
+			break;
+		}
+		if (extent.logical_addr < start)
+			break;
+		if (extent.logical_addr + extent.len > end) {
+			/* This should never happen, but be safe */
+			apfs_alert(sb, "extent crosses the end of a removed range for dstream 0x%llx", dstream->ds_id);
+			ret = -EFSCORRUPTED;
+			break;
+		}
+
+		ret = apfs_btree_remove(query);
+		if (ret) {
+			apfs_err(sb, "removal failed for id 0x%llx, addr 0x%llx", dstream->ds_id, extent.logical_addr);
+			break;
+		}
+		if (apfs_ext_is_hole(&extent)) {
+			dstream->ds_sparse_bytes -= extent.len;
+		} else {
+			ret = apfs_range_put_reference(sb, extent.phys_block_num, extent.len);
+			if (ret) {
+				apfs_err(sb, "failed to put range 0x%llx-0x%llx", extent.phys_block_num, extent.len);
+				break;
+			}
+		}
+		ret = apfs_crypto_adj_refcnt(sb, extent.crypto_id, -1);
+		if (ret) {
+			apfs_err(sb, "failed to put crypto id 0x%llx", extent.crypto_id);
+			break;
+		}
+		end = extent.logical_addr;
+
+		apfs_free_query(query);
+		query = NULL;
+	}
+
+	apfs_free_query(query);
+	return ret;
+}
+
+/**
+ * apfs_clone_range_step - Share the next few extents of a range with a dstream
+ * @src:	source data stream
+ * @src_off:	offset of the step in @src, block-aligned
+ * @dst:	destination data stream, which must not be shared
+ * @dst_off:	offset of the step in @dst, block-aligned
+ * @len:	length of what remains of the range, block-aligned
+ * @done:	on return, the length covered by the step
+ *
+ * Replaces the extents of @dst in the range with up to APFS_CLONE_BATCH
+ * extents from @src, cropped to fit, and takes references to their physical
+ * blocks. Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_clone_range_step(struct apfs_dstream_info *src, u64 src_off, struct apfs_dstream_info *dst, u64 dst_off, u64 len, u64 *done)
+{
+	struct super_block *sb = src->ds_sb;
+	struct apfs_file_extent *extents = NULL;
+	u64 pos = src_off, end = src_off + len;
+	int count, i;
+	int err = 0;
+
+	extents = kcalloc(APFS_CLONE_BATCH, sizeof(*extents), GFP_KERNEL);
+	if (!extents)
+		return -ENOMEM;
+
+	for (count = 0; count < APFS_CLONE_BATCH && pos < end; ++count) {
+		struct apfs_file_extent *extent = &extents[count];
+		u64 skip;
+
+		err = apfs_extent_read(src, pos >> sb->s_blocksize_bits, extent);
+		if (err) {
+			apfs_err(sb, "failed to read an extent to clone for dstream 0x%llx", src->ds_id);
+			goto out;
+		}
+		skip = pos - extent->logical_addr;
+		if (extent->logical_addr > pos || skip >= extent->len) {
+			apfs_err(sb, "bad extent for offset 0x%llx of dstream 0x%llx", pos, src->ds_id);
+			err = -EFSCORRUPTED;
+			goto out;
+		}
+
+		/* Crop the extent to the range, and move it to the target */
+		if (!apfs_ext_is_hole(extent))
+			extent->phys_block_num += skip >> sb->s_blocksize_bits;
+		extent->len = min(extent->len - skip, end - pos);
+		extent->logical_addr = dst_off + pos - src_off;
+		pos += extent->len;
+	}
+	*done = pos - src_off;
+
+	err = apfs_split_extent_at(dst, dst_off);
+	if (err)
+		goto out;
+	err = apfs_split_extent_at(dst, dst_off + *done);
+	if (err)
+		goto out;
+	err = apfs_remove_extent_range(dst, dst_off, dst_off + *done);
+	if (err) {
+		apfs_err(sb, "failed to remove old extents from dstream 0x%llx", dst->ds_id);
+		goto out;
+	}
+
+	err = apfs_extent_create_records(sb, dst->ds_id, extents, count);
+	if (err) {
+		apfs_err(sb, "failed to create extent records for clone of dstream 0x%llx", src->ds_id);
+		goto out;
+	}
+	for (i = 0; i < count; ++i) {
+		struct apfs_file_extent *extent = &extents[i];
+
+		if (apfs_ext_is_hole(extent)) {
+			dst->ds_sparse_bytes += extent->len;
+			continue;
+		}
+		err = apfs_range_take_reference(sb, extent->phys_block_num, extent->len);
+		if (err) {
+			apfs_err(sb, "failed to take a reference to physical range 0x%llx-0x%llx", extent->phys_block_num, extent->len);
+			goto out;
+		}
+	}
+
+out:
+	kfree(extents);
+	return err;
+}
+
+/*
+ * Two splits at the edges, plus the removal of the old extents and the new
+ * records. The old extents may outnumber the batch, but removals free space.
+ */
+#define APFS_CLONE_STEP_MAXOPS	((2 + 2 * APFS_CLONE_BATCH) * APFS_UPDATE_EXTENTS_MAXOPS + APFS_UPDATE_INODE_MAXOPS())
+/* Each extent needs a physical extent record updated, no new blocks */
+#define APFS_CLONE_STEP_MAXBLKS	(2 + 2 * APFS_CLONE_BATCH)
+
+/**
+ * apfs_inode_prepare_extent_edit - Get an inode ready for direct extent changes
+ * @inode: the vfs inode
+ *
+ * Gives the inode a dstream of its own, and makes sure that the catalog has
+ * all of its extents, with no delayed blocks or cached extent left to write.
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_inode_prepare_extent_edit(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct apfs_dstream_info *dstream = &APFS_I(inode)->i_dstream;
+	int err;
+
+	apfs_inode_join_transaction(sb, inode);
+	apfs_inode_data_join_transaction(sb, inode);
+
+	err = apfs_inode_create_dstream_rec(inode);
+	if (err) {
+		apfs_err(sb, "failed to create dstream for ino 0x%llx", apfs_ino(inode));
+		return err;
+	}
+	err = apfs_dstream_flush_delalloc(dstream, NULL /* locked_page */);
+	if (err)
+		return err;
+	err = apfs_flush_extent_cache(dstream);
+	if (err) {
+		apfs_err(sb, "extent cache flush failed for dstream 0x%llx", dstream->ds_id);
+		return err;
+	}
+	/* The cached extent may get removed */
+	dstream->ds_cached_ext.len = 0;
+	return 0;
+}
+#define APFS_PREPARE_EXTENT_EDIT_MAXOPS	(1 + APFS_UPDATE_INODE_MAXOPS() + APFS_FLUSH_EXTENT_CACHE)
+
+/**
+ * apfs_clone_extent_range - Share a range of extents between two files
+ * @src_inode:	source inode
+ * @off:	offset in @src_inode, block-aligned
+ * @dst_inode:	destination inode
+ * @destoff:	offset in @dst_inode, block-aligned
+ * @len:	length of the range, checked by apfs_remap_range_prep()
+ *
+ * The first transaction gets both files ready and then forces a commit, so
+ * that the source blocks are on disk before anyone can reach them through the
+ * destination. After that the extents are remapped in batches, each with its
+ * own transaction. Returns the length of the clone on success, or a negative
+ * error code in case of failure.
+ */
+static loff_t apfs_clone_extent_range(struct inode *src_inode, loff_t off, struct inode *dst_inode, loff_t destoff, loff_t len)
+{
+	struct apfs_inode_info *src_ai = APFS_I(src_inode);
+	struct apfs_inode_info *dst_ai = APFS_I(dst_inode);
+	struct apfs_dstream_info *src_ds = &src_ai->i_dstream;
+	struct apfs_dstream_info *dst_ds = &dst_ai->i_dstream;
+	struct super_block *sb = src_inode->i_sb;
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_max_ops maxops;
+	loff_t page_start, page_end;
+	u64 aligned_len, done, step = 0;
+	int err;
+
+	if (apfs_vol_is_encrypted(sb)) {
+		apfs_warn(sb, "ranged clones are not supported on encrypted volumes");
+		return -EOPNOTSUPP;
+	}
+	if ((src_ai->i_bsd_flags | dst_ai->i_bsd_flags) & APFS_INOBSD_COMPRESSED) {
+		apfs_warn(sb, "can't clone ranges of compressed files");
+		return -EOPNOTSUPP;
+	}
+	if (!src_ai->i_has_dstream) {
+		apfs_warn(sb, "can't clone a file with no dstream");
+		return -EOPNOTSUPP;
+	}
+
+	aligned_len = round_up(len, sb->s_blocksize);
+	page_start = round_down(destoff, PAGE_SIZE);
+	page_end = round_up(destoff + aligned_len, PAGE_SIZE) - 1;
+
+	maxops.cat = 2 * (APFS_UPDATE_INODE_MAXOPS() + APFS_FLUSH_EXTENT_CACHE);
+	maxops.blks = 0;
+	err = apfs_transaction_start(sb, maxops);
+	if (err)
+		return err;
+	apfs_inode_join_transaction(sb, src_inode);
+
+	/* Shared extents can't be delayed, the blocks must exist for the clone */
+	err = apfs_dstream_flush_delalloc(src_ds, NULL /* locked_page */);
+	if (err)
+		goto fail;
+	err = apfs_flush_extent_cache(src_ds);
+	if (err) {
+		apfs_err(sb, "extent cache flush failed for dstream 0x%llx", src_ds->ds_id);
+		goto fail;
+	}
+
+	/* This also stops the target from sharing a dstream with anyone else */
+	err = apfs_inode_prepare_extent_edit(dst_inode);
+	if (err)
+		goto fail;
+
+	if (destoff > dst_inode->i_size) {
+		err = apfs_setsize(dst_inode, destoff);
+		if (err) {
+			apfs_err(sb, "setsize failed for ino 0x%llx", apfs_ino(dst_inode));
+			goto fail;
+		}
+	} else {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 6, 0)
+		dst_inode->i_mtime = dst_inode->i_ctime = current_time(dst_inode);
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(6, 7, 0)
+		dst_inode->i_mtime = inode_set_ctime_current(dst_inode);
+#else
+		inode_set_mtime_to_ts(dst_inode, inode_set_ctime_current(dst_inode));
+#endif
+	}
+	dst_ai->i_int_flags |= APFS_INODE_WAS_EVER_CLONED;
+	src_ai->i_int_flags |= APFS_INODE_WAS_EVER_CLONED;
+
+	sbi->s_nxi->nx_transaction.t_state |= APFS_NX_TRANS_FORCE_COMMIT;
+	err = apfs_transaction_commit(sb);
+	if (err)
+		goto fail;
+
+	maxops.cat = APFS_CLONE_STEP_MAXOPS;
+	maxops.blks = APFS_CLONE_STEP_MAXBLKS;
+	for (done = 0; done < aligned_len; done += step) {
+		loff_t new_size;
+
+		err = apfs_transaction_start(sb, maxops);
+		if (err)
+			goto out_pages;
+		apfs_inode_join_transaction(sb, dst_inode);
+		apfs_inode_data_join_transaction(sb, dst_inode);
+
+		err = apfs_clone_range_step(src_ds, off + done, dst_ds, destoff + done, aligned_len - done, &step);
+		if (err) {
+			apfs_err(sb, "failed to clone range of ino 0x%llx", apfs_ino(src_inode));
+			goto fail;
+		}
+		new_size = destoff + min_t(u64, done + step, len);
+		if (new_size > dst_inode->i_size) {
+			i_size_write(dst_inode, new_size);
+			dst_ds->ds_size = new_size;
+		}
+
+		err = apfs_transaction_commit(sb);
+		if (err)
+			goto fail;
+	}
+
+	/* The flush made these pages clean, so they can go as a whole */
+	truncate_inode_pages_range(dst_inode->i_mapping, page_start, page_end);
+	return len;
+
+fail:
+	apfs_transaction_abort(sb);
+out_pages:
+	/* Earlier batches may be committed, so the cached pages can be stale */
+	truncate_inode_pages_range(dst_inode->i_mapping, page_start, page_end);
+	return err;
+}
+
+/**
+ * apfs_remap_range_prep - Check and adjust the range for a clone
+ * @src_inode:	source inode
+ * @off:	offset in @src_inode
+ * @dst_inode:	destination inode
+ * @destoff:	offset in @dst_inode
+ * @len:	length of the range, or 0 to clone up to the end of @src_inode
+ * @can_shorten: can @len be reduced to make the range valid?
+ *
+ * Ranges must be block-aligned, except at the end of the source, as long as
+ * that doesn't leave garbage inside the destination. On return, @len is the
+ * exact length to clone, which may be 0. Returns 0 on success or a negative
+ * error code in case of failure.
+ */
+static int apfs_remap_range_prep(struct inode *src_inode, loff_t off, struct inode *dst_inode, loff_t destoff, loff_t *len, bool can_shorten)
+{
+	u64 mask = src_inode->i_sb->s_blocksize - 1;
+	loff_t src_size = i_size_read(src_inode);
+	loff_t dst_size = i_size_read(dst_inode);
+
+	if (IS_IMMUTABLE(dst_inode) || IS_APPEND(dst_inode))
+		return -EPERM;
+	if (off < 0 || destoff < 0 || *len < 0)
+		return -EINVAL;
+	if ((off | destoff) & mask)
+		return -EINVAL;
+
+	if (off >= src_size) {
+		*len = 0;
+		return 0;
+	}
+	if (*len == 0) {
+		*len = src_size - off;
+	} else if (*len > src_size - off) {
+		if (!can_shorten)
+			return -EINVAL;
+		*len = src_size - off;
+	}
+
+	if ((*len & mask) && (off + *len != src_size || destoff + *len < dst_size)) {
+		if (!can_shorten)
+			return -EINVAL;
+		*len &= ~mask;
+	}
+	if (destoff + *len > APFS_MAX_FILE_SIZE)
+		return -EFBIG;
+	return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+loff_t apfs_remap_file_range(struct file *src_file, loff_t off, struct file *dst_file, loff_t destoff, loff_t len, unsigned int remap_flags)
+#else
+int apfs_clone_file_range(struct file *src_file, loff_t off, struct file *dst_file, loff_t destoff, u64 len)
+#endif
+{
+	struct inode *src_inode = file_inode(src_file);
+	struct inode *dst_inode = file_inode(dst_file);
+	bool can_shorten = false;
+	loff_t length = len;
+	loff_t ret;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+	if (remap_flags & ~(REMAP_FILE_ADVISORY | REMAP_FILE_CAN_SHORTEN))
+		return -EINVAL;
+	can_shorten = remap_flags & REMAP_FILE_CAN_SHORTEN;
+#endif
+	if (src_inode == dst_inode)
+		return -EINVAL;
+
+	lock_two_nondirectories(src_inode, dst_inode);
+
+	ret = apfs_remap_range_prep(src_inode, off, dst_inode, destoff, &length, can_shorten);
+	if (ret || length == 0)
+		goto out;
+
+	/* Like a write, the clone drops the setuid and setgid bits */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0)
+	ret = file_modified(dst_file);
+#else
+	ret = file_remove_privs(dst_file);
+#endif
+	if (ret)
+		goto out;
+
+	/* Whole files are cloned like in the official driver, if possible */
+	if (off == 0 && destoff == 0 && length == i_size_read(src_inode) &&
+	    apfs_clone_can_share_dstream(src_inode, dst_inode)) {
+		ret = apfs_clone_whole_file(src_inode, dst_inode);
+		goto out;
+	}
+
+	ret = filemap_write_and_wait_range(src_inode->i_mapping, off, off + length - 1);
+	if (ret)
+		goto out;
+	ret = filemap_write_and_wait_range(dst_inode->i_mapping, round_down(destoff, PAGE_SIZE), round_up(destoff + length, PAGE_SIZE) - 1);
+	if (ret)
+		goto out;
+	ret = apfs_clone_extent_range(src_inode, off, dst_inode, destoff, length);
+
+out:
+	unlock_two_nondirectories(src_inode, dst_inode);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+	return ret < 0 ? ret : length;
+#else
+	return ret < 0 ? ret : 0;
+#endif
+}
+
+/* Most blocks to preallocate in a single transaction */
+#define APFS_PREALLOC_STEP_BLKS	8192
+/* Most extents to replace with a hole in a single transaction */
+#define APFS_PUNCH_BATCH	64
+
+/**
+ * apfs_zero_blocks - Write zeroes to a run of blocks that nothing references
+ * @sb:		filesystem superblock
+ * @bno:	first block number
+ * @count:	number of blocks
+ *
+ * The blocks were just allocated, so they can be zeroed on disk right away,
+ * without going through the transaction. Returns 0 on success, or a negative
+ * error code in case of failure.
+ */
+static int apfs_zero_blocks(struct super_block *sb, u64 bno, u64 count)
+{
+	struct block_device *bdev = APFS_NXI(sb)->nx_bdev;
+	int shift = sb->s_blocksize_bits - 9;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 12, 0)
+	return blkdev_issue_zeroout(bdev, bno << shift, count << shift, GFP_NOFS, false /* discard */);
+#else
+	return blkdev_issue_zeroout(bdev, bno << shift, count << shift, GFP_NOFS, 0 /* flags */);
+#endif
+}
+
+/**
+ * apfs_prealloc_step - Give real blocks to the next hole in a range
+ * @dstream:	data stream info
+ * @pos:	logical address to start from, block-aligned
+ * @end:	logical address right after the range, block-aligned
+ * @max_blks:	most blocks to allocate
+ * @done:	on return, the length covered by the step
+ *
+ * Skips over the extents that already have blocks, and replaces the first
+ * hole found, or as much of it as possible, with a single contiguous extent
+ * of zeroed blocks. If the container has no free blocks left, nothing gets
+ * changed and @done is set to 0. Returns 0 on success, or a negative error
+ * code in case of failure.
+ */
+static int apfs_prealloc_step(struct apfs_dstream_info *dstream, u64 pos, u64 end, u64 max_blks, u64 *done)
+{
+	struct super_block *sb = dstream->ds_sb;
+	struct apfs_superblock *vsb_raw = APFS_SB(sb)->s_vsb_raw;
+	struct apfs_file_extent extent;
+	u64 start = pos, ext_end, bno, count;
+	int err;
+
+	while (pos < end) {
+		err = apfs_extent_read(dstream, pos >> sb->s_blocksize_bits, &extent);
+		if (err) {
+			apfs_err(sb, "failed to read extent for offset 0x%llx of dstream 0x%llx", pos, dstream->ds_id);
+			return err;
+		}
+		ext_end = extent.logical_addr + extent.len;
+		if (extent.logical_addr > pos || ext_end <= pos) {
+			apfs_err(sb, "bad extent for offset 0x%llx of dstream 0x%llx", pos, dstream->ds_id);
+			return -EFSCORRUPTED;
+		}
+		if (apfs_ext_is_hole(&extent))
+			break;
+		pos = min(ext_end, end);
+	}
+	if (pos == end) {
+		*done = end - start;
+		return 0;
+	}
+
+	count = (min(ext_end, end) - pos) >> sb->s_blocksize_bits;
+	count = min(count, max_blks);
+	err = apfs_spaceman_allocate_extent(sb, &bno, &count, false /* backwards */);
+	if (err == -ENOSPC) {
+		*done = 0;
+		return 0;
+	}
+	if (err)
+		return err;
+	err = apfs_zero_blocks(sb, bno, count);
+	if (err) {
+		apfs_err(sb, "failed to zero blocks 0x%llx-0x%llx", bno, count);
+		apfs_spaceman_free_unused_extent(sb, bno, count);
+		return err;
+	}
+
+	apfs_assert_in_transaction(sb, &vsb_raw->apfs_o);
+	apfs_alloc_count_add(sb, count);
+	le64_add_cpu(&vsb_raw->apfs_total_blocks_alloced, count);
+
+	extent.logical_addr = pos;
+	extent.phys_block_num = bno;
+	extent.len = count << sb->s_blocksize_bits;
+	extent.crypto_id = 0;
+
+	err = apfs_split_extent_at(dstream, pos);
+	if (err)
+		return err;
+	err = apfs_split_extent_at(dstream, pos + extent.len);
+	if (err)
+		return err;
+	err = apfs_remove_extent_range(dstream, pos, pos + extent.len);
+	if (err) {
+		apfs_err(sb, "failed to remove hole from dstream 0x%llx", dstream->ds_id);
+		return err;
+	}
+	err = apfs_extent_create_records(sb, dstream->ds_id, &extent, 1);
+	if (err) {
+		apfs_err(sb, "failed to create extent record for dstream 0x%llx", dstream->ds_id);
+		return err;
+	}
+	err = apfs_insert_phys_extent(dstream, &extent);
+	if (err) {
+		apfs_err(sb, "pext insertion failed for dstream 0x%llx", dstream->ds_id);
+		return err;
+	}
+
+	*done = pos + extent.len - start;
+	return 0;
+}
+/* Two splits, the hole removal, the new extent and its physical record */
+#define APFS_PREALLOC_STEP_MAXOPS	(5 * APFS_UPDATE_EXTENTS_MAXOPS + APFS_UPDATE_INODE_MAXOPS())
+
+/**
+ * apfs_prealloc_range - Allocate zeroed blocks for all the holes in a range
+ * @inode:	the vfs inode
+ * @start:	first logical address in the range, block-aligned
+ * @end:	logical address right after the range, block-aligned
+ *
+ * Each step runs in its own transaction, so the blocks allocated before the
+ * container runs out are kept. Returns 0 on success, or a negative error code
+ * in case of failure.
+ */
+static int apfs_prealloc_range(struct inode *inode, u64 start, u64 end)
+{
+	struct super_block *sb = inode->i_sb;
+	struct apfs_dstream_info *dstream = &APFS_I(inode)->i_dstream;
+	struct apfs_max_ops maxops;
+	u64 step_blks = APFS_PREALLOC_STEP_BLKS;
+	u64 done = 0;
+	int err;
+
+	maxops.cat = APFS_PREPARE_EXTENT_EDIT_MAXOPS + APFS_PREALLOC_STEP_MAXOPS;
+	for (; start < end; start += done) {
+		maxops.blks = min(step_blks, (end - start) >> sb->s_blocksize_bits);
+		err = apfs_transaction_start(sb, maxops);
+		if (err == -ENOSPC && step_blks > 1) {
+			/* Try again with a smaller step, the estimate is generous */
+			step_blks >>= 1;
+			done = 0;
+			continue;
+		}
+		if (err)
+			return err;
+		err = apfs_inode_prepare_extent_edit(inode);
+		if (err)
+			goto fail;
+		err = apfs_prealloc_step(dstream, start, end, maxops.blks, &done);
+		if (err)
+			goto fail;
+		err = apfs_transaction_commit(sb);
+		if (err)
+			goto fail;
+		if (!done)
+			return -ENOSPC;
+	}
+	return 0;
+
+fail:
+	apfs_transaction_abort(sb);
+	return err;
+}
+
+/**
+ * apfs_zero_partial_block - Zero part of a single block of a file
+ * @inode:	the vfs inode
+ * @pos:	file offset to zero from
+ * @len:	number of bytes to zero, all inside the block
+ *
+ * Goes through the page cache and copy-on-write, like any other write. Blocks
+ * in holes already read as zeroes, so only their page cache gets zeroed.
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_zero_partial_block(struct inode *inode, loff_t pos, unsigned int len)
+{
+	struct super_block *sb = inode->i_sb;
+	struct apfs_dstream_info *dstream = &APFS_I(inode)->i_dstream;
+	struct page *page = NULL;
+	void *fsdata = NULL;
+	u64 bno;
+	int err;
+
+	if (!len)
+		return 0;
+
+	err = apfs_logic_to_phys_bno(dstream, pos >> sb->s_blocksize_bits, &bno);
+	if (err)
+		return err;
+	if (!bno) {
+		truncate_pagecache_range(inode, pos, pos + len - 1);
+		return 0;
+	}
+
+	err = __apfs_write_begin(NULL, inode->i_mapping, pos, len, 0, &page, &fsdata);
+	if (err)
+		return err;
+	zero_user(page, offset_in_page(pos), len);
+	err = __apfs_write_end(NULL, inode->i_mapping, pos, len, len, page, fsdata);
+	return err < 0 ? err : 0;
+}
+
+/**
+ * apfs_punch_step - Replace the next few extents of a range with a hole
+ * @dstream:	data stream info
+ * @pos:	logical address to start from, block-aligned
+ * @end:	logical address right after the range, block-aligned
+ * @done:	on return, the length covered by the step
+ *
+ * Covers up to APFS_PUNCH_BATCH extents, so that the transaction has a bound.
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_punch_step(struct apfs_dstream_info *dstream, u64 pos, u64 end, u64 *done)
+{
+	struct super_block *sb = dstream->ds_sb;
+	struct apfs_file_extent extent;
+	u64 step_end = pos;
+	int count, err;
+
+	for (count = 0; count < APFS_PUNCH_BATCH && step_end < end; ++count) {
+		err = apfs_extent_read(dstream, step_end >> sb->s_blocksize_bits, &extent);
+		if (err) {
+			apfs_err(sb, "failed to read extent for offset 0x%llx of dstream 0x%llx", step_end, dstream->ds_id);
+			return err;
+		}
+		if (extent.logical_addr > step_end || extent.logical_addr + extent.len <= step_end) {
+			apfs_err(sb, "bad extent for offset 0x%llx of dstream 0x%llx", step_end, dstream->ds_id);
+			return -EFSCORRUPTED;
+		}
+		step_end = min(extent.logical_addr + extent.len, end);
+	}
+
+	err = apfs_split_extent_at(dstream, pos);
+	if (err)
+		return err;
+	err = apfs_split_extent_at(dstream, step_end);
+	if (err)
+		return err;
+	err = apfs_remove_extent_range(dstream, pos, step_end);
+	if (err) {
+		apfs_err(sb, "failed to remove extents from dstream 0x%llx", dstream->ds_id);
+		return err;
+	}
+	err = apfs_create_hole(dstream, pos >> sb->s_blocksize_bits, step_end >> sb->s_blocksize_bits);
+	if (err) {
+		apfs_err(sb, "hole creation failed for dstream 0x%llx", dstream->ds_id);
+		return err;
+	}
+
+	*done = step_end - pos;
+	return 0;
+}
+/* Two splits, the removed extents and the new hole */
+#define APFS_PUNCH_STEP_MAXOPS	((3 + APFS_PUNCH_BATCH) * APFS_UPDATE_EXTENTS_MAXOPS)
+/* Each removed extent puts the reference to its physical record */
+#define APFS_PUNCH_STEP_MAXBLKS	(2 + APFS_PUNCH_BATCH)
+
+/**
+ * apfs_punch_range - Zero a range of a file, and leave a hole in its place
+ * @inode:	the vfs inode
+ * @start:	first byte of the range
+ * @end:	first byte after the range, not past the end of the file
+ *
+ * The full blocks are replaced in batches, each with its own transaction; the
+ * partial blocks at the edges are zeroed last, along with the timestamp update.
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_punch_range(struct inode *inode, loff_t start, loff_t end)
+{
+	struct super_block *sb = inode->i_sb;
+	struct apfs_dstream_info *dstream = &APFS_I(inode)->i_dstream;
+	loff_t first_full = round_up(start, sb->s_blocksize);
+	loff_t last_full = round_down(end, sb->s_blocksize);
+	struct apfs_max_ops maxops;
+	u64 pos, done = 0;
+	int err;
+
+	/* Edit the extent records before the edges bring any into the cache */
+	maxops.cat = APFS_PREPARE_EXTENT_EDIT_MAXOPS + APFS_PUNCH_STEP_MAXOPS;
+	maxops.blks = APFS_PUNCH_STEP_MAXBLKS;
+	for (pos = first_full; pos < last_full; pos += done) {
+		err = apfs_transaction_start(sb, maxops);
+		if (err)
+			return err;
+		err = apfs_inode_prepare_extent_edit(inode);
+		if (err)
+			goto fail;
+		err = apfs_punch_step(dstream, pos, last_full, &done);
+		if (err)
+			goto fail;
+		truncate_pagecache_range(inode, pos, pos + done - 1);
+		err = apfs_transaction_commit(sb);
+		if (err)
+			goto fail;
+	}
+
+	maxops.cat = APFS_PREPARE_EXTENT_EDIT_MAXOPS + 2 * (APFS_UPDATE_INODE_MAXOPS() + APFS_GET_NEW_BLOCK_MAXOPS());
+	maxops.blks = 2;
+	err = apfs_transaction_start(sb, maxops);
+	if (err)
+		return err;
+	err = apfs_inode_prepare_extent_edit(inode);
+	if (err)
+		goto fail;
+	if (first_full > last_full) {
+		err = apfs_zero_partial_block(inode, start, end - start);
+	} else {
+		err = apfs_zero_partial_block(inode, start, first_full - start);
+		if (!err)
+			err = apfs_zero_partial_block(inode, last_full, end - last_full);
+	}
+	if (err)
+		goto fail;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 6, 0)
+	inode->i_mtime = inode->i_ctime = current_time(inode);
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(6, 7, 0)
+	inode->i_mtime = inode_set_ctime_current(inode);
+#else
+	inode_set_mtime_to_ts(inode, inode_set_ctime_current(inode));
+#endif
+	err = apfs_transaction_commit(sb);
+	if (err)
+		goto fail;
+	return 0;
+
+fail:
+	apfs_transaction_abort(sb);
+	return err;
+}
+
+/**
+ * apfs_fallocate - Preallocate, punch or zero out a range of a regular file
+ * @file:	the file
+ * @mode:	FALLOC_FL_* flags for the operation
+ * @offset:	first byte of the range
+ * @len:	length of the range
+ *
+ * Preallocated ranges get real blocks, zeroed on disk, in extents as long as
+ * the allocator can find. This filesystem has no concept of unwritten extents
+ * past the end of a file, so space can't be kept without changing the size.
+ * Every step is a transaction of its own, so a failure may leave part of the
+ * work done. Returns 0 on success, or a negative error code in case of failure.
+ */
+long apfs_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
+{
+	struct inode *inode = file_inode(file);
+	struct super_block *sb = inode->i_sb;
+	struct apfs_inode_info *ai = APFS_I(inode);
+	struct apfs_max_ops maxops;
+	bool keep_size = mode & FALLOC_FL_KEEP_SIZE;
+	loff_t end = offset + len;
+	u64 prealloc_start, prealloc_end;
+	int err;
+
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+		return -EOPNOTSUPP;
+	if (end > APFS_MAX_FILE_SIZE)
+		return -EFBIG;
+
+	inode_lock(inode);
+
+	if (ai->i_bsd_flags & APFS_INOBSD_COMPRESSED) {
+		err = -EOPNOTSUPP;
+		goto out;
+	}
+	if (mode & FALLOC_FL_PUNCH_HOLE) {
+		end = min(end, i_size_read(inode));
+		if (offset >= end || !ai->i_has_dstream) {
+			err = 0;
+			goto out;
+		}
+	} else if (apfs_vol_is_encrypted(sb)) {
+		/* Zeroed blocks would not decrypt to zeroes */
+		err = -EOPNOTSUPP;
+		goto out;
+	} else if (keep_size && end > i_size_read(inode)) {
+		err = -EOPNOTSUPP;
+		goto out;
+	}
+
+	if (end > inode->i_size) {
+		/* The new tail starts out as a hole */
+		maxops.cat = APFS_PREPARE_EXTENT_EDIT_MAXOPS + APFS_UPDATE_EXTENTS_MAXOPS;
+		maxops.blks = 0;
+		err = apfs_transaction_start(sb, maxops);
+		if (err)
+			goto out;
+		err = apfs_inode_prepare_extent_edit(inode);
+		if (err)
+			goto fail;
+		err = apfs_setsize(inode, end);
+		if (err) {
+			apfs_err(sb, "setsize failed for ino 0x%llx", apfs_ino(inode));
+			goto fail;
+		}
+		err = apfs_transaction_commit(sb);
+		if (err)
+			goto fail;
+	}
+
+	if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+		err = apfs_punch_range(inode, offset, end);
+		if (err)
+			goto out;
+	}
+	if (!(mode & FALLOC_FL_PUNCH_HOLE)) {
+		prealloc_start = round_down(offset, sb->s_blocksize);
+		prealloc_end = round_up(end, sb->s_blocksize);
+		err = apfs_prealloc_range(inode, prealloc_start, prealloc_end);
+	}
+	goto out;
+
+fail:
+	apfs_transaction_abort(sb);
+out:
+	inode_unlock(inode);
+	return err;
+}
+
+/**
+ * apfs_nonsparse_extent_map - Map a block of a dstream without holes
+ * @dstream:	the dstream
+ * @log_bno:	logical block number
+ * @bno:	on return, the physical block number
+ * @blkcnt:	on return, the number of contiguous blocks from @bno in the extent
+ *
+ * Returns 0 on success or a negative error code in case of failure.
+ */
+static int apfs_nonsparse_extent_map(struct apfs_dstream_info *dstream, u64 log_bno, u64 *bno, u64 *blkcnt)
+{
+	struct super_block *sb = dstream->ds_sb;
+	struct apfs_file_extent ext;
+	u64 blk_off, ext_blkcnt;
+	int ret;
+
+	ret = apfs_extent_read(dstream, log_bno, &ext);
+	if (ret)
+		return ret;
+	if (apfs_ext_is_hole(&ext)) {
+		apfs_err(sb, "nonsparse dstream has a hole");
+		return -EFSCORRUPTED;
+	}
+
+	blk_off = log_bno - (ext.logical_addr >> sb->s_blocksize_bits);
+	ext_blkcnt = apfs_size_to_blocks(sb, ext.len);
+	if (blk_off >= ext_blkcnt) {
+		apfs_err(sb, "bad extent for block 0x%llx", log_bno);
+		return -EFSCORRUPTED;
+	}
+	*bno = ext.phys_block_num + blk_off;
+	*blkcnt = ext_blkcnt - blk_off;
+	return 0;
+}
+
+/**
+ * apfs_nonsparse_getblk - Get the buffer head for a block and request a read
+ * @sb:		superblock structure
+ * @bno:	physical block number
+ *
+ * Doesn't wait for the read to complete. Returns the buffer head, or NULL in
+ * case of failure.
+ */
+static struct buffer_head *apfs_nonsparse_getblk(struct super_block *sb, u64 bno)
+{
+	struct buffer_head *bh = NULL;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 7, 0)
+	bh = __getblk_gfp(APFS_NXI(sb)->nx_bdev, bno, sb->s_blocksize, __GFP_MOVABLE);
+#else
+	bh = bdev_getblk(APFS_NXI(sb)->nx_bdev, bno, sb->s_blocksize, __GFP_MOVABLE);
+#endif
+	if (!bh) {
+		apfs_err(sb, "failed to map block 0x%llx", bno);
+		return NULL;
+	}
+	if (!buffer_uptodate(bh)) {
+		get_bh(bh);
+		lock_buffer(bh);
+		bh->b_end_io = end_buffer_read_sync;
+		apfs_submit_bh(REQ_OP_READ, 0, bh);
+	}
+	return bh;
+}
+
+/**
+ * apfs_nonsparse_dstream_read - Read from a dstream without holes
+ * @dstream:	dstream to read
+ * @buf:	destination buffer
+ * @count:	exact number of bytes to read
+ * @offset:	dstream offset to read from
+ *
+ * The reads are requested one extent at a time, under a plug, so that the
+ * block layer can merge the blocks of each extent into a single request.
+ *
+ * Returns 0 on success or a negative error code in case of failure.
+ */
+int apfs_nonsparse_dstream_read(struct apfs_dstream_info *dstream, void *buf, size_t count, u64 offset)
+{
+	struct super_block *sb = dstream->ds_sb;
+	u64 logical_start_block, logical_end_block, log_bno, blkcnt, idx;
+	struct buffer_head **bhs = NULL;
+	struct blk_plug plug;
+	int ret = 0;
+
+	/* Save myself from thinking about overflow here */
+	if (count >= APFS_MAX_FILE_SIZE || offset >= APFS_MAX_FILE_SIZE) {
+		apfs_err(sb, "dstream read overflow (0x%llx-0x%llx)", offset, (unsigned long long)count);
+		return -EFBIG;
+	}
+
+	if (offset + count > dstream->ds_size) {
+		apfs_err(sb, "reading past the end (0x%llx-0x%llx)", offset, (unsigned long long)count);
+		/* No caller is expected to legitimately read out-of-bounds */
+		return -EFSCORRUPTED;
+	}
+
+	logical_start_block = offset >> sb->s_blocksize_bits;
+	logical_end_block = (offset + count + sb->s_blocksize - 1) >> sb->s_blocksize_bits;
+	blkcnt = logical_end_block - logical_start_block;
+	bhs = kcalloc(blkcnt, sizeof(*bhs), GFP_KERNEL);
+	if (!bhs)
+		return -ENOMEM;
+
+	blk_start_plug(&plug);
+	log_bno = logical_start_block;
+	while (log_bno < logical_end_block) {
+		u64 bno = 0, ext_blkcnt = 0, i;
+
+		ret = apfs_nonsparse_extent_map(dstream, log_bno, &bno, &ext_blkcnt);
+		if (ret)
+			break;
+		ext_blkcnt = min(ext_blkcnt, logical_end_block - log_bno);
+
+		for (i = 0; i < ext_blkcnt; i++) {
+			idx = log_bno + i - logical_start_block;
+			bhs[idx] = apfs_nonsparse_getblk(sb, bno + i);
+			if (!bhs[idx]) {
+				ret = -EIO;
+				break;
+			}
+		}
+		if (ret)
+			break;
+		log_bno += ext_blkcnt;
+	}
+	blk_finish_plug(&plug);
+	if (ret)
+		goto out;
+
+	for (log_bno = logical_start_block; log_bno < logical_end_block; log_bno++) {
+		int off_in_block, left_in_block;
+
+		idx = log_bno - logical_start_block;
+		wait_on_buffer(bhs[idx]);
+		if (!buffer_uptodate(bhs[idx])) {
+			apfs_err(sb, "failed to read a block");
+			ret = -EIO;
+			goto out;
+		}
 
 		if (log_bno == logical_start_block)
 			off_in_block = offset & (sb->s_blocksize - 1);
@@ -2356,37 +3900,114 @@ out:
  * @dstream:	dstream to preread
  *
  * Requests reads for all blocks of a dstream, but doesn't wait for the result.
+ * Like for apfs_nonsparse_dstream_read(), the requests go one extent at a time
+ * under a plug, so a big resource fork needs only a few actual I/Os.
  */
 void apfs_nonsparse_dstream_preread(struct apfs_dstream_info *dstream)
 {
 	struct super_block *sb = dstream->ds_sb;
 	u64 logical_end_block, log_bno;
+	struct blk_plug plug;
 
 	logical_end_block = (dstream->ds_size + sb->s_blocksize - 1) >> sb->s_blocksize_bits;
 
-	for (log_bno = 0; log_bno < logical_end_block; log_bno++) {
-		struct buffer_head *bh = NULL;
-		u64 bno = 0;
-		int ret;
+	blk_start_plug(&plug);
+	log_bno = 0;
+	while (log_bno < logical_end_block) {
+		u64 bno = 0, ext_blkcnt = 0, i;
 
-		ret = apfs_logic_to_phys_bno(dstream, log_bno, &bno);
-		if (ret || bno == 0)
-			return;
+		if (apfs_nonsparse_extent_map(dstream, log_bno, &bno, &ext_blkcnt))
+			break;
+		ext_blkcnt = min(ext_blkcnt, logical_end_block - log_bno);
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 7, 0)
-		bh = __getblk_gfp(APFS_NXI(sb)->nx_bdev, bno, sb->s_blocksize, __GFP_MOVABLE);
-#else
-		bh = bdev_getblk(APFS_NXI(sb)->nx_bdev, bno, sb->s_blocksize, __GFP_MOVABLE);
-#endif
-		if (!bh)
-			return;
-		if (!buffer_uptodate(bh)) {
-			get_bh(bh);
-			lock_buffer(bh);
-			bh->b_end_io = end_buffer_read_sync;
-			apfs_submit_bh(REQ_OP_READ, 0, bh);
+		for (i = 0; i < ext_blkcnt; i++) {
+			struct buffer_head *bh = NULL;
+
+			bh = apfs_nonsparse_getblk(sb, bno + i);
+			if (!bh)
+				goto out;
+			brelse(bh);
 		}
-		brelse(bh);
-		bh = NULL;
+		log_bno += ext_blkcnt;
+	}
+out:
+	blk_finish_plug(&plug);
+}
+
+#ifdef APFS_IOMAP
+
+/**
+ * apfs_iomap_begin - Map a range of a regular file for iomap
+ * @inode:	the file
+ * @pos:	first byte to map
+ * @length:	length of the range
+ * @flags:	iomap flags for the operation
+ * @iomap:	on return, the mapping found
+ * @srcmap:	unused
+ *
+ * Returns 0 on success, or a negative error code in case of failure. Each call
+ * maps as much as the extent that covers @pos allows. Only reads are handled
+ * here; all writes go through the page cache and the transaction.
+ */
+static int apfs_iomap_begin(struct inode *inode, loff_t pos, loff_t length, unsigned int flags, struct iomap *iomap, struct iomap *srcmap)
+{
+	struct super_block *sb = inode->i_sb;
+	struct apfs_inode_info *ai = APFS_I(inode);
+	struct apfs_dstream_info *dstream = &ai->i_dstream;
+	struct apfs_file_extent ext;
+	u64 dsblock = pos >> sb->s_blocksize_bits;
+	int err = 0;
+
+	if (flags & IOMAP_WRITE)
+		return -EOPNOTSUPP;
+
+	iomap->bdev = APFS_NXI(sb)->nx_bdev;
+	iomap->flags = 0;
+
+	down_read(apfs_vol_sem(sb));
+
+	if (!ai->i_has_dstream || pos >= i_size_read(inode)) {
+		iomap->type = IOMAP_HOLE;
+		iomap->addr = IOMAP_NULL_ADDR;
+		iomap->offset = pos;
+		iomap->length = length;
+		goto out;
 	}
+
+	/* Delayed blocks have no extent records yet */
+	if (dstream->ds_delalloc_len && dsblock >= dstream->ds_delalloc_start) {
+		iomap->type = IOMAP_DELALLOC;
+		iomap->addr = IOMAP_NULL_ADDR;
+		iomap->offset = dstream->ds_delalloc_start << sb->s_blocksize_bits;
+		iomap->length = dstream->ds_delalloc_len << sb->s_blocksize_bits;
+		goto out;
+	}
+
+	err = apfs_extent_read(dstream, dsblock, &ext);
+	if (err) {
+		apfs_err(sb, "failed to map block 0x%llx of ino 0x%llx", dsblock, apfs_ino(inode));
+		goto out;
+	}
+
+	iomap->offset = ext.logical_addr;
+	iomap->length = ext.len;
+	if (apfs_ext_is_hole(&ext)) {
+		iomap->type = IOMAP_HOLE;
+		iomap->addr = IOMAP_NULL_ADDR;
+	} else {
+		iomap->type = IOMAP_MAPPED;
+		iomap->addr = ext.phys_block_num << sb->s_blocksize_bits;
+		if (dstream->ds_shared)
+			iomap->flags |= IOMAP_F_SHARED;
+	}
+
+out:
+	up_read(apfs_vol_sem(sb));
+	return err;
 }
+
+const struct iomap_ops apfs_iomap_ops = {
+	.iomap_begin	= apfs_iomap_begin,
+};
+
+#endif /* APFS_IOMAP */
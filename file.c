@@ -8,6 +8,9 @@
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
 #include <linux/splice.h>
 #endif
+#ifdef APFS_IOMAP
+#include <linux/iomap.h>
+#endif
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 17, 0)
 typedef int vm_fault_t;
 #endif
@@ -45,7 +48,7 @@ static vm_fault_t apfs_page_mkwrite(struct vm_fault *vmf)
 	err = apfs_transaction_start(sb, maxops);
 	if (err)
 		goto out;
-	apfs_inode_join_transaction(sb, inode);
+	apfs_inode_data_join_transaction(sb, inode);
 
 	err = apfs_inode_create_exclusive_dstream(inode);
 	if (err) {
@@ -85,7 +88,7 @@ static vm_fault_t apfs_page_mkwrite(struct vm_fault *vmf)
 		if (len > block_start) {
 			/* If it's not a hole, the fault read it already */
 			ASSERT(!buffer_mapped(bh) || buffer_uptodate(bh));
-			if (buffer_trans(bh))
+			if (buffer_trans(bh) || buffer_delay(bh))
 				continue;
 			clear_buffer_mapped(bh);
 		}
@@ -144,40 +147,186 @@ int apfs_file_mmap(struct file *file, struct vm_area_struct *vma)
 }
 
 /*
- * Just flush the whole transaction for now (TODO), since that's technically
- * correct and easy to implement.
+ * Commits the whole transaction, but only if it still holds changes to the
+ * inode that haven't reached the disk (as recorded in i_sync_xid and
+ * i_datasync_xid). Otherwise there is nothing to do.
  */
 int apfs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
 {
 	struct inode *inode = file->f_mapping->host;
 	struct super_block *sb = inode->i_sb;
 
+	/*
+	 * There is no intent log, so syncing means committing the whole
+	 * transaction. But the commits are deferred, and often the inode is
+	 * not part of the current one at all.
+	 */
+	if (!apfs_inode_needs_sync(inode, datasync))
+		return 0;
 	return apfs_sync_fs(sb, true /* wait */);
 }
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+/**
+ * apfs_file_open - Open a regular file
+ * @inode:	the inode
+ * @filp:	the file
+ *
+ * Keeps count of the open files for the inode, so that it can be compressed
+ * after the last close if the user asked for it. An inode may also have been
+ * compressed since the lookup that set up @filp, in which case the file gets
+ * switched to the compressed operations.
+ */
+static int apfs_file_open(struct inode *inode, struct file *filp)
+{
+	struct apfs_inode_info *ai = APFS_I(inode);
+	int err;
+
+	err = generic_file_open(inode, filp);
+	if (err)
+		return err;
+
+	inode_lock_shared(inode);
+	if (ai->i_bsd_flags & APFS_INOBSD_COMPRESSED) {
+		inode_unlock_shared(inode);
+		replace_fops(filp, &apfs_compress_file_operations);
+		return filp->f_op->open(inode, filp);
+	}
+	atomic_inc(&ai->i_open_count);
+	inode_unlock_shared(inode);
+	return 0;
+}
+
+/**
+ * apfs_file_release - Release a regular file
+ * @inode:	the inode
+ * @filp:	the file
+ */
+static int apfs_file_release(struct inode *inode, struct file *filp)
+{
+	struct apfs_inode_info *ai = APFS_I(inode);
+
+	/* Compressing the file may take a while, so leave it to a worker */
+	if (atomic_dec_and_test(&ai->i_open_count) && ai->i_compress_on_close)
+		apfs_compress_queue_inode(inode);
+	return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 3, 0)
+/**
+ * apfs_copy_file_range - Copy a range of bytes between two regular files
+ * @src_file:	source file
+ * @src_off:	offset in @src_file
+ * @dst_file:	destination file
+ * @dst_off:	offset in @dst_file
+ * @len:	number of bytes to copy
+ * @flags:	copy flags
+ *
+ * Block-aligned ranges inside a single volume get cloned, so that the copy
+ * only has to touch the metadata. Anything else, like an unaligned head or
+ * tail, is copied through the page cache.
+ */
 static ssize_t apfs_copy_file_range(struct file *src_file, loff_t src_off,
 				    struct file *dst_file, loff_t dst_off,
 				    size_t len, unsigned int flags)
 {
-	return (splice_copy_file_range(src_file, src_off,
-		dst_file, dst_off, len));
+	struct inode *src_inode = file_inode(src_file);
+	struct inode *dst_inode = file_inode(dst_file);
+	loff_t cloned;
+
+	if (src_inode->i_sb == dst_inode->i_sb && src_inode != dst_inode) {
+		cloned = apfs_remap_file_range(src_file, src_off, dst_file, dst_off,
+					       min_t(loff_t, MAX_RW_COUNT, len),
+					       REMAP_FILE_CAN_SHORTEN);
+		if (cloned > 0)
+			return cloned;
+		if (cloned != 0 && cloned != -EINVAL && cloned != -EOPNOTSUPP)
+			return cloned;
+	}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+	return splice_copy_file_range(src_file, src_off, dst_file, dst_off, len);
+#else
+	return generic_copy_file_range(src_file, src_off, dst_file, dst_off, len, flags);
+#endif
 }
 #endif
 
+#ifdef APFS_IOMAP
+
+/**
+ * apfs_file_read_iter - Read from a regular file
+ * @iocb:	kernel I/O control block
+ * @to:		destination for the data
+ *
+ * Direct reads get mapped by iomap, one extent at a time; the iomap code also
+ * takes care of writing back the dirty pages in the range first.
+ */
+static ssize_t apfs_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	ssize_t ret;
+
+	if (!(iocb->ki_flags & IOCB_DIRECT))
+		return generic_file_read_iter(iocb, to);
+	if (!iov_iter_count(to))
+		return 0;
+
+	inode_lock_shared(inode);
+	ret = iomap_dio_rw(iocb, to, &apfs_iomap_ops, NULL /* dops */, 0 /* dio_flags */, NULL /* private */, 0 /* done_before */);
+	inode_unlock_shared(inode);
+	return ret;
+}
+
+/**
+ * apfs_file_llseek - Seek in a regular file
+ * @file:	the file
+ * @offset:	offset to seek to
+ * @whence:	type of seek
+ */
+static loff_t apfs_file_llseek(struct file *file, loff_t offset, int whence)
+{
+	struct inode *inode = file_inode(file);
+
+	switch (whence) {
+	case SEEK_HOLE:
+		inode_lock_shared(inode);
+		offset = iomap_seek_hole(inode, offset, &apfs_iomap_ops);
+		inode_unlock_shared(inode);
+		break;
+	case SEEK_DATA:
+		inode_lock_shared(inode);
+		offset = iomap_seek_data(inode, offset, &apfs_iomap_ops);
+		inode_unlock_shared(inode);
+		break;
+	default:
+		return generic_file_llseek(file, offset, whence);
+	}
+
+	if (offset < 0)
+		return offset;
+	return vfs_setpos(file, offset, inode->i_sb->s_maxbytes);
+}
+
+#endif /* APFS_IOMAP */
+
 const struct file_operations apfs_file_operations = {
+#ifdef APFS_IOMAP
+	.llseek			= apfs_file_llseek,
+	.read_iter		= apfs_file_read_iter,
+#else
 	.llseek			= generic_file_llseek,
 	.read_iter		= generic_file_read_iter,
+#endif
 	.write_iter		= generic_file_write_iter,
 	.mmap			= apfs_file_mmap,
-	.open			= generic_file_open,
+	.open			= apfs_file_open,
+	.release		= apfs_file_release,
 	.fsync			= apfs_fsync,
+	.fallocate		= apfs_fallocate,
 	.unlocked_ioctl		= apfs_file_ioctl,
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 3, 0)
 	.copy_file_range	= apfs_copy_file_range,
-#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 3, 0)
-	.copy_file_range	= generic_copy_file_range,
 #endif
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
@@ -194,7 +343,15 @@ const struct file_operations apfs_file_operations = {
 	.splice_write		= iter_file_splice_write,
 };
 
-#if LINUX_VERSION_CODE == KERNEL_VERSION(5, 3, 0)
+#ifdef APFS_IOMAP
+static int apfs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo, u64 start, u64 len)
+{
+	/* The data of compressed files is not in the dstream */
+	if (APFS_I(inode)->i_bsd_flags & APFS_INOBSD_COMPRESSED)
+		return -EOPNOTSUPP;
+	return iomap_fiemap(inode, fieinfo, start, len, &apfs_iomap_ops);
+}
+#elif LINUX_VERSION_CODE == KERNEL_VERSION(5, 3, 0)
 /*
  * This is needed mainly to test clones with xfstests, so we only support the
  * kernel version I use during testing. TODO: support all kernel versions.
@@ -214,7 +371,7 @@ const struct inode_operations apfs_file_inode_operations = {
 	.fileattr_get	= apfs_fileattr_get,
 	.fileattr_set	= apfs_fileattr_set,
 #endif
-#if LINUX_VERSION_CODE == KERNEL_VERSION(5, 3, 0)
+#if defined(APFS_IOMAP) || LINUX_VERSION_CODE == KERNEL_VERSION(5, 3, 0)
 	.fiemap		= apfs_fiemap,
 #endif
 };
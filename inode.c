@@ -7,6 +7,7 @@
 #include <linux/buffer_head.h>
 #include <linux/mount.h>
 #include <linux/mpage.h>
+#include <linux/writeback.h>
 #include <linux/blk_types.h>
 #include "apfs.h"
 
@@ -143,6 +144,7 @@ int apfs_inode_create_exclusive_dstream(struct inode *inode)
 	}
 
 	dstream->ds_id = new_id;
+	apfs_extent_map_clear(dstream);
 	err = apfs_create_dstream_rec(dstream);
 	if (err) {
 		apfs_err(sb, "failed to create dstream for ino 0x%llx", apfs_ino(inode));
@@ -160,7 +162,7 @@ int apfs_inode_create_exclusive_dstream(struct inode *inode)
  * Does nothing if the record already exists.  TODO: support cloned files.
  * Returns 0 on success or a negative error code in case of failure.
  */
-static int apfs_inode_create_dstream_rec(struct inode *inode)
+int apfs_inode_create_dstream_rec(struct inode *inode)
 {
 	struct apfs_inode_info *ai = APFS_I(inode);
 	int err;
@@ -486,7 +488,7 @@ int __apfs_write_begin(struct file *file, struct address_space *mapping, loff_t
 	loff_t i_blks_end;
 	int err;
 
-	apfs_inode_join_transaction(sb, inode);
+	apfs_inode_data_join_transaction(sb, inode);
 
 	err = apfs_inode_create_dstream_rec(inode);
 	if (err) {
@@ -539,7 +541,8 @@ int __apfs_write_begin(struct file *file, struct address_space *mapping, loff_t
 	     block_start = block_end, bh = bh->b_this_page, ++iblock) {
 		block_end = block_start + blocksize;
 		if (to > block_start && from < block_end) {
-			if (buffer_trans(bh))
+			/* Delayed buffers have no block to move yet */
+			if (buffer_trans(bh) || buffer_delay(bh))
 				continue;
 			if (!buffer_mapped(bh)) {
 				err = __apfs_get_block(dstream, iblock, bh,
@@ -565,7 +568,7 @@ int __apfs_write_begin(struct file *file, struct address_space *mapping, loff_t
 		}
 	}
 
-	err = __block_write_begin(page, pos, len, apfs_get_new_block);
+	err = __block_write_begin(page, pos, len, apfs_get_delalloc_block);
 	if (err) {
 		apfs_err(sb, "CoW failed in inode 0x%llx", apfs_ino(inode));
 		goto out_put_page;
@@ -670,16 +673,111 @@ fail:
 	return err;
 }
 
+/**
+ * apfs_writepages - Allocate the delayed blocks of a file and commit them
+ * @mapping:	address space of the file
+ * @wbc:	writeback control
+ *
+ * Data pages are written by the transaction commit, never on their own, so
+ * this only gives the delayed blocks of the file their final location. Data
+ * integrity writeback also forces the commit.
+ */
+static int apfs_writepages(struct address_space *mapping, struct writeback_control *wbc)
+{
+	struct inode *inode = mapping->host;
+	struct super_block *sb = inode->i_sb;
+	struct apfs_dstream_info *dstream = &APFS_I(inode)->i_dstream;
+	struct apfs_max_ops maxops;
+	int err;
+
+	/*
+	 * Racy, but the commit will take care of any new delayed blocks. Data
+	 * integrity writeback must also commit any copy-on-write, because the
+	 * caller may read the new blocks directly from disk.
+	 */
+	if (sb->s_flags & SB_RDONLY)
+		return 0;
+	if (!READ_ONCE(dstream->ds_delalloc_len)) {
+		if (wbc->sync_mode != WB_SYNC_ALL || !apfs_inode_needs_sync(inode, true /* datasync */))
+			return 0;
+	}
+
+	maxops.cat = APFS_UPDATE_INODE_MAXOPS() + APFS_GET_NEW_BLOCK_MAXOPS();
+	maxops.blks = 0;
+
+	err = apfs_transaction_start(sb, maxops);
+	if (err)
+		return err;
+
+	err = apfs_dstream_flush_delalloc(dstream, NULL /* locked_page */);
+	if (err)
+		goto fail;
+
+	if (wbc->sync_mode == WB_SYNC_ALL)
+		APFS_NXI(sb)->nx_transaction.t_state |= APFS_NX_TRANS_FORCE_COMMIT;
+	err = apfs_transaction_commit(sb);
+	if (!err)
+		return 0;
+
+fail:
+	apfs_transaction_abort(sb);
+	return err;
+}
+
+#ifdef APFS_IOMAP
+/**
+ * apfs_direct_IO - Refuse direct I/O through the generic code
+ * @iocb:	kernel I/O control block
+ * @iter:	data for the I/O
+ *
+ * Direct reads are handled by apfs_file_read_iter(). Writes always need
+ * copy-on-write inside a transaction, so the generic code falls back to a
+ * buffered write, followed by writeback and invalidation of the range.
+ */
+static ssize_t apfs_direct_IO(struct kiocb *iocb, struct iov_iter *iter)
+{
+	return 0;
+}
+#endif
+
+/**
+ * apfs_page_is_pinned - Does this page have buffers that must stay around?
+ * @page: the page to check
+ *
+ * Buffers that are part of the transaction, or waiting for their allocation,
+ * are still needed by the next commit.
+ */
+static bool apfs_page_is_pinned(struct page *page)
+{
+	struct buffer_head *bh, *head;
+
+	if (!page_has_buffers(page))
+		return false;
+	bh = head = page_buffers(page);
+	do {
+		if (buffer_trans(bh) || buffer_delay(bh))
+			return true;
+		bh = bh->b_this_page;
+	} while (bh != head);
+	return false;
+}
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5, 18, 0)
-static void apfs_noop_invalidatepage(struct page *page, unsigned int offset, unsigned int length)
+static void apfs_invalidatepage(struct page *page, unsigned int offset, unsigned int length)
+{
+	if (!apfs_page_is_pinned(page))
+		block_invalidatepage(page, offset, length);
+}
 #else
-static void apfs_noop_invalidate_folio(struct folio *folio, size_t offset, size_t length)
-#endif
+static void apfs_invalidate_folio(struct folio *folio, size_t offset, size_t length)
 {
+	if (!apfs_page_is_pinned(&folio->page))
+		block_invalidate_folio(folio, offset, length);
 }
+#endif
 
 /* bmap is not implemented to avoid issues with CoW on swapfiles */
-static const struct address_space_operations apfs_aops = {
+const struct address_space_operations apfs_aops = {
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
 	.dirty_folio	= block_dirty_folio,
 #elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 14, 0)
@@ -700,12 +798,16 @@ static const struct address_space_operations apfs_aops = {
 
 	.write_begin	= apfs_write_begin,
 	.write_end	= apfs_write_end,
+	.writepages	= apfs_writepages,
+#ifdef APFS_IOMAP
+	.direct_IO	= apfs_direct_IO,
+#endif
 
-	/* The intention is to keep bhs around until the transaction is over */
+	/* Keep the bhs around until the transaction is over */
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5, 18, 0)
-	.invalidatepage	= apfs_noop_invalidatepage,
+	.invalidatepage	= apfs_invalidatepage,
 #else
-	.invalidate_folio = apfs_noop_invalidate_folio,
+	.invalidate_folio = apfs_invalidate_folio,
 #endif
 };
 
@@ -729,6 +831,11 @@ static void apfs_inode_set_ops(struct inode *inode, dev_t rdev, bool compressed)
 		} else {
 			inode->i_fop = &apfs_file_operations;
 			inode->i_mapping->a_ops = &apfs_aops;
+#ifdef APFS_LARGE_BLOCKS
+			/* Each folio must cover at least one whole block */
+			if (inode->i_blkbits > PAGE_SHIFT)
+				mapping_set_folio_min_order(inode->i_mapping, inode->i_blkbits - PAGE_SHIFT);
+#endif
 		}
 		break;
 	case S_IFDIR:
@@ -993,7 +1100,6 @@ fail:
 struct inode *apfs_iget(struct super_block *sb, u64 cnid)
 {
 	struct apfs_sb_info *sbi = APFS_SB(sb);
-	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
 	struct inode *inode;
 	struct apfs_query *query;
 	int err;
@@ -1004,7 +1110,7 @@ struct inode *apfs_iget(struct super_block *sb, u64 cnid)
 	if (!(inode->i_state & I_NEW))
 		return inode;
 
-	down_read(&nxi->nx_big_sem);
+	down_read(apfs_vol_sem(sb));
 	query = apfs_inode_lookup(inode);
 	if (IS_ERR(query)) {
 		err = PTR_ERR(query);
@@ -1022,7 +1128,7 @@ struct inode *apfs_iget(struct super_block *sb, u64 cnid)
 		apfs_err(sb, "refcnt check failed for ino 0x%llx", cnid);
 		goto fail;
 	}
-	up_read(&nxi->nx_big_sem);
+	up_read(apfs_vol_sem(sb));
 
 	/* Allow the user to override the ownership */
 	if (uid_valid(sbi->s_uid))
@@ -1035,7 +1141,7 @@ struct inode *apfs_iget(struct super_block *sb, u64 cnid)
 	return inode;
 
 fail:
-	up_read(&nxi->nx_big_sem);
+	up_read(apfs_vol_sem(sb));
 	iget_failed(inode);
 	return ERR_PTR(err);
 }
@@ -1448,6 +1554,7 @@ int apfs_update_inode(struct inode *inode, char *new_name)
 	struct apfs_inode_val *inode_raw;
 	int err;
 
+	ai->i_sync_xid = APFS_NXI(sb)->nx_xid;
 	err = apfs_flush_extent_cache(dstream);
 	if (err) {
 		apfs_err(sb, "extent cache flush failed for inode 0x%llx", apfs_ino(inode));
@@ -1540,6 +1647,73 @@ int APFS_UPDATE_INODE_MAXOPS(void)
 	return APFS_INODE_RENAME_MAXOPS + APFS_INODE_RESIZE_MAXOPS + 1;
 }
 
+/**
+ * apfs_inode_drop_dstream - Remove the data stream of an inode
+ * @inode: the vfs inode, with a dstream that is not shared
+ *
+ * Frees all the extents and deletes both the dstream record and its xfield,
+ * for when the data of @inode is about to be stored somewhere else. Returns 0
+ * on success or a negative error code in case of failure.
+ */
+int apfs_inode_drop_dstream(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct apfs_inode_info *ai = APFS_I(inode);
+	struct apfs_dstream_info *dstream = &ai->i_dstream;
+	struct apfs_query *query = NULL;
+	struct apfs_inode_val *new_val = NULL;
+	char *raw = NULL;
+	int xlen;
+	int err;
+
+	if (!ai->i_has_dstream)
+		return 0;
+	ASSERT(!dstream->ds_shared);
+
+	err = apfs_truncate(dstream, 0);
+	if (err) {
+		apfs_err(sb, "truncation failed for ino 0x%llx", apfs_ino(inode));
+		return err;
+	}
+	dstream->ds_size = 0;
+
+	err = apfs_put_dstream_rec(dstream);
+	if (err) {
+		apfs_err(sb, "failed to put dstream for ino 0x%llx", apfs_ino(inode));
+		return err;
+	}
+
+	query = apfs_inode_lookup(inode);
+	if (IS_ERR(query)) {
+		apfs_err(sb, "lookup failed for ino 0x%llx", apfs_ino(inode));
+		return PTR_ERR(query);
+	}
+	raw = query->node->object.data;
+	new_val = kmemdup(raw + query->off, query->len, GFP_KERNEL);
+	if (!new_val) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	xlen = apfs_remove_xfield(new_val->xfields, query->len - sizeof(*new_val), APFS_INO_EXT_TYPE_DSTREAM);
+	if (!xlen) {
+		apfs_err(sb, "bad xfields on inode 0x%llx", apfs_ino(inode));
+		err = -EFSCORRUPTED;
+		goto fail;
+	}
+	err = apfs_btree_replace(query, NULL /* key */, 0 /* key_len */, new_val, sizeof(*new_val) + xlen);
+	if (err) {
+		apfs_err(sb, "update failed for ino 0x%llx", apfs_ino(inode));
+		goto fail;
+	}
+	ai->i_has_dstream = false;
+
+fail:
+	kfree(new_val);
+	apfs_free_query(query);
+	return err;
+}
+
 /**
  * apfs_delete_inode - Delete an inode record
  * @inode: the vfs inode to delete
@@ -1624,6 +1798,80 @@ static int apfs_delete_inode(struct inode *inode)
 }
 #define APFS_DELETE_INODE_MAXOPS	1
 
+/*
+ * An orphan that was evicted from the inode cache during this mount, with its
+ * data still waiting to be deleted.
+ */
+struct apfs_orphan_entry {
+	struct list_head list;
+	u64 ino;
+};
+
+/* Time the cleanup worker may hold on to the filesystem before yielding */
+#define APFS_ORPHAN_CLEANUP_SLICE	(HZ / 10)
+
+/**
+ * apfs_orphan_queue_push - Add an orphan to the queue of pending cleanups
+ * @sb:		filesystem superblock
+ * @ino:	inode number for the orphan
+ *
+ * Orphans stay in the private directory until deleted in full, so this queue
+ * only saves the directory scan and nothing gets lost if the push is skipped.
+ */
+static void apfs_orphan_queue_push(struct super_block *sb, u64 ino)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_orphan_entry *entry;
+
+	entry = kmalloc(sizeof(*entry), GFP_NOFS);
+	if (!entry)
+		return;
+	entry->ino = ino;
+
+	spin_lock(&sbi->s_orphan_lock);
+	list_add_tail(&entry->list, &sbi->s_orphan_queue);
+	spin_unlock(&sbi->s_orphan_lock);
+}
+
+/**
+ * apfs_orphan_queue_pop - Take the next orphan from the queue
+ * @sb:		filesystem superblock
+ * @ino_p:	on return, the inode number for the orphan
+ *
+ * Returns 0 on success, or -ENODATA if the queue is empty.
+ */
+static int apfs_orphan_queue_pop(struct super_block *sb, u64 *ino_p)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_orphan_entry *entry;
+
+	spin_lock(&sbi->s_orphan_lock);
+	entry = list_first_entry_or_null(&sbi->s_orphan_queue, struct apfs_orphan_entry, list);
+	if (entry)
+		list_del(&entry->list);
+	spin_unlock(&sbi->s_orphan_lock);
+
+	if (!entry)
+		return -ENODATA;
+	*ino_p = entry->ino;
+	kfree(entry);
+	return 0;
+}
+
+/**
+ * apfs_orphan_queue_drop - Forget all pending orphan cleanups
+ * @sb: filesystem superblock
+ *
+ * Must only be called once the cleanup worker is done for good.
+ */
+void apfs_orphan_queue_drop(struct super_block *sb)
+{
+	u64 ino;
+
+	while (apfs_orphan_queue_pop(sb, &ino) == 0)
+		;
+}
+
 /**
  * apfs_clean_single_orphan - Clean the given orphan file
  * @inode:	inode for the file to clean
@@ -1655,6 +1903,7 @@ static int apfs_clean_single_orphan(struct inode *inode)
 			apfs_err(sb, "failed to unlink orphan 0x%llx", ino);
 			goto fail;
 		}
+		apfs_nx_stat_inc(APFS_NXI(sb), orphans_cleaned);
 	}
 	err = apfs_transaction_commit(sb);
 	if (err)
@@ -1670,20 +1919,27 @@ fail:
  * apfs_clean_any_orphan - Pick an orphan and delete as much as reasonable
  * @sb:		filesystem superblock
  *
+ * Orphans evicted during this mount are taken from the queue first; the rest
+ * are leftovers from earlier mounts, found by scanning the private directory.
+ * Files that can't be deleted in full get queued again on eviction, behind
+ * the others.
+ *
  * Returns 0 on success, or a negative error code in case of failure, which may
  * be -ENODATA if there are no more orphan files or -EAGAIN if a file could not
  * be deleted in full.
  */
 static int apfs_clean_any_orphan(struct super_block *sb)
 {
-	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
 	struct inode *inode = NULL;
 	int err;
 	u64 ino;
 
-	down_read(&nxi->nx_big_sem);
-	err = apfs_any_orphan_ino(sb, &ino);
-	up_read(&nxi->nx_big_sem);
+	err = apfs_orphan_queue_pop(sb, &ino);
+	if (err) {
+		down_read(apfs_vol_sem(sb));
+		err = apfs_any_orphan_ino(sb, &ino);
+		up_read(apfs_vol_sem(sb));
+	}
 	if (err) {
 		if (err == -ENODATA)
 			return -ENODATA;
@@ -1706,6 +1962,7 @@ static int apfs_clean_any_orphan(struct super_block *sb)
 		return 0;
 	}
 
+	/* The final iput() will queue it again */
 	if (atomic_read(&inode->i_count) > 1)
 		goto out;
 	err = apfs_clean_single_orphan(inode);
@@ -1719,33 +1976,35 @@ out:
 }
 
 /**
- * apfs_clean_orphans - Delete as many orphan files as is reasonable
+ * apfs_clean_orphans - Delete orphan files for a single time slice
  * @sb: filesystem superblock
  *
+ * Each step of the cleanup runs in a transaction of its own, so foreground
+ * operations get a chance at the locks in between. The worker still gives
+ * the cpu back regularly, and requeues itself to continue later.
+ *
  * Returns 0 on success or a negative error code in case of failure.
  */
 static int apfs_clean_orphans(struct super_block *sb)
 {
-	int ret, i;
+	unsigned long deadline = jiffies + APFS_ORPHAN_CLEANUP_SLICE;
+	int ret;
 
-	for (i = 0; i < 100; ++i) {
+	do {
 		ret = apfs_clean_any_orphan(sb);
-		if (ret) {
-			if (ret == -ENODATA)
-				return 0;
-			if (ret == -EAGAIN)
-				break;
+		if (ret == -ENODATA)
+			return 0;
+		if (ret && ret != -EAGAIN) {
 			apfs_err(sb, "failed to delete an orphan file");
 			return ret;
 		}
-	}
+		/* Don't keep going if someone is trying to unmount */
+		if (atomic_read(&sb->s_active) == 0)
+			return 0;
+		cond_resched();
+	} while (time_before(jiffies, deadline));
 
-	/*
-	 * If a file is too big, or if there are too many files, take a break
-	 * and continue later.
-	 */
-	if (atomic_read(&sb->s_active) != 0)
-		schedule_work(&APFS_SB(sb)->s_orphan_cleanup_work);
+	schedule_work(&APFS_SB(sb)->s_orphan_cleanup_work);
 	return 0;
 }
 
@@ -1768,11 +2027,14 @@ void apfs_evict_inode(struct inode *inode)
 
 	/*
 	 * If the inode still has extents then schedule cleanup for the rest
-	 * of it. Not during unmount though: completing all cleanup could take
-	 * a while so just leave future mounts to handle the orphans.
+	 * of it, so that the final unlink or close returns right away. Not
+	 * during unmount though: completing all cleanup could take a while so
+	 * just leave future mounts to handle the orphans.
 	 */
-	if (atomic_read(&sb->s_active))
+	if (atomic_read(&sb->s_active)) {
+		apfs_orphan_queue_push(sb, apfs_ino(inode));
 		schedule_work(&APFS_SB(sb)->s_orphan_cleanup_work);
+	}
 out:
 	truncate_inode_pages_final(&inode->i_data);
 	clear_inode(inode);
@@ -1840,6 +2102,7 @@ struct inode *apfs_new_inode(struct inode *dir, umode_t mode, dev_t rdev)
 		return ERR_PTR(-ENOMEM);
 	ai = APFS_I(inode);
 	dstream = &ai->i_dstream;
+	ai->i_sync_xid = ai->i_datasync_xid = APFS_NXI(sb)->nx_xid;
 
 	cnid = le64_to_cpu(vsb_raw->apfs_next_obj_id);
 	le64_add_cpu(&vsb_raw->apfs_next_obj_id, 1);
@@ -1963,7 +2226,7 @@ int APFS_CREATE_INODE_REC_MAXOPS(void)
  *
  * Returns 0 on success or a negative error code in case of failure.
  */
-static int apfs_setsize(struct inode *inode, loff_t new_size)
+int apfs_setsize(struct inode *inode, loff_t new_size)
 {
 	struct super_block *sb = inode->i_sb;
 	struct apfs_dstream_info *dstream = &APFS_I(inode)->i_dstream;
@@ -1971,6 +2234,7 @@ static int apfs_setsize(struct inode *inode, loff_t new_size)
 
 	if (new_size == inode->i_size)
 		return 0;
+	apfs_inode_data_join_transaction(sb, inode);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 6, 0)
 	inode->i_mtime = inode->i_ctime = current_time(inode);
 #elif LINUX_VERSION_CODE < KERNEL_VERSION(6, 7, 0)
@@ -2102,7 +2366,6 @@ static int apfs_ioc_set_dflt_pfk(struct file *file, void __user *user_pfk)
 	struct inode *inode = file_inode(file);
 	struct super_block *sb = inode->i_sb;
 	struct apfs_sb_info *sbi = APFS_SB(sb);
-	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
 	struct apfs_wrapped_crypto_state pfk_hdr;
 	struct apfs_crypto_state_val *pfk;
 	unsigned int key_len;
@@ -2121,13 +2384,13 @@ static int apfs_ioc_set_dflt_pfk(struct file *file, void __user *user_pfk)
 	}
 	pfk->refcnt = cpu_to_le32(1);
 
-	down_write(&nxi->nx_big_sem);
+	down_write(apfs_vol_sem(sb));
 
 	if (sbi->s_dflt_pfk)
 		kfree(sbi->s_dflt_pfk);
 	sbi->s_dflt_pfk = pfk;
 
-	up_write(&nxi->nx_big_sem);
+	up_write(apfs_vol_sem(sb));
 
 	return 0;
 }
@@ -2236,7 +2499,6 @@ static int apfs_ioc_get_pfk(struct file *file, void __user *user_pfk)
 {
 	struct inode *inode = file_inode(file);
 	struct super_block *sb = inode->i_sb;
-	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
 	struct apfs_wrapped_crypto_state pfk_hdr;
 	struct apfs_crypto_state_val *pfk;
 	unsigned int max_len, key_len;
@@ -2252,13 +2514,13 @@ static int apfs_ioc_get_pfk(struct file *file, void __user *user_pfk)
 	if (!pfk)
 		return -ENOMEM;
 
-	down_read(&nxi->nx_big_sem);
+	down_read(apfs_vol_sem(sb));
 
 	err = apfs_crypto_get_key(sb, dstream->ds_id, pfk, max_len);
 	if (err)
 		goto fail;
 
-	up_read(&nxi->nx_big_sem);
+	up_read(apfs_vol_sem(sb));
 
 	key_len = le16_to_cpu(pfk->state.key_len);
 	if (__copy_to_user(user_pfk, &pfk->state, sizeof(pfk_hdr) + key_len)) {
@@ -2270,7 +2532,7 @@ static int apfs_ioc_get_pfk(struct file *file, void __user *user_pfk)
 	return 0;
 
 fail:
-	up_read(&nxi->nx_big_sem);
+	up_read(apfs_vol_sem(sb));
 	kfree(pfk);
 	return err;
 }
@@ -2298,9 +2560,36 @@ static unsigned int apfs_getflags(struct inode *inode)
 		flags |= FS_IMMUTABLE_FL;
 	if (ai->i_bsd_flags & APFS_INOBSD_NODUMP)
 		flags |= FS_NODUMP_FL;
+	/* Files ask for compression before they get it */
+	if (ai->i_bsd_flags & APFS_INOBSD_COMPRESSED || ai->i_compress_on_close)
+		flags |= FS_COMPR_FL;
 	return flags;
 }
 
+/**
+ * apfs_check_setflags - Check that an inode can take the given flags
+ * @inode: the vfs inode, locked
+ * @flags: flags to set, in FS_IOC_SETFLAGS format
+ *
+ * Returns 0 if the flags are supported, or -EOPNOTSUPP otherwise.
+ */
+static int apfs_check_setflags(struct inode *inode, unsigned int flags)
+{
+	struct apfs_inode_info *ai = APFS_I(inode);
+
+	if (flags & ~(FS_APPEND_FL | FS_IMMUTABLE_FL | FS_NODUMP_FL | FS_COMPR_FL))
+		return -EOPNOTSUPP;
+
+	/* Compression needs an algorithm, and it can't be undone here */
+	if (flags & FS_COMPR_FL) {
+		if (!S_ISREG(inode->i_mode) || !APFS_SB(inode->i_sb)->s_compress_algo)
+			return -EOPNOTSUPP;
+	} else if (ai->i_bsd_flags & APFS_INOBSD_COMPRESSED) {
+		return -EOPNOTSUPP;
+	}
+	return 0;
+}
+
 /**
  * apfs_setflags - Set an inode's bsd flags
  * @inode: the vfs inode
@@ -2330,6 +2619,10 @@ static void apfs_setflags(struct inode *inode, unsigned int flags)
 	else
 		ai->i_bsd_flags &= ~APFS_INOBSD_NODUMP;
 
+	/* The request is kept in memory, until the last close queues the file */
+	if (!(ai->i_bsd_flags & APFS_INOBSD_COMPRESSED))
+		ai->i_compress_on_close = flags & FS_COMPR_FL;
+
 	inode_set_flags(inode, i_flags, S_IMMUTABLE | S_APPEND);
 }
 
@@ -2365,6 +2658,10 @@ static int apfs_do_ioc_setflags(struct inode *inode, unsigned int newflags)
 
 	lockdep_assert_held_write(&inode->i_rwsem);
 
+	err = apfs_check_setflags(inode, newflags);
+	if (err)
+		return err;
+
 	oldflags = apfs_getflags(inode);
 	err = vfs_ioc_setflags_prepare(inode, oldflags, newflags);
 	if (err)
@@ -2413,9 +2710,6 @@ static int apfs_ioc_setflags(struct file *file, int __user *arg)
 	if (get_user(newflags, arg))
 		return -EFAULT;
 
-	if (newflags & ~(FS_APPEND_FL | FS_IMMUTABLE_FL | FS_NODUMP_FL))
-		return -EOPNOTSUPP;
-
 	err = mnt_want_write_file(file);
 	if (err)
 		return err;
@@ -2448,13 +2742,15 @@ int apfs_fileattr_set(struct user_namespace *mnt_userns, struct dentry *dentry,
 	if (sb->s_flags & SB_RDONLY)
 		return -EROFS;
 
-	if (fa->flags & ~(FS_APPEND_FL | FS_IMMUTABLE_FL | FS_NODUMP_FL))
-		return -EOPNOTSUPP;
 	if (fileattr_has_fsx(fa))
 		return -EOPNOTSUPP;
 
 	lockdep_assert_held_write(&inode->i_rwsem);
 
+	err = apfs_check_setflags(inode, fa->flags);
+	if (err)
+		return err;
+
 	maxops.cat = APFS_UPDATE_INODE_MAXOPS();
 	maxops.blks = 0;
 	err = apfs_transaction_start(sb, maxops);
@@ -2491,13 +2787,15 @@ int apfs_fileattr_set(struct mnt_idmap *idmap, struct dentry *dentry, struct fil
 	if (sb->s_flags & SB_RDONLY)
 		return -EROFS;
 
-	if (fa->flags & ~(FS_APPEND_FL | FS_IMMUTABLE_FL | FS_NODUMP_FL))
-		return -EOPNOTSUPP;
 	if (fileattr_has_fsx(fa))
 		return -EOPNOTSUPP;
 
 	lockdep_assert_held_write(&inode->i_rwsem);
 
+	err = apfs_check_setflags(inode, fa->flags);
+	if (err)
+		return err;
+
 	maxops.cat = APFS_UPDATE_INODE_MAXOPS();
 	maxops.blks = 0;
 	err = apfs_transaction_start(sb, maxops);
@@ -2541,6 +2839,10 @@ long apfs_dir_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		return apfs_ioc_get_class(file, argp);
 	case APFS_IOC_TAKE_SNAPSHOT:
 		return apfs_ioc_take_snapshot(file, argp);
+	case APFS_IOC_READDIRPLUS:
+		return apfs_ioc_readdirplus(file, argp);
+	case APFS_IOC_SNAP_DIFF:
+		return apfs_ioc_snap_diff(file, argp);
 	default:
 		return -ENOTTY;
 	}
@@ -8,7 +8,9 @@
  * decompression code is included.
  */
 
+#include <linux/bitops.h>
 #include <linux/errno.h>
+#include <linux/init.h>
 #include <linux/string.h>
 #include "libzbitmap.h"
 
@@ -158,6 +160,41 @@ static void zbm_rewind_nibble(struct nybl_ptr *nybl)
     }
 }
 
+/*
+ * Apply a bitmap to a full group of eight bytes. The bounds checks are done
+ * once for the whole group, so the common all-literal and all-match cases
+ * become a single copy.
+ */
+static int zbm_apply_full_bitmap(struct zbm_state *state, uint8_t map)
+{
+    int i;
+
+    if(state->data + hweight8(map) > state->src_end)
+        return -EINVAL;
+    /* The first match is the one that needs the longest history */
+    if(map != 0xff && state->prewritten + state->written + __ffs(~map & 0xff) < state->period)
+        return -EINVAL;
+
+    if(map == 0xff) {
+        memcpy(state->dest, state->data, 8);
+        state->data += 8;
+    } else if(map == 0 && state->period >= 8) {
+        memcpy(state->dest, state->dest - state->period, 8);
+    } else {
+        for(i = 0; i < 8; ++i) {
+            if(map & 1 << i)
+                state->dest[i] = *state->data++;
+            else
+                state->dest[i] = state->dest[i - state->period];
+        }
+    }
+
+    state->dest += 8;
+    state->dest_left -= 8;
+    state->written += 8;
+    return 0;
+}
+
 static int zbm_apply_bitmap(struct zbm_state *state, struct zbm_bmap *bitmap)
 {
     int i;
@@ -175,6 +212,9 @@ static int zbm_apply_bitmap(struct zbm_state *state, struct zbm_bmap *bitmap)
     if(state->period == 0)
         return -EINVAL;
 
+    if(state->decmp_len - state->written >= 8)
+        return zbm_apply_full_bitmap(state, bitmap->bitmap);
+
     for(i = 0; i < 8; ++i) {
         if(state->written == state->decmp_len)
             break;
@@ -442,3 +482,44 @@ int zbm_decompress(void *dest, size_t dest_size, const void *src, size_t src_siz
     *out_len = state.prewritten;
     return 0;
 }
+
+int __init zbm_selftest(void)
+{
+    struct zbm_state state = {0};
+    uint8_t fast[24], slow[24], data[8];
+    const uint8_t *next;
+    int map, period, i;
+
+    for(i = 0; i < 8; ++i)
+        data[i] = 0xa0 + i;
+
+    for(period = 1; period <= 16; ++period) {
+        for(map = 0; map < 256; ++map) {
+            for(i = 0; i < 24; ++i)
+                fast[i] = slow[i] = i * 7 + 1;
+
+            state.dest = fast + 16;
+            state.dest_left = 8;
+            state.written = 0;
+            state.prewritten = 16;
+            state.period = period;
+            state.data = data;
+            state.src_end = data + sizeof(data);
+            if(zbm_apply_full_bitmap(&state, map))
+                return -EINVAL;
+
+            /* The byte loop that the grouped copies replaced */
+            next = data;
+            for(i = 0; i < 8; ++i) {
+                if(map & 1 << i)
+                    slow[16 + i] = *next++;
+                else
+                    slow[16 + i] = slow[16 + i - period];
+            }
+
+            if(memcmp(fast, slow, sizeof(fast)) || state.data != next)
+                return -EINVAL;
+        }
+    }
+    return 0;
+}
@@ -28,4 +28,12 @@
  */
 int zbm_decompress(void *dest, size_t dest_size, const void *src, size_t src_size, size_t *out_len);
 
+/**
+ * zbm_selftest - Check the grouped bitmap copies against the byte loop
+ *
+ * Returns 0 if the outputs match for all bitmaps and short periods, or -EINVAL
+ * otherwise.
+ */
+int zbm_selftest(void);
+
 #endif /* _LIBZBITMAP_H */
@@ -202,7 +202,9 @@ static int lzfse_decode_lmd(lzfse_decoder_state *s) {
       return LZFSE_STATUS_ERROR;
     }
     L = fse_value_decode(&l_state, bs->l_decoder, &in);
-    if ((lit + L) >= (bs->literals + LZFSE_LITERALS_PER_BLOCK + 64)) {
+    //  Valid blocks never go past LZFSE_LITERALS_PER_BLOCK; the limit leaves
+    //  room in the padding for the 16-byte copies to slop over.
+    if ((lit + L) >= (bs->literals + LZFSE_LITERALS_PER_BLOCK + 64 - 16)) {
       return LZFSE_STATUS_ERROR;
     }
     res = fse_in_flush2(&in, &src, src_start);
@@ -228,10 +230,10 @@ static int lzfse_decode_lmd(lzfse_decoder_state *s) {
     if (L + M <= remaining_bytes) {
       size_t i;
       //  If we have plenty of space remaining, we can copy the literal
-      //  and match with 16- and 32-byte operations, without worrying
+      //  and match with 8- and 16-byte operations, without worrying
       //  about writing off the end of the buffer.
       remaining_bytes -= L + M;
-      copy(dst, lit, L);
+      copy_wide(dst, lit, L);
       dst += L;
       lit += L;
       //  For the match, we have two paths; a fast copy by 16-bytes if
@@ -239,8 +241,12 @@ static int lzfse_decode_lmd(lzfse_decoder_state *s) {
       //  careful path that applies a permutation to account for the
       //  possible overlap between source and destination if the distance
       //  is small.
-      if (D >= 8 || D >= M)
+      if (D >= 16)
+        copy_wide(dst, dst - D, M);
+      else if (D >= 8 || D >= M)
         copy(dst, dst - D, M);
+      else if (M > 8)
+        copy_short_distance(dst, D, M);
       else
         for (i = 0; i < M; i++)
           dst[i] = dst[i - D];
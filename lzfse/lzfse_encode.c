@@ -21,10 +21,11 @@ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSI
 
 // LZFSE encode API
 
+#include <linux/slab.h>
 #include "lzfse.h"
 #include "lzfse_internal.h"
 
-size_t lzfse_encode_scratch_size() {
+size_t lzfse_encode_scratch_size(void) {
   size_t s1 = sizeof(lzfse_encoder_state);
   size_t s2 = lzvn_encode_scratch_size();
   return (s1 > s2) ? s1 : s2; // max(lzfse,lzvn)
@@ -44,10 +45,13 @@ size_t lzfse_encode_buffer_with_scratch(uint8_t *__restrict dst_buffer,
   if (src_size < LZFSE_ENCODE_LZVN_THRESHOLD) {
     // need header + end-of-stream marker
     size_t extra_size = 4 + sizeof(lzvn_compressed_block_header);
+    lzvn_compressed_block_header header;
+    size_t sz;
+
     if (dst_size <= extra_size)
       goto try_uncompressed; // DST is really too small, give up
 
-    size_t sz = lzvn_encode_buffer(
+    sz = lzvn_encode_buffer(
         dst_buffer + sizeof(lzvn_compressed_block_header),
         dst_size - extra_size, src_buffer, src_size, scratch_buffer);
     if (sz == 0 || sz >= src_size)
@@ -56,7 +60,6 @@ size_t lzfse_encode_buffer_with_scratch(uint8_t *__restrict dst_buffer,
 
     // If we could encode, setup header and end-of-stream marker (we left room
     // for them, no need to test)
-    lzvn_compressed_block_header header;
     header.magic = LZFSE_COMPRESSEDLZVN_BLOCK_MAGIC;
     header.n_raw_bytes = (uint32_t)src_size;
     header.n_payload_bytes = (uint32_t)sz;
@@ -149,7 +152,7 @@ size_t lzfse_encode_buffer(uint8_t *__restrict dst_buffer, size_t dst_size,
   // Deal with the possible NULL pointer
   if (scratch_buffer == NULL) {
     // +1 in case scratch size could be zero
-    scratch_buffer = malloc(lzfse_encode_scratch_size() + 1);
+    scratch_buffer = kvmalloc(lzfse_encode_scratch_size() + 1, GFP_KERNEL);
     has_malloc = 1;
   }
   if (scratch_buffer == NULL)
@@ -158,6 +161,6 @@ size_t lzfse_encode_buffer(uint8_t *__restrict dst_buffer, size_t dst_size,
                         dst_size, src_buffer,
                         src_size, scratch_buffer);
   if (has_malloc)
-    free(scratch_buffer);
+    kvfree(scratch_buffer);
   return ret;
 }
@@ -118,7 +118,10 @@ lzfse_encode_v1_freq_table(lzfse_compressed_block_header_v2 *out,
                                           // will not be modified, so this code
                                           // will remain valid)
   uint8_t *dst = &(out->freq[0]);
-  for (int i = 0; i < LZFSE_ENCODE_L_SYMBOLS + LZFSE_ENCODE_M_SYMBOLS +
+  uint32_t header_size;
+  int i;
+
+  for (i = 0; i < LZFSE_ENCODE_L_SYMBOLS + LZFSE_ENCODE_M_SYMBOLS +
                           LZFSE_ENCODE_D_SYMBOLS + LZFSE_ENCODE_LITERAL_SYMBOLS;
        i++) {
     // Encode one value to accum
@@ -142,7 +145,7 @@ lzfse_encode_v1_freq_table(lzfse_compressed_block_header_v2 *out,
   }
 
   // Return final size of out
-  uint32_t header_size = (uint32_t)(dst - (uint8_t *)out);
+  header_size = (uint32_t)(dst - (uint8_t *)out);
   out->packed_fields[0] = 0;
   out->packed_fields[1] = 0;
   out->packed_fields[2] = setField(header_size, 0, 32);
@@ -166,24 +169,27 @@ lzfse_encode_v1_freq_table(lzfse_compressed_block_header_v2 *out,
  * @return LZFSE_STATUS_DST_FULL and restore initial state if output buffer is
  * full. */
 static int lzfse_encode_matches(lzfse_encoder_state *s) {
-  if (s->n_literals == 0 && s->n_matches == 0)
-    return LZFSE_STATUS_OK; // nothing to store, OK
-
-  uint32_t l_occ[LZFSE_ENCODE_L_SYMBOLS];
-  uint32_t m_occ[LZFSE_ENCODE_M_SYMBOLS];
-  uint32_t d_occ[LZFSE_ENCODE_D_SYMBOLS];
-  uint32_t literal_occ[LZFSE_ENCODE_LITERAL_SYMBOLS];
-  fse_encoder_entry l_encoder[LZFSE_ENCODE_L_SYMBOLS];
-  fse_encoder_entry m_encoder[LZFSE_ENCODE_M_SYMBOLS];
-  fse_encoder_entry d_encoder[LZFSE_ENCODE_D_SYMBOLS];
-  fse_encoder_entry literal_encoder[LZFSE_ENCODE_LITERAL_SYMBOLS];
+  uint32_t *l_occ = s->l_occ;
+  uint32_t *m_occ = s->m_occ;
+  uint32_t *d_occ = s->d_occ;
+  uint32_t *literal_occ = s->literal_occ;
+  fse_encoder_entry *l_encoder = s->l_encoder;
+  fse_encoder_entry *m_encoder = s->m_encoder;
+  fse_encoder_entry *d_encoder = s->d_encoder;
+  fse_encoder_entry *literal_encoder = s->literal_encoder;
   int ok = 1;
   lzfse_compressed_block_header_v1 header1 = {0};
   lzfse_compressed_block_header_v2 *header2 = 0;
-
   // Keep initial state to be able to restore it if DST full
   uint8_t *dst0 = s->dst;
   uint32_t n_literals0 = s->n_literals;
+  uint32_t d_prev = 0;
+  uint32_t l_sum = 0;
+  uint32_t m_sum = 0;
+  uint32_t i;
+
+  if (s->n_literals == 0 && s->n_matches == 0)
+    return LZFSE_STATUS_OK; // nothing to store, OK
 
   // Add 0x00 literals until n_literals multiple of 4, since we encode 4
   // interleaved literal streams.
@@ -193,8 +199,7 @@ static int lzfse_encode_matches(lzfse_encoder_state *s) {
   }
 
   // Encode previous distance
-  uint32_t d_prev = 0;
-  for (uint32_t i = 0; i < s->n_matches; i++) {
+  for (i = 0; i < s->n_matches; i++) {
     uint32_t d = s->d_values[i];
     if (d == d_prev)
       s->d_values[i] = 0;
@@ -203,27 +208,25 @@ static int lzfse_encode_matches(lzfse_encoder_state *s) {
   }
 
   // Clear occurrence tables
-  memset(l_occ, 0, sizeof(l_occ));
-  memset(m_occ, 0, sizeof(m_occ));
-  memset(d_occ, 0, sizeof(d_occ));
-  memset(literal_occ, 0, sizeof(literal_occ));
+  memset(s->l_occ, 0, sizeof(s->l_occ));
+  memset(s->m_occ, 0, sizeof(s->m_occ));
+  memset(s->d_occ, 0, sizeof(s->d_occ));
+  memset(s->literal_occ, 0, sizeof(s->literal_occ));
 
   // Update occurrence tables in all 4 streams (L,M,D,literals)
-  uint32_t l_sum = 0;
-  uint32_t m_sum = 0;
-  for (uint32_t i = 0; i < s->n_matches; i++) {
+  for (i = 0; i < s->n_matches; i++) {
     uint32_t l = s->l_values[i];
     l_sum += l;
     l_occ[l_base_from_value(l)]++;
   }
-  for (uint32_t i = 0; i < s->n_matches; i++) {
+  for (i = 0; i < s->n_matches; i++) {
     uint32_t m = s->m_values[i];
     m_sum += m;
     m_occ[m_base_from_value(m)]++;
   }
-  for (uint32_t i = 0; i < s->n_matches; i++)
+  for (i = 0; i < s->n_matches; i++)
     d_occ[d_base_from_value(s->d_values[i])]++;
-  for (uint32_t i = 0; i < s->n_literals; i++)
+  for (i = 0; i < s->n_literals; i++)
     literal_occ[s->literals[i]]++;
 
   // Make sure we have enough room for a _full_ V2 header
@@ -266,12 +269,12 @@ static int lzfse_encode_matches(lzfse_encoder_state *s) {
   // Encode literals
   {
     fse_out_stream out;
-    fse_out_init(&out);
     fse_state state0, state1, state2, state3;
-    state0 = state1 = state2 = state3 = 0;
-
     uint8_t *buf = s->dst;
-    uint32_t i = s->n_literals; // I multiple of 4
+
+    fse_out_init(&out);
+    state0 = state1 = state2 = state3 = 0;
+    i = s->n_literals; // I multiple of 4
     // We encode starting from the last literal so we can decode starting from
     // the first
     while (i > 0) {
@@ -307,12 +310,12 @@ static int lzfse_encode_matches(lzfse_encoder_state *s) {
   // Encode L,M,D
   {
     fse_out_stream out;
-    fse_out_init(&out);
     fse_state l_state, m_state, d_state;
-    l_state = m_state = d_state = 0;
-
     uint8_t *buf = s->dst;
-    uint32_t i = s->n_matches;
+
+    fse_out_init(&out);
+    l_state = m_state = d_state = 0;
+    i = s->n_matches;
 
     // Add 8 padding bytes to the L,M,D payload
     if (buf + 8 > s->dst_end) {
@@ -325,6 +328,11 @@ static int lzfse_encode_matches(lzfse_encoder_state *s) {
     // We encode starting from the last match so we can decode starting from the
     // first
     while (i > 0) {
+      int32_t d_value, d_nbits, d_bits;
+      int32_t m_value, m_nbits, m_bits;
+      int32_t l_value, l_nbits, l_bits;
+      uint8_t d_symbol, m_symbol, l_symbol;
+
       if (buf + 16 > s->dst_end) {
         ok = 0;
         goto END;
@@ -332,10 +340,10 @@ static int lzfse_encode_matches(lzfse_encoder_state *s) {
       i -= 1;
 
       // D requires 23b max
-      int32_t d_value = s->d_values[i];
-      uint8_t d_symbol = d_base_from_value(d_value);
-      int32_t d_nbits = d_extra_bits[d_symbol];
-      int32_t d_bits = d_value - d_base_value[d_symbol];
+      d_value = s->d_values[i];
+      d_symbol = d_base_from_value(d_value);
+      d_nbits = d_extra_bits[d_symbol];
+      d_bits = d_value - d_base_value[d_symbol];
       fse_out_push(&out, d_nbits, d_bits);
       fse_encode(&d_state, d_encoder, &out, d_symbol);
 #if !FSE_IOSTREAM_64
@@ -343,10 +351,10 @@ static int lzfse_encode_matches(lzfse_encoder_state *s) {
 #endif
 
       // M requires 17b max
-      int32_t m_value = s->m_values[i];
-      uint8_t m_symbol = m_base_from_value(m_value);
-      int32_t m_nbits = m_extra_bits[m_symbol];
-      int32_t m_bits = m_value - m_base_value[m_symbol];
+      m_value = s->m_values[i];
+      m_symbol = m_base_from_value(m_value);
+      m_nbits = m_extra_bits[m_symbol];
+      m_bits = m_value - m_base_value[m_symbol];
       fse_out_push(&out, m_nbits, m_bits);
       fse_encode(&m_state, m_encoder, &out, m_symbol);
 #if !FSE_IOSTREAM_64
@@ -354,10 +362,10 @@ static int lzfse_encode_matches(lzfse_encoder_state *s) {
 #endif
 
       // L requires 14b max
-      int32_t l_value = s->l_values[i];
-      uint8_t l_symbol = l_base_from_value(l_value);
-      int32_t l_nbits = l_extra_bits[l_symbol];
-      int32_t l_bits = l_value - l_base_value[l_symbol];
+      l_value = s->l_values[i];
+      l_symbol = l_base_from_value(l_value);
+      l_nbits = l_extra_bits[l_symbol];
+      l_bits = l_value - l_base_value[l_symbol];
       fse_out_push(&out, l_nbits, l_bits);
       fse_encode(&l_state, l_encoder, &out, l_symbol);
       fse_out_flush(&out, &buf);
@@ -394,8 +402,8 @@ END:
     // Revert state, DST was full
 
     // Revert the d_prev encoding
-    uint32_t d_prev = 0;
-    for (uint32_t i = 0; i < s->n_matches; i++) {
+    d_prev = 0;
+    for (i = 0; i < s->n_matches; i++) {
       uint32_t d = s->d_values[i];
       if (d == 0)
         s->d_values[i] = d_prev;
@@ -421,6 +429,11 @@ END:
  * the buffers is full. In that case the state is not modified. */
 static inline int lzfse_push_lmd(lzfse_encoder_state *s, uint32_t L,
                                  uint32_t M, uint32_t D) {
+  uint8_t *dst = s->literals + s->n_literals;
+  const uint8_t *src = s->src + s->src_literal;
+  uint8_t *dst_end = dst + L;
+  uint32_t n;
+
   // Check if we have enough space to push the match (we add some margin to copy
   // literals faster here, and round final count later)
   if (s->n_matches + 1 + 8 > LZFSE_MATCHES_PER_BLOCK)
@@ -429,15 +442,12 @@ static inline int lzfse_push_lmd(lzfse_encoder_state *s, uint32_t L,
     return LZFSE_STATUS_DST_FULL; // state full
 
   // Store match
-  uint32_t n = s->n_matches++;
+  n = s->n_matches++;
   s->l_values[n] = L;
   s->m_values[n] = M;
   s->d_values[n] = D;
 
   // Store literals
-  uint8_t *dst = s->literals + s->n_literals;
-  const uint8_t *src = s->src + s->src_literal;
-  uint8_t *dst_end = dst + L;
   if (s->src_literal + L + 16 > s->src_end) {
     // Careful at the end of SRC, we can't read 16 bytes
     if (L > 0)
@@ -547,6 +557,7 @@ static int lzfse_backend_literals(lzfse_encoder_state *s, lzfse_offset L) {
   // Create a fake match with M=0, D=1
   lzfse_match match;
   lzfse_offset pos = s->src_literal + L;
+
   match.pos = pos;
   match.ref = match.pos - 1;
   match.length = 0;
@@ -587,12 +598,14 @@ static int lzfse_backend_end_of_stream(lzfse_encoder_state *s) {
 int lzfse_encode_init(lzfse_encoder_state *s) {
   const lzfse_match NO_MATCH = {0};
   lzfse_history_set line;
-  for (int i = 0; i < LZFSE_ENCODE_HASH_WIDTH; i++) {
+  int i;
+
+  for (i = 0; i < LZFSE_ENCODE_HASH_WIDTH; i++) {
     line.pos[i] = -4 * LZFSE_ENCODE_MAX_D_VALUE; // invalid pos
     line.value[i] = 0;
   }
   // Fill table
-  for (int i = 0; i < LZFSE_ENCODE_HASH_VALUES; i++)
+  for (i = 0; i < LZFSE_ENCODE_HASH_VALUES; i++)
     s->history_table[i] = line;
   s->pending = NO_MATCH;
   s->src_literal = 0;
@@ -604,6 +617,9 @@ int lzfse_encode_init(lzfse_encoder_state *s) {
  * Offsets in \p src are updated backwards to point to the same positions.
  * @return  LZFSE_STATUS_OK */
 int lzfse_encode_translate(lzfse_encoder_state *s, lzfse_offset delta) {
+  int32_t invalidPos = -4 * LZFSE_ENCODE_MAX_D_VALUE;
+  int i, j;
+
   if (delta == 0)
     return LZFSE_STATUS_OK; // OK
 
@@ -621,10 +637,9 @@ int lzfse_encode_translate(lzfse_encoder_state *s, lzfse_offset delta) {
   s->pending.ref -= delta;
 
   // history_table positions, translated, and clamped to invalid pos
-  int32_t invalidPos = -4 * LZFSE_ENCODE_MAX_D_VALUE;
-  for (int i = 0; i < LZFSE_ENCODE_HASH_VALUES; i++) {
+  for (i = 0; i < LZFSE_ENCODE_HASH_VALUES; i++) {
     int32_t *p = &(s->history_table[i].pos[0]);
-    for (int j = 0; j < LZFSE_ENCODE_HASH_WIDTH; j++) {
+    for (j = 0; j < LZFSE_ENCODE_HASH_WIDTH; j++) {
       lzfse_offset newPos = p[j] - delta; // translate
       p[j] = (int32_t)((newPos < invalidPos) ? invalidPos : newPos); // clamp
     }
@@ -649,20 +664,23 @@ int lzfse_encode_base(lzfse_encoder_state *s) {
   s->src_encode_end = s->src_end - 8;
   for (; s->src_encode_i < s->src_encode_end; s->src_encode_i++) {
     lzfse_offset pos = s->src_encode_i; // pos >= 0
-
     // Load 4 byte value and get hash line
     uint32_t x = load4(s->src + pos);
+    lzfse_history_set h;
+    lzfse_match incoming;
+    int k;
+
     hashLine = history_table + hashX(x);
-    lzfse_history_set h = *hashLine;
+    h = *hashLine;
 
     // Prepare next hash line (component 0 is the most recent) to prepare new
     // entries (stored later)
     {
       newH.pos[0] = (int32_t)pos;
-      for (int k = 0; k < LZFSE_ENCODE_HASH_WIDTH - 1; k++)
+      for (k = 0; k < LZFSE_ENCODE_HASH_WIDTH - 1; k++)
         newH.pos[k + 1] = h.pos[k];
       newH.value[0] = x;
-      for (int k = 0; k < LZFSE_ENCODE_HASH_WIDTH - 1; k++)
+      for (k = 0; k < LZFSE_ENCODE_HASH_WIDTH - 1; k++)
         newH.value[k + 1] = h.value[k];
     }
 
@@ -671,22 +689,25 @@ int lzfse_encode_base(lzfse_encoder_state *s) {
       goto END_POS;
 
     // Search best incoming match
-    lzfse_match incoming = {.pos = pos, .ref = 0, .length = 0};
+    incoming.pos = pos;
+    incoming.ref = 0;
+    incoming.length = 0;
 
     // Check for matches.  We consider matches of length >= 4 only.
-    for (int k = 0; k < LZFSE_ENCODE_HASH_WIDTH; k++) {
+    for (k = 0; k < LZFSE_ENCODE_HASH_WIDTH; k++) {
       uint32_t d = h.value[k] ^ x;
-      if (d)
-        continue; // no 4 byte match
       int32_t ref = h.pos[k];
-      if (ref + LZFSE_ENCODE_MAX_D_VALUE < pos)
-        continue; // too far
-
       const uint8_t *src_ref = s->src + ref;
       const uint8_t *src_pos = s->src + pos;
       uint32_t length = 4;
       uint32_t maxLength =
         (uint32_t)(s->src_end - pos - 8); // ensure we don't hit the end of SRC
+
+      if (d)
+        continue; // no 4 byte match
+      if (ref + LZFSE_ENCODE_MAX_D_VALUE < pos)
+        continue; // too far
+
       while (length < maxLength) {
         uint64_t d = load8(src_ref + length) ^ load8(src_pos + length);
         if (d == 0) {
@@ -803,6 +824,7 @@ END:
 
 int lzfse_encode_finish(lzfse_encoder_state *s) {
   const lzfse_match NO_MATCH = {0};
+  lzfse_offset L;
 
   // Emit pending match
   if (s->pending.length > 0) {
@@ -812,7 +834,7 @@ int lzfse_encode_finish(lzfse_encoder_state *s) {
   }
 
   // Emit final literals if any
-  lzfse_offset L = s->src_end - s->src_literal;
+  L = s->src_end - s->src_literal;
   if (L > 0) {
     if (lzfse_backend_literals(s, L) != LZFSE_STATUS_OK)
       return LZFSE_STATUS_DST_FULL;
@@ -202,6 +202,16 @@ typedef struct {
   //  corresponds to a group of four byte sequences in the input stream
   //  that hash to the same value.
   lzfse_history_set history_table[LZFSE_ENCODE_HASH_VALUES];
+  //  Occurrence and encoder tables for lzfse_encode_matches(). They are kept
+  //  here instead of on the stack, which is small in the kernel.
+  uint32_t l_occ[LZFSE_ENCODE_L_SYMBOLS];
+  uint32_t m_occ[LZFSE_ENCODE_M_SYMBOLS];
+  uint32_t d_occ[LZFSE_ENCODE_D_SYMBOLS];
+  uint32_t literal_occ[LZFSE_ENCODE_LITERAL_SYMBOLS];
+  fse_encoder_entry l_encoder[LZFSE_ENCODE_L_SYMBOLS];
+  fse_encoder_entry m_encoder[LZFSE_ENCODE_M_SYMBOLS];
+  fse_encoder_entry d_encoder[LZFSE_ENCODE_D_SYMBOLS];
+  fse_encoder_entry literal_encoder[LZFSE_ENCODE_LITERAL_SYMBOLS];
 } lzfse_encoder_state;
 
 /*! @abstract Decoder state object for lzfse compressed blocks. */
@@ -468,6 +478,39 @@ LZFSE_INLINE void copy16(void *dst, const void *src) {
   store8((unsigned char *)dst + 8, m1);
 }
 
+/*! @abstract Copy \p length bytes sixteen bytes at a time. It may write up to
+ * 15 bytes past the end, and the source must be at least 16 bytes behind the
+ * destination if they overlap. */
+LZFSE_INLINE void copy_wide(unsigned char *dst, const unsigned char *src,
+                            size_t length) {
+  const unsigned char *dst_end = dst + length;
+  do {
+    copy16(dst, src);
+    dst += 16;
+    src += 16;
+  } while (dst < dst_end);
+}
+
+/*! @abstract Copy a match of length \p M at distance \p D from DST - D to DST,
+ * with the byte-by-byte semantics of LZ matches, for 0 < D < 8 < M. The output
+ * is periodic with period D, so once the first multiple of D that is at least
+ * eight has been written byte by byte, the rest of the match can be filled with
+ * non-overlapping eight-byte copies from that far back. Like the other wide
+ * copies, this may write up to 7 bytes past DST + M. */
+LZFSE_INLINE void copy_short_distance(unsigned char *dst, size_t D, size_t M) {
+  size_t step = D;
+  size_t i;
+
+  while (step < 8)
+    step += D;
+  if (step > M)
+    step = M;
+  for (i = 0; i < step; ++i)
+    dst[i] = dst[i - D];
+  for (; i < M; i += 8)
+    store8(&dst[i], load8(&dst[i - step]));
+}
+
 // ===============================================================
 // Bitfield Operations
 
@@ -455,10 +455,16 @@ copy_match:
     size_t i;
     for (i = 0; i < M; i += 8)
       store8(&dst_ptr[i], load8(&dst_ptr[i - D]));
+  } else if (dst_len >= M + 7 && M > 8) {
+    //  The match distance is small, but the match is long and far enough
+    //  from the end of the buffer: these are runs of a short pattern, so
+    //  write the first period byte-by-byte and replicate it with eight
+    //  byte copies.
+    copy_short_distance(dst_ptr, D, M);
   } else if (M <= dst_len) {
-    //  Either the match distance is too small, or we are too close to
-    //  the end of the buffer to safely use eight byte copies. Fall back
-    //  on a simple byte-by-byte implementation.
+    //  Either the match is short, or we are too close to the end of the
+    //  buffer to safely use eight byte copies. Fall back on a simple
+    //  byte-by-byte implementation.
     size_t i;
     for (i = 0; i < M; ++i)
       dst_ptr[i] = dst_ptr[i - D];
@@ -23,20 +23,18 @@ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSI
 
 #include "lzvn_encode_base.h"
 
-#if defined(_MSC_VER) && !defined(__clang__)
-#  define restrict __restrict
-#endif
-
 // ===============================================================
 // Coarse/fine copy, non overlapping buffers
 
 /*! @abstract Copy at least \p nbytes bytes from \p src to \p dst, by blocks
  * of 8 bytes (may go beyond range). No overlap.
  * @return \p dst + \p nbytes. */
-static inline unsigned char *lzvn_copy64(unsigned char *restrict dst,
-                                         const unsigned char *restrict src,
+static inline unsigned char *lzvn_copy64(unsigned char *__restrict dst,
+                                         const unsigned char *__restrict src,
                                          size_t nbytes) {
-  for (size_t i = 0; i < nbytes; i += 8)
+  size_t i;
+
+  for (i = 0; i < nbytes; i += 8)
     store8(dst + i, load8(src + i));
   return dst + nbytes;
 }
@@ -44,10 +42,12 @@ static inline unsigned char *lzvn_copy64(unsigned char *restrict dst,
 /*! @abstract Copy exactly \p nbytes bytes from \p src to \p dst (respects range).
  * No overlap.
  * @return \p dst + \p nbytes. */
-static inline unsigned char *lzvn_copy8(unsigned char *restrict dst,
-                                        const unsigned char *restrict src,
+static inline unsigned char *lzvn_copy8(unsigned char *__restrict dst,
+                                        const unsigned char *__restrict src,
                                         size_t nbytes) {
-  for (size_t i = 0; i < nbytes; i++)
+  size_t i;
+
+  for (i = 0; i < nbytes; i++)
     dst[i] = src[i];
   return dst + nbytes;
 }
@@ -96,6 +96,8 @@ static inline unsigned char *emit(const unsigned char *p, unsigned char *q,
                                   unsigned char *q1, size_t L, size_t M,
                                   size_t D, size_t D_prev) {
   size_t x;
+  uint32_t literal;
+
   while (L > 15) {
     x = L < 271 ? L : 271;
     if (q + x + 10 >= q1)
@@ -119,7 +121,7 @@ static inline unsigned char *emit(const unsigned char *p, unsigned char *q,
   x -= 3; // M = (x+3) + M'    max value for x is 7-2*L
 
   // Here L<4 literals remaining, we read them here
-  uint32_t literal = load4(p);
+  literal = load4(p);
   // P is not accessed after this point
 
   // Relaxed capacity test covering all cases
@@ -193,8 +195,10 @@ static inline lzvn_offset offset_from_s32(int32_t x) { return (lzvn_offset)x; }
 
 /*! @abstract Get hash in range \c [0,LZVN_ENCODE_HASH_VALUES-1] from 3 bytes in i. */
 static inline uint32_t hash3i(uint32_t i) {
+  uint32_t h;
+
   i &= 0xffffff; // truncate to 24-bit input (slightly increases compression ratio)
-  uint32_t h = (i * (1 + (1 << 6) + (1 << 12))) >> 12;
+  h = (i * (1 + (1 << 6) + (1 << 12))) >> 12;
   return h & (LZVN_ENCODE_HASH_VALUES - 1);
 }
 
@@ -229,15 +233,16 @@ static inline int lzvn_find_match(const unsigned char *src,
                                   lzvn_offset m0_begin, lzvn_offset m_begin,
                                   lzvn_match_info *match) {
   lzvn_offset n = nmatch4(src, m_begin, m0_begin);
+  lzvn_offset D = m_begin - m0_begin; // actual distance
+  lzvn_offset m_end = m_begin + n;
+  lzvn_offset M;
+
   if (n < 3)
     return 0; // no match
-
-  lzvn_offset D = m_begin - m0_begin; // actual distance
   if (D <= 0 || D > LZVN_ENCODE_MAX_DISTANCE)
     return 0; // distance out of range
 
   // Expand forward
-  lzvn_offset m_end = m_begin + n;
   while (n == 4 && m_end + 4 < src_end) {
     n = nmatch4(src, m_end, m_end - D);
     m_end += n;
@@ -251,7 +256,7 @@ static inline int lzvn_find_match(const unsigned char *src,
   }
 
   // OK, we keep it, update MATCH
-  lzvn_offset M = m_end - m_begin; // match length
+  M = m_end - m_begin; // match length
   match->m_begin = m_begin;
   match->m_end = m_end;
   match->K = M - ((D < 0x600) ? 2 : 3);
@@ -268,16 +273,17 @@ static inline int lzvn_find_matchN(const unsigned char *src,
                                    lzvn_offset src_end, lzvn_offset l_begin,
                                    lzvn_offset m0_begin, lzvn_offset m_begin,
                                    lzvn_offset n, lzvn_match_info *match) {
+  lzvn_offset D = m_begin - m0_begin; // actual distance
+  lzvn_offset m_end = m_begin + n;
+  lzvn_offset M;
+
   // We can skip the first comparison on 4 bytes
   if (n < 3)
     return 0; // no match
-
-  lzvn_offset D = m_begin - m0_begin; // actual distance
   if (D <= 0 || D > LZVN_ENCODE_MAX_DISTANCE)
     return 0; // distance out of range
 
   // Expand forward
-  lzvn_offset m_end = m_begin + n;
   while (n == 4 && m_end + 4 < src_end) {
     n = nmatch4(src, m_end, m_end - D);
     m_end += n;
@@ -291,7 +297,7 @@ static inline int lzvn_find_matchN(const unsigned char *src,
   }
 
   // OK, we keep it, update MATCH
-  lzvn_offset M = m_end - m_begin; // match length
+  M = m_end - m_begin; // match length
   match->m_begin = m_begin;
   match->m_end = m_end;
   match->K = M - ((D < 0x600) ? 2 : 3);
@@ -315,13 +321,15 @@ static inline lzvn_offset lzvn_emit_match(lzvn_encoder_state *state,
   size_t D_prev = (size_t)state->d_prev; // previously emitted match distance
   unsigned char *dst = emit(state->src + state->src_literal, state->dst,
                             state->dst_end, L, M, D, D_prev);
+  lzvn_offset dst_used;
+
   // Check if DST is full
   if (dst >= state->dst_end) {
     return 0; // FULL
   }
 
   // Update state
-  lzvn_offset dst_used = dst - state->dst;
+  dst_used = dst - state->dst;
   state->d_prev = match.D;
   state->dst = dst;
   state->src_literal = match.m_end;
@@ -336,12 +344,14 @@ static inline lzvn_offset lzvn_emit_literal(lzvn_encoder_state *state,
   size_t L = (size_t)n;
   unsigned char *dst = emit_literal(state->src + state->src_literal, state->dst,
                                     state->dst_end, L);
+  lzvn_offset dst_used;
+
   // Check if DST is full
   if (dst >= state->dst_end)
     return 0; // FULL
 
   // Update state
-  lzvn_offset dst_used = dst - state->dst;
+  dst_used = dst - state->dst;
   state->dst = dst;
   state->src_literal += n;
   return dst_used;
@@ -367,16 +377,19 @@ static inline lzvn_offset lzvn_emit_end_of_stream(lzvn_encoder_state *state) {
 /*! @abstract Initialize encoder table in \p state, uses current I/O parameters. */
 static inline void lzvn_init_table(lzvn_encoder_state *state) {
   lzvn_offset index = -LZVN_ENCODE_MAX_DISTANCE; // max match distance
+  uint32_t value;
+  lzvn_encode_entry_type e;
+  int i, u;
+
   if (index < state->src_begin)
     index = state->src_begin;
-  uint32_t value = load4(state->src + index);
+  value = load4(state->src + index);
 
-  lzvn_encode_entry_type e;
-  for (int i = 0; i < 4; i++) {
+  for (i = 0; i < 4; i++) {
     e.indices[i] = offset_to_s32(index);
     e.values[i] = value;
   }
-  for (int u = 0; u < LZVN_ENCODE_HASH_VALUES; u++)
+  for (u = 0; u < LZVN_ENCODE_HASH_VALUES; u++)
     state->table[u] = e; // fill entire table
 }
 
@@ -395,6 +408,12 @@ void lzvn_encode(lzvn_encoder_state *state) {
 
     // Update entry with index=current and value=vi
     lzvn_encode_entry_type updated_e; // rotate values, so we will replace the oldest
+    lzvn_match_info incoming;
+    uint32_t diffs[4];
+    lzvn_offset ik;                // index
+    lzvn_offset nk;                // match byte count
+    int k;
+
     updated_e.indices[0] = offset_to_s32(state->src_current);
     updated_e.indices[1] = e.indices[0];
     updated_e.indices[2] = e.indices[1];
@@ -439,14 +458,11 @@ void lzvn_encode(lzvn_encoder_state *state) {
       return;                                                                  \
   } while (0)
 
-    lzvn_match_info incoming = NO_MATCH;
+    incoming = NO_MATCH;
 
     // Check candidates in order (closest first)
-    uint32_t diffs[4];
-    for (int k = 0; k < 4; k++)
+    for (k = 0; k < 4; k++)
       diffs[k] = e.values[k] ^ vi; // XOR, 0 if equal
-    lzvn_offset ik;                // index
-    lzvn_offset nk;                // match byte count
 
     // The values stored in e.xyzw are 32-bit signed indices, extended to signed
     // type lzvn_offset
@@ -536,6 +552,8 @@ size_t lzvn_encode_scratch_size(void) { return LZVN_ENCODE_WORK_SIZE; }
 static size_t lzvn_encode_partial(void *__restrict dst, size_t dst_size,
                                   const void *__restrict src, size_t src_size,
                                   size_t *src_used, void *__restrict work) {
+  lzvn_encoder_state state;
+
   // Min size checks to avoid accessing memory outside buffers.
   if (dst_size < LZVN_ENCODE_MIN_DST_SIZE) {
     *src_used = 0;
@@ -547,7 +565,6 @@ static size_t lzvn_encode_partial(void *__restrict dst, size_t dst_size,
   }
 
   // Setup encoder state
-  lzvn_encoder_state state;
   memset(&state, 0, sizeof(state));
 
   state.src = src;
@@ -17,7 +17,7 @@ static struct dentry *apfs_lookup(struct inode *dir, struct dentry *dentry,
 	if (dentry->d_name.len > APFS_NAME_LEN)
 		return ERR_PTR(-ENAMETOOLONG);
 
-	err = apfs_inode_by_name(dir, &dentry->d_name, &ino);
+	err = apfs_inode_by_name(dir, dentry, &ino);
 	if (err && err != -ENODATA) {
 		apfs_err(dir->i_sb, "inode lookup by name failed");
 		return ERR_PTR(err);
@@ -76,38 +76,45 @@ const struct inode_operations apfs_special_inode_operations = {
 	.update_time	= apfs_update_time,
 };
 
+/**
+ * apfs_dentry_salt - Get the salt for the dcache hashes of a directory
+ * @dir:	dentry for the directory
+ */
+static inline u32 apfs_dentry_salt(const struct dentry *dir)
+{
+	return hash_ptr(dir, 32);
+}
+
+/*
+ * On normalization-insensitive volumes the dcache hash is the same one used
+ * for the dentry records, salted with the parent, so that a lookup doesn't
+ * need to normalize the name all over again to build its catalog key.
+ */
 static int apfs_dentry_hash(const struct dentry *dir, struct qstr *child)
 {
-	struct apfs_unicursor cursor;
-	unsigned long hash;
-	bool case_fold = apfs_is_case_insensitive(dir->d_sb);
+	struct super_block *sb = dir->d_sb;
 
-	if (!apfs_is_normalization_insensitive(dir->d_sb))
+	if (!apfs_is_normalization_insensitive(sb))
 		return 0;
 
-	apfs_init_unicursor(&cursor, child->name, child->len);
-	hash = init_name_hash(dir);
-
-	while (1) {
-		int i;
-		unicode_t utf32;
-
-		utf32 = apfs_normalize_next(&cursor, case_fold);
-		if (!utf32)
-			break;
-
-		/* Hash the unicode character one byte at a time */
-		for (i = 0; i < 4; ++i) {
-			hash = partial_name_hash((u8)utf32, hash);
-			utf32 = utf32 >> 8;
-		}
-	}
-	child->hash = end_name_hash(hash);
-
 	/* TODO: return error instead of truncating invalid UTF-8? */
+	child->hash = apfs_drec_name_hash(sb, child->name, child->len) ^ apfs_dentry_salt(dir);
 	return 0;
 }
 
+/**
+ * apfs_dentry_drec_hash - Get the dentry record hash saved by apfs_dentry_hash()
+ * @dentry:	the dentry, with its parent locked
+ *
+ * Returns the hash, or 0 if the volume doesn't hash its dentry records.
+ */
+u32 apfs_dentry_drec_hash(const struct dentry *dentry)
+{
+	if (!apfs_is_normalization_insensitive(dentry->d_sb))
+		return 0;
+	return dentry->d_name.hash ^ apfs_dentry_salt(dentry->d_parent);
+}
+
 static int apfs_dentry_compare(const struct dentry *dentry, unsigned int len,
 			       const char *str, const struct qstr *name)
 {
@@ -5,7 +5,10 @@
 
 #include <linux/slab.h>
 #include <linux/buffer_head.h>
+#include <linux/hash.h>
+#include <linux/sort.h>
 #include "apfs.h"
+#include "trace.h"
 
 /**
  * apfs_node_is_valid - Check basic sanity of the node index
@@ -43,6 +46,8 @@ void apfs_node_free(struct apfs_node *node)
 
 	if (!node)
 		return;
+	if (!atomic_dec_and_test(&node->refcnt))
+		return;
 	obj = &node->object;
 
 	if (obj->o_bh) {
@@ -57,6 +62,134 @@ void apfs_node_free(struct apfs_node *node)
 	kfree(node);
 }
 
+/**
+ * apfs_node_cache_init - Set up an empty node cache
+ * @cache: the cache to initialize
+ */
+void apfs_node_cache_init(struct apfs_node_cache *cache)
+{
+	int i;
+
+	for (i = 0; i < APFS_NODE_CACHE_LOCKS; ++i)
+		spin_lock_init(&cache->locks[i]);
+}
+
+/**
+ * apfs_node_cache_lock - Get the spinlock that protects a node cache slot
+ * @cache:	the node cache
+ * @slot:	index of the slot
+ */
+static inline spinlock_t *apfs_node_cache_lock(struct apfs_node_cache *cache, unsigned int slot)
+{
+	return &cache->locks[slot % APFS_NODE_CACHE_LOCKS];
+}
+
+/**
+ * apfs_node_cache_lookup - Look for a parsed node in the cache
+ * @sb:		filesystem superblock
+ * @bno:	block number for the node
+ * @oid:	object id for the node
+ *
+ * Returns the cached node with a new reference taken, or NULL if not found.
+ */
+static struct apfs_node *apfs_node_cache_lookup(struct super_block *sb, u64 bno, u64 oid)
+{
+	struct apfs_node_cache *cache = &APFS_NXI(sb)->nx_node_cache;
+	unsigned int slot = hash_64(bno, APFS_NODE_CACHE_BITS);
+	spinlock_t *lock = apfs_node_cache_lock(cache, slot);
+	struct apfs_node *node = NULL;
+
+	spin_lock(lock);
+	node = cache->slots[slot];
+	if (node && node->object.sb == sb && node->object.block_nr == bno && node->object.oid == oid)
+		atomic_inc(&node->refcnt);
+	else
+		node = NULL;
+	spin_unlock(lock);
+	return node;
+}
+
+/**
+ * apfs_node_cache_insert - Add a freshly read node to the cache, if it fits
+ * @node: the node
+ *
+ * Only index nodes are cached, because they are few and get read on every
+ * query. Roots already stay in memory, and leaves would just push everything
+ * else out.
+ */
+static void apfs_node_cache_insert(struct apfs_node *node)
+{
+	struct super_block *sb = node->object.sb;
+	struct apfs_node_cache *cache = &APFS_NXI(sb)->nx_node_cache;
+	unsigned int slot = hash_64(node->object.block_nr, APFS_NODE_CACHE_BITS);
+	spinlock_t *lock = apfs_node_cache_lock(cache, slot);
+	struct apfs_node *old = NULL;
+
+	if (node->object.ephemeral || apfs_node_is_leaf(node) || apfs_node_is_root(node))
+		return;
+	/* Nodes in the transaction get modified in place */
+	if (buffer_trans(node->object.o_bh))
+		return;
+
+	atomic_inc(&node->refcnt);
+	spin_lock(lock);
+	old = cache->slots[slot];
+	cache->slots[slot] = node;
+	spin_unlock(lock);
+	apfs_node_free(old);
+}
+
+/**
+ * apfs_node_cache_forget - Drop the cached node for a block, if any
+ * @sb:		filesystem superblock
+ * @bno:	block number
+ *
+ * Must be called before the contents of the block can change, which for now
+ * only happens when it joins a transaction, or when the node gets CoW'd.
+ */
+void apfs_node_cache_forget(struct super_block *sb, u64 bno)
+{
+	struct apfs_node_cache *cache = &APFS_NXI(sb)->nx_node_cache;
+	unsigned int slot = hash_64(bno, APFS_NODE_CACHE_BITS);
+	spinlock_t *lock = apfs_node_cache_lock(cache, slot);
+	struct apfs_node *node = NULL;
+
+	spin_lock(lock);
+	node = cache->slots[slot];
+	if (node && node->object.block_nr == bno)
+		cache->slots[slot] = NULL;
+	else
+		node = NULL;
+	spin_unlock(lock);
+	apfs_node_free(node);
+}
+
+/**
+ * apfs_node_cache_drop_all - Drop all cached nodes for a volume
+ * @sb: superblock for the volume
+ *
+ * Called before the volume goes away.
+ */
+void apfs_node_cache_drop_all(struct super_block *sb)
+{
+	struct apfs_node_cache *cache = &APFS_NXI(sb)->nx_node_cache;
+	unsigned int slot;
+
+	for (slot = 0; slot < APFS_NODE_CACHE_SLOTS; ++slot) {
+		spinlock_t *lock = apfs_node_cache_lock(cache, slot);
+		struct apfs_node *node = NULL;
+
+		spin_lock(lock);
+		node = cache->slots[slot];
+		if (node && node->object.sb == sb)
+			cache->slots[slot] = NULL;
+		else
+			node = NULL;
+		spin_unlock(lock);
+		apfs_node_free(node);
+	}
+}
+
 /**
  * apfs_read_node - Read a node header from disk
  * @sb:		filesystem superblock
@@ -65,9 +198,8 @@ void apfs_node_free(struct apfs_node *node)
  * @write:	request write access?
  *
  * Returns ERR_PTR in case of failure, otherwise return a pointer to the
- * resulting apfs_node structure with the initial reference taken.
- *
- * For now we assume the node has not been read before.
+ * resulting apfs_node structure with the initial reference taken. Read-only
+ * requests may get a node from the cache, which must not be modified.
  */
 struct apfs_node *apfs_read_node(struct super_block *sb, u64 oid, u32 storage,
 				 bool write)
@@ -90,6 +222,11 @@ struct apfs_node *apfs_read_node(struct super_block *sb, u64 oid, u32 storage,
 			apfs_err(sb, "omap lookup failed for oid 0x%llx", oid);
 			return ERR_PTR(err);
 		}
+		if (!write) {
+			node = apfs_node_cache_lookup(sb, bno, oid);
+			if (node)
+				return node;
+		}
 		/* CoW has already been done, don't worry about snapshots */
 		bh = apfs_read_object_block(sb, bno, write, false /* preserve */);
 		if (IS_ERR(bh)) {
@@ -100,6 +237,11 @@ struct apfs_node *apfs_read_node(struct super_block *sb, u64 oid, u32 storage,
 		raw = (struct apfs_btree_node_phys *)bh->b_data;
 		break;
 	case APFS_OBJ_PHYSICAL:
+		if (!write) {
+			node = apfs_node_cache_lookup(sb, oid, oid);
+			if (node)
+				return node;
+		}
 		bh = apfs_read_object_block(sb, oid, write, false /* preserve */);
 		if (IS_ERR(bh)) {
 			apfs_err(sb, "object read failed for bno 0x%llx", oid);
@@ -136,6 +278,7 @@ struct apfs_node *apfs_read_node(struct super_block *sb, u64 oid, u32 storage,
 		return ERR_PTR(-ENOMEM);
 	}
 
+	atomic_set(&node->refcnt, 1);
 	node->tree_type = le32_to_cpu(raw->btn_o.o_subtype);
 	node->flags = le16_to_cpu(raw->btn_flags);
 	node->records = le32_to_cpu(raw->btn_nkeys);
@@ -169,6 +312,8 @@ struct apfs_node *apfs_read_node(struct super_block *sb, u64 oid, u32 storage,
 		return ERR_PTR(-EFSCORRUPTED);
 	}
 
+	if (!write)
+		apfs_node_cache_insert(node);
 	return node;
 }
 
@@ -278,7 +423,7 @@ int apfs_make_empty_btree_root(struct super_block *sb, u32 subtype, u64 *oid)
 		return err;
 	}
 	apfs_assert_in_transaction(sb, &vsb_raw->apfs_o);
-	le64_add_cpu(&vsb_raw->apfs_fs_alloc_count, 1);
+	apfs_alloc_count_add(sb, 1);
 	le64_add_cpu(&vsb_raw->apfs_total_blocks_alloced, 1);
 
 	bh = apfs_getblk(sb, bno);
@@ -361,7 +506,7 @@ static struct apfs_node *apfs_create_node(struct super_block *sb, u32 storage)
 			return ERR_PTR(err);
 		}
 		apfs_assert_in_transaction(sb, &vsb_raw->apfs_o);
-		le64_add_cpu(&vsb_raw->apfs_fs_alloc_count, 1);
+		apfs_alloc_count_add(sb, 1);
 		le64_add_cpu(&vsb_raw->apfs_total_blocks_alloced, 1);
 
 		oid = le64_to_cpu(msb_raw->nx_next_oid);
@@ -380,7 +525,7 @@ static struct apfs_node *apfs_create_node(struct super_block *sb, u32 storage)
 		}
 		/* We don't write to the container's omap */
 		apfs_assert_in_transaction(sb, &vsb_raw->apfs_o);
-		le64_add_cpu(&vsb_raw->apfs_fs_alloc_count, 1);
+		apfs_alloc_count_add(sb, 1);
 		le64_add_cpu(&vsb_raw->apfs_total_blocks_alloced, 1);
 		oid = bno;
 		break;
@@ -390,7 +535,7 @@ static struct apfs_node *apfs_create_node(struct super_block *sb, u32 storage)
 			return ERR_PTR(-EOPNOTSUPP);
 		}
 		eph_info = &nxi->nx_eph_list[nxi->nx_eph_count++];
-		eph_info->object = kzalloc(sb->s_blocksize, GFP_KERNEL);
+		eph_info->object = kvzalloc(sb->s_blocksize, GFP_KERNEL);
 		if (!eph_info->object)
 			return ERR_PTR(-ENOMEM);
 		eph_info->size = sb->s_blocksize;
@@ -443,6 +588,7 @@ static struct apfs_node *apfs_create_node(struct super_block *sb, u32 storage)
 		goto fail;
 	}
 
+	atomic_set(&node->refcnt, 1);
 	node->object.sb = sb;
 	node->object.block_nr = bno;
 	node->object.oid = oid;
@@ -493,7 +639,7 @@ int apfs_delete_node(struct apfs_node *node, int type)
 		}
 		vsb_raw = APFS_SB(sb)->s_vsb_raw;
 		apfs_assert_in_transaction(sb, &vsb_raw->apfs_o);
-		le64_add_cpu(&vsb_raw->apfs_fs_alloc_count, -1);
+		apfs_alloc_count_add(sb, -1);
 		le64_add_cpu(&vsb_raw->apfs_total_blocks_freed, 1);
 		return 0;
 	case APFS_QUERY_OMAP:
@@ -507,7 +653,7 @@ int apfs_delete_node(struct apfs_node *node, int type)
 		/* We don't write to the container's omap */
 		vsb_raw = APFS_SB(sb)->s_vsb_raw;
 		apfs_assert_in_transaction(sb, &vsb_raw->apfs_o);
-		le64_add_cpu(&vsb_raw->apfs_fs_alloc_count, -1);
+		apfs_alloc_count_add(sb, -1);
 		le64_add_cpu(&vsb_raw->apfs_total_blocks_freed, 1);
 		return 0;
 	case APFS_QUERY_FREE_QUEUE:
@@ -517,7 +663,7 @@ int apfs_delete_node(struct apfs_node *node, int type)
 			apfs_alert(sb, "can't find ephemeral object to delete");
 			return PTR_ERR(eph_info);
 		}
-		kfree(eph_info->object);
+		kvfree(eph_info->object);
 		eph_info->object = NULL;
 		memmove(eph_info, eph_info + 1, (char *)eph_info_end - (char *)(eph_info + 1));
 		eph_info_end->object = NULL;
@@ -898,6 +1044,75 @@ static int apfs_node_next(struct super_block *sb, struct apfs_query *query)
 	return 0;
 }
 
+/* Number of sibling leaves to read ahead during range scans */
+#define APFS_BTREE_READAHEAD	8
+
+/**
+ * apfs_node_readahead_leaves - Start reading the next leaves for a range scan
+ * @query: query for an index node right above the leaves, about to descend
+ *
+ * Range scans move through the leaves one at a time, so they would become a
+ * chain of dependent reads on a cold cache. This requests the next few siblings
+ * in the direction of the scan, as long as their first keys say they may still
+ * have matching records. Failures are ignored, the scan will find them anyway.
+ */
+void apfs_node_readahead_leaves(struct apfs_query *query)
+{
+	struct apfs_node *node = query->node;
+	struct super_block *sb = node->object.sb;
+	struct apfs_btree_node_phys *raw = (void *)node->object.data;
+	bool forward = query->flags & APFS_QUERY_PREV;
+	u32 storage = apfs_query_storage(query);
+	struct apfs_query tmp;
+	int i;
+
+	if (!forward && !(query->flags & APFS_QUERY_MULTIPLE))
+		return;
+	/* A backwards scan won't return to this level */
+	if (!forward && query->flags & APFS_QUERY_DONE)
+		return;
+	if (storage == APFS_OBJ_EPHEMERAL || le16_to_cpu(raw->btn_level) != 1)
+		return;
+
+	tmp = *query;
+	tmp.parent = NULL;
+	for (i = 1; i <= APFS_BTREE_READAHEAD; ++i) {
+		struct apfs_key key;
+		int index, key_index;
+		u64 oid, bno;
+
+		/*
+		 * Going forwards, the first key of the sibling must be in the
+		 * range. Going backwards, the sibling can only have matches if
+		 * the node that follows it starts with one.
+		 */
+		index = forward ? query->index + i : query->index - i;
+		if (index < 0 || index >= node->records)
+			break;
+		key_index = forward ? index : index + 1;
+		tmp.index = key_index;
+		tmp.key_len = apfs_node_locate_key(node, key_index, &tmp.key_off);
+		if (!tmp.key_len || apfs_key_from_query(&tmp, &key))
+			break;
+		if (forward && (key.id != query->key.id || key.type != query->key.type))
+			break;
+		if (!forward && apfs_keycmp(&key, &query->key) != 0)
+			break;
+
+		tmp.index = index;
+		tmp.len = apfs_node_locate_data(node, index, &tmp.off);
+		if (apfs_child_from_query(&tmp, &oid))
+			break;
+		if (storage == APFS_OBJ_VIRTUAL) {
+			if (apfs_omap_lookup_block(sb, APFS_SB(sb)->s_omap, oid, &bno, false /* write */))
+				break;
+		} else {
+			bno = oid;
+		}
+		apfs_sb_breadahead(sb, bno);
+	}
+}
+
 /**
  * apfs_node_query - Execute a query on a single node
  * @sb:		filesystem superblock
@@ -983,6 +1198,76 @@ int apfs_node_query(struct super_block *sb, struct apfs_query *query)
 	return 0;
 }
 
+/**
+ * apfs_query_continue_multiple - Continue a regular query as a multiple one
+ * @query:	successful query, pointing to a leaf record
+ * @key:	key for the multiple search
+ * @flags:	multiple search flags (APFS_QUERY_ANY_NAME, APFS_QUERY_ANY_NUMBER)
+ *
+ * This allows a multiple search to start from wherever a regular query found
+ * its record, instead of from the last match. Following calls to
+ * apfs_btree_query() will return the matching records that come before the
+ * current one, in the usual order.
+ *
+ * Returns 0 on success, -ENODATA if the current record doesn't match @key, or
+ * another negative error code in case of failure.
+ */
+int apfs_query_continue_multiple(struct apfs_query *query, const struct apfs_key *key, int flags)
+{
+	struct super_block *sb = query->node->object.sb;
+	struct apfs_query *curr = NULL;
+	struct apfs_key curr_key;
+	int cmp, err;
+
+	for (curr = query; curr; curr = curr->parent) {
+		curr->key = *key;
+		curr->flags &= ~APFS_QUERY_DONE;
+		curr->flags |= flags | APFS_QUERY_EXACT | APFS_QUERY_NEXT;
+
+		curr->key_len = apfs_node_locate_key(curr->node, curr->index, &curr->key_off);
+		err = apfs_key_from_query(curr, &curr_key);
+		if (err) {
+			apfs_err(sb, "bad key for index %d", curr->index);
+			return err;
+		}
+
+		cmp = apfs_keycmp(&curr_key, &curr->key);
+		if (cmp > 0) {
+			apfs_err(sb, "records are out of order");
+			return -EFSCORRUPTED;
+		}
+		/* Earlier records in this node can't match either */
+		if (cmp != 0)
+			curr->flags |= APFS_QUERY_DONE;
+	}
+
+	return query->flags & APFS_QUERY_DONE ? -ENODATA : 0;
+}
+
+/**
+ * apfs_query_next_in_node - Move a query to the following record in its node
+ * @query:	successful query, pointing to a leaf record
+ * @key:	on return, the key of the new record
+ *
+ * Lets the caller walk the records that come right after the one found, for as
+ * long as they are in the same node, without new descents. Returns 0 on
+ * success, -EAGAIN if there are no more records in the node, or another
+ * negative error code in case of failure.
+ */
+int apfs_query_next_in_node(struct apfs_query *query, struct apfs_key *key)
+{
+	struct super_block *sb = query->node->object.sb;
+	int err;
+
+	err = apfs_node_prev(sb, query);
+	if (err)
+		return err;
+	err = apfs_key_from_query(query, key);
+	if (err)
+		apfs_err(sb, "bad key for index %d", query->index);
+	return err;
+}
+
 /**
  * apfs_node_query_first - Find the first record in a node
  * @query: on return this query points to the record
@@ -1246,37 +1531,180 @@ static int apfs_attach_child(struct apfs_query *query, struct apfs_node *child)
 	return __apfs_btree_insert(query, (void *)raw + key_off, key_len, &raw_oid, sizeof(raw_oid));
 }
 
+/*
+ * Location of a key or value inside a node, sorted by offset for compaction
+ */
+struct apfs_node_area {
+	int index;	/* Index of the record */
+	int off;	/* Offset of the key or value in the block */
+	int len;	/* Length of the key or value */
+};
+
+static int apfs_node_area_cmp(const void *a, const void *b)
+{
+	const struct apfs_node_area *area_a = a;
+	const struct apfs_node_area *area_b = b;
+
+	return area_a->off - area_b->off;
+}
+
 /**
- * apfs_node_temp_dup - Make an in-memory duplicate of a node
- * @original:	node to duplicate
- * @duplicate:	on success, the duplicate node
+ * apfs_node_compact - Make all free space in a node contiguous, in place
+ * @node:	the node
+ * @records:	number of records to keep, counting from the first one
  *
- * Returns 0 on success or a negative error code in case of failure.
+ * Slides the keys towards the table of contents and the values towards the end
+ * of the block, in the order they already have on disk, so no temporary copy
+ * of the node is needed. The records after @records are simply forgotten. The
+ * caller must update the on-disk node afterwards. Returns 0 on success or a
+ * negative error code in case of failure.
  */
-static int apfs_node_temp_dup(const struct apfs_node *original, struct apfs_node **duplicate)
+static int apfs_node_compact(struct apfs_node *node, int records)
 {
-	struct super_block *sb = original->object.sb;
-	struct apfs_node *dup = NULL;
-	char *buffer = NULL;
+	struct super_block *sb = node->object.sb;
+	struct apfs_btree_node_phys *raw = (void *)node->object.data;
+	struct apfs_node_area *keys = NULL, *vals = NULL;
+	bool fixed = apfs_node_has_fixed_kv_size(node);
+	int toc_size, toc_entry_size, new_key, value_end, cursor, prev_end;
+	int val_count, i;
+	int err = -EFSCORRUPTED;
 
-	dup = kmalloc(sizeof(*dup), GFP_KERNEL);
-	if (!dup)
-		return -ENOMEM;
-	*dup = *original;
-	dup->object.o_bh = NULL;
-	dup->object.data = NULL;
-	dup->object.ephemeral = false;
-
-	buffer = kmalloc(sb->s_blocksize, GFP_KERNEL);
-	if (!buffer) {
-		kfree(dup);
-		return -ENOMEM;
+	apfs_assert_in_transaction(sb, &raw->btn_o);
+	ASSERT(records <= node->records);
+
+	if (records) {
+		keys = kmalloc_array(2 * records, sizeof(*keys), GFP_KERNEL);
+		if (!keys)
+			return -ENOMEM;
+		vals = keys + records;
 	}
-	memcpy(buffer, original->object.data, sb->s_blocksize);
-	dup->object.data = buffer;
 
-	*duplicate = dup;
-	return 0;
+	/* Shrink the table of contents if it got too big */
+	toc_entry_size = fixed ? sizeof(struct apfs_kvoff) : sizeof(struct apfs_kvloc);
+	toc_size = apfs_node_min_table_size(sb, node->tree_type, node->flags);
+	if (toc_size < toc_entry_size * records)
+		toc_size = toc_entry_size * round_up(records, APFS_BTREE_TOC_ENTRY_INCREMENT);
+	new_key = min_t(int, node->key, sizeof(*raw) + toc_size);
+
+	value_end = sb->s_blocksize;
+	if (apfs_node_is_root(node))
+		value_end -= sizeof(struct apfs_btree_info);
+
+	/*
+	 * Empty keys and values are possible here, for ghosts and for the
+	 * record that is being replaced. They have nothing to move.
+	 */
+	val_count = 0;
+	for (i = 0; i < records; ++i) {
+		struct apfs_node_area *val = &vals[val_count];
+
+		keys[i].index = i;
+		keys[i].len = apfs_node_locate_key(node, i, &keys[i].off);
+		if (!keys[i].len)
+			keys[i].off = node->key;
+
+		val->index = i;
+		val->len = apfs_node_locate_data(node, i, &val->off);
+		if (val->len)
+			++val_count;
+	}
+	sort(keys, records, sizeof(*keys), apfs_node_area_cmp, NULL);
+	sort(vals, val_count, sizeof(*vals), apfs_node_area_cmp, NULL);
+
+	/* Check for overlaps first, so that a corrupted node is left alone */
+	prev_end = node->key;
+	for (i = 0; i < records; ++i) {
+		if (!keys[i].len)
+			continue;
+		if (keys[i].off < prev_end) {
+			apfs_err(sb, "overlapping keys in node 0x%llx", node->object.block_nr);
+			goto out;
+		}
+		prev_end = keys[i].off + keys[i].len;
+	}
+	prev_end = value_end;
+	for (i = val_count - 1; i >= 0; --i) {
+		if (vals[i].off + vals[i].len > prev_end) {
+			apfs_err(sb, "overlapping values in node 0x%llx", node->object.block_nr);
+			goto out;
+		}
+		prev_end = vals[i].off;
+	}
+
+	/* The keys go down in order, so none can get overwritten */
+	cursor = new_key;
+	for (i = 0; i < records; ++i) {
+		struct apfs_node_area *key = &keys[i];
+
+		memmove((char *)raw + cursor, (char *)raw + key->off, key->len);
+		if (fixed)
+			((struct apfs_kvoff *)raw->btn_data + key->index)->k = cpu_to_le16(cursor - new_key);
+		else
+			((struct apfs_kvloc *)raw->btn_data + key->index)->k.off = cpu_to_le16(cursor - new_key);
+		cursor += key->len;
+	}
+	node->key = new_key;
+	node->free = cursor;
+
+	/* The values go up, starting from the one closest to the end */
+	cursor = value_end;
+	for (i = val_count - 1; i >= 0; --i) {
+		struct apfs_node_area *val = &vals[i];
+
+		cursor -= val->len;
+		memmove((char *)raw + cursor, (char *)raw + val->off, val->len);
+		if (fixed)
+			((struct apfs_kvoff *)raw->btn_data + val->index)->v = cpu_to_le16(value_end - cursor);
+		else
+			((struct apfs_kvloc *)raw->btn_data + val->index)->v.off = cpu_to_le16(value_end - cursor);
+	}
+	node->data = cursor;
+
+	/* Point the empty values to the start of the area, like new ones */
+	for (i = 0; i < records && !fixed; ++i) {
+		struct apfs_kvloc *kvloc = (struct apfs_kvloc *)raw->btn_data + i;
+
+		if (!kvloc->v.len)
+			kvloc->v.off = cpu_to_le16(value_end - cursor);
+	}
+
+	node->records = records;
+	node->key_free_list_len = 0;
+	node->val_free_list_len = 0;
+	err = 0;
+out:
+	kfree(keys);
+	return err;
+}
+
+/**
+ * apfs_node_split_point - Decide how many records stay in a node being split
+ * @query: query pointing to the node
+ *
+ * Records that get appended at the end of the tree will never be followed by
+ * others in the same node, so a split puts only the last one in the new node
+ * and leaves the original one full. The same is done for the nodes that fill
+ * up during a batch insertion, with the split right after the insertion point.
+ * In all other cases the records are divided in half, as usual.
+ */
+static int apfs_node_split_point(struct apfs_query *query)
+{
+	struct apfs_query *parent = NULL;
+	int record_count = query->node->records;
+
+	if (query->index == record_count - 1) {
+		if (query->flags & APFS_QUERY_SEQ)
+			return record_count - 1;
+		for (parent = query->parent; parent; parent = parent->parent) {
+			if (parent->index != parent->node->records - 1)
+				break;
+		}
+		if (!parent)
+			return record_count - 1;
+	} else if (query->flags & APFS_QUERY_SEQ && query->index >= 0) {
+		return query->index + 1;
+	}
+	return record_count - record_count / 2;
 }
 
 /**
@@ -1291,7 +1719,7 @@ static int apfs_node_temp_dup(const struct apfs_node *original, struct apfs_node
 int apfs_node_split(struct apfs_query *query)
 {
 	struct super_block *sb = query->node->object.sb;
-	struct apfs_node *old_node = NULL, *new_node = NULL, *tmp_node = NULL;
+	struct apfs_node *old_node = NULL, *new_node = NULL;
 	struct apfs_btree_node_phys *new_raw = NULL, *old_raw = NULL;
 	u32 storage = apfs_query_storage(query);
 	int record_count, new_rec_count, old_rec_count;
@@ -1314,22 +1742,14 @@ int apfs_node_split(struct apfs_query *query)
 	old_raw = (void *)old_node->object.data;
 	apfs_assert_in_transaction(sb, &old_raw->btn_o);
 
-	/*
-	 * To defragment the original node, we put all records in a temporary
-	 * in-memory node before dealing them out.
-	 */
-	err = apfs_node_temp_dup(old_node, &tmp_node);
-	if (err)
-		return err;
-
 	record_count = old_node->records;
 	if (record_count == 1) {
 		apfs_alert(sb, "splitting node with a single record");
-		err = -EFSCORRUPTED;
-		goto out;
+		return -EFSCORRUPTED;
 	}
-	new_rec_count = record_count / 2;
-	old_rec_count = record_count - new_rec_count;
+	trace_apfs_node_split(sb, old_node->object.oid, record_count);
+	old_rec_count = apfs_node_split_point(query);
+	new_rec_count = record_count - old_rec_count;
 
 	/*
 	 * The second half of the records go into a new node. This is done
@@ -1349,7 +1769,7 @@ int apfs_node_split(struct apfs_query *query)
 	new_node->records = 0;
 	new_node->key_free_list_len = 0;
 	new_node->val_free_list_len = 0;
-	err = apfs_copy_record_range(new_node, tmp_node, old_rec_count, record_count);
+	err = apfs_copy_record_range(new_node, old_node, old_rec_count, record_count);
 	if (err) {
 		apfs_err(sb, "record copy failed");
 		goto out;
@@ -1378,15 +1798,12 @@ int apfs_node_split(struct apfs_query *query)
 
 	/*
 	 * No more risk of ancestor splits, now actual changes can be made. The
-	 * first half of the records go into the original node.
+	 * first half of the records stay in the original node, which gets
+	 * defragmented in place.
 	 */
-
-	old_node->records = 0;
-	old_node->key_free_list_len = 0;
-	old_node->val_free_list_len = 0;
-	err = apfs_copy_record_range(old_node, tmp_node, 0, old_rec_count);
+	err = apfs_node_compact(old_node, old_rec_count);
 	if (err) {
-		apfs_err(sb, "record copy failed");
+		apfs_err(sb, "node compaction failed");
 		goto out;
 	}
 	apfs_update_node(old_node);
@@ -1411,7 +1828,6 @@ int apfs_node_split(struct apfs_query *query)
 
 out:
 	apfs_node_free(new_node);
-	apfs_node_free(tmp_node);
 	return err;
 }
 
@@ -1688,28 +2104,17 @@ static int apfs_defragment_node(struct apfs_node *node)
 {
 	struct super_block *sb = node->object.sb;
 	struct apfs_btree_node_phys *node_raw = (void *)node->object.data;
-	struct apfs_node *tmp_node = NULL;
-	int record_count, err;
+	int err;
 
 	apfs_assert_in_transaction(sb, &node_raw->btn_o);
 
-	/* Put all records in a temporary in-memory node and deal them out */
-	err = apfs_node_temp_dup(node, &tmp_node);
-	if (err)
-		return err;
-	record_count = node->records;
-	node->records = 0;
-	node->key_free_list_len = 0;
-	node->val_free_list_len = 0;
-	err = apfs_copy_record_range(node, tmp_node, 0, record_count);
+	err = apfs_node_compact(node, node->records);
 	if (err) {
-		apfs_err(sb, "record copy failed");
-		goto fail;
+		apfs_err(sb, "node compaction failed");
+		return err;
 	}
 	apfs_update_node(node);
-fail:
-	apfs_node_free(tmp_node);
-	return err;
+	return 0;
 }
 
 /**
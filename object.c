@@ -5,7 +5,15 @@
 
 #include <linux/buffer_head.h>
 #include <linux/fs.h>
+#include <linux/version.h>
+#include <linux/vmalloc.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
+#include <linux/unaligned.h>
+#else
+#include <asm/unaligned.h>
+#endif
 #include "apfs.h"
+#include "trace.h"
 
 /*
  * Note that this is not a generic implementation of fletcher64, as it assumes
@@ -13,20 +21,57 @@
  * for apfs, though, since the block size is limited to 2^16.  For a more
  * generic optimized implementation, see Nakassis (1988).
  */
-static u64 apfs_fletcher64(void *addr, size_t len)
+static void apfs_fletcher64_scalar(const __le32 *buff, size_t count, u64 *sum1_p, u64 *sum2_p)
 {
-	__le32 *buff = addr;
-	u64 sum1 = 0;
-	u64 sum2 = 0;
-	u64 c1, c2;
-	int i, count_32;
+	u64 sum1 = *sum1_p;
+	u64 sum2 = *sum2_p;
+	size_t i;
 
-	count_32 = len >> 2;
-	for (i = 0; i < count_32; i++) {
+	for (i = 0; i < count; i++) {
 		sum1 += le32_to_cpu(buff[i]);
 		sum2 += sum1;
 	}
 
+	*sum1_p = sum1;
+	*sum2_p = sum2;
+}
+
+/*
+ * Same as apfs_fletcher64_scalar(), but eight words at a time, loaded in
+ * pairs. Each word adds to sum2 a multiple of itself that only depends on its
+ * position in the group, so the additions don't need to wait for each other.
+ */
+static void apfs_fletcher64_wide(const __le32 *buff, size_t count, u64 *sum1_p, u64 *sum2_p)
+{
+	const __le64 *wide = (const __le64 *)buff;
+	u64 sum1 = *sum1_p;
+	u64 sum2 = *sum2_p;
+	size_t i;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		u64 w01 = get_unaligned_le64(wide++);
+		u64 w23 = get_unaligned_le64(wide++);
+		u64 w45 = get_unaligned_le64(wide++);
+		u64 w67 = get_unaligned_le64(wide++);
+		u64 w0 = lower_32_bits(w01), w1 = upper_32_bits(w01);
+		u64 w2 = lower_32_bits(w23), w3 = upper_32_bits(w23);
+		u64 w4 = lower_32_bits(w45), w5 = upper_32_bits(w45);
+		u64 w6 = lower_32_bits(w67), w7 = upper_32_bits(w67);
+
+		sum2 += (sum1 << 3) + 8 * w0 + 7 * w1 + 6 * w2 + 5 * w3 +
+			4 * w4 + 3 * w5 + 2 * w6 + w7;
+		sum1 += w0 + w1 + w2 + w3 + w4 + w5 + w6 + w7;
+	}
+
+	*sum1_p = sum1;
+	*sum2_p = sum2;
+	apfs_fletcher64_scalar(buff + i, count - i, sum1_p, sum2_p);
+}
+
+static u64 apfs_fletcher64_finish(u64 sum1, u64 sum2)
+{
+	u64 c1, c2;
+
 	c1 = sum1 + sum2;
 	c1 = 0xFFFFFFFF - do_div(c1, 0xFFFFFFFF);
 	c2 = sum1 + c1;
@@ -35,6 +80,106 @@ static u64 apfs_fletcher64(void *addr, size_t len)
 	return (c2 << 32) | c1;
 }
 
+static u64 apfs_fletcher64(void *addr, size_t len)
+{
+	u64 sum1 = 0;
+	u64 sum2 = 0;
+
+	apfs_fletcher64_wide(addr, len >> 2, &sum1, &sum2);
+	return apfs_fletcher64_finish(sum1, sum2);
+}
+
+/**
+ * apfs_fletcher64_selftest - Check the checksum implementations against each other
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+int __init apfs_fletcher64_selftest(void)
+{
+	static const size_t lens[] __initconst = {
+		4, 28, 32, 36, 4096 - APFS_MAX_CKSUM_SIZE, 4096,
+		APFS_COMPRESS_BLOCK - APFS_MAX_CKSUM_SIZE,
+	};
+	u32 *buf = NULL;
+	u32 seed = 0x41504653;
+	int pattern, i, err = 0;
+
+	buf = vmalloc(APFS_COMPRESS_BLOCK);
+	if (!buf)
+		return -ENOMEM;
+
+	/* Test random data, and all ones to check for overflow */
+	for (pattern = 0; pattern < 2; pattern++) {
+		for (i = 0; i < APFS_COMPRESS_BLOCK / sizeof(*buf); i++) {
+			seed = seed * 1103515245 + 12345;
+			buf[i] = pattern ? 0xFFFFFFFF : seed;
+		}
+
+		for (i = 0; i < ARRAY_SIZE(lens); i++) {
+			u64 sum1 = 0, sum2 = 0;
+			u64 ref, wide;
+
+			/* Also check an unaligned start */
+			apfs_fletcher64_scalar((__le32 *)buf + 1, lens[i] >> 2, &sum1, &sum2);
+			ref = apfs_fletcher64_finish(sum1, sum2);
+			wide = apfs_fletcher64((__le32 *)buf + 1, lens[i]);
+			if (ref != wide) {
+				pr_err("APFS: fletcher64 self-test failed for length %zu\n", lens[i]);
+				err = -EINVAL;
+				goto out;
+			}
+		}
+	}
+
+out:
+	vfree(buf);
+	return err;
+}
+
+/**
+ * apfs_fletcher64_bench - Time the checksum implementations
+ *
+ * Reports the best of a few runs over the same pseudorandom block, so that the
+ * numbers can be compared between builds on the same machine.
+ */
+void __init apfs_fletcher64_bench(void)
+{
+	u32 *buf = NULL;
+	u32 seed = 0x41504653;
+	u64 best_scalar = U64_MAX, best_wide = U64_MAX, sink = 0;
+	int run, i;
+
+	buf = vmalloc(4096);
+	if (!buf)
+		return;
+	for (i = 0; i < 4096 / sizeof(*buf); i++) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = seed;
+	}
+
+	for (run = 0; run < APFS_BENCH_RUNS; run++) {
+		u64 start;
+
+		start = ktime_get_ns();
+		for (i = 0; i < APFS_BENCH_ITERS; i++) {
+			u64 sum1 = 0, sum2 = 0;
+
+			apfs_fletcher64_scalar((__le32 *)buf, 4096 >> 2, &sum1, &sum2);
+			sink += apfs_fletcher64_finish(sum1, sum2);
+		}
+		best_scalar = min(best_scalar, ktime_get_ns() - start);
+
+		start = ktime_get_ns();
+		for (i = 0; i < APFS_BENCH_ITERS; i++)
+			sink += apfs_fletcher64(buf, 4096);
+		best_wide = min(best_wide, ktime_get_ns() - start);
+	}
+	vfree(buf);
+
+	pr_info("APFS: bench: fletcher64 of 4096 bytes: scalar %llu ns, wide %llu ns (%llx)\n",
+		div_u64(best_scalar, APFS_BENCH_ITERS), div_u64(best_wide, APFS_BENCH_ITERS), sink);
+}
+
 int apfs_obj_verify_csum(struct super_block *sb, struct buffer_head *bh)
 {
 	/* The checksum may be stale until the transaction is committed */
@@ -275,6 +420,8 @@ struct buffer_head *apfs_read_object_block(struct super_block *sb, u64 bno, bool
 		goto fail;
 	}
 	memcpy(new_bh->b_data, bh->b_data, sb->s_blocksize);
+	trace_apfs_cow(sb, type, bno, new_bno);
+	apfs_nx_stat_inc(nxi, cows);
 
 	/*
 	 * Don't free the old copy of the object if it's part of a snapshot.
@@ -288,7 +435,7 @@ struct buffer_head *apfs_read_object_block(struct super_block *sb, u64 bno, bool
 	} else if ((type & APFS_OBJECT_TYPE_MASK) != APFS_OBJECT_TYPE_FS) {
 		vsb_raw = APFS_SB(sb)->s_vsb_raw;
 		apfs_assert_in_transaction(sb, &vsb_raw->apfs_o);
-		le64_add_cpu(&vsb_raw->apfs_fs_alloc_count, 1);
+		apfs_alloc_count_add(sb, 1);
 		le64_add_cpu(&vsb_raw->apfs_total_blocks_alloced, 1);
 	}
 
@@ -610,3 +610,479 @@ fail:
 	apfs_node_free(snap_root);
 	return err;
 }
+
+/* Most ranges returned by a single call to the snapshot diff ioctl */
+#define APFS_SNAP_DIFF_MAX_RANGES	4096
+
+/*
+ * State for a walk of the catalog in search of changes since a snapshot
+ */
+struct apfs_snap_diff_ctx {
+	struct super_block *sb;
+	u64 base_xid;		/* Transaction id for the base snapshot */
+	u64 pos;		/* First object id to report */
+	struct apfs_ioctl_snap_diff_range *ranges;
+	u32 max;		/* Capacity of @ranges */
+	u32 count;		/* Number of ranges found so far */
+	bool full;		/* Is there a range that didn't fit? */
+};
+
+/**
+ * apfs_snap_diff_emit - Report a range of object ids with possible changes
+ * @ctx:	diff context
+ * @start:	first object id in the range
+ * @end:	last object id in the range
+ *
+ * Ranges are found in increasing order, so they get merged with the previous
+ * one whenever possible. Once there is no room left, @ctx->pos is set to the
+ * start of the first range lost.
+ */
+static void apfs_snap_diff_emit(struct apfs_snap_diff_ctx *ctx, u64 start, u64 end)
+{
+	struct apfs_ioctl_snap_diff_range *last = NULL;
+
+	if (ctx->full || end < ctx->pos)
+		return;
+	start = max(start, ctx->pos);
+
+	if (ctx->count) {
+		last = &ctx->ranges[ctx->count - 1];
+		if (last->end == U64_MAX || start <= last->end + 1) {
+			last->end = max(last->end, end);
+			return;
+		}
+	}
+	if (ctx->count == ctx->max) {
+		ctx->full = true;
+		ctx->pos = start;
+		return;
+	}
+	ctx->ranges[ctx->count].start = start;
+	ctx->ranges[ctx->count].end = end;
+	++ctx->count;
+}
+
+/**
+ * apfs_snap_diff_key_id - Read the object id for a key in a catalog node
+ * @node:	the node
+ * @index:	index of the record
+ * @id:		on return, the object id
+ *
+ * Returns 0 on success or a negative error code in case of failure.
+ */
+static int apfs_snap_diff_key_id(struct apfs_node *node, int index, u64 *id)
+{
+	struct super_block *sb = node->object.sb;
+	struct apfs_key key;
+	int off, len, err;
+
+	len = apfs_node_locate_key(node, index, &off);
+	if (!len) {
+		apfs_err(sb, "bad key in node 0x%llx", node->object.oid);
+		return -EFSCORRUPTED;
+	}
+	err = apfs_read_cat_key(node->object.data + off, len, &key, apfs_is_normalization_insensitive(sb));
+	if (err) {
+		apfs_err(sb, "bad key in node 0x%llx", node->object.oid);
+		return err;
+	}
+	*id = key.id;
+	return 0;
+}
+
+/**
+ * apfs_snap_diff_child - Read a child id from an index node of the catalog
+ * @node:	the node
+ * @index:	index of the record
+ * @child:	on return, the child id
+ *
+ * Returns 0 on success or a negative error code in case of failure.
+ */
+static int apfs_snap_diff_child(struct apfs_node *node, int index, u64 *child)
+{
+	struct apfs_query tmp = {0};
+
+	tmp.node = node;
+	tmp.flags = APFS_QUERY_CAT;
+	tmp.index = index;
+	tmp.len = apfs_node_locate_data(node, index, &tmp.off);
+	return apfs_child_from_query(&tmp, child);
+}
+
+/**
+ * apfs_snap_diff_child_bounds - Get the key range for a child of an index node
+ * @node:	the index node
+ * @index:	index of the child
+ * @lo:		on return, first id for the child, or 0 for the start of the node
+ * @hi:		on return, id for the next child, or U64_MAX for the end of the node
+ *
+ * Returns 0 on success or a negative error code in case of failure.
+ */
+static int apfs_snap_diff_child_bounds(struct apfs_node *node, int index, u64 *lo, u64 *hi)
+{
+	int err;
+
+	*lo = 0;
+	*hi = U64_MAX;
+	if (index != 0) {
+		err = apfs_snap_diff_key_id(node, index, lo);
+		if (err)
+			return err;
+	}
+	if (index + 1 < node->records) {
+		err = apfs_snap_diff_key_id(node, index + 1, hi);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+/**
+ * apfs_snap_diff_moved_children - Check if the children of an index node moved
+ * @node:	current version of the index node
+ * @base_bno:	block number for the version in the base snapshot
+ * @moved:	on return, true if a child from the base is no longer there, or
+ *		its key range is not the same
+ *
+ * The range of a child that got removed is absorbed by its siblings, which may
+ * be unchanged. The same happens to the first records of a leaf that get
+ * deleted, because the parent key moves forward to match the new first key.
+ * The whole node must be reported in both cases. Returns 0 on success or a
+ * negative error code in case of failure.
+ */
+static int apfs_snap_diff_moved_children(struct apfs_node *node, u64 base_bno, bool *moved)
+{
+	struct super_block *sb = node->object.sb;
+	struct apfs_node *base = NULL;
+	u64 *children = NULL;
+	u64 child, lo, hi, base_lo, base_hi;
+	int i, j, err = 0;
+
+	*moved = false;
+	if (node->records == 0)
+		return 0;
+
+	/* Old versions are physically addressed inside the snapshot */
+	base = apfs_read_node(sb, base_bno, APFS_OBJ_PHYSICAL, false /* write */);
+	if (IS_ERR(base)) {
+		apfs_err(sb, "failed to read base version of node 0x%llx", node->object.oid);
+		return PTR_ERR(base);
+	}
+
+	children = kmalloc_array(node->records, sizeof(*children), GFP_KERNEL);
+	if (!children) {
+		err = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < node->records; ++i) {
+		err = apfs_snap_diff_child(node, i, &children[i]);
+		if (err)
+			goto out;
+	}
+
+	for (j = 0; j < base->records; ++j) {
+		err = apfs_snap_diff_child(base, j, &child);
+		if (err)
+			goto out;
+		for (i = 0; i < node->records; ++i) {
+			if (children[i] == child)
+				break;
+		}
+		if (i == node->records) {
+			*moved = true;
+			break;
+		}
+
+		err = apfs_snap_diff_child_bounds(base, j, &base_lo, &base_hi);
+		if (err)
+			goto out;
+		err = apfs_snap_diff_child_bounds(node, i, &lo, &hi);
+		if (err)
+			goto out;
+		if (lo != base_lo || hi != base_hi) {
+			*moved = true;
+			break;
+		}
+	}
+
+out:
+	kfree(children);
+	apfs_node_free(base);
+	return err;
+}
+
+/**
+ * apfs_snap_diff_changed - Check if a catalog node changed since the base
+ * @ctx:	diff context
+ * @oid:	object id for the node
+ * @changed:	on return, true if the current version is newer than the base
+ * @base_bno:	on return, block number for the version in the base snapshot,
+ *		or 0 if the node didn't exist back then
+ *
+ * This only needs the object map, so the nodes themselves don't get read.
+ * Returns 0 on success or a negative error code in case of failure.
+ */
+static int apfs_snap_diff_changed(struct apfs_snap_diff_ctx *ctx, u64 oid, bool *changed, u64 *base_bno)
+{
+	struct super_block *sb = ctx->sb;
+	struct apfs_omap *omap = APFS_SB(sb)->s_omap;
+	u64 bno, xid;
+	int err;
+
+	err = apfs_omap_lookup_version(sb, omap, oid, -1, &bno, &xid);
+	if (err) {
+		apfs_err(sb, "omap lookup failed for oid 0x%llx", oid);
+		return err;
+	}
+	*changed = xid > ctx->base_xid;
+	if (!base_bno)
+		return 0;
+	*base_bno = 0;
+	if (!*changed)
+		return 0;
+
+	err = apfs_omap_lookup_version(sb, omap, oid, ctx->base_xid, &bno, &xid);
+	if (err == -ENODATA)
+		return 0;
+	if (err) {
+		apfs_err(sb, "omap lookup failed for oid 0x%llx", oid);
+		return err;
+	}
+	*base_bno = bno;
+	return 0;
+}
+
+/**
+ * apfs_snap_diff_walk - Report changes in a subtree of the catalog
+ * @ctx:	diff context
+ * @oid:	object id for the root of the subtree
+ * @start:	first object id that may be stored in the subtree
+ * @end:	last object id that may be stored in the subtree
+ * @depth:	depth of the subtree root, to put a limit on recursion
+ *
+ * Virtual nodes get copied without touching their parents, so every index node
+ * must be visited, but a leaf is only checked against the object map. Returns
+ * 0 on success or a negative error code in case of failure.
+ */
+static int apfs_snap_diff_walk(struct apfs_snap_diff_ctx *ctx, u64 oid, u64 start, u64 end, int depth)
+{
+	struct super_block *sb = ctx->sb;
+	struct apfs_node *node = NULL;
+	struct apfs_btree_node_phys *raw = NULL;
+	u64 base_bno = 0;
+	bool changed, moved;
+	int i, err;
+
+	if (depth >= 12) {
+		apfs_err(sb, "catalog is too deep");
+		return -EFSCORRUPTED;
+	}
+
+	err = apfs_snap_diff_changed(ctx, oid, &changed, &base_bno);
+	if (err)
+		return err;
+
+	node = apfs_read_node(sb, oid, APFS_OBJ_VIRTUAL, false /* write */);
+	if (IS_ERR(node)) {
+		apfs_err(sb, "failed to read catalog node 0x%llx", oid);
+		return PTR_ERR(node);
+	}
+	if (apfs_node_is_leaf(node)) {
+		/* Only the root can get here */
+		if (changed)
+			apfs_snap_diff_emit(ctx, start, end);
+		goto out;
+	}
+
+	if (changed) {
+		if (!base_bno) {
+			/* The node is new, so don't even try to be precise */
+			apfs_snap_diff_emit(ctx, start, end);
+			goto out;
+		}
+		err = apfs_snap_diff_moved_children(node, base_bno, &moved);
+		if (err)
+			goto out;
+		if (moved) {
+			apfs_snap_diff_emit(ctx, start, end);
+			goto out;
+		}
+	}
+
+	raw = (struct apfs_btree_node_phys *)node->object.data;
+	for (i = 0; i < node->records && !ctx->full; ++i) {
+		u64 child_start = start, child_end = end, child;
+
+		/* Records for a single id may be split between siblings */
+		if (i + 1 < node->records) {
+			err = apfs_snap_diff_key_id(node, i + 1, &child_end);
+			if (err)
+				goto out;
+		}
+		if (child_end < ctx->pos)
+			continue;
+		if (i != 0) {
+			err = apfs_snap_diff_key_id(node, i, &child_start);
+			if (err)
+				goto out;
+		}
+
+		err = apfs_snap_diff_child(node, i, &child);
+		if (err) {
+			apfs_alert(sb, "bad index block: 0x%llx", node->object.block_nr);
+			goto out;
+		}
+
+		if (le16_to_cpu(raw->btn_level) != 1) {
+			err = apfs_snap_diff_walk(ctx, child, child_start, child_end, depth + 1);
+			if (err)
+				goto out;
+			continue;
+		}
+
+		err = apfs_snap_diff_changed(ctx, child, &changed, NULL /* base_bno */);
+		if (err)
+			goto out;
+		if (changed)
+			apfs_snap_diff_emit(ctx, child_start, child_end);
+	}
+
+out:
+	apfs_node_free(node);
+	return err;
+}
+
+/**
+ * apfs_do_snap_diff - Find the catalog ranges that changed since a snapshot
+ * @sb:		superblock structure
+ * @name:	name of the base snapshot
+ * @ctx:	diff context
+ *
+ * Returns 0 on success or a negative error code in case of failure.
+ */
+static int apfs_do_snap_diff(struct super_block *sb, const char *name, struct apfs_snap_diff_ctx *ctx)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_superblock *vsb_raw = NULL;
+	struct apfs_node *snap_root = NULL;
+	u64 snap_root_oid;
+	int err;
+
+	down_read(apfs_vol_sem(sb));
+
+	vsb_raw = sbi->s_vsb_raw;
+	snap_root_oid = le64_to_cpu(vsb_raw->apfs_snap_meta_tree_oid);
+	vsb_raw = NULL;
+	snap_root = apfs_read_node(sb, snap_root_oid, APFS_OBJ_PHYSICAL, false /* write */);
+	if (IS_ERR(snap_root)) {
+		apfs_err(sb, "failed to read snap meta root 0x%llx", snap_root_oid);
+		err = PTR_ERR(snap_root);
+		snap_root = NULL;
+		goto out;
+	}
+	err = apfs_snapshot_name_to_xid(snap_root, name, &ctx->base_xid);
+	if (err) {
+		if (err == -ENODATA) {
+			apfs_info(sb, "no snapshot under that name (%s)", name);
+			err = -ENOENT;
+		}
+		goto out;
+	}
+
+	err = apfs_snap_diff_walk(ctx, sbi->s_cat_root->object.oid, 0, U64_MAX, 0 /* depth */);
+
+out:
+	apfs_node_free(snap_root);
+	up_read(apfs_vol_sem(sb));
+	return err;
+}
+
+/**
+ * apfs_ioc_snap_diff - Ioctl handler for APFS_IOC_SNAP_DIFF
+ * @file:	affected file
+ * @arg:	ioctl argument
+ *
+ * Reports the ranges of object ids whose catalog records, file extents
+ * included, may have changed since the given snapshot was taken. The walk
+ * starts at the position from the argument and stops when the buffer fills
+ * up, so that it can be resumed by calling again. Returns 0 on success, or a
+ * negative error code in case of failure.
+ */
+int apfs_ioc_snap_diff(struct file *file, void __user *user_arg)
+{
+	struct inode *inode = file_inode(file);
+	struct super_block *sb = inode->i_sb;
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_ioctl_snap_diff *arg = NULL;
+	struct apfs_snap_diff_ctx ctx = {0};
+	size_t name_len;
+	int err;
+
+	if (apfs_ino(inode) != APFS_ROOT_DIR_INO_NUM) {
+		apfs_info(sb, "snapshot diff must be requested on mountpoint");
+		return -ENOTTY;
+	}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 12, 0)
+	if (!inode_owner_or_capable(inode))
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0)
+	if (!inode_owner_or_capable(&init_user_ns, inode))
+#else
+	if (!inode_owner_or_capable(&nop_mnt_idmap, inode))
+#endif
+		return -EPERM;
+
+	/* Snapshots have no snapshots, and sealed catalogs are immutable */
+	if (sbi->s_snap_name || apfs_is_sealed(sb))
+		return -EOPNOTSUPP;
+
+	arg = kzalloc(sizeof(*arg), GFP_KERNEL);
+	if (!arg)
+		return -ENOMEM;
+	if (copy_from_user(arg, user_arg, sizeof(*arg))) {
+		err = -EFAULT;
+		goto fail;
+	}
+
+	name_len = strnlen(arg->name, sizeof(arg->name));
+	if (name_len == sizeof(arg->name)) {
+		apfs_warn(sb, "snapshot name is too long (%d)", (int)name_len);
+		err = -EINVAL;
+		goto fail;
+	}
+	if (arg->count == 0) {
+		err = -EINVAL;
+		goto fail;
+	}
+
+	ctx.sb = sb;
+	ctx.pos = arg->pos;
+	ctx.max = min_t(u32, arg->count, APFS_SNAP_DIFF_MAX_RANGES);
+	ctx.ranges = kvmalloc_array(ctx.max, sizeof(*ctx.ranges), GFP_KERNEL);
+	if (!ctx.ranges) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	err = apfs_do_snap_diff(sb, arg->name, &ctx);
+	if (err)
+		goto fail;
+
+	if (copy_to_user(u64_to_user_ptr(arg->buf), ctx.ranges, ctx.count * sizeof(*ctx.ranges))) {
+		err = -EFAULT;
+		goto fail;
+	}
+	arg->count = ctx.count;
+	arg->flags = 0;
+	if (ctx.full)
+		arg->pos = ctx.pos;
+	else
+		arg->flags |= APFS_SNAP_DIFF_EOF;
+	if (copy_to_user(user_arg, arg, sizeof(*arg)))
+		err = -EFAULT;
+
+fail:
+	kvfree(ctx.ranges);
+	kfree(arg);
+	return err;
+}
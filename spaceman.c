@@ -3,10 +3,12 @@
  * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
  */
 
+#include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/fs.h>
 #include <linux/slab.h>
 #include "apfs.h"
+#include "trace.h"
 
 /**
  * apfs_spaceman_read_cib_addr - Get the address of a cib from the spaceman
@@ -93,6 +95,20 @@ static int apfs_read_spaceman_dev(struct super_block *sb,
 		return -EFSCORRUPTED;
 	}
 
+	/* The summary is kept across transactions, and filled as cibs are read */
+	if (!spaceman->sm_cib_max_free || spaceman->sm_cib_summary_len != spaceman->sm_cib_count) {
+		u32 i;
+
+		kfree(spaceman->sm_cib_max_free);
+		spaceman->sm_cib_summary_len = 0;
+		spaceman->sm_cib_max_free = kmalloc_array(spaceman->sm_cib_count, sizeof(u32), GFP_KERNEL);
+		if (!spaceman->sm_cib_max_free) /* Not needed, just slower */
+			return 0;
+		for (i = 0; i < spaceman->sm_cib_count; ++i)
+			spaceman->sm_cib_max_free[i] = APFS_CIB_FREE_UNKNOWN;
+		spaceman->sm_cib_summary_len = spaceman->sm_cib_count;
+	}
+
 	return 0;
 }
 
@@ -259,6 +275,33 @@ out:
 	return err;
 }
 
+/**
+ * apfs_readahead_ip_bitmaps - Start reading all the current ip bitmaps
+ * @sb: superblock structure
+ *
+ * The bitmaps are only read from disk by the first transaction after mount,
+ * so don't make it wait for each one in turn.
+ */
+static void apfs_readahead_ip_bitmaps(struct super_block *sb)
+{
+	struct apfs_spaceman *spaceman = APFS_SM(sb);
+	struct apfs_spaceman_phys *sm_raw = spaceman->sm_raw;
+	u64 ring_base = le64_to_cpu(sm_raw->sm_ip_bm_base);
+	u32 ip_bitmap_off = le32_to_cpu(sm_raw->sm_ip_bitmap_offset);
+	struct blk_plug plug;
+	__le16 *ip_bitmap_p = NULL;
+	u32 i;
+
+	blk_start_plug(&plug);
+	for (i = 0; i < spaceman->sm_ip_bmaps_count; ++i) {
+		ip_bitmap_p = apfs_spaceman_get_16(sb, ip_bitmap_off + i * sizeof(*ip_bitmap_p));
+		if (!ip_bitmap_p) /* Reported by the rotation */
+			break;
+		apfs_sb_breadahead(sb, ring_base + le16_to_cpup(ip_bitmap_p));
+	}
+	blk_finish_plug(&plug);
+}
+
 /**
  * apfs_rotate_ip_bitmaps - Allocate new ip bitmaps from the circular buffer
  * @sb: superblock structure
@@ -296,6 +339,8 @@ static int apfs_rotate_ip_bitmaps(struct super_block *sb)
 		return -ENOSPC;
 	}
 
+	apfs_readahead_ip_bitmaps(sb);
+
 	for (i = 0; i < bmaps_count; ++i) {
 		err = apfs_rotate_single_ip_bitmap(sb, i);
 		if (err) {
@@ -393,9 +438,34 @@ static int apfs_ip_mark_free(struct super_block *sb, u64 bno)
 }
 
 /*
- * apfs_main_free - Mark a regular block as free
+ * apfs_main_free_extent - Mark a run of regular blocks as free
  */
-static int apfs_main_free(struct super_block *sb, u64 bno);
+static int apfs_main_free_extent(struct super_block *sb, u64 bno, u64 count);
+
+/**
+ * apfs_main_run_length - Count the regular blocks that can be freed together
+ * @sm:		in-memory spaceman structure
+ * @bno:	first block number (must not belong to the ip)
+ * @end:	block number right after the end of the range
+ *
+ * Returns the length of the longest run of main blocks that starts at @bno,
+ * ends before @end, and stays inside a single chunk, so that its bitmap can be
+ * updated all at once.
+ */
+static u64 apfs_main_run_length(struct apfs_spaceman *sm, u64 bno, u64 end)
+{
+	u64 chunk_off = bno;
+	u64 max, len;
+
+	chunk_off = do_div(chunk_off, sm->sm_blocks_per_chunk);
+	max = min_t(u64, end - bno, sm->sm_blocks_per_chunk - chunk_off);
+
+	for (len = 1; len < max; ++len) {
+		if (apfs_block_in_ip(sm, bno + len))
+			break;
+	}
+	return len;
+}
 
 /**
  * apfs_flush_fq_rec - Delete a single fq record and mark its blocks as free
@@ -412,7 +482,7 @@ static int apfs_flush_fq_rec(struct apfs_node *root, u64 xid, u64 *len)
 	struct apfs_spaceman *sm = APFS_SM(sb);
 	struct apfs_query *query = NULL;
 	struct apfs_fq_rec fqrec = {0};
-	u64 bno;
+	u64 bno, end, run;
 	int err;
 
 	query = apfs_alloc_query(root, NULL /* parent */);
@@ -433,11 +503,21 @@ static int apfs_flush_fq_rec(struct apfs_node *root, u64 xid, u64 *len)
 		goto fail;
 	}
 
-	for (bno = fqrec.bno; bno < fqrec.bno + fqrec.len; ++bno) {
-		if (apfs_block_in_ip(sm, bno))
+	if (!sm->sm_blocks_per_chunk) {
+		apfs_err(sb, "block count per chunk not set");
+		err = -EINVAL;
+		goto fail;
+	}
+	end = fqrec.bno + fqrec.len;
+	for (bno = fqrec.bno; bno < end; bno += run) {
+		if (apfs_block_in_ip(sm, bno)) {
+			run = 1;
 			err = apfs_ip_mark_free(sb, bno);
-		else
-			err = apfs_main_free(sb, bno);
+		} else {
+			/* One bitmap update for each chunk, not for each block */
+			run = apfs_main_run_length(sm, bno, end);
+			err = apfs_main_free_extent(sb, bno, run);
+		}
 		if (err) {
 			apfs_err(sb, "freeing block 0x%llx failed (%d)", (unsigned long long)bno, err);
 			goto fail;
@@ -477,6 +557,39 @@ static u64 apfs_free_queue_oldest_xid(struct apfs_node *root)
 	return le64_to_cpu(key->sfqk_xid);
 }
 
+/**
+ * apfs_fq_flush_done - Check if a non-forced free queue flush can stop
+ * @sb:		superblock structure
+ * @qid:	queue being flushed
+ * @recs:	number of records flushed so far
+ */
+static bool apfs_fq_flush_done(struct super_block *sb, unsigned int qid, u64 recs)
+{
+	struct apfs_spaceman_phys *sm_raw = APFS_SM(sb)->sm_raw;
+	u64 sfq_count = le64_to_cpu(sm_raw->sm_fq[qid].sfq_count);
+
+	/*
+	 * Flushing a single transaction may not be enough to avoid running out
+	 * of space in the ip, but it's probably best not to flush all the old
+	 * transactions at once either. We use a harsher version of the
+	 * apfs_transaction_need_commit() check, to make sure we won't be forced
+	 * to commit again right away.
+	 */
+	if (qid == APFS_SFQ_IP)
+		return sfq_count * 6 <= le64_to_cpu(sm_raw->sm_ip_block_count);
+	if (sfq_count <= TRANSACTION_MAIN_QUEUE_MAX - 200)
+		return true;
+
+	/*
+	 * A big delete can leave a long main queue behind. Flushing all of it
+	 * at once would stall whatever operation happens to start the next
+	 * transaction, so spread the work over several of them. Only the
+	 * growth of the queue counts against the commit limits, so a backlog
+	 * is harmless as long as it doesn't get out of hand.
+	 */
+	return recs >= TRANSACTION_FQ_FLUSH_MAX && sfq_count <= TRANSACTION_FQ_BACKLOG_MAX;
+}
+
 /**
  * apfs_flush_free_queue - Free ip blocks queued by old transactions
  * @sb:		superblock structure
@@ -493,7 +606,9 @@ static int apfs_flush_free_queue(struct super_block *sb, unsigned int qid, bool
 	struct apfs_spaceman_free_queue *fq = &sm_raw->sm_fq[qid];
 	struct apfs_node *fq_root;
 	u64 oldest = le64_to_cpu(fq->sfq_oldest_xid);
-	int err;
+	u64 freed = 0, recs = 0;
+	bool done = false;
+	int err = 0;
 
 	fq_root = apfs_read_node(sb, le64_to_cpu(fq->sfq_tree_oid),
 				 APFS_OBJ_EPHEMERAL, true /* write */);
@@ -502,9 +617,7 @@ static int apfs_flush_free_queue(struct super_block *sb, unsigned int qid, bool
 		return PTR_ERR(fq_root);
 	}
 
-	while (oldest) {
-		u64 sfq_count;
-
+	while (oldest && !done) {
 		/*
 		 * Try to preserve one transaction here. I don't really know
 		 * what free queues are for so this is probably silly.
@@ -528,35 +641,46 @@ static int apfs_flush_free_queue(struct super_block *sb, unsigned int qid, bool
 			} else if (err) {
 				apfs_err(sb, "failed to flush fq");
 				goto fail;
-			} else {
-				le64_add_cpu(&fq->sfq_count, -count);
+			}
+			le64_add_cpu(&fq->sfq_count, -count);
+			freed += count;
+			++recs;
+
+			if (!force && apfs_fq_flush_done(sb, qid, recs)) {
+				done = true;
+				break;
 			}
 		}
 		oldest = apfs_free_queue_oldest_xid(fq_root);
 		fq->sfq_oldest_xid = cpu_to_le64(oldest);
-
-		if (force)
-			continue;
-
-		/*
-		 * Flushing a single transaction may not be enough to avoid
-		 * running out of space in the ip, but it's probably best not
-		 * to flush all the old transactions at once either. We use a
-		 * harsher version of the apfs_transaction_need_commit() check,
-		 * to make sure we won't be forced to commit again right away.
-		 */
-		sfq_count = le64_to_cpu(fq->sfq_count);
-		if (qid == APFS_SFQ_IP && sfq_count * 6 <= le64_to_cpu(sm_raw->sm_ip_block_count))
-			break;
-		if (qid == APFS_SFQ_MAIN && sfq_count <= TRANSACTION_MAIN_QUEUE_MAX - 200)
-			break;
 	}
 
 fail:
+	/* A forced flush may shrink the queue below its size at the start */
+	if (qid == APFS_SFQ_MAIN)
+		sm->sm_main_fq_start = min(sm->sm_main_fq_start, le64_to_cpu(fq->sfq_count));
+	trace_apfs_flush_free_queue(sb, qid, freed, err);
 	apfs_node_free(fq_root);
 	return err;
 }
 
+/**
+ * apfs_main_fq_trans_count - Count the main fq blocks added by this transaction
+ * @sb: superblock structure
+ *
+ * The main free queue may still hold a backlog left by older transactions, so
+ * its total size says little about how big the current transaction has grown.
+ */
+u64 apfs_main_fq_trans_count(struct super_block *sb)
+{
+	struct apfs_spaceman *sm = APFS_SM(sb);
+	u64 sfq_count = le64_to_cpu(sm->sm_raw->sm_fq[APFS_SFQ_MAIN].sfq_count);
+
+	if (sfq_count <= sm->sm_main_fq_start)
+		return 0;
+	return sfq_count - sm->sm_main_fq_start;
+}
+
 /**
  * apfs_allocate_spaceman - Allocate an in-memory spaceman struct, if needed
  * @sb:		superblock structure
@@ -665,6 +789,7 @@ int apfs_read_spaceman(struct super_block *sb)
 		apfs_err(sb, "failed to flush ip fq");
 		goto fail;
 	}
+	spaceman->sm_main_fq_start = le64_to_cpu(sm_raw->sm_fq[APFS_SFQ_MAIN].sfq_count);
 	err = apfs_flush_free_queue(sb, APFS_SFQ_MAIN, false /* force */);
 	if (err) {
 		apfs_err(sb, "failed to flush main fq");
@@ -729,22 +854,40 @@ static u64 apfs_ip_find_free(struct super_block *sb)
 }
 
 /**
- * apfs_chunk_find_free - Find a free block inside a chunk
+ * apfs_chunk_find_free - Find a run of free blocks inside a chunk
  * @sb:		superblock structure
  * @bitmap:	allocation bitmap for the chunk, which should have free blocks
  * @addr:	number of the first block in the chunk
+ * @count:	maximum length of the run; on return, the length found
  *
- * Returns the block number for a free block, or 0 in case of corruption.
+ * Picks the first run that is long enough, or the longest one if there is none,
+ * in a single pass over the bitmap. Returns the first block number for the run,
+ * or 0 in case of corruption.
  */
-static u64 apfs_chunk_find_free(struct super_block *sb, char *bitmap, u64 addr)
+static u64 apfs_chunk_find_free(struct super_block *sb, char *bitmap, u64 addr, u64 *count)
 {
-	int bitcount = sb->s_blocksize * 8;
-	u64 bno;
+	unsigned long bitcount = sb->s_blocksize * 8;
+	unsigned long start, end;
+	unsigned long best = 0, best_len = 0;
+
+	start = find_next_zero_bit_le(bitmap, bitcount, 0 /* offset */);
+	while (start < bitcount) {
+		end = find_next_bit_le(bitmap, bitcount, start);
+		if (end - start > best_len) {
+			best = start;
+			best_len = end - start;
+			if (best_len >= *count)
+				break;
+		}
+		if (end >= bitcount)
+			break;
+		start = find_next_zero_bit_le(bitmap, bitcount, end);
+	}
 
-	bno = find_next_zero_bit_le(bitmap, bitcount, 0 /* offset */);
-	if (bno >= bitcount)
+	if (!best_len)
 		return 0;
-	return addr + bno;
+	*count = min_t(u64, *count, best_len);
+	return addr + best;
 }
 
 /**
@@ -967,16 +1110,18 @@ int apfs_free_queue_insert(struct super_block *sb, u64 bno, u64 count)
 }
 
 /**
- * apfs_chunk_alloc_free - Allocate or free block in given CIB and chunk
+ * apfs_chunk_alloc_free - Allocate or free blocks in given CIB and chunk
  * @sb:		superblock structure
  * @cib_bh:	buffer head for the chunk-info block
  * @index:	index of this chunk's info structure inside @cib
- * @bno:	block number
+ * @bno:	first block number
+ * @count:	number of consecutive blocks; for allocations, the maximum, and
+ *		the number actually allocated on return
  * @is_alloc:	true to allocate, false to free
  */
 static int apfs_chunk_alloc_free(struct super_block *sb,
 				 struct buffer_head **cib_bh,
-				 int index, u64 *bno, bool is_alloc)
+				 int index, u64 *bno, u64 *count, bool is_alloc)
 {
 	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
 	struct apfs_spaceman *sm = APFS_SM(sb);
@@ -986,6 +1131,7 @@ static int apfs_chunk_alloc_free(struct super_block *sb,
 	char *bmap = NULL;
 	bool old_cib = false;
 	bool old_bmap = false;
+	u64 i;
 	int err = 0;
 
 	cib = (struct apfs_chunk_info_block *)(*cib_bh)->b_data;
@@ -1100,29 +1246,37 @@ static int apfs_chunk_alloc_free(struct super_block *sb,
 	/* The chunk info can be updated now */
 	apfs_assert_in_transaction(sb, &cib->cib_o);
 	ci->ci_xid = cpu_to_le64(nxi->nx_xid);
-	le32_add_cpu(&ci->ci_free_count, is_alloc ? -1 : 1);
 	ci->ci_bitmap_addr = cpu_to_le64(bmap_bh->b_blocknr);
 	ASSERT(buffer_trans(*cib_bh));
 	set_buffer_csum(*cib_bh);
 
-	/* Finally, allocate / free the actual block that was requested */
+	/* Finally, allocate / free the actual blocks that were requested */
 	if (is_alloc) {
-		*bno = apfs_chunk_find_free(sb, bmap, le64_to_cpu(ci->ci_addr));
+		*bno = apfs_chunk_find_free(sb, bmap, le64_to_cpu(ci->ci_addr), count);
 		if (!*bno) {
 			apfs_err(sb, "no free blocks in chunk");
 			err = -EFSCORRUPTED;
 			goto fail;
 		}
-		apfs_chunk_mark_used(sb, bmap, *bno);
-		sm->sm_free_count -= 1;
-	} else {
-		if (!apfs_chunk_mark_free(sb, bmap, *bno)) {
-			apfs_err(sb, "block already marked as free (0x%llx)", *bno);
-			le32_add_cpu(&ci->ci_free_count, -1);
-			set_buffer_csum(*cib_bh);
+		if (*count > le32_to_cpu(ci->ci_free_count)) {
+			apfs_err(sb, "free count too low in chunk (%u)", le32_to_cpu(ci->ci_free_count));
 			err = -EFSCORRUPTED;
-		} else
-			sm->sm_free_count += 1;
+			goto fail;
+		}
+		for (i = 0; i < *count; i++)
+			apfs_chunk_mark_used(sb, bmap, *bno + i);
+		le32_add_cpu(&ci->ci_free_count, -(u32)*count);
+		sm->sm_free_count -= *count;
+	} else {
+		for (i = 0; i < *count; i++) {
+			if (!apfs_chunk_mark_free(sb, bmap, *bno + i)) {
+				apfs_err(sb, "block already marked as free (0x%llx)", *bno + i);
+				err = -EFSCORRUPTED;
+				break;
+			}
+		}
+		le32_add_cpu(&ci->ci_free_count, (u32)i);
+		sm->sm_free_count += i;
 	}
 	mark_buffer_dirty(bmap_bh);
 
@@ -1132,36 +1286,84 @@ fail:
 }
 
 /**
- * apfs_chunk_allocate_block - Allocate a single block from a chunk
+ * apfs_chunk_allocate_extent - Allocate a run of blocks from a chunk
  * @sb:		superblock structure
  * @cib_bh:	buffer head for the chunk-info block
  * @index:	index of this chunk's info structure inside @cib
- * @bno:	on return, the allocated block number
+ * @bno:	on return, the first allocated block number
+ * @count:	maximum number of blocks; on return, the number allocated
  *
- * Finds a free block in the chunk and marks it as used; the buffer at @cib_bh
- * may be replaced if needed for copy-on-write.  Returns 0 on success, or a
- * negative error code in case of failure.
+ * Finds a run of free blocks in the chunk and marks it as used; the buffer at
+ * @cib_bh may be replaced if needed for copy-on-write.  Returns 0 on success,
+ * or a negative error code in case of failure.
  */
-static int apfs_chunk_allocate_block(struct super_block *sb,
-				     struct buffer_head **cib_bh,
-				     int index, u64 *bno)
+static int apfs_chunk_allocate_extent(struct super_block *sb,
+				      struct buffer_head **cib_bh,
+				      int index, u64 *bno, u64 *count)
 {
-	return apfs_chunk_alloc_free(sb, cib_bh, index, bno, true);
+	return apfs_chunk_alloc_free(sb, cib_bh, index, bno, count, true);
 }
 
 /**
- * apfs_cib_allocate_block - Allocate a single block from a cib
+ * apfs_cib_update_summary - Record the largest free count among a cib's chunks
  * @sb:		superblock structure
+ * @index:	index of the cib
  * @cib_bh:	buffer head for the chunk-info block
- * @bno:	on return, the allocated block number
+ */
+static void apfs_cib_update_summary(struct super_block *sb, int index, struct buffer_head *cib_bh)
+{
+	struct apfs_spaceman *sm = APFS_SM(sb);
+	struct apfs_chunk_info_block *cib = (void *)cib_bh->b_data;
+	u32 chunk_count, max_free = 0;
+	int i;
+
+	if (!sm->sm_cib_max_free)
+		return;
+
+	chunk_count = le32_to_cpu(cib->cib_chunk_info_count);
+	if (chunk_count > sm->sm_chunks_per_cib) {
+		/* Corrupted, so don't pretend to know anything */
+		sm->sm_cib_max_free[index] = APFS_CIB_FREE_UNKNOWN;
+		return;
+	}
+	for (i = 0; i < chunk_count; ++i)
+		max_free = max(max_free, le32_to_cpu(cib->cib_chunk_info[i].ci_free_count));
+	sm->sm_cib_max_free[index] = max_free;
+}
+
+/**
+ * apfs_cib_may_have_free - Check the summary for a cib before reading it
+ * @sb:		superblock structure
+ * @index:	index of the cib
+ * @min_free:	number of free blocks that a chunk needs to be useful
+ */
+static inline bool apfs_cib_may_have_free(struct super_block *sb, int index, u32 min_free)
+{
+	struct apfs_spaceman *sm = APFS_SM(sb);
+	u32 max_free;
+
+	if (!sm->sm_cib_max_free)
+		return true;
+	max_free = sm->sm_cib_max_free[index];
+	return max_free == APFS_CIB_FREE_UNKNOWN || max_free >= min_free;
+}
+
+/**
+ * apfs_cib_allocate_extent - Allocate a run of blocks from a cib
+ * @sb:		superblock structure
+ * @cib_bh:	buffer head for the chunk-info block
+ * @bno:	on return, the first allocated block number
+ * @count:	maximum number of blocks; on return, the number allocated
+ * @min_free:	skip chunks with fewer free blocks than this
  * @backwards:	start the search on the last chunk
  *
- * Finds a free block among all the chunks in the cib and marks it as used; the
- * buffer at @cib_bh may be replaced if needed for copy-on-write.  Returns 0 on
- * success, or a negative error code in case of failure.
+ * Finds a run of free blocks among all the chunks in the cib and marks it as
+ * used; the buffer at @cib_bh may be replaced if needed for copy-on-write.
+ * Returns 0 on success, or a negative error code in case of failure.
  */
-static int apfs_cib_allocate_block(struct super_block *sb,
-				   struct buffer_head **cib_bh, u64 *bno, bool backwards)
+static int apfs_cib_allocate_extent(struct super_block *sb,
+				    struct buffer_head **cib_bh, u64 *bno, u64 *count,
+				    u32 min_free, bool backwards)
 {
 	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
 	struct apfs_spaceman *sm = APFS_SM(sb);
@@ -1188,7 +1390,11 @@ static int apfs_cib_allocate_block(struct super_block *sb,
 
 		index = backwards ? chunk_count - 1 - i : i;
 
-		err = apfs_chunk_allocate_block(sb, cib_bh, index, bno);
+		/* No need to look at the bitmap if the run can't be there */
+		if (le32_to_cpu(cib->cib_chunk_info[index].ci_free_count) < min_free)
+			continue;
+
+		err = apfs_chunk_allocate_extent(sb, cib_bh, index, bno, count);
 		if (err == -ENOSPC) /* This chunk is full */
 			continue;
 		if (err)
@@ -1199,76 +1405,123 @@ static int apfs_cib_allocate_block(struct super_block *sb,
 }
 
 /**
- * apfs_spaceman_allocate_block - Allocate a single on-disk block
+ * apfs_spaceman_allocate_extent - Allocate a run of contiguous on-disk blocks
  * @sb:		superblock structure
- * @bno:	on return, the allocated block number
+ * @bno:	on return, the first allocated block number
+ * @count:	maximum number of blocks, must not be zero; on return, the number
+ *		of blocks actually allocated
  * @backwards:	start the search on the last chunk
  *
- * Finds a free block among the spaceman bitmaps and marks it as used.  Returns
- * 0 on success, or a negative error code in case of failure.
+ * Finds a run of free blocks among the spaceman bitmaps and marks it as used.
+ * The run never crosses a chunk boundary, so it may be shorter than asked even
+ * if there is more free space.  Returns 0 on success, or a negative error code
+ * in case of failure.
  */
-int apfs_spaceman_allocate_block(struct super_block *sb, u64 *bno, bool backwards)
+int apfs_spaceman_allocate_extent(struct super_block *sb, u64 *bno, u64 *count, bool backwards)
 {
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
 	struct apfs_spaceman *sm = APFS_SM(sb);
+	u64 wanted = *count;
+	u32 min_free, cibs = 0;
 	int i;
+	int err;
 
+	/*
+	 * First look for a chunk that may have the whole run, then settle for
+	 * any free block. The summary lets us skip the cibs that won't do.
+	 */
+	min_free = min_t(u64, *count, sm->sm_blocks_per_chunk);
+again:
 	for (i = 0; i < sm->sm_cib_count; ++i) {
 		struct buffer_head *cib_bh;
 		u64 cib_bno;
 		int index;
-		int err;
 
 		/* Keep extents and metadata separate to limit fragmentation */
 		index = backwards ? sm->sm_cib_count - 1 - i : i;
+		if (!apfs_cib_may_have_free(sb, index, min_free))
+			continue;
 
 		cib_bno = apfs_spaceman_read_cib_addr(sb, index);
 		cib_bh = apfs_sb_bread(sb, cib_bno);
 		if (!cib_bh) {
 			apfs_err(sb, "failed to read cib");
-			return -EIO;
+			err = -EIO;
+			goto out;
 		}
+		++cibs;
 
-		err = apfs_cib_allocate_block(sb, &cib_bh, bno, backwards);
+		err = apfs_cib_allocate_extent(sb, &cib_bh, bno, count, min_free, backwards);
 		if (!err) {
 			/* The cib may have been moved */
 			apfs_spaceman_write_cib_addr(sb, index, cib_bh->b_blocknr);
 			/* The free block count has changed */
 			apfs_write_spaceman(sm);
 		}
+		if (!err || err == -ENOSPC)
+			apfs_cib_update_summary(sb, index, cib_bh);
 		brelse(cib_bh);
 		if (err == -ENOSPC) /* This cib is full */
 			continue;
 		if (err)
 			apfs_err(sb, "error during allocation");
-		return err;
+		goto out;
 	}
-	return -ENOSPC;
+	if (min_free > 1) {
+		min_free = 1;
+		goto again;
+	}
+	err = -ENOSPC;
+
+out:
+	apfs_nx_stat_inc(nxi, allocations);
+	apfs_nx_stat_add(nxi, alloc_cibs_scanned, cibs);
+	trace_apfs_spaceman_allocate(sb, wanted, err ? 0 : *bno, err ? 0 : *count, cibs, err);
+	return err;
 }
 
 /**
- * apfs_chunk_free - Mark a regular block as free given CIB and chunk
+ * apfs_spaceman_allocate_block - Allocate a single on-disk block
+ * @sb:		superblock structure
+ * @bno:	on return, the allocated block number
+ * @backwards:	start the search on the last chunk
+ *
+ * Finds a free block among the spaceman bitmaps and marks it as used.  Returns
+ * 0 on success, or a negative error code in case of failure.
+ */
+int apfs_spaceman_allocate_block(struct super_block *sb, u64 *bno, bool backwards)
+{
+	u64 count = 1;
+
+	return apfs_spaceman_allocate_extent(sb, bno, &count, backwards);
+}
+
+/**
+ * apfs_chunk_free - Mark a run of regular blocks as free given CIB and chunk
  * @sb:		superblock structure
  * @cib_bh:	buffer head for the chunk-info block
  * @index:	index of this chunk's info structure inside @cib
- * @bno:	block number (must not belong to the ip)
+ * @bno:	first block number (must not belong to the ip)
+ * @count:	number of blocks, all inside the chunk
  */
 static int apfs_chunk_free(struct super_block *sb,
 				struct buffer_head **cib_bh,
-				int index, u64 bno)
+				int index, u64 bno, u64 count)
 {
-	return apfs_chunk_alloc_free(sb, cib_bh, index, &bno, false);
+	return apfs_chunk_alloc_free(sb, cib_bh, index, &bno, &count, false);
 }
 
 /**
- * apfs_main_free - Mark a regular block as free
+ * apfs_main_free_extent - Mark a run of regular blocks as free
  * @sb:		superblock structure
- * @bno:	block number (must not belong to the ip)
+ * @bno:	first block number (must not belong to the ip)
+ * @count:	number of blocks, all inside the same chunk
  */
-static int apfs_main_free(struct super_block *sb, u64 bno)
+static int apfs_main_free_extent(struct super_block *sb, u64 bno, u64 count)
 {
 	struct apfs_spaceman *sm = APFS_SM(sb);
 	struct apfs_spaceman_phys *sm_raw = sm->sm_raw;
-	u64 cib_idx, chunk_idx;
+	u64 cib_idx, chunk_idx, last_chunk_idx;
 	struct buffer_head *cib_bh;
 	u64 cib_bno;
 	int err;
@@ -1280,6 +1533,12 @@ static int apfs_main_free(struct super_block *sb, u64 bno)
 	/* TODO: use bitshifts instead of do_div() */
 	chunk_idx = bno;
 	do_div(chunk_idx, sm->sm_blocks_per_chunk);
+	last_chunk_idx = bno + count - 1;
+	do_div(last_chunk_idx, sm->sm_blocks_per_chunk);
+	if (chunk_idx != last_chunk_idx) {
+		apfs_err(sb, "range crosses chunk boundary (0x%llx-0x%llx)", bno, count);
+		return -EINVAL;
+	}
 	cib_idx = chunk_idx;
 	chunk_idx = do_div(cib_idx, sm->sm_chunks_per_cib);
 
@@ -1290,12 +1549,13 @@ static int apfs_main_free(struct super_block *sb, u64 bno)
 		return -EIO;
 	}
 
-	err = apfs_chunk_free(sb, &cib_bh, chunk_idx, bno);
+	err = apfs_chunk_free(sb, &cib_bh, chunk_idx, bno, count);
 	if (!err) {
 		/* The cib may have been moved */
 		apfs_spaceman_write_cib_addr(sb, cib_idx, cib_bh->b_blocknr);
 		/* The free block count has changed */
 		apfs_write_spaceman(sm);
+		apfs_cib_update_summary(sb, cib_idx, cib_bh);
 	}
 	brelse(cib_bh);
 	if (err)
@@ -1303,3 +1563,117 @@ static int apfs_main_free(struct super_block *sb, u64 bno)
 
 	return err;
 }
+
+/**
+ * apfs_spaceman_free_unused_extent - Free blocks that were never put to use
+ * @sb:		superblock structure
+ * @bno:	first block number
+ * @count:	number of blocks
+ *
+ * The blocks must have been allocated by apfs_spaceman_allocate_extent() in the
+ * current transaction, and never written, so they don't need to go through the
+ * free queue.  Returns 0 on success, or a negative error code in case of
+ * failure.
+ */
+int apfs_spaceman_free_unused_extent(struct super_block *sb, u64 bno, u64 count)
+{
+	if (!count)
+		return 0;
+	return apfs_main_free_extent(sb, bno, count);
+}
+
+/* Blocks allocated, and then freed, by each run of the allocator benchmark */
+#define APFS_BENCH_BLOCKS	256
+
+/**
+ * apfs_spaceman_bench_run - Time a run of single block allocations
+ * @sb:		superblock structure
+ * @bnos:	array with room for APFS_BENCH_BLOCKS block numbers
+ * @backwards:	start the searches on the last chunk
+ * @ns:		on return, the time taken by the allocations
+ *
+ * The blocks are freed again in the same transaction, so the bitmaps end up
+ * as they were. Returns 0 on success or a negative error code in case of
+ * failure.
+ */
+static int apfs_spaceman_bench_run(struct super_block *sb, u64 *bnos, bool backwards, u64 *ns)
+{
+	struct apfs_max_ops maxops;
+	u64 start;
+	int err, i;
+
+	maxops.cat = 0;
+	maxops.blks = APFS_BENCH_BLOCKS;
+	err = apfs_transaction_start(sb, maxops);
+	if (err)
+		return err;
+
+	start = ktime_get_ns();
+	for (i = 0; i < APFS_BENCH_BLOCKS; i++) {
+		err = apfs_spaceman_allocate_block(sb, &bnos[i], backwards);
+		if (err) {
+			apfs_err(sb, "block allocation failed");
+			goto fail;
+		}
+	}
+	*ns = ktime_get_ns() - start;
+
+	for (i = 0; i < APFS_BENCH_BLOCKS; i++) {
+		err = apfs_spaceman_free_unused_extent(sb, bnos[i], 1);
+		if (err) {
+			apfs_err(sb, "failed to free block 0x%llx", bnos[i]);
+			goto fail;
+		}
+	}
+
+	err = apfs_transaction_commit(sb);
+	if (err)
+		goto fail;
+	return 0;
+
+fail:
+	apfs_transaction_abort(sb);
+	return err;
+}
+
+/**
+ * apfs_spaceman_bench - Time the allocator scans
+ * @sb: superblock structure for a read-write mount
+ *
+ * Allocates a run of single blocks from each end of the container, the way the
+ * metadata and the file extents get them. Reports the best of a few runs, so
+ * that the numbers can be compared between builds on the same image.
+ */
+void apfs_spaceman_bench(struct super_block *sb)
+{
+	u64 best_fwd = U64_MAX, best_back = U64_MAX;
+	u64 *bnos = NULL;
+	int err = 0;
+	int run;
+
+	if (sb_rdonly(sb))
+		return;
+	bnos = kmalloc_array(APFS_BENCH_BLOCKS, sizeof(*bnos), GFP_KERNEL);
+	if (!bnos)
+		return;
+
+	for (run = 0; run < APFS_BENCH_RUNS; run++) {
+		u64 ns;
+
+		err = apfs_spaceman_bench_run(sb, bnos, false /* backwards */, &ns);
+		if (err)
+			goto out;
+		best_fwd = min(best_fwd, ns);
+		err = apfs_spaceman_bench_run(sb, bnos, true /* backwards */, &ns);
+		if (err)
+			goto out;
+		best_back = min(best_back, ns);
+	}
+	apfs_info(sb, "bench: allocation of %d blocks: forwards %llu ns, backwards %llu ns",
+		  APFS_BENCH_BLOCKS, div_u64(best_fwd, APFS_BENCH_BLOCKS), div_u64(best_back, APFS_BENCH_BLOCKS));
+
+out:
+	if (err)
+		apfs_warn(sb, "bench: block allocations failed (err:%d)", err);
+	kfree(bnos);
+}
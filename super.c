@@ -96,6 +96,13 @@ static struct buffer_head *apfs_read_super_copy(struct super_block *sb)
 	if (sb->s_blocksize != blocksize) {
 		brelse(bh);
 
+#ifndef APFS_LARGE_BLOCKS
+		if (blocksize > PAGE_SIZE && blocksize <= APFS_NX_MAXIMUM_BLOCK_SIZE) {
+			apfs_err(sb, "blocksize %d above page size needs kernel 6.15 or later", blocksize);
+			return ERR_PTR(err);
+		}
+#endif
+
 		if (!apfs_sb_set_blocksize(sb, blocksize)) {
 			apfs_err(sb, "bad blocksize %d", blocksize);
 			return ERR_PTR(err);
@@ -239,7 +246,6 @@ static int apfs_read_main_super(struct super_block *sb)
 	nxi->nx_bno = bno;
 	nxi->nx_xid = xid;
 
-	/* For now we only support blocksize < PAGE_SIZE */
 	nxi->nx_blocksize = sb->s_blocksize;
 	nxi->nx_blocksize_bits = sb->s_blocksize_bits;
 
@@ -306,7 +312,7 @@ static inline void apfs_free_main_super(struct apfs_sb_info *sbi)
 	eph_list = nxi->nx_eph_list;
 	if (eph_list) {
 		for (i = 0; i < nxi->nx_eph_count; ++i) {
-			kfree(eph_list[i].object);
+			kvfree(eph_list[i].object);
 			eph_list[i].object = NULL;
 		}
 		kfree(eph_list);
@@ -328,6 +334,9 @@ static inline void apfs_free_main_super(struct apfs_sb_info *sbi)
 #endif
 
 	list_del(&nxi->nx_list);
+	apfs_sysfs_unregister_nx(nxi);
+	if (nxi->nx_spaceman)
+		kfree(nxi->nx_spaceman->sm_cib_max_free);
 	kfree(nxi->nx_spaceman);
 	nxi->nx_spaceman = NULL;
 	kfree(nxi);
@@ -613,10 +622,17 @@ static int apfs_first_read_omap(struct super_block *sb)
 	omap = kzalloc(sizeof(*omap), GFP_KERNEL);
 	if (!omap)
 		return -ENOMEM;
+	init_rwsem(&omap->omap_sem);
+	err = apfs_omap_cache_init(&omap->omap_cache, sbi->s_omap_cache_size);
+	if (err) {
+		kfree(omap);
+		return err;
+	}
 
 	sbi->s_omap = omap;
 	err = apfs_read_omap(sb, false /* write */);
 	if (err) {
+		apfs_omap_cache_free(&omap->omap_cache);
 		kfree(omap);
 		sbi->s_omap = NULL;
 		return err;
@@ -640,6 +656,7 @@ static void apfs_put_omap(struct apfs_omap *omap)
 	if (--omap->omap_refcnt != 0)
 		return;
 
+	apfs_omap_cache_free(&omap->omap_cache);
 	apfs_node_free(omap->omap_root);
 	kfree(omap);
 }
@@ -673,12 +690,51 @@ int apfs_read_catalog(struct super_block *sb, bool write)
 	return 0;
 }
 
+/**
+ * apfs_read_fext_root - Find and read the root node of the fext tree
+ * @sb: superblock structure
+ *
+ * Sealed volumes keep their file extents in a separate tree, which gets
+ * queried for every miss in the extent caches. Its root is read only once, on
+ * mount, so that those queries don't keep parsing and validating it again.
+ *
+ * On success, returns 0 and sets APFS_SB(@sb)->s_fext_root; on failure returns
+ * a negative error code.
+ */
+static int apfs_read_fext_root(struct super_block *sb)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_superblock *vsb_raw = sbi->s_vsb_raw;
+	struct apfs_node *root_node;
+	u64 oid = le64_to_cpu(vsb_raw->apfs_fext_tree_oid);
+
+	ASSERT(apfs_is_sealed(sb));
+
+	root_node = apfs_read_node(sb, oid, APFS_OBJ_PHYSICAL, false /* write */);
+	if (IS_ERR(root_node)) {
+		apfs_err(sb, "failed to read fext root 0x%llx", oid);
+		return PTR_ERR(root_node);
+	}
+	sbi->s_fext_root = root_node;
+	return 0;
+}
+
 static void apfs_put_super(struct super_block *sb)
 {
 	struct apfs_sb_info *sbi = APFS_SB(sb);
 
+	/* The benchmarks run their own transactions */
+	flush_work(&sbi->s_bench_work);
+	/* Closed files hold inode references until they get compressed */
+	flush_work(&sbi->s_compress_work);
 	/* Cleanups won't reschedule themselves during unmount */
 	flush_work(&sbi->s_orphan_cleanup_work);
+	/* The orphans are still in the private dir for the next mount */
+	apfs_orphan_queue_drop(sb);
+
+	/* The final commit is forced below, so stop the background ones */
+	sbi->s_commit_interval = 0;
+	cancel_delayed_work_sync(&sbi->s_commit_work);
 
 	/* Stop flushing orphans and update the volume as needed */
 	if (!(sb->s_flags & SB_RDONLY)) {
@@ -716,10 +772,19 @@ fail:
 	iput(sbi->s_private_dir);
 	sbi->s_private_dir = NULL;
 
+	apfs_node_free(sbi->s_fext_root);
+	sbi->s_fext_root = NULL;
 	apfs_node_free(sbi->s_cat_root);
+	apfs_node_cache_drop_all(sb);
 	apfs_unmap_volume_super(sb);
 
 	mutex_lock(&nxs_mutex);
+	if (sbi->s_omap->omap_refcnt == 1) {
+		struct apfs_omap_cache_stats stats;
+
+		apfs_omap_cache_get_stats(&sbi->s_omap->omap_cache, &stats);
+		apfs_debug(sb, "omap cache: %llu hits, %llu misses, %llu evictions", stats.hits, stats.misses, stats.evictions);
+	}
 	apfs_put_omap(sbi->s_omap);
 	sbi->s_omap = NULL;
 	apfs_free_main_super(sbi);
@@ -758,9 +823,20 @@ static struct inode *apfs_alloc_inode(struct super_block *sb)
 	dstream->ds_inode = &ai->vfs_inode;
 	dstream->ds_cached_ext.len = 0;
 	dstream->ds_ext_dirty = false;
+	dstream->ds_prealloc_len = 0;
+	dstream->ds_delalloc_len = 0;
+	dstream->ds_ext_map = RB_ROOT;
+	INIT_LIST_HEAD(&dstream->ds_ext_map_lru);
+	dstream->ds_ext_map_count = 0;
 	ai->i_nchildren = 0;
 	INIT_LIST_HEAD(&ai->i_list);
 	ai->i_cleaned = false;
+	ai->i_sync_xid = ai->i_datasync_xid = 0;
+	ai->i_compress_table = NULL;
+	ai->i_xattr_cache = NULL;
+	atomic_set(&ai->i_open_count, 0);
+	ai->i_compress_on_close = false;
+	INIT_LIST_HEAD(&ai->i_compress_list);
 	return &ai->vfs_inode;
 }
 
@@ -773,6 +849,9 @@ static void apfs_i_callback(struct rcu_head *head)
 
 static void apfs_destroy_inode(struct inode *inode)
 {
+	apfs_compress_forget_table(inode);
+	apfs_xattr_cache_drop(inode);
+	apfs_extent_map_clear(&APFS_I(inode)->i_dstream);
 	call_rcu(&inode->i_rcu, apfs_i_callback);
 }
 
@@ -938,9 +1017,21 @@ static int apfs_statfs(struct dentry *dentry, struct kstatfs *buf)
 
 	/* Volumes share the whole disk space */
 	buf->f_blocks = le64_to_cpu(msb_raw->nx_block_count);
-	err = apfs_count_used_blocks(sb, &used_blocks);
-	if (err)
-		goto fail;
+	if (READ_ONCE(nxi->nx_used_blocks_valid)) {
+		smp_rmb();
+		used_blocks = READ_ONCE(nxi->nx_used_blocks);
+	} else {
+		/*
+		 * From now on, the transactions keep the count up to date. Two
+		 * readers may race here, but they will store the same value.
+		 */
+		err = apfs_count_used_blocks(sb, &used_blocks);
+		if (err)
+			goto fail;
+		WRITE_ONCE(nxi->nx_used_blocks, used_blocks);
+		smp_wmb();
+		WRITE_ONCE(nxi->nx_used_blocks_valid, true);
+	}
 	buf->f_bfree = buf->f_blocks - used_blocks;
 	buf->f_bavail = buf->f_bfree; /* I don't know any better */
 
@@ -985,6 +1076,16 @@ static int apfs_show_options(struct seq_file *seq, struct dentry *root)
 						     sbi->s_gid));
 	if (nxi->nx_flags & APFS_CHECK_NODES)
 		seq_puts(seq, ",cknodes");
+	if (sbi->s_omap_cache_size != APFS_OMAP_CACHE_DEFAULT_SIZE)
+		seq_printf(seq, ",omap_cache=%u", sbi->s_omap_cache_size);
+	if (sbi->s_commit_interval != APFS_DEFAULT_COMMIT_INTERVAL)
+		seq_printf(seq, ",commit=%u", sbi->s_commit_interval);
+	if (sbi->s_compress_algo == APFS_COMPRESS_LZFSE_RSRC)
+		seq_puts(seq, ",compress=lzfse");
+	else if (sbi->s_compress_algo == APFS_COMPRESS_LZVN_RSRC)
+		seq_puts(seq, ",compress=lzvn");
+	if (sbi->s_bench)
+		seq_puts(seq, ",bench");
 
 	return 0;
 }
@@ -1043,7 +1144,9 @@ static const struct super_operations apfs_sops = {
 };
 
 enum {
-	Opt_readwrite, Opt_cknodes, Opt_uid, Opt_gid, Opt_vol, Opt_snap, Opt_err,
+	Opt_readwrite, Opt_cknodes, Opt_uid, Opt_gid, Opt_vol, Opt_snap,
+	Opt_omap_cache, Opt_commit, Opt_compress_lzfse, Opt_compress_lzvn,
+	Opt_bench, Opt_err,
 };
 
 static const match_table_t tokens = {
@@ -1053,6 +1156,11 @@ static const match_table_t tokens = {
 	{Opt_gid, "gid=%u"},
 	{Opt_vol, "vol=%u"},
 	{Opt_snap, "snap=%s"},
+	{Opt_omap_cache, "omap_cache=%u"},
+	{Opt_commit, "commit=%u"},
+	{Opt_compress_lzfse, "compress=lzfse"},
+	{Opt_compress_lzvn, "compress=lzvn"},
+	{Opt_bench, "bench"},
 	{Opt_err, NULL}
 };
 
@@ -1145,6 +1253,10 @@ static int parse_options(struct super_block *sb, char *options)
 
 	/* Set default values before parsing */
 	sbi->s_vol_nr = 0;
+	sbi->s_omap_cache_size = APFS_OMAP_CACHE_DEFAULT_SIZE;
+	sbi->s_commit_interval = APFS_DEFAULT_COMMIT_INTERVAL;
+	sbi->s_compress_algo = 0;
+	sbi->s_bench = false;
 	nx_flags = 0;
 
 	if (!options)
@@ -1202,6 +1314,40 @@ static int parse_options(struct super_block *sb, char *options)
 			if (!sbi->s_snap_name)
 				return -ENOMEM;
 			break;
+		case Opt_omap_cache:
+			/*
+			 * The cache is shared by all mounts of the volume, so
+			 * only the first one gets to choose its size.
+			 */
+			err = match_int(&args[0], &option);
+			if (err)
+				return err;
+			if (option < 0 || option > APFS_OMAP_CACHE_MAX_SIZE) {
+				apfs_err(sb, "invalid omap cache size");
+				return -EINVAL;
+			}
+			sbi->s_omap_cache_size = option;
+			break;
+		case Opt_commit:
+			/* Zero leaves all commits to the foreground */
+			err = match_int(&args[0], &option);
+			if (err)
+				return err;
+			if (option < 0 || option > INT_MAX / HZ) {
+				apfs_err(sb, "invalid commit interval");
+				return -EINVAL;
+			}
+			sbi->s_commit_interval = option;
+			break;
+		case Opt_compress_lzfse:
+			sbi->s_compress_algo = APFS_COMPRESS_LZFSE_RSRC;
+			break;
+		case Opt_compress_lzvn:
+			sbi->s_compress_algo = APFS_COMPRESS_LZVN_RSRC;
+			break;
+		case Opt_bench:
+			sbi->s_bench = true;
+			break;
 		default:
 			return -EINVAL;
 		}
@@ -1392,13 +1538,16 @@ static void apfs_set_trans_buffer_limit(struct super_block *sb)
 	struct sysinfo info = {0};
 
 	si_meminfo(&info);
-	memsize_in_blocks = info.totalram << (PAGE_SHIFT - sb->s_blocksize_bits);
+	if (sb->s_blocksize_bits > PAGE_SHIFT)
+		memsize_in_blocks = info.totalram >> (sb->s_blocksize_bits - PAGE_SHIFT);
+	else
+		memsize_in_blocks = info.totalram << (PAGE_SHIFT - sb->s_blocksize_bits);
 
 	/*
 	 * Buffer heads are not reclaimed while they are part of the current
-	 * transaction, so systems with little memory will crash if we don't
-	 * commit often enough. This hack should make that happen in general,
-	 * but I still need to get the reclaim to work eventually (TODO).
+	 * transaction. Data buffers get written early once half this limit is
+	 * reached, so in practice it only caps the metadata of a transaction;
+	 * the overall size depends on TRANSACTION_BUFFERS_MAX instead.
 	 */
 	if (memsize_in_blocks >= 16 * TRANSACTION_BUFFERS_MAX)
 		sbi->s_trans_buffers_max = TRANSACTION_BUFFERS_MAX;
@@ -1406,6 +1555,25 @@ static void apfs_set_trans_buffer_limit(struct super_block *sb)
 		sbi->s_trans_buffers_max = memsize_in_blocks / 16;
 }
 
+/**
+ * apfs_bench_work - Time the b-trees and the allocator of a mounted volume
+ * @work: the benchmark work struct of the volume
+ *
+ * The results only go to the kernel log. The writes are skipped on read-only
+ * mounts, and undone in the same transaction otherwise.
+ */
+static void apfs_bench_work(struct work_struct *work)
+{
+	struct apfs_sb_info *sbi = NULL;
+	struct super_block *sb = NULL;
+
+	sbi = container_of(work, struct apfs_sb_info, s_bench_work);
+	sb = sbi->s_private_dir->i_sb;
+
+	apfs_btree_bench(sb);
+	apfs_spaceman_bench(sb);
+}
+
 static int apfs_fill_super(struct super_block *sb, void *data, int silent)
 {
 	struct apfs_sb_info *sbi = APFS_SB(sb);
@@ -1423,10 +1591,30 @@ static int apfs_fill_super(struct super_block *sb, void *data, int silent)
 
 	sbi->s_uid = INVALID_UID;
 	sbi->s_gid = INVALID_GID;
+	INIT_DELAYED_WORK(&sbi->s_commit_work, apfs_transaction_commit_work);
+	spin_lock_init(&sbi->s_orphan_lock);
+	INIT_LIST_HEAD(&sbi->s_orphan_queue);
+	INIT_WORK(&sbi->s_compress_work, apfs_compress_work);
+	spin_lock_init(&sbi->s_compress_lock);
+	INIT_LIST_HEAD(&sbi->s_compress_queue);
+	INIT_WORK(&sbi->s_bench_work, apfs_bench_work);
 	err = parse_options(sb, data);
 	if (err)
 		return err;
 
+	/*
+	 * The write path still assumes that each page holds whole blocks, and
+	 * that each block has a single buffer head in the page cache.
+	 */
+	if (sb->s_blocksize > PAGE_SIZE && !(sb->s_flags & SB_RDONLY)) {
+		apfs_warn(sb, "writes are not supported for blocks above page size");
+		sb->s_flags |= SB_RDONLY;
+	}
+
+	/* Let the checkpoint reads run in the background while we mount */
+	if (!(sb->s_flags & SB_RDONLY))
+		apfs_readahead_ephemeral_objects(sb);
+
 	err = apfs_map_volume_super(sb, false /* write */);
 	if (err)
 		return err;
@@ -1453,6 +1641,11 @@ static int apfs_fill_super(struct super_block *sb, void *data, int silent)
 	err = apfs_read_catalog(sb, false /* write */);
 	if (err)
 		goto failed_cat;
+	if (apfs_is_sealed(sb)) {
+		err = apfs_read_fext_root(sb);
+		if (err)
+			goto failed_fext;
+	}
 
 	sb->s_op = &apfs_sops;
 	sb->s_d_op = &apfs_dentry_operations;
@@ -1487,17 +1680,26 @@ static int apfs_fill_super(struct super_block *sb, void *data, int silent)
 		if (APFS_I(priv)->i_nchildren)
 			schedule_work(&sbi->s_orphan_cleanup_work);
 	}
+	/* The transactions need the container lock, so the mount can't wait */
+	if (sbi->s_bench)
+		schedule_work(&sbi->s_bench_work);
 	return 0;
 
 failed_mount:
 	iput(sbi->s_private_dir);
+	sbi->s_commit_interval = 0;
+	cancel_delayed_work_sync(&sbi->s_commit_work);
 failed_private_dir:
 	sbi->s_private_dir = NULL;
+	apfs_node_free(sbi->s_fext_root);
+	sbi->s_fext_root = NULL;
+failed_fext:
 	apfs_node_free(sbi->s_cat_root);
 failed_cat:
 	apfs_put_omap(sbi->s_omap);
 	sbi->s_omap = NULL;
 failed_omap:
+	apfs_node_cache_drop_all(sb);
 	apfs_unmap_volume_super(sb);
 	return err;
 }
@@ -1649,13 +1851,20 @@ static int apfs_attach_nxi(struct apfs_sb_info *sbi, const char *dev_name, fmode
 
 		nxi->nx_bdev = bdev;
 		init_rwsem(&nxi->nx_big_sem);
+		apfs_node_cache_init(&nxi->nx_node_cache);
 		list_add(&nxi->nx_list, &nxs);
 		INIT_LIST_HEAD(&nxi->vol_list);
 	}
 
 	list_add(&sbi->list, &nxi->vol_list);
 	sbi->s_nxi = nxi;
-	++nxi->nx_refcnt;
+	if (++nxi->nx_refcnt == 1) {
+		ret = apfs_sysfs_register_nx(nxi);
+		if (ret) {
+			apfs_free_main_super(sbi);
+			return ret;
+		}
+	}
 	return 0;
 }
 
@@ -1761,22 +1970,48 @@ static struct file_system_type apfs_fs_type = {
 };
 MODULE_ALIAS_FS("apfs");
 
+static bool bench;
+module_param(bench, bool, 0444);
+MODULE_PARM_DESC(bench, "Time some of the hot paths when the module is loaded");
+
 static int __init init_apfs_fs(void)
 {
 	int err = 0;
 
+	err = apfs_fletcher64_selftest();
+	if (err)
+		return err;
+	err = apfs_decode_selftest();
+	if (err)
+		return err;
+	if (bench) {
+		apfs_fletcher64_bench();
+		apfs_filename_bench();
+		apfs_decode_bench();
+	}
 	err = init_inodecache();
 	if (err)
 		return err;
+	err = apfs_sysfs_init();
+	if (err)
+		goto fail_sysfs;
 	err = register_filesystem(&apfs_fs_type);
 	if (err)
-		destroy_inodecache();
+		goto fail_register;
+	return 0;
+
+fail_register:
+	apfs_sysfs_exit();
+fail_sysfs:
+	destroy_inodecache();
 	return err;
 }
 
 static void __exit exit_apfs_fs(void)
 {
 	unregister_filesystem(&apfs_fs_type);
+	apfs_sysfs_exit();
+	apfs_compress_free_workspaces();
 	destroy_inodecache();
 }
 
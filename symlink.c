@@ -20,12 +20,11 @@ static const char *apfs_get_link(struct dentry *dentry, struct inode *inode,
 				 struct delayed_call *done)
 {
 	struct super_block *sb = inode->i_sb;
-	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
 	char *target = NULL;
 	int err;
 	int size;
 
-	down_read(&nxi->nx_big_sem);
+	down_read(apfs_vol_sem(sb));
 
 	if (!dentry) {
 		err = -ECHILD;
@@ -59,13 +58,13 @@ static const char *apfs_get_link(struct dentry *dentry, struct inode *inode,
 		goto fail;
 	}
 
-	up_read(&nxi->nx_big_sem);
+	up_read(apfs_vol_sem(sb));
 	set_delayed_call(done, kfree_link, target);
 	return target;
 
 fail:
 	kfree(target);
-	up_read(&nxi->nx_big_sem);
+	up_read(apfs_vol_sem(sb));
 	return ERR_PTR(err);
 }
 
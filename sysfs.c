@@ -0,0 +1,166 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Container statistics in /sys/fs/apfs/, and the tracepoint definitions.
+ */
+
+#include <linux/kobject.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/sysfs.h>
+#include "apfs.h"
+
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
+static struct kset *apfs_kset;
+
+/*
+ * A read-only file that reports one or more consecutive counters from the
+ * container statistics, added up for all cpus.
+ */
+struct apfs_stat_attr {
+	struct attribute attr;
+	size_t offset;		/* Offset of the first counter in apfs_nx_stats */
+	unsigned int count;	/* Number of counters */
+};
+
+#define APFS_STAT_ATTR(_name, _field)						\
+static struct apfs_stat_attr apfs_stat_attr_##_name = {				\
+	.attr	= { .name = __stringify(_name), .mode = 0444 },			\
+	.offset	= offsetof(struct apfs_nx_stats, _field),			\
+	.count	= sizeof(((struct apfs_nx_stats *)0)->_field) / sizeof(u64),	\
+}
+
+APFS_STAT_ATTR(commits, commits);
+APFS_STAT_ATTR(commit_buffers, commit_buffers);
+APFS_STAT_ATTR(early_data_buffers, early_buffers);
+APFS_STAT_ATTR(commit_latency_hist, commit_hist);
+APFS_STAT_ATTR(omap_cache_hits, omap_hits);
+APFS_STAT_ATTR(omap_cache_misses, omap_misses);
+APFS_STAT_ATTR(allocations, allocations);
+APFS_STAT_ATTR(alloc_cibs_scanned, alloc_cibs_scanned);
+APFS_STAT_ATTR(cows, cows);
+APFS_STAT_ATTR(decompressed_bytes, decompressed);
+APFS_STAT_ATTR(orphans_cleaned, orphans_cleaned);
+APFS_STAT_ATTR(orphan_blocks_freed, orphan_blocks);
+APFS_STAT_ATTR(xattr_cache_hits, xattr_hits);
+APFS_STAT_ATTR(xattr_cache_misses, xattr_misses);
+
+static struct attribute *apfs_nx_attrs[] = {
+	&apfs_stat_attr_commits.attr,
+	&apfs_stat_attr_commit_buffers.attr,
+	&apfs_stat_attr_early_data_buffers.attr,
+	&apfs_stat_attr_commit_latency_hist.attr,
+	&apfs_stat_attr_omap_cache_hits.attr,
+	&apfs_stat_attr_omap_cache_misses.attr,
+	&apfs_stat_attr_allocations.attr,
+	&apfs_stat_attr_alloc_cibs_scanned.attr,
+	&apfs_stat_attr_cows.attr,
+	&apfs_stat_attr_decompressed_bytes.attr,
+	&apfs_stat_attr_orphans_cleaned.attr,
+	&apfs_stat_attr_orphan_blocks_freed.attr,
+	&apfs_stat_attr_xattr_cache_hits.attr,
+	&apfs_stat_attr_xattr_cache_misses.attr,
+	NULL,
+};
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0)
+ATTRIBUTE_GROUPS(apfs_nx);
+#endif
+
+static ssize_t apfs_nx_attr_show(struct kobject *kobj, struct attribute *attr, char *buf)
+{
+	struct apfs_nxsb_info *nxi = container_of(kobj, struct apfs_nxsb_info, nx_kobj);
+	struct apfs_stat_attr *sattr = container_of(attr, struct apfs_stat_attr, attr);
+	ssize_t len = 0;
+	unsigned int i;
+
+	for (i = 0; i < sattr->count; ++i) {
+		u64 total = 0;
+		int cpu;
+
+		for_each_possible_cpu(cpu) {
+			u64 *counters = (void *)per_cpu_ptr(nxi->nx_stats, cpu) + sattr->offset;
+
+			total += READ_ONCE(counters[i]);
+		}
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s%llu", i ? " " : "", total);
+	}
+	len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+	return len;
+}
+
+static const struct sysfs_ops apfs_nx_sysfs_ops = {
+	.show	= apfs_nx_attr_show,
+};
+
+static void apfs_nx_kobj_release(struct kobject *kobj)
+{
+	struct apfs_nxsb_info *nxi = container_of(kobj, struct apfs_nxsb_info, nx_kobj);
+
+	complete(&nxi->nx_kobj_unregister);
+}
+
+static struct kobj_type apfs_nx_ktype = {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0)
+	.default_groups	= apfs_nx_groups,
+#else
+	.default_attrs	= apfs_nx_attrs,
+#endif
+	.sysfs_ops	= &apfs_nx_sysfs_ops,
+	.release	= apfs_nx_kobj_release,
+};
+
+/**
+ * apfs_sysfs_register_nx - Set up the statistics for a new container
+ * @nxi: the container, with its block device already open
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+int apfs_sysfs_register_nx(struct apfs_nxsb_info *nxi)
+{
+	int err;
+
+	nxi->nx_stats = alloc_percpu(struct apfs_nx_stats);
+	if (!nxi->nx_stats)
+		return -ENOMEM;
+
+	init_completion(&nxi->nx_kobj_unregister);
+	err = kobject_init_and_add(&nxi->nx_kobj, &apfs_nx_ktype, &apfs_kset->kobj, "%pg", nxi->nx_bdev);
+	if (err) {
+		kobject_put(&nxi->nx_kobj);
+		wait_for_completion(&nxi->nx_kobj_unregister);
+		free_percpu(nxi->nx_stats);
+		nxi->nx_stats = NULL;
+	}
+	return err;
+}
+
+/**
+ * apfs_sysfs_unregister_nx - Clean up apfs_sysfs_register_nx()
+ * @nxi: the container
+ */
+void apfs_sysfs_unregister_nx(struct apfs_nxsb_info *nxi)
+{
+	if (!nxi->nx_stats) /* Registration failed */
+		return;
+
+	kobject_del(&nxi->nx_kobj);
+	kobject_put(&nxi->nx_kobj);
+	wait_for_completion(&nxi->nx_kobj_unregister);
+	free_percpu(nxi->nx_stats);
+	nxi->nx_stats = NULL;
+}
+
+int __init apfs_sysfs_init(void)
+{
+	apfs_kset = kset_create_and_add("apfs", NULL /* uevent_ops */, fs_kobj);
+	if (!apfs_kset)
+		return -ENOMEM;
+	return 0;
+}
+
+void apfs_sysfs_exit(void)
+{
+	kset_unregister(apfs_kset);
+	apfs_kset = NULL;
+}
@@ -0,0 +1,193 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Tracepoints for the hot paths of the filesystem.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM apfs
+
+#if !defined(_APFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _APFS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+struct apfs_query;
+
+TRACE_EVENT(apfs_btree_query,
+	TP_PROTO(struct super_block *sb, struct apfs_query *query, int err),
+	TP_ARGS(sb, query, err),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(u64,		node)
+		__field(u64,		id)
+		__field(u64,		number)
+		__field(unsigned int,	type)
+		__field(int,		depth)
+		__field(int,		err)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= sb->s_dev;
+		__entry->node	= query->node->object.oid;
+		__entry->id	= query->key.id;
+		__entry->number	= query->key.number;
+		__entry->type	= query->key.type;
+		__entry->depth	= query->depth;
+		__entry->err	= err;
+	),
+
+	TP_printk("dev %d,%d node 0x%llx key 0x%llx/%u/0x%llx depth %d err %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->node,
+		  __entry->id, __entry->type, __entry->number, __entry->depth,
+		  __entry->err)
+);
+
+TRACE_EVENT(apfs_node_split,
+	TP_PROTO(struct super_block *sb, u64 oid, int records),
+	TP_ARGS(sb, oid, records),
+
+	TP_STRUCT__entry(
+		__field(dev_t,	dev)
+		__field(u64,	oid)
+		__field(int,	records)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= sb->s_dev;
+		__entry->oid		= oid;
+		__entry->records	= records;
+	),
+
+	TP_printk("dev %d,%d node 0x%llx records %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->oid,
+		  __entry->records)
+);
+
+TRACE_EVENT(apfs_cow,
+	TP_PROTO(struct super_block *sb, u32 type, u64 old_bno, u64 new_bno),
+	TP_ARGS(sb, type, old_bno, new_bno),
+
+	TP_STRUCT__entry(
+		__field(dev_t,	dev)
+		__field(u32,	type)
+		__field(u64,	old_bno)
+		__field(u64,	new_bno)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= sb->s_dev;
+		__entry->type		= type;
+		__entry->old_bno	= old_bno;
+		__entry->new_bno	= new_bno;
+	),
+
+	TP_printk("dev %d,%d type 0x%x block 0x%llx -> 0x%llx",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->type,
+		  __entry->old_bno, __entry->new_bno)
+);
+
+TRACE_EVENT(apfs_spaceman_allocate,
+	TP_PROTO(struct super_block *sb, u64 wanted, u64 bno, u64 count, u32 cibs, int err),
+	TP_ARGS(sb, wanted, bno, count, cibs, err),
+
+	TP_STRUCT__entry(
+		__field(dev_t,	dev)
+		__field(u64,	wanted)
+		__field(u64,	bno)
+		__field(u64,	count)
+		__field(u32,	cibs)
+		__field(int,	err)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= sb->s_dev;
+		__entry->wanted	= wanted;
+		__entry->bno	= bno;
+		__entry->count	= count;
+		__entry->cibs	= cibs;
+		__entry->err	= err;
+	),
+
+	TP_printk("dev %d,%d wanted %llu got 0x%llx+%llu cibs %u err %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->wanted,
+		  __entry->bno, __entry->count, __entry->cibs, __entry->err)
+);
+
+TRACE_EVENT(apfs_flush_free_queue,
+	TP_PROTO(struct super_block *sb, unsigned int qid, u64 freed, int err),
+	TP_ARGS(sb, qid, freed, err),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned int,	qid)
+		__field(u64,		freed)
+		__field(int,		err)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= sb->s_dev;
+		__entry->qid	= qid;
+		__entry->freed	= freed;
+		__entry->err	= err;
+	),
+
+	TP_printk("dev %d,%d queue %u freed %llu err %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->qid,
+		  __entry->freed, __entry->err)
+);
+
+TRACE_EVENT(apfs_transaction_commit,
+	TP_PROTO(struct super_block *sb, u64 xid, size_t buffers, u64 duration_ns),
+	TP_ARGS(sb, xid, buffers, duration_ns),
+
+	TP_STRUCT__entry(
+		__field(dev_t,	dev)
+		__field(u64,	xid)
+		__field(size_t,	buffers)
+		__field(u64,	duration_ns)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= sb->s_dev;
+		__entry->xid		= xid;
+		__entry->buffers	= buffers;
+		__entry->duration_ns	= duration_ns;
+	),
+
+	TP_printk("dev %d,%d xid 0x%llx buffers %zu duration %lluns",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->xid,
+		  __entry->buffers, __entry->duration_ns)
+);
+
+TRACE_EVENT(apfs_decompress,
+	TP_PROTO(struct super_block *sb, u32 algo, size_t csize, ssize_t size),
+	TP_ARGS(sb, algo, csize, size),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(u32,		algo)
+		__field(size_t,		csize)
+		__field(ssize_t,	size)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= sb->s_dev;
+		__entry->algo	= algo;
+		__entry->csize	= csize;
+		__entry->size	= size;
+	),
+
+	TP_printk("dev %d,%d algo %u compressed %zu decompressed %zd",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->algo,
+		  __entry->csize, __entry->size)
+);
+
+#endif /* _APFS_TRACE_H */
+
+/* This is an out-of-tree module, so the header is not under include/trace */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>
@@ -4,16 +4,19 @@
  */
 
 #include <linux/blkdev.h>
+#include <linux/list_sort.h>
 #include <linux/rmap.h>
 #include "apfs.h"
+#include "trace.h"
 
 /**
  * apfs_checkpoint_end - End the new checkpoint
  * @sb:	filesystem superblock
  *
  * Flushes all changes to disk, and commits the new checkpoint by setting the
- * fletcher checksum on its superblock.  Returns 0 on success, or a negative
- * error code in case of failure.
+ * fletcher checksum on its superblock.  The superblock write also works as the
+ * only cache flush barrier for the whole transaction.  Returns 0 on success, or
+ * a negative error code in case of failure.
  */
 static int apfs_checkpoint_end(struct super_block *sb)
 {
@@ -39,8 +42,9 @@ static int apfs_checkpoint_end(struct super_block *sb)
 	if (err)
 		goto out;
 
+	/* Everything else must be stable before the new checkpoint is */
 	mark_buffer_dirty(bh);
-	err = sync_dirty_buffer(bh);
+	err = __sync_dirty_buffer(bh, REQ_SYNC | REQ_PREFLUSH | REQ_FUA);
 	if (err)
 		goto out;
 
@@ -58,7 +62,8 @@ out:
  */
 static bool apfs_transaction_has_room(struct super_block *sb, struct apfs_max_ops maxops)
 {
-	u64 max_cat_blks, max_omap_blks, max_extref_blks, max_blks;
+	struct apfs_nx_transaction *nx_trans = &APFS_NXI(sb)->nx_transaction;
+	u64 max_cat_blks, max_omap_blks, max_extref_blks, max_blks, file_blks;
 	/* I don't know the actual maximum heights, just guessing */
 	const u64 max_cat_height = 8, max_omap_height = 3, max_extref_height = 3;
 
@@ -75,14 +80,21 @@ static bool apfs_transaction_has_room(struct super_block *sb, struct apfs_max_op
 	 */
 	max_omap_blks = 1 + 2 * max_cat_blks * max_omap_height;
 
+	/*
+	 * The delayed blocks from earlier in the transaction are not allocated
+	 * yet, and the commit can't fail when it gets to them, so they count
+	 * the same as the blocks of this operation.
+	 */
+	file_blks = maxops.blks + nx_trans->t_delalloc_count;
+
 	/* The extent reference tree needs a maximum of one record per block */
-	max_extref_blks = 1 + 2 * maxops.blks * max_extref_height;
+	max_extref_blks = 1 + 2 * file_blks * max_extref_height;
 
 	/*
 	 * Ephemeral allocations shouldn't fail, and neither should those in the
 	 * internal pool. So just add the actual file blocks and we are done.
 	 */
-	max_blks = max_cat_blks + max_omap_blks + max_extref_blks + maxops.blks;
+	max_blks = max_cat_blks + max_omap_blks + max_extref_blks + file_blks;
 
 	return max_blks < APFS_SM(sb)->sm_free_count;
 }
@@ -115,19 +127,16 @@ static int apfs_read_single_ephemeral_object(struct super_block *sb, struct apfs
 	bno = le64_to_cpu(map->cpm_paddr);
 	oid = le64_to_cpu(map->cpm_oid);
 	size = le32_to_cpu(map->cpm_size);
-	if (size > sb->s_blocksize << 1) {
-		/*
-		 * No reason not to support bigger objects, but there has to be
-		 * a limit somewhere and this is all I've seen so far.
-		 */
-		apfs_warn(sb, "ephemeral object has more than 2 blocks");
+	if (size > APFS_EPHEMERAL_OBJ_MAX_SIZE) {
+		/* There has to be a limit somewhere */
+		apfs_warn(sb, "ephemeral object is too big (0x%x)", size);
 		return -EOPNOTSUPP;
 	}
 	if (!size || (size & (sb->s_blocksize - 1))) {
 		apfs_err(sb, "invalid object size (0x%x)", size);
 		return -EFSCORRUPTED;
 	}
-	object = kmalloc(size, GFP_KERNEL);
+	object = kvmalloc(size, GFP_KERNEL);
 	if (!object)
 		return -ENOMEM;
 
@@ -165,7 +174,7 @@ static int apfs_read_single_ephemeral_object(struct super_block *sb, struct apfs
 	return 0;
 
 fail:
-	kfree(object);
+	kvfree(object);
 	object = NULL;
 	return err;
 }
@@ -181,7 +190,8 @@ static int apfs_read_single_cpm_block(struct super_block *sb, u64 cpm_bno)
 {
 	struct buffer_head *bh = NULL;
 	struct apfs_checkpoint_map_phys *cpm = NULL;
-	u32 map_count;
+	struct blk_plug plug;
+	u32 map_count, blk;
 	int err, i;
 
 	bh = apfs_sb_bread(sb, cpm_bno);
@@ -207,6 +217,20 @@ static int apfs_read_single_cpm_block(struct super_block *sb, u64 cpm_bno)
 		goto out;
 	}
 
+	/* Get all the reads in flight before waiting on the first one */
+	blk_start_plug(&plug);
+	for (i = 0; i < map_count; ++i) {
+		u64 paddr = le64_to_cpu(cpm->cpm_map[i].cpm_paddr);
+		u32 blkcnt = le32_to_cpu(cpm->cpm_map[i].cpm_size) >> sb->s_blocksize_bits;
+
+		/* Bad sizes get reported below */
+		if (blkcnt > APFS_EPHEMERAL_OBJ_MAX_SIZE >> sb->s_blocksize_bits)
+			continue;
+		for (blk = 0; blk < blkcnt; ++blk)
+			apfs_sb_breadahead(sb, paddr + blk);
+	}
+	blk_finish_plug(&plug);
+
 	for (i = 0; i < map_count; ++i) {
 		err = apfs_read_single_ephemeral_object(sb, &cpm->cpm_map[i]);
 		if (err) {
@@ -221,6 +245,49 @@ out:
 	return err;
 }
 
+/**
+ * apfs_readahead_ephemeral_objects - Start reading the current checkpoint
+ * @sb:	superblock structure
+ *
+ * The ephemeral objects only get read by the first transaction, but this lets
+ * the reads overlap with the rest of the mount. The whole checkpoint area is
+ * requested at once, so that each block doesn't need its own round trip.
+ */
+void apfs_readahead_ephemeral_objects(struct super_block *sb)
+{
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_nx_superblock *raw_sb = nxi->nx_raw;
+	u64 desc_base, data_base;
+	u32 desc_index, desc_blks, desc_len;
+	u32 data_index, data_blks, data_len;
+	struct blk_plug plug;
+	u32 i;
+
+	if (nxi->nx_eph_list)
+		return;
+
+	desc_base = le64_to_cpu(raw_sb->nx_xp_desc_base);
+	desc_index = le32_to_cpu(raw_sb->nx_xp_desc_index);
+	desc_blks = le32_to_cpu(raw_sb->nx_xp_desc_blocks);
+	desc_len = le32_to_cpu(raw_sb->nx_xp_desc_len);
+	data_base = le64_to_cpu(raw_sb->nx_xp_data_base);
+	data_index = le32_to_cpu(raw_sb->nx_xp_data_index);
+	data_blks = le32_to_cpu(raw_sb->nx_xp_data_blocks);
+	data_len = le32_to_cpu(raw_sb->nx_xp_data_len);
+
+	/* Nonsense values will get reported when the area is actually read */
+	if (!desc_blks || !data_blks || desc_len > desc_blks || data_len > data_blks)
+		return;
+
+	blk_start_plug(&plug);
+	/* Last block in the area is superblock; the rest are mapping blocks */
+	for (i = 0; i + 1 < desc_len; ++i)
+		apfs_sb_breadahead(sb, desc_base + (desc_index + i) % desc_blks);
+	for (i = 0; i < data_len; ++i)
+		apfs_sb_breadahead(sb, data_base + (data_index + i) % data_blks);
+	blk_finish_plug(&plug);
+}
+
 /**
  * apfs_read_ephemeral_objects - Read all ephemeral objects to memory
  * @sb:	superblock structure
@@ -233,23 +300,36 @@ static int apfs_read_ephemeral_objects(struct super_block *sb)
 	struct apfs_nx_superblock *raw_sb = nxi->nx_raw;
 	u64 desc_base;
 	u32 desc_index, desc_blks, desc_len, i;
+	struct blk_plug plug;
 	int err;
 
 	if (nxi->nx_eph_list) {
 		apfs_alert(sb, "attempt to reread ephemeral object list");
 		return -EFSCORRUPTED;
 	}
-	nxi->nx_eph_list = kzalloc(APFS_EPHEMERAL_LIST_SIZE, GFP_KERNEL);
-	if (!nxi->nx_eph_list)
-		return -ENOMEM;
-	nxi->nx_eph_count = 0;
 
 	desc_base = le64_to_cpu(raw_sb->nx_xp_desc_base);
 	desc_index = le32_to_cpu(raw_sb->nx_xp_desc_index);
 	desc_blks = le32_to_cpu(raw_sb->nx_xp_desc_blocks);
 	desc_len = le32_to_cpu(raw_sb->nx_xp_desc_len);
 
+	/* The area must at least hold the superblock */
+	if (!desc_blks || !desc_len || desc_len > desc_blks) {
+		apfs_err(sb, "bad checkpoint descriptor area (len %u, blocks %u)", desc_len, desc_blks);
+		return -EFSCORRUPTED;
+	}
+
+	nxi->nx_eph_list = kzalloc(APFS_EPHEMERAL_LIST_SIZE, GFP_KERNEL);
+	if (!nxi->nx_eph_list)
+		return -ENOMEM;
+	nxi->nx_eph_count = 0;
+
 	/* Last block in the area is superblock; the rest are mapping blocks */
+	blk_start_plug(&plug);
+	for (i = 0; i < desc_len - 1; ++i)
+		apfs_sb_breadahead(sb, desc_base + (desc_index + i) % desc_blks);
+	blk_finish_plug(&plug);
+
 	for (i = 0; i < desc_len - 1; ++i) {
 		u64 cpm_bno = desc_base + (desc_index + i) % desc_blks;
 
@@ -263,14 +343,15 @@ static int apfs_read_ephemeral_objects(struct super_block *sb)
 }
 
 /**
- * apfs_transaction_start - Begin a new transaction
+ * __apfs_transaction_start - Begin a new transaction
  * @sb:		superblock structure
  * @maxops:	maximum operations expected
+ * @retry:	try again once if a commit of the delayed blocks may free room
  *
- * Also locks the filesystem for writing; returns 0 on success or a negative
- * error code in case of failure.
+ * Also locks the container and the volume for writing; returns 0 on success or
+ * a negative error code in case of failure.
  */
-int apfs_transaction_start(struct super_block *sb, struct apfs_max_ops maxops)
+static int __apfs_transaction_start(struct super_block *sb, struct apfs_max_ops maxops, bool retry)
 {
 	struct apfs_sb_info *sbi = APFS_SB(sb);
 	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
@@ -279,11 +360,13 @@ int apfs_transaction_start(struct super_block *sb, struct apfs_max_ops maxops)
 	int err;
 
 	down_write(&nxi->nx_big_sem);
+	down_write(apfs_vol_sem(sb));
 	mutex_lock(&nxs_mutex); /* Don't mount during a transaction */
 
 	if (sb->s_flags & SB_RDONLY) {
 		/* A previous transaction has failed; this should be rare */
 		mutex_unlock(&nxs_mutex);
+		up_write(apfs_vol_sem(sb));
 		up_write(&nxi->nx_big_sem);
 		return -EROFS;
 	}
@@ -296,6 +379,7 @@ int apfs_transaction_start(struct super_block *sb, struct apfs_max_ops maxops)
 		err = apfs_read_ephemeral_objects(sb);
 		if (err) {
 			mutex_unlock(&nxs_mutex);
+			up_write(apfs_vol_sem(sb));
 			up_write(&nxi->nx_big_sem);
 			apfs_err(sb, "failed to read the ephemeral objects");
 			return err;
@@ -306,6 +390,10 @@ int apfs_transaction_start(struct super_block *sb, struct apfs_max_ops maxops)
 		++nxi->nx_xid;
 		nxi->nx_raw->nx_next_xid = cpu_to_le64(nxi->nx_xid + 1);
 
+		/* Don't leave the new transaction open for too long */
+		if (sbi->s_commit_interval)
+			schedule_delayed_work(&sbi->s_commit_work, sbi->s_commit_interval * HZ);
+
 		INIT_LIST_HEAD(&nx_trans->t_inodes);
 		INIT_LIST_HEAD(&nx_trans->t_buffers);
 
@@ -318,6 +406,8 @@ int apfs_transaction_start(struct super_block *sb, struct apfs_max_ops maxops)
 
 	/* Don't start transactions unless we are sure they fit in disk */
 	if (!apfs_transaction_has_room(sb, maxops)) {
+		bool had_delalloc = nx_trans->t_delalloc_count;
+
 		/* Commit what we have so far to flush the queues */
 		nx_trans->t_state |= APFS_NX_TRANS_FORCE_COMMIT;
 		err = apfs_transaction_commit(sb);
@@ -325,6 +415,9 @@ int apfs_transaction_start(struct super_block *sb, struct apfs_max_ops maxops)
 			apfs_err(sb, "commit failed");
 			goto fail;
 		}
+		/* The delayed blocks are allocated now, so check again once */
+		if (had_delalloc && retry)
+			return __apfs_transaction_start(sb, maxops, false /* retry */);
 		return -ENOSPC;
 	}
 
@@ -365,6 +458,39 @@ fail:
 	return err;
 }
 
+/**
+ * apfs_transaction_start - Begin a new transaction
+ * @sb:		superblock structure
+ * @maxops:	maximum operations expected
+ *
+ * Also locks the container and the volume for writing; returns 0 on success or
+ * a negative error code in case of failure.
+ */
+int apfs_transaction_start(struct super_block *sb, struct apfs_max_ops maxops)
+{
+	return __apfs_transaction_start(sb, maxops, true /* retry */);
+}
+
+/**
+ * apfs_lock_other_volume - Lock a volume touched by the current transaction
+ * @sb:		superblock that is running the transaction
+ * @vol_sb:	superblock for the volume to lock
+ *
+ * A transaction locks only the volume that started it, but a commit may have
+ * to touch the trees of other volumes as well. Returns true if the volume
+ * semaphore for @vol_sb was taken, in which case the caller must release it.
+ */
+static bool apfs_lock_other_volume(struct super_block *sb, struct super_block *vol_sb)
+{
+	lockdep_assert_held_write(&APFS_NXI(sb)->nx_big_sem);
+
+	if (apfs_vol_sem(vol_sb) == apfs_vol_sem(sb))
+		return false;
+	/* Other writers are excluded by nx_big_sem, so the order is irrelevant */
+	down_write_nested(apfs_vol_sem(vol_sb), SINGLE_DEPTH_NESTING);
+	return true;
+}
+
 /**
  * apfs_transaction_flush_all_inodes - Flush inode metadata to the buffer heads
  * @sb: superblock structure
@@ -384,12 +510,22 @@ int apfs_transaction_flush_all_inodes(struct super_block *sb)
 	while (!list_empty(&nx_trans->t_inodes)) {
 		struct apfs_inode_info *ai = NULL;
 		struct inode *inode = NULL;
+		bool locked;
 
 		ai = list_first_entry(&nx_trans->t_inodes, struct apfs_inode_info, i_list);
 		inode = &ai->vfs_inode;
 
 		/* This is a bit wasteful if the inode will get deleted */
+		locked = apfs_lock_other_volume(sb, inode->i_sb);
+		curr_err = apfs_dstream_flush_delalloc(&ai->i_dstream, NULL /* locked_page */);
+		if (curr_err)
+			err = curr_err;
+		curr_err = apfs_dstream_free_prealloc(&ai->i_dstream);
+		if (curr_err)
+			err = curr_err;
 		curr_err = apfs_update_inode(inode, NULL /* new_name */);
+		if (locked)
+			up_write(apfs_vol_sem(inode->i_sb));
 		if (curr_err)
 			err = curr_err;
 		inode->i_state &= ~I_DIRTY_ALL;
@@ -402,12 +538,14 @@ int apfs_transaction_flush_all_inodes(struct super_block *sb)
 
 		nx_trans->t_state |= APFS_NX_TRANS_COMMITTING;
 		mutex_unlock(&nxs_mutex);
+		up_write(apfs_vol_sem(sb));
 		up_write(&nxi->nx_big_sem);
 
 		/* Unlocked, so it may call evict() and wait for writeback */
 		iput(inode);
 
 		down_write(&nxi->nx_big_sem);
+		down_write(apfs_vol_sem(sb));
 		mutex_lock(&nxs_mutex);
 		nx_trans->t_state = 0;
 
@@ -589,46 +727,49 @@ static int apfs_write_ephemeral_objects(struct super_block *sb)
 }
 
 /**
- * apfs_transaction_commit_nx - Definitely commit the current transaction
- * @sb: superblock structure
+ * apfs_bh_info_cmp - Compare two transaction buffers by block number
+ * @priv:	unused
+ * @a:		list entry for the first buffer
+ * @b:		list entry for the second buffer
  */
-static int apfs_transaction_commit_nx(struct super_block *sb)
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 13, 0)
+static int apfs_bh_info_cmp(void *priv, struct list_head *a, struct list_head *b)
+#else
+static int apfs_bh_info_cmp(void *priv, const struct list_head *a, const struct list_head *b)
+#endif
 {
-	struct apfs_spaceman *sm = APFS_SM(sb);
-	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
-	struct apfs_sb_info *sbi;
-	struct apfs_nx_transaction *nx_trans = &nxi->nx_transaction;
-	struct apfs_bh_info *bhi, *tmp;
-	int err = 0;
-	u32 bmap_idx;
+	sector_t bno_a = list_entry(a, struct apfs_bh_info, list)->bh->b_blocknr;
+	sector_t bno_b = list_entry(b, struct apfs_bh_info, list)->bh->b_blocknr;
 
-	ASSERT(!(sb->s_flags & SB_RDONLY));
+	if (bno_a < bno_b)
+		return -1;
+	return bno_a > bno_b;
+}
 
-	/* Before committing the bhs, write all inode metadata to them */
-	err = apfs_transaction_flush_all_inodes(sb);
-	if (err) {
-		apfs_err(sb, "failed to flush all inodes");
-		return err;
-	}
+/**
+ * apfs_write_trans_buffers - Write a list of transaction buffers and release them
+ * @sb:		superblock structure
+ * @list:	list of buffers, all of them part of the transaction
+ * @locked:	the caller already holds the locks for all the pages
+ *
+ * Each buffer leaves the transaction after it's written, and its page gets
+ * unlocked if @locked is set. On failure, the buffers that remain stay on
+ * @list, along with their page locks. Returns 0 on success, or a negative
+ * error code in case of failure.
+ */
+static int apfs_write_trans_buffers(struct super_block *sb, struct list_head *list, bool locked)
+{
+	struct apfs_nx_transaction *nx_trans = &APFS_NXI(sb)->nx_transaction;
+	struct apfs_bh_info *bhi, *tmp;
+	struct blk_plug plug;
 
 	/*
-	 * Now that nothing else will be freed, flush the last update to the
-	 * free queues so that it can be committed to disk along with all the
-	 * ephemeral objects.
+	 * Copy-on-write tends to put the new blocks close together, so submit
+	 * them in order under a plug and let the block layer merge the bios.
 	 */
-	if (sm->sm_free_cache_base) {
-		err = apfs_free_queue_insert_nocache(sb, sm->sm_free_cache_base, sm->sm_free_cache_blkcnt);
-		if (err) {
-			apfs_err(sb, "fq cache flush failed (0x%llx-0x%llx)", sm->sm_free_cache_base, sm->sm_free_cache_blkcnt);
-			return err;
-		}
-		sm->sm_free_cache_base = sm->sm_free_cache_blkcnt = 0;
-	}
-	err = apfs_write_ephemeral_objects(sb);
-	if (err)
-		return err;
-
-	list_for_each_entry(bhi, &nx_trans->t_buffers, list) {
+	list_sort(NULL, list, apfs_bh_info_cmp);
+	blk_start_plug(&plug);
+	list_for_each_entry(bhi, list, list) {
 		struct buffer_head *bh = bhi->bh;
 
 		ASSERT(buffer_trans(bh));
@@ -642,7 +783,8 @@ static int apfs_transaction_commit_nx(struct super_block *sb)
 		bh->b_end_io = end_buffer_write_sync;
 		apfs_submit_bh(REQ_OP_WRITE, REQ_SYNC, bh);
 	}
-	list_for_each_entry_safe(bhi, tmp, &nx_trans->t_buffers, list) {
+	blk_finish_plug(&plug);
+	list_for_each_entry_safe(bhi, tmp, list, list) {
 		struct buffer_head *bh = bhi->bh;
 		struct page *page = NULL;
 		bool is_metadata;
@@ -673,7 +815,8 @@ static int apfs_transaction_commit_nx(struct super_block *sb)
 		bh = NULL;
 
 		/* Future writes to mmapped areas should fault for CoW */
-		lock_page(page);
+		if (!locked)
+			lock_page(page);
 		page_mkclean(page);
 		/* XXX: otherwise, the page cache fills up and crashes the machine */
 		if (!is_metadata) {
@@ -686,6 +829,114 @@ static int apfs_transaction_commit_nx(struct super_block *sb)
 		unlock_page(page);
 		put_page(page);
 	}
+	return 0;
+}
+
+/**
+ * apfs_transaction_unpin_data - Write the data of the transaction ahead of time
+ * @sb:	superblock structure
+ *
+ * Buffer heads can't be reclaimed while they are part of the transaction, so
+ * a big enough transaction could use up all memory. Data blocks have already
+ * been moved to their new location by copy-on-write, and nothing in the last
+ * checkpoint points to them, so they can safely be written early and let go.
+ * Metadata stays pinned until the commit because it may still change. Returns
+ * 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_transaction_unpin_data(struct super_block *sb)
+{
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_nx_transaction *nx_trans = &nxi->nx_transaction;
+	struct inode *bdev_inode = nxi->nx_bdev->bd_inode;
+	struct apfs_bh_info *bhi, *tmp;
+	LIST_HEAD(data_list);
+	size_t count = 0;
+	int err;
+
+	/* Deferred commits come from callers that may hold page locks */
+	if (nx_trans->t_state & (APFS_NX_TRANS_FORCE_COMMIT | APFS_NX_TRANS_COMMITTING | APFS_NX_TRANS_DEFER_COMMIT))
+		return 0;
+	if (nx_trans->t_buffers_count <= APFS_SB(sb)->s_trans_buffers_max >> 1)
+		return 0;
+
+	list_for_each_entry_safe(bhi, tmp, &nx_trans->t_buffers, list) {
+		struct buffer_head *bh = bhi->bh;
+
+		/* Metadata lives in the page cache of the block device */
+		if (buffer_csum(bh) || bh->b_page->mapping == bdev_inode->i_mapping)
+			continue;
+		/*
+		 * Some other lock holder may be waiting for this transaction,
+		 * so leave those pages for the commit. This also takes a single
+		 * buffer per page, which keeps the unlocking simple.
+		 */
+		if (!trylock_page(bh->b_page))
+			continue;
+		list_move(&bhi->list, &data_list);
+		++count;
+	}
+	if (!count)
+		return 0;
+
+	err = apfs_write_trans_buffers(sb, &data_list, true /* locked */);
+	/* Let the abort take care of anything left */
+	list_for_each_entry(bhi, &data_list, list)
+		unlock_page(bhi->bh->b_page);
+	list_splice(&data_list, &nx_trans->t_buffers);
+	if (err) {
+		apfs_err(sb, "failed to write data buffers early");
+		return err;
+	}
+	apfs_nx_stat_add(nxi, early_buffers, count);
+	return 0;
+}
+
+/**
+ * apfs_transaction_commit_nx - Definitely commit the current transaction
+ * @sb: superblock structure
+ */
+static int apfs_transaction_commit_nx(struct super_block *sb)
+{
+	struct apfs_spaceman *sm = APFS_SM(sb);
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_sb_info *sbi;
+	struct apfs_nx_transaction *nx_trans = &nxi->nx_transaction;
+	u64 start_ns = ktime_get_ns(), duration_ns;
+	size_t buffers;
+	int bucket;
+	int err = 0;
+	u32 bmap_idx;
+
+	ASSERT(!(sb->s_flags & SB_RDONLY));
+
+	/* Before committing the bhs, write all inode metadata to them */
+	err = apfs_transaction_flush_all_inodes(sb);
+	if (err) {
+		apfs_err(sb, "failed to flush all inodes");
+		return err;
+	}
+
+	/*
+	 * Now that nothing else will be freed, flush the last update to the
+	 * free queues so that it can be committed to disk along with all the
+	 * ephemeral objects.
+	 */
+	if (sm->sm_free_cache_base) {
+		err = apfs_free_queue_insert_nocache(sb, sm->sm_free_cache_base, sm->sm_free_cache_blkcnt);
+		if (err) {
+			apfs_err(sb, "fq cache flush failed (0x%llx-0x%llx)", sm->sm_free_cache_base, sm->sm_free_cache_blkcnt);
+			return err;
+		}
+		sm->sm_free_cache_base = sm->sm_free_cache_blkcnt = 0;
+	}
+	err = apfs_write_ephemeral_objects(sb);
+	if (err)
+		return err;
+
+	buffers = nx_trans->t_buffers_count;
+	err = apfs_write_trans_buffers(sb, &nx_trans->t_buffers, false /* locked */);
+	if (err)
+		return err;
 	err = apfs_checkpoint_end(sb);
 	if (err) {
 		apfs_err(sb, "failed to end the checkpoint");
@@ -718,16 +969,95 @@ static int apfs_transaction_commit_nx(struct super_block *sb)
 
 	nx_trans->t_starts_count = 0;
 	nx_trans->t_buffers_count = 0;
+
+	duration_ns = ktime_get_ns() - start_ns;
+	trace_apfs_transaction_commit(sb, nxi->nx_xid, buffers, duration_ns);
+	apfs_nx_stat_inc(nxi, commits);
+	apfs_nx_stat_add(nxi, commit_buffers, buffers);
+	/* Each bucket is four times longer than the last, starting at 1ms */
+	for (bucket = 0; bucket < APFS_COMMIT_HIST_BUCKETS - 1; ++bucket) {
+		if (duration_ns < (NSEC_PER_MSEC << (2 * bucket)))
+			break;
+	}
+	apfs_nx_stat_inc(nxi, commit_hist[bucket]);
 	return 0;
 }
 
+/**
+ * apfs_transaction_over_limits - Check if the transaction has grown too big
+ * @sb:		superblock structure
+ * @shift:	log2 of the divisor for all limits
+ */
+static bool apfs_transaction_over_limits(struct super_block *sb, int shift)
+{
+	struct apfs_spaceman *sm = APFS_SM(sb);
+	struct apfs_nx_transaction *nx_trans = &APFS_NXI(sb)->nx_transaction;
+	struct apfs_spaceman_phys *sm_raw = NULL;
+	struct apfs_spaceman_free_queue *fq_ip = NULL;
+	struct apfs_spaceman_free_queue *fq_main = NULL;
+	int buffers_max = TRANSACTION_BUFFERS_MAX;
+	int pinned_max = APFS_SB(sb)->s_trans_buffers_max;
+	int starts_max = TRANSACTION_STARTS_MAX;
+	int mq_max = TRANSACTION_MAIN_QUEUE_MAX;
+
+	if (!sm)
+		return false;
+	sm_raw = sm->sm_raw;
+	fq_ip = &sm_raw->sm_fq[APFS_SFQ_IP];
+	fq_main = &sm_raw->sm_fq[APFS_SFQ_MAIN];
+
+	/*
+	 * Try to avoid committing halfway through a data block write,
+	 * otherwise the block will be put through copy-on-write again,
+	 * causing unnecessary fragmentation.
+	 */
+	if (nx_trans->t_state & APFS_NX_TRANS_INCOMPLETE_BLOCK) {
+		buffers_max += 50;
+		starts_max += 50;
+		mq_max += 20;
+	}
+
+	/* Delayed blocks will all need a buffer on commit */
+	if (nx_trans->t_buffers_count + nx_trans->t_delalloc_count > buffers_max >> shift)
+		return true;
+	/* Most of what remains pinned after the early data writes is metadata */
+	if (nx_trans->t_buffers_count > pinned_max >> shift)
+		return true;
+	if (nx_trans->t_starts_count > starts_max >> shift)
+		return true;
+
+	/*
+	 * The internal pool has enough blocks to map the container
+	 * exactly 3 times. Don't allow large transactions if we can't
+	 * be sure the bitmap changes will all fit.
+	 */
+	if (le64_to_cpu(fq_ip->sfq_count) * 3 > le64_to_cpu(sm_raw->sm_ip_block_count) >> shift)
+		return true;
+
+	/*
+	 * Don't let the main queue get too full either. Part of it may be a
+	 * backlog from older transactions that is still getting flushed, so
+	 * only count the records queued since this transaction started.
+	 */
+	if (apfs_main_fq_trans_count(sb) > mq_max >> shift)
+		return true;
+	if (le64_to_cpu(fq_main->sfq_count) > TRANSACTION_FQ_BACKLOG_MAX >> shift)
+		return true;
+
+	return false;
+}
+
 /**
  * apfs_transaction_need_commit - Evaluate if a commit is required
  * @sb: superblock structure
+ *
+ * With background commits enabled, transactions that reach half their limits
+ * get handed to the commit worker, so that foreground operations only have to
+ * commit when the worker can't keep up.
  */
 static bool apfs_transaction_need_commit(struct super_block *sb)
 {
-	struct apfs_spaceman *sm = APFS_SM(sb);
+	struct apfs_sb_info *sbi = APFS_SB(sb);
 	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
 	struct apfs_nx_transaction *nx_trans = &nxi->nx_transaction;
 
@@ -745,43 +1075,10 @@ static bool apfs_transaction_need_commit(struct super_block *sb)
 		return true;
 	}
 
-	if (sm) {
-		struct apfs_spaceman_phys *sm_raw = sm->sm_raw;
-		struct apfs_spaceman_free_queue *fq_ip = &sm_raw->sm_fq[APFS_SFQ_IP];
-		struct apfs_spaceman_free_queue *fq_main = &sm_raw->sm_fq[APFS_SFQ_MAIN];
-		int buffers_max = APFS_SB(sb)->s_trans_buffers_max;
-		int starts_max = TRANSACTION_STARTS_MAX;
-		int mq_max = TRANSACTION_MAIN_QUEUE_MAX;
-
-		/*
-		 * Try to avoid committing halfway through a data block write,
-		 * otherwise the block will be put through copy-on-write again,
-		 * causing unnecessary fragmentation.
-		 */
-		if (nx_trans->t_state & APFS_NX_TRANS_INCOMPLETE_BLOCK) {
-			buffers_max += 50;
-			starts_max += 50;
-			mq_max += 20;
-		}
-
-		if (nx_trans->t_buffers_count > buffers_max)
-			return true;
-		if (nx_trans->t_starts_count > starts_max)
-			return true;
-
-		/*
-		 * The internal pool has enough blocks to map the container
-		 * exactly 3 times. Don't allow large transactions if we can't
-		 * be sure the bitmap changes will all fit.
-		 */
-		if (le64_to_cpu(fq_ip->sfq_count) * 3 > le64_to_cpu(sm_raw->sm_ip_block_count))
-			return true;
-
-		/* Don't let the main queue get too full either */
-		if (le64_to_cpu(fq_main->sfq_count) > mq_max)
-			return true;
-	}
-
+	if (apfs_transaction_over_limits(sb, 0 /* shift */))
+		return true;
+	if (sbi->s_commit_interval && apfs_transaction_over_limits(sb, 1 /* shift */))
+		mod_delayed_work(system_wq, &sbi->s_commit_work, 0);
 	return false;
 }
 
@@ -789,15 +1086,19 @@ static bool apfs_transaction_need_commit(struct super_block *sb)
  * apfs_transaction_commit - Possibly commit the current transaction
  * @sb: superblock structure
  *
- * On success returns 0 and releases the big filesystem lock. On failure,
- * returns a negative error code, and the caller is responsibly for aborting
- * the transaction.
+ * On success returns 0 and releases the container and volume locks. On
+ * failure, returns a negative error code, and the caller is responsibly for
+ * aborting the transaction.
  */
 int apfs_transaction_commit(struct super_block *sb)
 {
 	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
 	int err = 0;
 
+	err = apfs_transaction_unpin_data(sb);
+	if (err)
+		return err;
+
 	if (apfs_transaction_need_commit(sb)) {
 		err = apfs_transaction_commit_nx(sb);
 		if (err) {
@@ -807,10 +1108,49 @@ int apfs_transaction_commit(struct super_block *sb)
 	}
 
 	mutex_unlock(&nxs_mutex);
+	up_write(apfs_vol_sem(sb));
 	up_write(&nxi->nx_big_sem);
 	return 0;
 }
 
+/**
+ * apfs_transaction_commit_work - Commit the current transaction in background
+ * @work: the commit work for the volume that started the transaction
+ */
+void apfs_transaction_commit_work(struct work_struct *work)
+{
+	struct apfs_sb_info *sbi = NULL;
+	struct apfs_nxsb_info *nxi = NULL;
+	struct super_block *sb = NULL;
+	struct apfs_max_ops maxops = {0};
+	bool pending;
+	int err;
+
+	sbi = container_of(to_delayed_work(work), struct apfs_sb_info, s_commit_work);
+	sb = sbi->s_vobject.sb;
+	nxi = APFS_NXI(sb);
+
+	if (sb->s_flags & SB_RDONLY)
+		return;
+
+	/* Don't write an empty checkpoint if another commit got here first */
+	down_read(&nxi->nx_big_sem);
+	pending = nxi->nx_transaction.t_starts_count != 0;
+	up_read(&nxi->nx_big_sem);
+	if (!pending)
+		return;
+
+	err = apfs_transaction_start(sb, maxops);
+	if (err)
+		return;
+	nxi->nx_transaction.t_state |= APFS_NX_TRANS_FORCE_COMMIT;
+	err = apfs_transaction_commit(sb);
+	if (err) {
+		apfs_err(sb, "background commit failed");
+		apfs_transaction_abort(sb);
+	}
+}
+
 /**
  * apfs_inode_join_transaction - Add an inode to the current transaction
  * @sb:		superblock structure
@@ -825,6 +1165,7 @@ void apfs_inode_join_transaction(struct super_block *sb, struct inode *inode)
 	ASSERT(!(sb->s_flags & SB_RDONLY));
 	lockdep_assert_held_write(&nxi->nx_big_sem);
 
+	ai->i_sync_xid = nxi->nx_xid;
 	if (!list_empty(&ai->i_list)) /* Already in the transaction */
 		return;
 
@@ -832,6 +1173,47 @@ void apfs_inode_join_transaction(struct super_block *sb, struct inode *inode)
 	list_add(&ai->i_list, &nx_trans->t_inodes);
 }
 
+/**
+ * apfs_inode_data_join_transaction - Add an inode to the transaction for a
+ *				      change to its data
+ * @sb:		superblock structure
+ * @inode:	vfs inode to add
+ *
+ * Like apfs_inode_join_transaction(), but also makes fdatasync() on the inode
+ * wait for this transaction.
+ */
+void apfs_inode_data_join_transaction(struct super_block *sb, struct inode *inode)
+{
+	apfs_inode_join_transaction(sb, inode);
+	APFS_I(inode)->i_datasync_xid = APFS_NXI(sb)->nx_xid;
+}
+
+/**
+ * apfs_inode_needs_sync - Check if an inode has changes yet to be committed
+ * @inode:	vfs inode to check
+ * @datasync:	only consider the changes needed to read back the data?
+ *
+ * The container has a single transaction, so an inode whose latest change
+ * belongs to a transaction that already committed has nothing to sync.
+ */
+bool apfs_inode_needs_sync(struct inode *inode, int datasync)
+{
+	struct super_block *sb = inode->i_sb;
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_inode_info *ai = APFS_I(inode);
+	bool ret;
+
+	/* Let the caller report the error after an abort */
+	if (sb->s_flags & SB_RDONLY)
+		return true;
+
+	down_read(&nxi->nx_big_sem);
+	ret = nxi->nx_transaction.t_starts_count &&
+	      (datasync ? ai->i_datasync_xid : ai->i_sync_xid) == nxi->nx_xid;
+	up_read(&nxi->nx_big_sem);
+	return ret;
+}
+
 /**
  * apfs_transaction_join - Add a buffer head to the current transaction
  * @sb:	superblock structure
@@ -849,6 +1231,9 @@ int apfs_transaction_join(struct super_block *sb, struct buffer_head *bh)
 	if (buffer_trans(bh)) /* Already part of the only transaction */
 		return 0;
 
+	/* The block is about to change, so a parsed copy would go stale */
+	apfs_node_cache_forget(sb, bh->b_blocknr);
+
 	/* TODO: use a slab cache */
 	bhi = kzalloc(sizeof(*bhi), GFP_NOFS);
 	if (!bhi)
@@ -883,9 +1268,9 @@ static void apfs_force_readonly(struct apfs_nxsb_info *nxi)
  * apfs_transaction_abort - Abort the current transaction
  * @sb: superblock structure
  *
- * Releases the big filesystem lock and clears the in-memory transaction data;
- * the on-disk changes are irrelevant because the superblock checksum hasn't
- * been written yet. Leaves the filesystem in read-only state.
+ * Releases the container and volume locks and clears the in-memory transaction
+ * data; the on-disk changes are irrelevant because the superblock checksum
+ * hasn't been written yet. Leaves the filesystem in read-only state.
  */
 void apfs_transaction_abort(struct super_block *sb)
 {
@@ -902,6 +1287,7 @@ void apfs_transaction_abort(struct super_block *sb)
 		ASSERT(list_empty(&nx_trans->t_inodes));
 		ASSERT(list_empty(&nx_trans->t_buffers));
 		mutex_unlock(&nxs_mutex);
+		up_write(apfs_vol_sem(sb));
 		up_write(&nxi->nx_big_sem);
 		return;
 	}
@@ -909,6 +1295,9 @@ void apfs_transaction_abort(struct super_block *sb)
 	nx_trans->t_state = 0;
 	apfs_err(sb, "aborting transaction");
 
+	/* The volume allocation counts will be read again from disk */
+	nxi->nx_used_blocks_valid = false;
+
 	--nxi->nx_xid;
 	list_for_each_entry_safe(bhi, tmp, &nx_trans->t_buffers, list) {
 		struct buffer_head *bh = bhi->bh;
@@ -923,6 +1312,7 @@ void apfs_transaction_abort(struct super_block *sb)
 		list_del(&bhi->list);
 		kfree(bhi);
 	}
+	nx_trans->t_delalloc_count = 0;
 
 	/*
 	 * TODO: get rid of all this stuff, it makes little sense. Maybe do an
@@ -930,11 +1320,14 @@ void apfs_transaction_abort(struct super_block *sb)
 	 */
 	list_for_each_entry(sbi, &nxi->vol_list, list) {
 		struct apfs_vol_transaction *vol_trans = &sbi->s_transaction;
+		struct super_block *vol_sb = sbi->s_vobject.sb;
+		bool locked;
 
 		if (!vol_trans->t_old_vsb)
 			continue;
 
 		/* Restore volume state for all volumes */
+		locked = apfs_lock_other_volume(sb, vol_sb);
 		brelse(sbi->s_vobject.o_bh);
 		sbi->s_vobject.o_bh = vol_trans->t_old_vsb;
 		sbi->s_vobject.data = sbi->s_vobject.o_bh->b_data;
@@ -951,6 +1344,8 @@ void apfs_transaction_abort(struct super_block *sb)
 		*(sbi->s_cat_root) = vol_trans->t_old_cat_root;
 		vol_trans->t_old_cat_root.object.o_bh = NULL;
 		vol_trans->t_old_cat_root.object.data = NULL;
+		if (locked)
+			up_write(apfs_vol_sem(vol_sb));
 	}
 
 	sm = APFS_SM(sb);
@@ -969,9 +1364,13 @@ void apfs_transaction_abort(struct super_block *sb)
 	apfs_force_readonly(nxi);
 
 	mutex_unlock(&nxs_mutex);
+	up_write(apfs_vol_sem(sb));
 	up_write(&nxi->nx_big_sem);
 
 	list_for_each_entry_safe(ai, ai_tmp, &nx_trans->t_inodes, i_list) {
+		/* The reserved blocks are free again in the old bitmaps */
+		ai->i_dstream.ds_prealloc_len = 0;
+		ai->i_dstream.ds_delalloc_len = 0;
 		list_del_init(&ai->i_list);
 		iput(&ai->vfs_inode);
 	}
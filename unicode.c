@@ -12,6 +12,7 @@
 #include <linux/types.h>
 #include <linux/nls.h>
 #include <linux/ctype.h>
+#include <linux/string.h>
 #include "unicode.h"
 
 #define MIN(X, Y)	((X) <= (Y) ? (X) : (Y))
@@ -74,6 +75,104 @@ static int apfs_trie_find(void *trie, unicode_t key, void *result, bool is_ccc)
 	return node & TRIE_SIZE_MASK;
 }
 
+#define REPEAT_BYTE_UL(x)	((~0UL / 0xff) * (x))
+
+/**
+ * apfs_load_word - Read an unaligned word from a string
+ * @str:	the string
+ */
+static inline unsigned long apfs_load_word(const char *str)
+{
+	unsigned long word;
+
+	memcpy(&word, str, sizeof(word));
+	return word;
+}
+
+/**
+ * apfs_ascii_fold_word - Case-fold a word of ASCII characters
+ * @word:	the characters, none of them with the high bit set
+ *
+ * The additions can't carry into the next byte, so uppercase letters can be
+ * found by comparing all bytes at the same time.
+ */
+static inline unsigned long apfs_ascii_fold_word(unsigned long word)
+{
+	unsigned long ge_a = word + REPEAT_BYTE_UL(0x80 - 'A');
+	unsigned long gt_z = word + REPEAT_BYTE_UL(0x80 - 'Z' - 1);
+
+	return word | ((ge_a & ~gt_z & REPEAT_BYTE_UL(0x80)) >> 2);
+}
+
+/**
+ * apfs_is_ascii - Check if a filename can skip normalization
+ * @str:	the filename
+ * @len:	length of @str
+ *
+ * Returns true if @str is made only of ASCII characters, checking a word at a
+ * time. Null characters are rejected as well, because they end the string for
+ * apfs_normalize_next().
+ */
+bool apfs_is_ascii(const char *str, unsigned int len)
+{
+	unsigned long ones = REPEAT_BYTE_UL(0x01), highs = REPEAT_BYTE_UL(0x80);
+
+	for (; len >= sizeof(unsigned long); str += sizeof(unsigned long), len -= sizeof(unsigned long)) {
+		unsigned long word = apfs_load_word(str);
+
+		/* Any high bit, or any null byte */
+		if ((word | ((word - ones) & ~word)) & highs)
+			return false;
+	}
+	for (; len; ++str, --len) {
+		if (!*str || !isascii(*str))
+			return false;
+	}
+	return true;
+}
+
+/**
+ * apfs_ascii_cmp - Compare two ASCII filenames
+ * @str1:	first filename
+ * @len1:	length of @str1
+ * @str2:	second filename
+ * @len2:	length of @str2
+ * @case_fold:	ignore case?
+ *
+ * Both filenames must have passed apfs_is_ascii(). The result has the same
+ * sign as comparing their normalized characters one by one.
+ */
+int apfs_ascii_cmp(const char *str1, unsigned int len1, const char *str2, unsigned int len2, bool case_fold)
+{
+	unsigned int len = MIN(len1, len2);
+	unsigned int i = 0;
+
+	for (; i + sizeof(unsigned long) <= len; i += sizeof(unsigned long)) {
+		unsigned long word1 = apfs_load_word(str1 + i);
+		unsigned long word2 = apfs_load_word(str2 + i);
+
+		if (case_fold) {
+			word1 = apfs_ascii_fold_word(word1);
+			word2 = apfs_ascii_fold_word(word2);
+		}
+		if (word1 != word2)
+			break;
+	}
+	for (; i < len; ++i) {
+		u8 c1 = str1[i], c2 = str2[i];
+
+		if (case_fold) {
+			c1 = apfs_ascii_fold(c1);
+			c2 = apfs_ascii_fold(c2);
+		}
+		if (c1 != c2)
+			return c1 < c2 ? -1 : 1;
+	}
+	if (len1 == len2)
+		return 0;
+	return len1 < len2 ? -1 : 1;
+}
+
 /**
  * apfs_init_unicursor - Initialize an apfs_unicursor structure
  * @cursor:	cursor to initialize
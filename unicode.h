@@ -20,6 +20,17 @@ struct apfs_unicursor {
 	u8 last_ccc;		/* CCC of the last character returned */
 };
 
+/**
+ * apfs_ascii_fold - Case-fold a single ASCII character
+ * @c:		the character
+ */
+static inline u8 apfs_ascii_fold(u8 c)
+{
+	return c | ((u8)(c - 'A') < 26) << 5;
+}
+
+extern bool apfs_is_ascii(const char *str, unsigned int len);
+extern int apfs_ascii_cmp(const char *str1, unsigned int len1, const char *str2, unsigned int len2, bool case_fold);
 extern void apfs_init_unicursor(struct apfs_unicursor *cursor, const char *utf8str, unsigned int total_len);
 extern unicode_t apfs_normalize_next(struct apfs_unicursor *cursor,
 				     bool case_fold);
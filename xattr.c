@@ -183,6 +183,237 @@ static int apfs_xattr_inline_read(struct apfs_xattr *xattr, void *buffer, size_t
 	return length;
 }
 
+/* Most bytes of xattr entries to cache for a single inode */
+#define APFS_XATTR_CACHE_MAX		4096
+/* Longest inline value to keep in the cache */
+#define APFS_XATTR_CACHE_VALUE_MAX	256
+
+/*
+ * Xattr record kept in the cache of its inode. It's followed by the raw value,
+ * if cached, and then by the null-terminated name.
+ */
+struct apfs_xattr_cache_entry {
+	u16	rec_len;	/* Length of the entry, padded to 8 bytes */
+	u16	name_len;	/* Length of the name, without the null */
+	u16	xdata_len;	/* Length of the raw value, or of the dstream info */
+	u8	has_dstream;	/* Is the value in a dstream? */
+	u8	has_value;	/* Is the raw value in the cache? */
+	u8	data[];
+};
+
+/*
+ * All the xattrs of an inode, as found in the catalog. An empty cache is the
+ * common case, and it saves a query on each lookup.
+ */
+struct apfs_xattr_cache {
+	bool	complete;	/* Did all the entries fit? If not, @used is 0 */
+	u32	used;		/* Bytes of entries */
+	u8	entries[];
+};
+
+/**
+ * apfs_xattr_cache_build - Read all the xattrs of an inode into a new cache
+ * @inode: the vfs inode
+ *
+ * Returns the new cache, or an error pointer in case of failure.
+ */
+static struct apfs_xattr_cache *apfs_xattr_cache_build(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_xattr_cache *cache = NULL, *shrunk = NULL;
+	struct apfs_query *query = NULL;
+	u64 cnid = apfs_ino(inode);
+	int ret;
+
+	cache = kmalloc(sizeof(*cache) + APFS_XATTR_CACHE_MAX, GFP_KERNEL);
+	if (!cache)
+		return ERR_PTR(-ENOMEM);
+	cache->complete = true;
+	cache->used = 0;
+
+	query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
+	if (!query) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+	apfs_init_xattr_key(cnid, NULL /* name */, &query->key);
+	query->flags = APFS_QUERY_CAT | APFS_QUERY_MULTIPLE | APFS_QUERY_EXACT;
+
+	while (1) {
+		struct apfs_xattr_cache_entry *entry = NULL;
+		struct apfs_xattr xattr;
+		u32 value_len, rec_len;
+
+		ret = apfs_btree_query(sb, &query);
+		if (ret == -ENODATA) /* Got all the xattrs */
+			break;
+		if (ret) {
+			apfs_err(sb, "query failed for id 0x%llx", cnid);
+			goto fail;
+		}
+		ret = apfs_xattr_from_query(query, &xattr);
+		if (ret) {
+			apfs_err(sb, "bad xattr record in inode 0x%llx", cnid);
+			goto fail;
+		}
+
+		/* The dstream info is small, so only big inline values miss */
+		value_len = 0;
+		if (xattr.has_dstream || xattr.xdata_len <= APFS_XATTR_CACHE_VALUE_MAX)
+			value_len = xattr.xdata_len;
+		rec_len = round_up(sizeof(*entry) + value_len + xattr.name_len + 1, 8);
+		if (rec_len > APFS_XATTR_CACHE_MAX - cache->used) {
+			cache->complete = false;
+			cache->used = 0;
+			break;
+		}
+
+		entry = (void *)cache->entries + cache->used;
+		entry->rec_len = rec_len;
+		entry->name_len = xattr.name_len;
+		entry->xdata_len = xattr.xdata_len;
+		entry->has_dstream = xattr.has_dstream;
+		entry->has_value = value_len == xattr.xdata_len;
+		memcpy(entry->data, xattr.xdata, value_len);
+		memcpy(entry->data + value_len, xattr.name, xattr.name_len + 1);
+		cache->used += rec_len;
+	}
+	apfs_free_query(query);
+
+	shrunk = krealloc(cache, sizeof(*cache) + cache->used, GFP_KERNEL);
+	return shrunk ?: cache;
+
+fail:
+	apfs_free_query(query);
+	kfree(cache);
+	return ERR_PTR(ret);
+}
+
+/**
+ * apfs_xattr_cache_get - Get the xattr cache for an inode, reading it if needed
+ * @inode: the vfs inode
+ *
+ * The caller must hold the volume lock. Returns NULL if the cache can't be
+ * read, and then the catalog must be queried directly, which will also report
+ * the error.
+ */
+static struct apfs_xattr_cache *apfs_xattr_cache_get(struct inode *inode)
+{
+	struct apfs_inode_info *ai = APFS_I(inode);
+	struct apfs_xattr_cache *cache = NULL, *old = NULL;
+
+	cache = READ_ONCE(ai->i_xattr_cache);
+	if (cache)
+		return cache;
+
+	cache = apfs_xattr_cache_build(inode);
+	if (IS_ERR(cache))
+		return NULL;
+
+	/* Readers only share the volume lock, so another one may be first */
+	old = cmpxchg(&ai->i_xattr_cache, NULL, cache);
+	if (old) {
+		kfree(cache);
+		cache = old;
+	}
+	return cache;
+}
+
+/**
+ * apfs_xattr_cache_drop - Forget the cached xattrs for an inode
+ * @inode: the vfs inode
+ *
+ * Must be called before any change to the xattrs of @inode, with the volume
+ * lock held for writing.
+ */
+void apfs_xattr_cache_drop(struct inode *inode)
+{
+	struct apfs_inode_info *ai = APFS_I(inode);
+
+	kfree(ai->i_xattr_cache);
+	ai->i_xattr_cache = NULL;
+}
+
+/**
+ * apfs_xattr_cache_lookup - Find a named attribute in the cache of its inode
+ * @inode:	inode the attribute belongs to
+ * @name:	name of the attribute
+ * @xattr:	on return, the xattr found
+ *
+ * Returns 0 on success, -ENODATA if the inode has no such xattr, or -EAGAIN if
+ * the answer is not in the cache and the catalog must be queried. On success,
+ * @xattr points to the cache, so it's only valid under the volume lock.
+ */
+static int apfs_xattr_cache_lookup(struct inode *inode, const char *name, struct apfs_xattr *xattr)
+{
+	struct apfs_nxsb_info *nxi = APFS_NXI(inode->i_sb);
+	struct apfs_xattr_cache *cache = NULL;
+	struct apfs_xattr_cache_entry *entry = NULL;
+	u8 *entry_name = NULL;
+	u32 off;
+
+	cache = apfs_xattr_cache_get(inode);
+	if (!cache || !cache->complete)
+		goto miss;
+
+	for (off = 0; off < cache->used; off += entry->rec_len) {
+		entry = (void *)cache->entries + off;
+		entry_name = entry->data + (entry->has_value ? entry->xdata_len : 0);
+		if (strcmp((char *)entry_name, name) != 0)
+			continue;
+		if (!entry->has_value)
+			goto miss;
+
+		xattr->name = entry_name;
+		xattr->name_len = entry->name_len;
+		xattr->xdata = entry->data;
+		xattr->xdata_len = entry->xdata_len;
+		xattr->has_dstream = entry->has_dstream;
+		apfs_nx_stat_inc(nxi, xattr_hits);
+		return 0;
+	}
+	apfs_nx_stat_inc(nxi, xattr_hits);
+	return -ENODATA;
+
+miss:
+	apfs_nx_stat_inc(nxi, xattr_misses);
+	return -EAGAIN;
+}
+
+/**
+ * apfs_xattr_cache_list - List the xattr names from a complete cache
+ * @cache:	the xattr cache
+ * @buffer:	where to copy the list, or NULL to get the size required
+ * @size:	size of @buffer
+ *
+ * Returns the length of the list, or a negative error code in case of failure.
+ */
+static ssize_t apfs_xattr_cache_list(struct apfs_xattr_cache *cache, char *buffer, size_t size)
+{
+	struct apfs_xattr_cache_entry *entry = NULL;
+	size_t free = size;
+	u32 off;
+
+	for (off = 0; off < cache->used; off += entry->rec_len) {
+		u8 *entry_name = NULL;
+
+		entry = (void *)cache->entries + off;
+		entry_name = entry->data + (entry->has_value ? entry->xdata_len : 0);
+		if (buffer) {
+			/* Prepend the fake 'osx' prefix before listing */
+			if (entry->name_len + XATTR_MAC_OSX_PREFIX_LEN + 1 > free)
+				return -ERANGE;
+			memcpy(buffer, XATTR_MAC_OSX_PREFIX, XATTR_MAC_OSX_PREFIX_LEN);
+			buffer += XATTR_MAC_OSX_PREFIX_LEN;
+			memcpy(buffer, entry_name, entry->name_len + 1);
+			buffer += entry->name_len + 1;
+		}
+		free -= entry->name_len + XATTR_MAC_OSX_PREFIX_LEN + 1;
+	}
+	return size - free;
+}
+
 /**
  * apfs_xattr_get_compressed_data - Get the compressed data in a named attribute
  * @inode:	inode the attribute belongs to
@@ -200,23 +431,30 @@ int apfs_xattr_get_compressed_data(struct inode *inode, const char *name, struct
 	u64 cnid = apfs_ino(inode);
 	int ret;
 
-
 	query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
 	if (!query)
 		return -ENOMEM;
-	apfs_init_xattr_key(cnid, name, &query->key);
-	query->flags |= APFS_QUERY_CAT | APFS_QUERY_EXACT;
 
-	ret = apfs_btree_query(sb, &query);
-	if (ret) {
-		apfs_err(sb, "query failed for id 0x%llx (%s)", cnid, name);
+	ret = apfs_xattr_cache_lookup(inode, name, &xattr);
+	if (ret == -ENODATA) {
+		apfs_err(sb, "no compressed data for id 0x%llx (%s)", cnid, name);
 		goto done;
 	}
+	if (ret == -EAGAIN) {
+		apfs_init_xattr_key(cnid, name, &query->key);
+		query->flags |= APFS_QUERY_CAT | APFS_QUERY_EXACT;
 
-	ret = apfs_xattr_from_query(query, &xattr);
-	if (ret) {
-		apfs_err(sb, "bad xattr record in inode 0x%llx", cnid);
-		goto done;
+		ret = apfs_btree_query(sb, &query);
+		if (ret) {
+			apfs_err(sb, "query failed for id 0x%llx (%s)", cnid, name);
+			goto done;
+		}
+
+		ret = apfs_xattr_from_query(query, &xattr);
+		if (ret) {
+			apfs_err(sb, "bad xattr record in inode 0x%llx", cnid);
+			goto done;
+		}
 	}
 
 	cdata->has_dstream = xattr.has_dstream;
@@ -336,20 +574,26 @@ int ____apfs_xattr_get(struct inode *inode, const char *name, void *buffer,
 	query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
 	if (!query)
 		return -ENOMEM;
-	apfs_init_xattr_key(cnid, name, &query->key);
-	query->flags |= APFS_QUERY_CAT | APFS_QUERY_EXACT;
 
-	ret = apfs_btree_query(sb, &query);
-	if (ret) {
-		if (ret != -ENODATA)
-			apfs_err(sb, "query failed for id 0x%llx (%s)", cnid, name);
+	ret = apfs_xattr_cache_lookup(inode, name, &xattr);
+	if (ret == -ENODATA)
 		goto done;
-	}
+	if (ret == -EAGAIN) {
+		apfs_init_xattr_key(cnid, name, &query->key);
+		query->flags |= APFS_QUERY_CAT | APFS_QUERY_EXACT;
 
-	ret = apfs_xattr_from_query(query, &xattr);
-	if (ret) {
-		apfs_err(sb, "bad xattr record in inode 0x%llx", cnid);
-		goto done;
+		ret = apfs_btree_query(sb, &query);
+		if (ret) {
+			if (ret != -ENODATA)
+				apfs_err(sb, "query failed for id 0x%llx (%s)", cnid, name);
+			goto done;
+		}
+
+		ret = apfs_xattr_from_query(query, &xattr);
+		if (ret) {
+			apfs_err(sb, "bad xattr record in inode 0x%llx", cnid);
+			goto done;
+		}
 	}
 
 	if (xattr.has_dstream)
@@ -377,12 +621,11 @@ done:
  */
 static int apfs_xattr_get(struct inode *inode, const char *name, void *buffer, size_t size)
 {
-	struct apfs_nxsb_info *nxi = APFS_NXI(inode->i_sb);
 	int ret;
 
-	down_read(&nxi->nx_big_sem);
+	down_read(apfs_vol_sem(inode->i_sb));
 	ret = __apfs_xattr_get(inode, name, buffer, size);
-	up_read(&nxi->nx_big_sem);
+	up_read(apfs_vol_sem(inode->i_sb));
 	if (ret > XATTR_SIZE_MAX) {
 		apfs_warn(inode->i_sb, "xattr is too big to read on linux (%d)", ret);
 		return -E2BIG;
@@ -498,6 +741,7 @@ int apfs_delete_all_xattrs(struct inode *inode)
 
 	lockdep_assert_held_write(&nxi->nx_big_sem);
 
+	apfs_xattr_cache_drop(inode);
 	do {
 		ret = apfs_delete_any_xattr(inode);
 	} while (ret == -EAGAIN);
@@ -716,6 +960,13 @@ int apfs_xattr_set(struct inode *inode, const char *name, const void *value,
 	struct apfs_dstream_info *old_dstream = NULL;
 	int ret;
 
+	APFS_I(inode)->i_sync_xid = APFS_NXI(sb)->nx_xid;
+	apfs_xattr_cache_drop(inode);
+
+	/* Later opens of a compressed file must not use the old block table */
+	if (strcmp(name, APFS_XATTR_NAME_RSRC_FORK) == 0 || strcmp(name, APFS_XATTR_NAME_COMPRESSED) == 0)
+		apfs_compress_forget_table(inode);
+
 	if (size > APFS_XATTR_MAX_EMBEDDED_SIZE) {
 		dstream = apfs_create_xattr_dstream(sb, value, size);
 		if (IS_ERR(dstream)) {
@@ -862,13 +1113,22 @@ ssize_t apfs_listxattr(struct dentry *dentry, char *buffer, size_t size)
 	struct inode *inode = d_inode(dentry);
 	struct super_block *sb = inode->i_sb;
 	struct apfs_sb_info *sbi = APFS_SB(sb);
-	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
 	struct apfs_query *query;
 	u64 cnid = apfs_ino(inode);
+	struct apfs_xattr_cache *cache = NULL;
 	size_t free = size;
 	ssize_t ret;
 
-	down_read(&nxi->nx_big_sem);
+	down_read(apfs_vol_sem(sb));
+
+	cache = apfs_xattr_cache_get(inode);
+	if (cache && cache->complete) {
+		apfs_nx_stat_inc(APFS_NXI(sb), xattr_hits);
+		ret = apfs_xattr_cache_list(cache, buffer, size);
+		up_read(apfs_vol_sem(sb));
+		return ret;
+	}
+	apfs_nx_stat_inc(APFS_NXI(sb), xattr_misses);
 
 	query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
 	if (!query) {
@@ -917,6 +1177,6 @@ ssize_t apfs_listxattr(struct dentry *dentry, char *buffer, size_t size)
 
 fail:
 	apfs_free_query(query);
-	up_read(&nxi->nx_big_sem);
+	up_read(apfs_vol_sem(sb));
 	return ret;
 }
@@ -169,3 +169,62 @@ done:
 	blob->xf_used_data = cpu_to_le16(used_data);
 	return total_len;
 }
+
+/**
+ * apfs_remove_xfield - Remove an xfield from an in-memory collection
+ * @buffer:	buffer holding the collection of xfields
+ * @buflen:	length of the collection
+ * @xtype:	type of the xfield to remove
+ *
+ * Returns the new length of the collection, which is unchanged if there was no
+ * xfield of type @xtype, or 0 if the collection is corrupted.
+ */
+int apfs_remove_xfield(u8 *buffer, int buflen, u8 xtype)
+{
+	struct apfs_xf_blob *blob;
+	struct apfs_x_field *curr_xkey;
+	u8 *curr_xval;
+	int count;
+	int rest = buflen;
+	int i;
+
+	if (!buflen)
+		return 0;
+
+	rest -= sizeof(*blob);
+	if (rest < 0)
+		return 0;
+	blob = (struct apfs_xf_blob *)buffer;
+
+	count = le16_to_cpu(blob->xf_num_exts);
+	rest -= count * sizeof(*curr_xkey);
+	if (rest < 0)
+		return 0;
+	curr_xkey = (struct apfs_x_field *)blob->xf_data;
+	curr_xval = buffer + buflen - rest;
+
+	for (i = 0; i < count; ++i, ++curr_xkey) {
+		int curr_xlen;
+
+		/* Attribute length is padded to a multiple of 8 */
+		curr_xlen = round_up(le16_to_cpu(curr_xkey->x_size), 8);
+		if (curr_xlen > rest)
+			return 0;
+		if (curr_xkey->x_type != xtype) {
+			rest -= curr_xlen;
+			curr_xval += curr_xlen;
+			continue;
+		}
+
+		/* Drop the value first, then the metadata entry before it */
+		memmove(curr_xval, curr_xval + curr_xlen, rest - curr_xlen);
+		buflen -= curr_xlen;
+		memmove(curr_xkey, curr_xkey + 1, buffer + buflen - (u8 *)(curr_xkey + 1));
+		buflen -= sizeof(*curr_xkey);
+
+		blob->xf_num_exts = cpu_to_le16(count - 1);
+		le16_add_cpu(&blob->xf_used_data, -curr_xlen);
+		return buflen;
+	}
+	return buflen;
+}